@@ -0,0 +1,310 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "bench.h"
+#include "emulator_functions.h"
+#include "io.h"
+#include "lapic.h"
+#include "machine.h"
+#include "stats.h"
+#include "util.h"
+
+typedef struct
+{
+    uint64_t *ns;
+    uint32_t count;
+    uint32_t capacity;
+} BenchSeries;
+
+typedef struct
+{
+    uint64_t begin_ns;
+    uint64_t end_ns;
+    uint64_t begin_icount;
+    uint64_t end_icount;
+    uint64_t begin_sectors;
+    uint64_t end_sectors;
+    int ended;
+} BenchPhase;
+
+/* Appended to by the CPU threads, per process like stats */
+static pthread_mutex_t bench_lock = PTHREAD_MUTEX_INITIALIZER;
+static BenchSeries interrupts[256];
+static BenchSeries keys;
+static BenchPhase phases[BENCH_MAX_PHASES];
+static int phase_count;
+
+typedef struct
+{
+    uint64_t ns;
+    uint64_t icount;
+    int reached;
+} BenchMark;
+
+static const char *milestone_names[] = {"protected_mode", "paging", "user_mode", "kbd_read"};
+static BenchMark milestones[BENCH_MILESTONES];
+/* Host time init_bench ran at, milestones count from it */
+static uint64_t start_ns;
+
+/* Where bench_mark_icount stores the count (markers and milestones taken since the last slow path) */
+#define BENCH_MAX_PENDING (BENCH_MILESTONES + 2)
+static uint64_t *pending_icounts[BENCH_MAX_PENDING];
+static int pending_count;
+
+/* With bench_lock held */
+static void add_pending(Emulator *emu, uint64_t *icount)
+{
+    if (pending_count < BENCH_MAX_PENDING)
+        pending_icounts[pending_count++] = icount;
+    raise_attention(emu, ATTENTION_BENCH);
+}
+
+static void add_sample(BenchSeries *series, uint64_t ns)
+{
+    pthread_mutex_lock(&bench_lock);
+    if (series->count == series->capacity && series->capacity < BENCH_MAX_SAMPLES)
+    {
+        series->capacity = series->capacity != 0 ? series->capacity * 2 : 1024;
+        series->ns = realloc(series->ns, series->capacity * sizeof(uint64_t));
+    }
+    if (series->count < series->capacity)
+        series->ns[series->count++] = ns;
+    pthread_mutex_unlock(&bench_lock);
+}
+
+void bench_interrupt(Emulator *emu, uint8_t vector)
+{
+    uint64_t raised = emu->lapic->bench_accepted;
+    if (raised != 0)
+        add_sample(&interrupts[vector], monotonic_ns() - raised);
+}
+
+void bench_key_read(uint64_t stored_ns)
+{
+    if (stored_ns != 0)
+        add_sample(&keys, monotonic_ns() - stored_ns);
+}
+
+/* Instructions up to the marker are only counted at the next slow path, hence ATTENTION_BENCH. */
+static void write_bench_port(Emulator *emu, void *device, uint16_t address, uint32_t value)
+{
+    uint64_t now = monotonic_ns();
+    uint64_t sectors = __atomic_load_n(&stats.disk_sectors_read, __ATOMIC_RELAXED);
+    BenchPhase *phase;
+    pthread_mutex_lock(&bench_lock);
+    switch (value)
+    {
+    case BENCH_BEGIN:
+        if (phase_count == BENCH_MAX_PHASES)
+            break;
+        phase = &phases[phase_count++];
+        phase->begin_ns = now;
+        phase->begin_sectors = sectors;
+        add_pending(emu, &phase->begin_icount);
+        break;
+    case BENCH_END:
+        if (phase_count == 0 || phases[phase_count - 1].ended)
+            break;
+        phase = &phases[phase_count - 1];
+        phase->end_ns = now;
+        phase->end_sectors = sectors;
+        phase->ended = 1;
+        add_pending(emu, &phase->end_icount);
+        break;
+    default:
+        break;
+    }
+    pthread_mutex_unlock(&bench_lock);
+}
+
+void bench_milestone(Emulator *emu, int milestone)
+{
+    BenchMark *mark = &milestones[milestone];
+    if (emu->cpu_id != 0 || mark->reached)
+        return;
+    pthread_mutex_lock(&bench_lock);
+    mark->ns = monotonic_ns() - start_ns;
+    mark->reached = 1;
+    add_pending(emu, &mark->icount);
+    pthread_mutex_unlock(&bench_lock);
+}
+
+void bench_mark_icount(Emulator *emu)
+{
+    int i;
+    pthread_mutex_lock(&bench_lock);
+    for (i = 0; i < pending_count; i++)
+        *pending_icounts[i] = emu->icount;
+    pending_count = 0;
+    pthread_mutex_unlock(&bench_lock);
+}
+
+void init_bench(Machine *machine)
+{
+    register_io_ports(machine->io, BENCH_PORT, 1, 4, NULL, write_bench_port, NULL);
+    start_ns = monotonic_ns();
+}
+
+static int compare_ns(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Nearest rank of sorted samples */
+static double percentile_us(BenchSeries *series, int percent)
+{
+    return series->ns[(uint64_t)(series->count - 1) * percent / 100] / 1000.0;
+}
+
+static void print_series(BenchSeries *series, int json)
+{
+    qsort(series->ns, series->count, sizeof(uint64_t), compare_ns);
+    printf(json ? "{\"samples\": %u, \"p50_us\": %.3f, \"p90_us\": %.3f, \"p99_us\": %.3f, \"max_us\": %.3f}"
+                : " %u samples, us p50 %.1f p90 %.1f p99 %.1f max %.1f\n",
+           series->count, percentile_us(series, 50), percentile_us(series, 90), percentile_us(series, 99),
+           percentile_us(series, 100));
+}
+
+static void print_phase(BenchPhase *phase, int index, int json)
+{
+    uint64_t ns = phase->end_ns - phase->begin_ns;
+    uint64_t instructions = phase->end_icount - phase->begin_icount;
+    uint64_t sectors = phase->end_sectors - phase->begin_sectors;
+    double mips = ns > 0 ? instructions * 1000.0 / ns : 0;
+    double ns_per_instruction = instructions > 0 ? (double)ns / instructions : 0;
+    double mb_per_s = ns > 0 ? sectors * 512 * 1000.0 / ns : 0;
+    if (json)
+    {
+        printf("{\"ns\": %llu, \"instructions\": %llu, \"mips\": %.3f, \"ns_per_instruction\": %.3f, "
+               "\"sectors_read\": %llu, \"mb_per_s\": %.3f}",
+               (unsigned long long)ns, (unsigned long long)instructions, mips, ns_per_instruction,
+               (unsigned long long)sectors, mb_per_s);
+        return;
+    }
+    printf("Phase %d: %.3f ms, %llu instructions (%.2f MIPS, %.1f ns/instruction)", index, ns / 1000000.0,
+           (unsigned long long)instructions, mips, ns_per_instruction);
+    if (sectors != 0)
+        printf(", %llu sectors read (%.1f MB/s)", (unsigned long long)sectors, mb_per_s);
+    printf("\n");
+}
+
+/* MIPS since the milestone reached last before this one (or the start) */
+static void print_milestone(int milestone, int json)
+{
+    BenchMark *mark = &milestones[milestone];
+    BenchMark *previous = NULL;
+    uint64_t ns = mark->ns;
+    uint64_t instructions = mark->icount;
+    int i;
+    for (i = 0; i < BENCH_MILESTONES; i++)
+    {
+        if (!milestones[i].reached || milestones[i].ns >= mark->ns)
+            continue;
+        if (previous == NULL || milestones[i].ns > previous->ns)
+            previous = &milestones[i];
+    }
+    if (previous != NULL)
+    {
+        ns -= previous->ns;
+        instructions -= previous->icount;
+    }
+    double mips = ns > 0 ? instructions * 1000.0 / ns : 0;
+    if (json)
+        printf("{\"name\": \"%s\", \"ns\": %llu, \"instructions\": %llu, \"phase_mips\": %.3f}",
+               milestone_names[milestone], (unsigned long long)mark->ns, (unsigned long long)mark->icount, mips);
+    else
+        printf("  %s: at %.3f ms, %llu instructions (%.2f MIPS since the previous)\n", milestone_names[milestone],
+               mark->ns / 1000000.0, (unsigned long long)mark->icount, mips);
+}
+
+static void print_text(void)
+{
+    int header = 0;
+    int i;
+    printf("<Bench>\n");
+    for (i = 0; i < 256; i++)
+    {
+        if (interrupts[i].count == 0)
+            continue;
+        printf("Interrupt vector %3d:", i);
+        print_series(&interrupts[i], 0);
+    }
+    if (keys.count != 0)
+    {
+        printf("Key read:");
+        print_series(&keys, 0);
+    }
+    for (i = 0; i < phase_count; i++)
+    {
+        if (phases[i].ended)
+            print_phase(&phases[i], i + 1, 0);
+    }
+    for (i = 0; i < BENCH_MILESTONES; i++)
+    {
+        if (!milestones[i].reached)
+            continue;
+        if (!header)
+            printf("Milestones:\n");
+        header = 1;
+        print_milestone(i, 0);
+    }
+}
+
+/*
+ * One line: {"interrupts": {"vector": series...}, "keys": series,
+ * "phases": [phase...], "milestones": [milestone...]}
+ */
+static void print_json(void)
+{
+    const char *separator = "";
+    int i;
+    printf("{\"interrupts\": {");
+    for (i = 0; i < 256; i++)
+    {
+        if (interrupts[i].count == 0)
+            continue;
+        printf("%s\"%d\": ", separator, i);
+        print_series(&interrupts[i], 1);
+        separator = ", ";
+    }
+    printf("}, \"keys\": ");
+    if (keys.count != 0)
+        print_series(&keys, 1);
+    else
+        printf("null");
+    printf(", \"phases\": [");
+    separator = "";
+    for (i = 0; i < phase_count; i++)
+    {
+        if (!phases[i].ended)
+            continue;
+        printf("%s", separator);
+        print_phase(&phases[i], i + 1, 1);
+        separator = ", ";
+    }
+    printf("], \"milestones\": [");
+    separator = "";
+    for (i = 0; i < BENCH_MILESTONES; i++)
+    {
+        if (!milestones[i].reached)
+            continue;
+        printf("%s", separator);
+        print_milestone(i, 1);
+        separator = ", ";
+    }
+    printf("]}\n");
+}
+
+void print_bench(void)
+{
+    pthread_mutex_lock(&bench_lock);
+    if (config.bench == BENCH_JSON)
+        print_json();
+    else
+        print_text();
+    pthread_mutex_unlock(&bench_lock);
+}
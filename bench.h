@@ -0,0 +1,61 @@
+#ifndef BENCH_H_
+#define BENCH_H_
+
+#include <stdint.h>
+
+#include "emulator.h"
+
+/*
+ * Latency benchmarks (-bench)
+ * Host time (ns) is taken where an event enters the machine and again
+ * where the guest sees it:
+ *   interrupt: requested in LAPIC IRR (timer, IOAPIC, IPI), until
+ *              handle_interrupt has entered its handler
+ *   key: stored in the KBD buffer, until the guest reads it from PS2DATA
+ * Guests mark phases on BENCH_PORT, which are reported with host time,
+ * instructions retired and disk sectors read in between (PIO
+ * throughput). The programs under tests/bench (bench.sh) use them.
+ * Boot milestones of the BSP (BenchMilestone) are taken the first time
+ * they happen, with host time since the machine was set up and the
+ * instructions retired, so each phase between two has its MIPS.
+ * Percentiles are printed on exit, over up to BENCH_MAX_SAMPLES samples
+ * per series, as text or with -bench-json as one line of JSON.
+ *
+ * Port (32-bit writes)
+ * | BENCH_PORT | W | BENCH_BEGIN: starts a phase, BENCH_END: ends it |
+ */
+#define BENCH_PORT 0xC200
+#define BENCH_BEGIN 1
+#define BENCH_END 2
+
+#define BENCH_MAX_SAMPLES (1 << 20)
+#define BENCH_MAX_PHASES 64
+
+enum BenchMilestone
+{
+    /* check_protected_mode_entry: CR0.PE set and CS reloaded */
+    BENCH_PROTECTED_MODE,
+    /* update_translation: CR0.PG set */
+    BENCH_PAGING,
+    /* CS loaded with RPL 3 */
+    BENCH_USER_MODE,
+    /* PS2DATA read (bootloaders poll PS2STACMD for the A20 gate) */
+    BENCH_KBD_READ,
+    BENCH_MILESTONES
+};
+
+/* Registers BENCH_PORT on machine. */
+void init_bench(Machine *machine);
+
+/* After handle_interrupt delivered vector accepted by lapic_accept_intr */
+void bench_interrupt(Emulator *emu, uint8_t vector);
+/* A key stored at host time stored_ns was read by the guest. */
+void bench_key_read(uint64_t stored_ns);
+/* On emu's thread; only the first of each on the BSP counts. */
+void bench_milestone(Emulator *emu, int milestone);
+/* At ATTENTION_BENCH: Emulator.icount at the markers and milestones just taken */
+void bench_mark_icount(Emulator *emu);
+
+void print_bench(void);
+
+#endif
@@ -0,0 +1,104 @@
+#!/bin/bash
+# Benchmarks with Guest Programs
+# Each guest in tests/bench runs with -bench, which prints the latency
+# percentiles and the phases it marked on exit:
+#   timer, kbd, disk: interrupt and I/O latency, PIO throughput
+#   alu, mem, string, farcall, paging, int: one instruction family each
+#     (host ns per guest instruction, MIPS)
+# -json prints one JSON object keyed by benchmark instead, to compare
+# commits. Other options go to dax86 (e.g. -jit).
+
+# Keys typed into the kbd benchmark, one per KEY_INTERVAL seconds
+KEYS=100
+KEY_INTERVAL=0.01
+
+json=false
+options=()
+
+function type_keys() {
+  for i in $(seq $KEYS); do
+    printf a
+    sleep $KEY_INTERVAL
+  done
+}
+
+function run_bench() {
+  bench_dir="./tests/bench/$1"
+  kernel_path="$bench_dir/$1.elf"
+  image_path="$kernel_path"
+  bench_flag="-bench"
+  if [ "$json" = true ]; then
+    bench_flag="-bench-json"
+  else
+    echo "------------------------------------------------"
+    echo "Building benchmark $1..."
+  fi
+
+  build_output=$(make -C $bench_dir 2>&1)
+  if [ $? -ne 0 ]; then
+    echo "$build_output" >&2
+    exit 1
+  fi
+  if [ -f "$bench_dir/disk.img" ]; then
+    image_path="$bench_dir/disk.img"
+  fi
+  if [ "$json" = false ]; then
+    echo "Running benchmark $1..."
+  fi
+  if [ "$1" == "kbd" ]; then
+    output=$(type_keys | ./dax86 $image_path -kernel $kernel_path test $bench_flag "${options[@]}")
+  else
+    output=$(./dax86 $image_path -kernel $kernel_path test $bench_flag "${options[@]}" < /dev/null)
+  fi
+
+  if [ "$json" = true ]; then
+    line=$(echo "$output" | grep '^{"interrupts"' | tail -1)
+    if [ -z "$line" ]; then
+      echo "$output" >&2
+      exit 1
+    fi
+    echo "\"$1\": $line"
+    return
+  fi
+  if [[ $output != *"<Bench>"* ]]; then
+    echo "[Run: FAILURE]"
+    echo
+    echo "$output"
+    exit 1
+  fi
+  echo "${output#*<Bench>$'\n'}"
+  echo
+}
+
+function main() {
+  benches=()
+  for arg in "$@"; do
+    if [ "$arg" == "-json" ]; then
+      json=true
+    elif [[ "$arg" == -* ]] || [ ${#options[@]} -gt 0 ]; then
+      options+=("$arg")
+    else
+      benches+=("$arg")
+    fi
+  done
+  if [ ${#benches[@]} -eq 0 ]; then
+    benches=("timer" "kbd" "disk" "alu" "mem" "string" "farcall" "paging" "int")
+  fi
+
+  if [ "$json" = false ]; then
+    for i in "${benches[@]}"; do
+      run_bench $i
+    done
+    return
+  fi
+  separator=""
+  printf "{"
+  for i in "${benches[@]}"; do
+    result=$(run_bench $i) || exit 1
+    printf "%s%s" "$separator" "$result"
+    separator=", "
+  done
+  printf "}\n"
+}
+
+main "$@"
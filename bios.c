@@ -0,0 +1,390 @@
+#include <stdint.h>
+#include <stdio.h>
+
+#include "bios.h"
+#include "cga.h"
+#include "disk.h"
+#include "emulator_functions.h"
+#include "io.h"
+#include "ioapic.h"
+#include "lapic.h"
+#include "machine.h"
+#include "serial.h"
+#include "stats.h"
+
+#define BIOS_TELETYPE_ATTRIBUTE 0x07
+
+/* int 13h status (AH) */
+#define BIOS_DISK_OK 0x00
+#define BIOS_DISK_BAD_COMMAND 0x01
+#define BIOS_DISK_NOT_FOUND 0x04
+#define BIOS_DISK_BOUNDARY 0x09
+/* int 15h AH: function not supported */
+#define BIOS_UNSUPPORTED 0x86
+
+static void set_result(Emulator *emu, uint8_t status)
+{
+    set_register8(emu, AH, status);
+    set_carry_flag(emu, status != 0);
+}
+
+/* Is [p_address, p_address + len) in RAM? */
+static int is_ram(Emulator *emu, uint32_t p_address, uint32_t len)
+{
+    uint32_t page;
+    if (len == 0 || p_address >= emu->memory_size || len > emu->memory_size - p_address)
+        return 0;
+    for (page = p_address >> 12; page <= (p_address + len - 1) >> 12; page++)
+    {
+        if (emu->page_types[page] != PAGE_RAM && emu->page_types[page] != PAGE_WATCH)
+            return 0;
+    }
+    return 1;
+}
+
+/* Real mode address of seg:offset */
+static uint32_t real_address(uint16_t segment, uint16_t offset)
+{
+    return ((uint32_t)segment << 4) + offset;
+}
+
+/* Teletype: the serial port as the guest's out would, and the screen */
+static void put_char(Emulator *emu, uint8_t c, uint8_t attribute)
+{
+    io_out8(emu, SERIALDATA, c);
+    if (emu->machine->cga != NULL)
+        cga_teletype(emu->machine->cga, c, attribute);
+}
+
+/* AH=13h: CX characters at ES:BP from row DH column DL, AL bit 1: with attributes, bit 0: cursor moved */
+static void write_string(Emulator *emu)
+{
+    Cga *cga = emu->machine->cga;
+    uint8_t mode = get_register8(emu, AL);
+    uint8_t attribute = get_register8(emu, BL);
+    uint16_t count = get_register16(emu, ECX);
+    uint16_t offset = get_register16(emu, EBP);
+    uint16_t cursor = 0;
+    uint16_t i;
+    if (cga != NULL)
+    {
+        cursor = cga_cursor(cga);
+        cga_set_cursor(cga, get_register8(emu, DH) * CGA_COLUMNS + get_register8(emu, DL));
+    }
+    for (i = 0; i < count; i++)
+    {
+        uint8_t c = get_memory8(emu, ES, offset++);
+        if (mode & 2)
+            attribute = get_memory8(emu, ES, offset++);
+        put_char(emu, c, attribute);
+    }
+    if (cga != NULL && !(mode & 1))
+        cga_set_cursor(cga, cursor);
+}
+
+static void video_service(Emulator *emu)
+{
+    Cga *cga = emu->machine->cga;
+    uint16_t cursor;
+    switch (get_register8(emu, AH))
+    {
+    case 0x02:
+        if (cga != NULL && get_register8(emu, DH) < CGA_ROWS && get_register8(emu, DL) < CGA_COLUMNS)
+            cga_set_cursor(cga, get_register8(emu, DH) * CGA_COLUMNS + get_register8(emu, DL));
+        break;
+    case 0x03:
+        cursor = cga != NULL ? cga_cursor(cga) : 0;
+        set_register8(emu, DH, cursor / CGA_COLUMNS);
+        set_register8(emu, DL, cursor % CGA_COLUMNS);
+        /* Cursor scan lines 6 - 7 */
+        set_register16(emu, ECX, 0x0607);
+        break;
+    case 0x0E:
+        put_char(emu, get_register8(emu, AL), BIOS_TELETYPE_ATTRIBUTE);
+        break;
+    case 0x0F:
+        set_register8(emu, AL, 0x03);
+        set_register8(emu, AH, CGA_COLUMNS);
+        set_register8(emu, BH, 0);
+        break;
+    case 0x13:
+        write_string(emu);
+        break;
+    default:
+        break;
+    }
+}
+
+/*
+ * Reads (or writes) count sectors from lba into RAM at p_address, in
+ * one backend access. Returns the status.
+ */
+static uint8_t transfer_sectors(Emulator *emu, uint64_t lba, uint32_t count, uint32_t p_address, int write)
+{
+    Disk *disk = emu->disk;
+    uint32_t len = count * 512;
+    uint32_t page;
+    if (count == 0 || count > BIOS_DISK_MAX_SECTORS)
+        return BIOS_DISK_BAD_COMMAND;
+    if (disk == NULL || lba > disk_sectors(disk) || count > disk_sectors(disk) - lba)
+        return BIOS_DISK_NOT_FOUND;
+    if (!is_ram(emu, p_address, len))
+        return BIOS_DISK_BOUNDARY;
+    if (write)
+    {
+        write_disk_sectors(disk, lba, count, emu->memory + p_address);
+        STAT_ADD(stats.disk_sectors_written, count);
+        return BIOS_DISK_OK;
+    }
+    for (page = p_address >> 12; page <= (p_address + len - 1) >> 12; page++)
+    {
+        uint32_t from = page << 12 > p_address ? page << 12 : p_address;
+        uint32_t to = (page + 1) << 12 < p_address + len ? (page + 1) << 12 : p_address + len;
+        page_written(emu, from, to - from);
+    }
+    read_disk_sectors(disk, lba, count, emu->memory + p_address);
+    STAT_ADD(stats.disk_sectors_read, count);
+    return BIOS_DISK_OK;
+}
+
+static uint32_t disk_cylinders(Emulator *emu)
+{
+    uint64_t cylinders = disk_sectors(emu->disk) / (BIOS_DISK_HEADS * BIOS_DISK_SECTORS);
+    if (cylinders == 0)
+        return 1;
+    return cylinders < BIOS_DISK_MAX_CYLINDERS ? cylinders : BIOS_DISK_MAX_CYLINDERS;
+}
+
+/* AH=02h/03h: AL sectors from cylinder CH (and CL bits 6-7), head DH, sector CL bits 0-5 to ES:BX */
+static void transfer_chs(Emulator *emu, int write)
+{
+    uint8_t count = get_register8(emu, AL);
+    uint8_t cl = get_register8(emu, CL);
+    uint32_t cylinder = get_register8(emu, CH) | (cl & 0xC0) << 2;
+    uint32_t head = get_register8(emu, DH);
+    uint32_t sector = cl & 0x3F;
+    if (sector == 0 || sector > BIOS_DISK_SECTORS || head >= BIOS_DISK_HEADS)
+    {
+        set_result(emu, BIOS_DISK_NOT_FOUND);
+        set_register8(emu, AL, 0);
+        return;
+    }
+    uint64_t lba = ((uint64_t)cylinder * BIOS_DISK_HEADS + head) * BIOS_DISK_SECTORS + sector - 1;
+    uint32_t p_address = real_address(get_seg_register16(emu, ES), get_register16(emu, EBX));
+    uint8_t status = transfer_sectors(emu, lba, count, p_address, write);
+    set_result(emu, status);
+    set_register8(emu, AL, status == BIOS_DISK_OK ? count : 0);
+}
+
+/*
+ * AH=42h/43h: disk address packet at DS:SI
+ * | 0 | size (16) | 2 | sectors | 4 | buffer offset | 6 | buffer segment | 8 | LBA (64) |
+ */
+static void transfer_lba(Emulator *emu, int write)
+{
+    uint16_t packet = get_register16(emu, ESI);
+    if (get_memory8(emu, DS, packet) < 0x10)
+    {
+        set_result(emu, BIOS_DISK_BAD_COMMAND);
+        return;
+    }
+    uint16_t count = get_memory16(emu, DS, packet + 2);
+    uint32_t p_address = real_address(get_memory16(emu, DS, packet + 6), get_memory16(emu, DS, packet + 4));
+    uint64_t lba = get_memory32(emu, DS, packet + 8) | (uint64_t)get_memory32(emu, DS, packet + 12) << 32;
+    uint8_t status = transfer_sectors(emu, lba, count, p_address, write);
+    if (status != BIOS_DISK_OK)
+        set_memory16(emu, DS, packet + 2, 0);
+    set_result(emu, status);
+}
+
+/* AH=48h: drive parameters to the buffer at DS:SI */
+static void drive_parameters(Emulator *emu)
+{
+    uint16_t buffer = get_register16(emu, ESI);
+    uint64_t sectors = disk_sectors(emu->disk);
+    if (get_memory16(emu, DS, buffer) < 0x1A)
+    {
+        set_result(emu, BIOS_DISK_BAD_COMMAND);
+        return;
+    }
+    set_memory16(emu, DS, buffer, 0x1A);
+    /* The geometry is valid. */
+    set_memory16(emu, DS, buffer + 2, 0x0002);
+    set_memory32(emu, DS, buffer + 4, disk_cylinders(emu));
+    set_memory32(emu, DS, buffer + 8, BIOS_DISK_HEADS);
+    set_memory32(emu, DS, buffer + 12, BIOS_DISK_SECTORS);
+    set_memory32(emu, DS, buffer + 16, (uint32_t)sectors);
+    set_memory32(emu, DS, buffer + 20, (uint32_t)(sectors >> 32));
+    set_memory16(emu, DS, buffer + 24, 512);
+    set_result(emu, BIOS_DISK_OK);
+}
+
+static void disk_service(Emulator *emu)
+{
+    uint8_t function = get_register8(emu, AH);
+    uint32_t cylinders;
+    uint64_t sectors;
+    if (get_register8(emu, DL) != BIOS_HARD_DISK || emu->disk == NULL)
+    {
+        set_result(emu, BIOS_DISK_BAD_COMMAND);
+        return;
+    }
+    switch (function)
+    {
+    case 0x00:
+    case 0x01:
+        set_result(emu, BIOS_DISK_OK);
+        break;
+    case 0x02:
+    case 0x03:
+        transfer_chs(emu, function == 0x03);
+        break;
+    case 0x08:
+        cylinders = disk_cylinders(emu) - 1;
+        set_register8(emu, CH, cylinders & 0xFF);
+        set_register8(emu, CL, BIOS_DISK_SECTORS | (cylinders >> 2 & 0xC0));
+        set_register8(emu, DH, BIOS_DISK_HEADS - 1);
+        /* Drives */
+        set_register8(emu, DL, 1);
+        set_register8(emu, AL, 0);
+        set_register8(emu, BL, 0);
+        set_result(emu, BIOS_DISK_OK);
+        break;
+    case 0x15:
+        sectors = disk_sectors(emu->disk);
+        if (sectors > 0xFFFFFFFF)
+            sectors = 0xFFFFFFFF;
+        set_register16(emu, ECX, sectors >> 16);
+        set_register16(emu, EDX, sectors & 0xFFFF);
+        /* Hard disk */
+        set_register8(emu, AH, 0x03);
+        set_carry_flag(emu, 0);
+        break;
+    case 0x41:
+        if (get_register16(emu, EBX) != 0x55AA)
+        {
+            set_result(emu, BIOS_DISK_BAD_COMMAND);
+            break;
+        }
+        set_register16(emu, EBX, 0xAA55);
+        /* EDD 3.0, functions 42h - 44h, 47h, 48h */
+        set_register16(emu, ECX, 0x0001);
+        set_register8(emu, AH, 0x30);
+        set_carry_flag(emu, 0);
+        break;
+    case 0x42:
+    case 0x43:
+        transfer_lba(emu, function == 0x43);
+        break;
+    case 0x48:
+        drive_parameters(emu);
+        break;
+    default:
+        set_result(emu, BIOS_DISK_BAD_COMMAND);
+        break;
+    }
+}
+
+/* Returns the number of entries. */
+static uint32_t memory_map(Emulator *emu, BiosE820Entry *entries)
+{
+    uint32_t count = 0;
+    uint32_t conventional = BIOS_CONVENTIONAL_KB << 10;
+    entries[count++] = (BiosE820Entry){0, conventional, BIOS_E820_RAM};
+    /* EBDA with the MP tables up to the video memory */
+    entries[count++] = (BiosE820Entry){conventional, 0xA0000 - conventional, BIOS_E820_RESERVED};
+    /* BIOS area, the MP floating pointer is searched there */
+    entries[count++] = (BiosE820Entry){0xF0000, 0x10000, BIOS_E820_RESERVED};
+    if (emu->memory_size > 0x100000)
+        entries[count++] = (BiosE820Entry){0x100000, emu->memory_size - 0x100000, BIOS_E820_RAM};
+    entries[count++] = (BiosE820Entry){IOAPIC_DEFAULT_BASE, 0x1000, BIOS_E820_RESERVED};
+    entries[count++] = (BiosE820Entry){LAPIC_DEFAULT_BASE, 0x1000, BIOS_E820_RESERVED};
+    return count;
+}
+
+/* AX=E820h: entry EBX to ES:DI (ECX bytes, EDX "SMAP"), EBX the next one, 0 after the last */
+static void memory_map_entry(Emulator *emu)
+{
+    BiosE820Entry entries[8];
+    uint32_t count = memory_map(emu, entries);
+    uint32_t index = get_register32(emu, EBX);
+    if (get_register32(emu, EDX) != BIOS_SMAP || get_register32(emu, ECX) < 20 || index >= count)
+    {
+        set_result(emu, BIOS_UNSUPPORTED);
+        return;
+    }
+    uint16_t buffer = get_register16(emu, EDI);
+    BiosE820Entry *entry = &entries[index];
+    set_memory32(emu, ES, buffer, (uint32_t)entry->base);
+    set_memory32(emu, ES, buffer + 4, (uint32_t)(entry->base >> 32));
+    set_memory32(emu, ES, buffer + 8, (uint32_t)entry->length);
+    set_memory32(emu, ES, buffer + 12, (uint32_t)(entry->length >> 32));
+    set_memory32(emu, ES, buffer + 16, entry->type);
+    set_register32(emu, EAX, BIOS_SMAP);
+    set_register32(emu, ECX, 20);
+    set_register32(emu, EBX, index + 1 < count ? index + 1 : 0);
+    set_carry_flag(emu, 0);
+}
+
+static void system_service(Emulator *emu)
+{
+    uint16_t function = get_register16(emu, EAX);
+    uint32_t extended_kb = emu->memory_size > 0x100000 ? (emu->memory_size - 0x100000) >> 10 : 0;
+    switch (function)
+    {
+    case 0xE820:
+        memory_map_entry(emu);
+        return;
+    case 0xE801:
+        /* KB from 1M to 16M, 64KB blocks above */
+        set_register16(emu, EAX, extended_kb < 0x3C00 ? extended_kb : 0x3C00);
+        set_register16(emu, EBX, emu->memory_size > 0x1000000 ? (emu->memory_size - 0x1000000) >> 16 : 0);
+        set_register16(emu, ECX, get_register16(emu, EAX));
+        set_register16(emu, EDX, get_register16(emu, EBX));
+        set_carry_flag(emu, 0);
+        return;
+    case 0x2400:
+    case 0x2401:
+        set_result(emu, 0);
+        return;
+    case 0x2402:
+        set_register8(emu, AL, 1);
+        set_result(emu, 0);
+        return;
+    case 0x2403:
+        /* A20 through the keyboard controller and port 92h */
+        set_register16(emu, EBX, 0x0003);
+        set_result(emu, 0);
+        return;
+    default:
+        break;
+    }
+    if (function >> 8 == 0x88)
+    {
+        set_register16(emu, EAX, extended_kb < 0xFFFF ? extended_kb : 0xFFFF);
+        set_carry_flag(emu, 0);
+        return;
+    }
+    set_result(emu, BIOS_UNSUPPORTED);
+}
+
+int bios_interrupt(Emulator *emu, uint8_t vector)
+{
+    switch (vector)
+    {
+    case 0x10:
+        video_service(emu);
+        return 1;
+    case 0x12:
+        set_register16(emu, EAX, BIOS_CONVENTIONAL_KB);
+        return 1;
+    case 0x13:
+        disk_service(emu);
+        return 1;
+    case 0x15:
+        system_service(emu);
+        return 1;
+    default:
+        return 0;
+    }
+}
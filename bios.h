@@ -0,0 +1,49 @@
+#ifndef BIOS_H_
+#define BIOS_H_
+
+#include <stdint.h>
+
+#include "emulator.h"
+
+/*
+ * BIOS services (real mode int n)
+ * Run in host code when the guest executes int n, there are no handlers
+ * in guest memory: the registers and CF are set as the BIOS returns them
+ * and the guest goes on after the int.
+ *
+ * | int 10h | video: AH=0Eh teletype and AH=13h write string go to the  |
+ * |         | serial port (and the -cga screen), AH=02h/03h cursor,     |
+ * |         | AH=0Fh mode 3 (80x25 text); the other functions do nothing |
+ * | int 12h | conventional memory: 639 KB (the EBDA holds the MP tables) |
+ * | int 13h | disk 80h, read into guest memory straight from the Disk    |
+ * |         | backend, BIOS_DISK_MAX_SECTORS at once:                    |
+ * |         | AH=00h reset, 02h/03h CHS read/write, 08h parameters,      |
+ * |         | 15h type, 41h/42h/43h/48h LBA extensions (EDD 3.0)         |
+ * | int 15h | AX=E820h memory map, E801h / AH=88h extended memory,       |
+ * |         | AX=240xh A20 (always on)                                   |
+ * Unknown functions return CF set (int 13h: AH=01h, int 15h: AH=86h).
+ */
+#define BIOS_CONVENTIONAL_KB 639
+/* Geometry of the CHS functions */
+#define BIOS_DISK_HEADS 16
+#define BIOS_DISK_SECTORS 63
+#define BIOS_DISK_MAX_CYLINDERS 1024
+#define BIOS_DISK_MAX_SECTORS 0x7F
+#define BIOS_HARD_DISK 0x80
+
+/* E820 entry types */
+#define BIOS_E820_RAM 1
+#define BIOS_E820_RESERVED 2
+#define BIOS_SMAP 0x534D4150
+
+typedef struct
+{
+    uint64_t base;
+    uint64_t length;
+    uint32_t type;
+} BiosE820Entry;
+
+/* Runs the service of int vector. Returns 0 if the BIOS has none (the vector is not one above). */
+int bios_interrupt(Emulator *emu, uint8_t vector);
+
+#endif
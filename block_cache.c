@@ -0,0 +1,674 @@
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "block_cache.h"
+#include "jit.h"
+#include "emulator_functions.h"
+#include "gdb.h"
+#include "machine.h"
+#include "stats.h"
+#include "util.h"
+
+/*
+ * Decode flags for one-byte opcodes
+ * D_MODRM: ModR/M follows the opcode
+ * D_IMM8/D_IMM32: immediate follows ModR/M (or the opcode)
+ * D_END: last instruction of a block
+ * D_GROUP: immediate or D_END depends on REG of ModR/M (F6, F7, FF)
+ */
+#define D_MODRM (1 << 0)
+#define D_IMM8 (1 << 1)
+#define D_IMM32 (1 << 2)
+#define D_END (1 << 3)
+#define D_GROUP (1 << 4)
+
+/* Decoding never reads past this many bytes from the opcode. */
+#define DECODE_MAX_LENGTH 16
+
+static const uint8_t decode_flags[256] = {
+    /* 00 - 0F */
+    [0x00] = D_MODRM, [0x01] = D_MODRM, [0x02] = D_MODRM, [0x03] = D_MODRM,
+    [0x04] = D_IMM8, [0x05] = D_IMM32,
+    [0x08] = D_MODRM, [0x09] = D_MODRM, [0x0A] = D_MODRM, [0x0B] = D_MODRM,
+    [0x0C] = D_IMM8, [0x0D] = D_IMM32,
+    /* 10 - 1F */
+    [0x10] = D_MODRM, [0x11] = D_MODRM, [0x12] = D_MODRM, [0x13] = D_MODRM,
+    [0x14] = D_IMM8, [0x15] = D_IMM32,
+    [0x18] = D_MODRM, [0x19] = D_MODRM, [0x1A] = D_MODRM, [0x1B] = D_MODRM,
+    [0x1C] = D_IMM8, [0x1D] = D_IMM32,
+    /* 20 - 2F */
+    [0x20] = D_MODRM, [0x21] = D_MODRM, [0x22] = D_MODRM, [0x23] = D_MODRM,
+    [0x24] = D_IMM8, [0x25] = D_IMM32,
+    [0x28] = D_MODRM, [0x29] = D_MODRM, [0x2A] = D_MODRM, [0x2B] = D_MODRM,
+    [0x2C] = D_IMM8, [0x2D] = D_IMM32,
+    /* 30 - 3F */
+    [0x30] = D_MODRM, [0x31] = D_MODRM, [0x32] = D_MODRM, [0x33] = D_MODRM,
+    [0x34] = D_IMM8, [0x35] = D_IMM32,
+    [0x38] = D_MODRM, [0x39] = D_MODRM, [0x3A] = D_MODRM, [0x3B] = D_MODRM,
+    [0x3C] = D_IMM8, [0x3D] = D_IMM32,
+    /* 60 - 6F */
+    [0x66] = D_END,
+    [0x68] = D_IMM32, [0x69] = D_MODRM | D_IMM32,
+    [0x6A] = D_IMM8, [0x6B] = D_MODRM | D_IMM8,
+    /* 70 - 7F */
+    [0x70] = D_END, [0x71] = D_END, [0x72] = D_END, [0x73] = D_END,
+    [0x74] = D_END, [0x75] = D_END, [0x76] = D_END, [0x77] = D_END,
+    [0x78] = D_END, [0x79] = D_END, [0x7A] = D_END, [0x7B] = D_END,
+    [0x7C] = D_END, [0x7D] = D_END, [0x7E] = D_END, [0x7F] = D_END,
+    /* 80 - 8F */
+    [0x80] = D_MODRM | D_IMM8, [0x81] = D_MODRM | D_IMM32, [0x83] = D_MODRM | D_IMM8,
+    [0x84] = D_MODRM, [0x85] = D_MODRM, [0x86] = D_MODRM, [0x87] = D_MODRM,
+    [0x88] = D_MODRM, [0x89] = D_MODRM, [0x8A] = D_MODRM, [0x8B] = D_MODRM,
+    [0x8C] = D_MODRM, [0x8D] = D_MODRM, [0x8E] = D_MODRM, [0x8F] = D_MODRM,
+    /* 90 - 9F */
+    [0x9A] = D_END,
+    /* A0 - AF: moffs32 */
+    [0xA0] = D_IMM32, [0xA1] = D_IMM32, [0xA2] = D_IMM32, [0xA3] = D_IMM32,
+    [0xA8] = D_IMM8, [0xA9] = D_IMM32,
+    /* B0 - BF */
+    [0xB0] = D_IMM8, [0xB1] = D_IMM8, [0xB2] = D_IMM8, [0xB3] = D_IMM8,
+    [0xB4] = D_IMM8, [0xB5] = D_IMM8, [0xB6] = D_IMM8, [0xB7] = D_IMM8,
+    [0xB8] = D_IMM32, [0xB9] = D_IMM32, [0xBA] = D_IMM32, [0xBB] = D_IMM32,
+    [0xBC] = D_IMM32, [0xBD] = D_IMM32, [0xBE] = D_IMM32, [0xBF] = D_IMM32,
+    /* C0 - CF */
+    [0xC0] = D_MODRM | D_IMM8, [0xC1] = D_MODRM | D_IMM8,
+    [0xC2] = D_END, [0xC3] = D_END,
+    [0xC4] = D_MODRM, [0xC5] = D_MODRM,
+    [0xC6] = D_MODRM | D_IMM8, [0xC7] = D_MODRM | D_IMM32,
+    [0xCA] = D_END, [0xCB] = D_END, [0xCC] = D_END, [0xCD] = D_END,
+    [0xCE] = D_END, [0xCF] = D_END,
+    /* D0 - DF */
+    [0xD0] = D_MODRM, [0xD1] = D_MODRM, [0xD2] = D_MODRM, [0xD3] = D_MODRM,
+    /* E0 - EF */
+    [0xE0] = D_END, [0xE1] = D_END, [0xE2] = D_END, [0xE3] = D_END,
+    [0xE4] = D_IMM8, [0xE5] = D_IMM8, [0xE6] = D_IMM8, [0xE7] = D_IMM8,
+    [0xE8] = D_END, [0xE9] = D_END, [0xEA] = D_END, [0xEB] = D_END,
+    /* F0 - FF */
+    [0xF0] = D_END, [0xF1] = D_END, [0xF2] = D_END, [0xF3] = D_END,
+    [0xF4] = D_END,
+    [0xF6] = D_MODRM | D_GROUP, [0xF7] = D_MODRM | D_GROUP,
+    [0xFE] = D_MODRM, [0xFF] = D_MODRM | D_GROUP,
+    /* Segment override and address size prefixes */
+    [0x26] = D_END, [0x2E] = D_END, [0x36] = D_END, [0x3E] = D_END,
+    [0x64] = D_END, [0x65] = D_END, [0x67] = D_END,
+};
+
+/* Decode flags for two-byte opcodes (0F xx) */
+static const uint8_t two_byte_decode_flags[256] = {
+    /* Descriptor tables, invlpg and control registers change translation. */
+    [0x00] = D_MODRM | D_END, [0x01] = D_MODRM | D_END,
+    [0x20] = D_MODRM | D_END, [0x22] = D_MODRM | D_END,
+    [0x80] = D_END, [0x81] = D_END, [0x82] = D_END, [0x83] = D_END,
+    [0x84] = D_END, [0x85] = D_END, [0x86] = D_END, [0x87] = D_END,
+    [0x88] = D_END, [0x89] = D_END, [0x8A] = D_END, [0x8B] = D_END,
+    [0x8C] = D_END, [0x8D] = D_END, [0x8E] = D_END, [0x8F] = D_END,
+    [0x90] = D_MODRM, [0x91] = D_MODRM, [0x92] = D_MODRM, [0x93] = D_MODRM,
+    [0x94] = D_MODRM, [0x95] = D_MODRM, [0x96] = D_MODRM, [0x97] = D_MODRM,
+    [0x98] = D_MODRM, [0x99] = D_MODRM, [0x9A] = D_MODRM, [0x9B] = D_MODRM,
+    [0x9C] = D_MODRM, [0x9D] = D_MODRM, [0x9E] = D_MODRM, [0x9F] = D_MODRM,
+    [0xB1] = D_MODRM, [0xB6] = D_MODRM, [0xB7] = D_MODRM, [0xBE] = D_MODRM,
+    [0xBF] = D_MODRM, [0xC1] = D_MODRM,
+};
+
+static uint64_t fusion_counts[FUSION_PATTERNS];
+
+static const char *fusion_names[FUSION_PATTERNS] = {
+    [FUSE_CMP_JCC] = "cmp + jcc",
+    [FUSE_TEST_JCC] = "test + jcc",
+    [FUSE_PUSH_MOV] = "push ebp + mov ebp, esp",
+    [FUSE_MOV_ADD] = "mov + add",
+};
+
+BlockCache *create_block_cache(uint32_t page_count)
+{
+    BlockCache *cache = malloc(sizeof(BlockCache));
+    memset(cache, 0, sizeof(BlockCache));
+    cache->page_count = page_count;
+    cache->pages = calloc(page_count, sizeof(Block *));
+    cache->stale = calloc((page_count + 63) / 64, sizeof(uint64_t));
+    return cache;
+}
+
+static void free_retired_blocks(BlockCache *cache)
+{
+    Block **link = &cache->retired;
+    while (*link != NULL)
+    {
+        Block *block = *link;
+        /* Freed once the JIT compiler thread is done with it */
+        if (__atomic_load_n(&block->queued, __ATOMIC_ACQUIRE))
+        {
+            link = &block->retired_next;
+            continue;
+        }
+        *link = block->retired_next;
+        free(block);
+    }
+}
+
+static void retire_block(BlockCache *cache, Block *block)
+{
+    Block **link = &cache->hash[block->phys_addr % BLOCK_HASH_SIZE];
+    while (*link != block)
+        link = &(*link)->hash_next;
+    *link = block->hash_next;
+
+    block->valid = 0;
+    block->retired_next = cache->retired;
+    cache->retired = block;
+    cache->block_count--;
+    /* Chains may point at it. */
+    cache->generation++;
+}
+
+void invalidate_code_page(Emulator *emu, uint32_t page)
+{
+    BlockCache *cache = emu->block_cache;
+    Block *block = cache->pages[page];
+    while (block != NULL)
+    {
+        Block *next = block->page_next;
+        retire_block(cache, block);
+        block = next;
+    }
+    cache->pages[page] = NULL;
+    __atomic_fetch_and(&emu->page_info[page].code_cpus, ~(1u << emu->cpu_id), __ATOMIC_RELAXED);
+}
+
+void invalidate_code_range(Emulator *emu, uint32_t p_address, uint32_t size)
+{
+    BlockCache *cache = emu->block_cache;
+    uint32_t page = p_address >> 12;
+    Block **link = &cache->pages[page];
+    while (*link != NULL)
+    {
+        Block *block = *link;
+        if (block->phys_addr < p_address + size && p_address < block->phys_addr + block->length)
+        {
+            *link = block->page_next;
+            retire_block(cache, block);
+        }
+        else
+        {
+            link = &block->page_next;
+        }
+    }
+    if (cache->pages[page] == NULL)
+        __atomic_fetch_and(&emu->page_info[page].code_cpus, ~(1u << emu->cpu_id), __ATOMIC_RELAXED);
+}
+
+void invalidate_remote_code(Emulator *emu, uint32_t page, uint32_t cpus)
+{
+    int i;
+    for (i = 0; i < emu->machine->cpu_count; i++)
+    {
+        if (!(cpus & (1u << i)))
+            continue;
+        Emulator *cpu = emu->machine->cpus[i];
+        __atomic_fetch_or(&cpu->block_cache->stale[page >> 6], 1ull << (page & 63), __ATOMIC_RELEASE);
+        raise_attention(cpu, ATTENTION_CODE);
+    }
+}
+
+void drop_stale_code(Emulator *emu)
+{
+    BlockCache *cache = emu->block_cache;
+    uint32_t word;
+    for (word = 0; word < (cache->page_count + 63) / 64; word++)
+    {
+        if (__atomic_load_n(&cache->stale[word], __ATOMIC_RELAXED) == 0)
+            continue;
+        uint64_t bits = __atomic_exchange_n(&cache->stale[word], 0, __ATOMIC_ACQUIRE);
+        while (bits != 0)
+        {
+            int bit = __builtin_ctzll(bits);
+            bits &= bits - 1;
+            invalidate_code_page(emu, word * 64 + bit);
+        }
+    }
+}
+
+static void invalidate_all(Emulator *emu)
+{
+    uint32_t page;
+    for (page = 0; page < emu->block_cache->page_count; page++)
+    {
+        if (emu->block_cache->pages[page] != NULL)
+            invalidate_code_page(emu, page);
+    }
+}
+
+void drop_native_code(Emulator *emu)
+{
+    int i;
+    for (i = 0; i < BLOCK_HASH_SIZE; i++)
+    {
+        Block *block;
+        for (block = emu->block_cache->hash[i]; block != NULL; block = block->hash_next)
+        {
+            block->native = NULL;
+            block->hits = 0;
+        }
+    }
+}
+
+void destroy_block_cache(BlockCache *cache)
+{
+    int i;
+    /* Stops the compiler thread before the blocks it may read are freed. */
+    free_jit_code(cache);
+    for (i = 0; i < BLOCK_HASH_SIZE; i++)
+    {
+        while (cache->hash[i] != NULL)
+        {
+            Block *next = cache->hash[i]->hash_next;
+            free(cache->hash[i]);
+            cache->hash[i] = next;
+        }
+    }
+    free_retired_blocks(cache);
+    free(cache->pages);
+    free(cache->stale);
+    free(cache);
+}
+
+/*
+ * Decodes one instruction at code.
+ * Returns its length, or 0 if it can not be run from a block.
+ */
+static int decode_op(Emulator *emu, const uint8_t *code, DecodedOp *decoded, int *ends_block)
+{
+    uint8_t op = code[0];
+    uint8_t flags;
+    int length;
+
+    decoded->op = op;
+    decoded->fused = FUSE_NONE;
+    decoded->fused_handler = NULL;
+    decoded->modrm_length = 0;
+    if (op == 0x0F)
+    {
+        decoded->handler = two_byte_instructions[code[1]];
+        flags = two_byte_decode_flags[code[1]];
+        length = 2;
+        /* Handlers of two-byte ops not listed are run as well, but only last. */
+        if (flags == 0)
+            flags = D_END;
+    }
+    else
+    {
+        decoded->handler = instructions[op];
+        flags = decode_flags[op];
+        length = 1;
+    }
+    if (decoded->handler == NULL)
+        return 0;
+
+    if (flags & D_MODRM)
+    {
+        decoded->modrm_offset = length;
+        decoded->modrm_length = decode_modrm(code + length, emu->is_pe, &decoded->modrm);
+        length += decoded->modrm_length;
+        if (op != 0x0F)
+        {
+            instruction_func_t *reg_form = reg_form_handler(op, &decoded->modrm);
+            if (reg_form != NULL)
+                decoded->handler = reg_form;
+        }
+        if (flags & D_GROUP)
+        {
+            uint8_t reg = decoded->modrm.opcode;
+            /* test rm8 imm8, test rm32 imm32 */
+            if (op == 0xF6 && reg == 0)
+                flags |= D_IMM8;
+            if (op == 0xF7 && reg == 0)
+                flags |= D_IMM32;
+            /* call, callf, jmp, jmpf */
+            if (op == 0xFF && reg >= 2 && reg <= 5)
+                flags |= D_END;
+        }
+    }
+    if (flags & D_IMM8)
+        length += 1;
+    if (flags & D_IMM32)
+        length += 4;
+
+    *ends_block = (flags & D_END) != 0;
+    return length;
+}
+
+/*
+ * Attention raised from other threads for the host (signals, dax86_stop,
+ * the kbd thread of -record) does not split a pair, so that with -icount
+ * the boundaries instructions retire at do not depend on host timing.
+ */
+#define ATTENTION_HOST (ATTENTION_STOP | ATTENTION_STATS | ATTENTION_SNAPSHOT | ATTENTION_DEADLINE | ATTENTION_INPUT | ATTENTION_CHECKPOINT)
+
+/*
+ * Runs the first op of a pair and, unless it left straight-line
+ * execution or something needs attention, the second one.
+ */
+static void run_fused(Emulator *emu)
+{
+    DecodedOp *first = emu->decoded;
+    DecodedOp *second = first + 1;
+    uint32_t second_eip = emu->block_cache->current_eip + second->offset;
+
+    first->fused_handler(emu);
+    emu->retired = 1;
+    Block *block = emu->block_cache->current;
+    if (emu->eip != second_eip || (emu->attention & ~ATTENTION_HOST) != 0 || block == NULL || !block->valid)
+        return;
+    fusion_counts[first->fused]++;
+    if (config.stats)
+        count_op(emu, second->op);
+    emu->decoded = second;
+    second->handler(emu);
+    emu->decoded = first;
+    emu->retired = 2;
+}
+
+static int is_jcc(const uint8_t *code)
+{
+    return (code[0] >= 0x70 && code[0] <= 0x7F) ||
+           (code[0] == 0x0F && code[1] >= 0x80 && code[1] <= 0x8F);
+}
+
+static int fusion_pattern(const uint8_t *code, DecodedOp *first, DecodedOp *second)
+{
+    const uint8_t *first_code = code + first->offset;
+    const uint8_t *second_code = code + second->offset;
+    uint8_t op = first_code[0];
+
+    if (is_jcc(second_code))
+    {
+        /* cmp(38 - 3D), cmp rm imm(80, 81, 83 /7) */
+        if ((op >= 0x38 && op <= 0x3D) ||
+            ((op == 0x80 || op == 0x81 || op == 0x83) && first->modrm.opcode == 7))
+            return FUSE_CMP_JCC;
+        /* test(84, 85, A8, A9), test rm imm(F6, F7 /0) */
+        if (op == 0x84 || op == 0x85 || op == 0xA8 || op == 0xA9 ||
+            ((op == 0xF6 || op == 0xF7) && first->modrm.opcode == 0))
+            return FUSE_TEST_JCC;
+        return FUSE_NONE;
+    }
+    /* 55 89 E5 */
+    if (op == 0x55 && second_code[0] == 0x89 && second_code[1] == 0xE5)
+        return FUSE_PUSH_MOV;
+    if (op == 0x8B)
+    {
+        uint8_t reg = first->modrm.reg_index;
+        ModRM *modrm = &second->modrm;
+        /* add r32 rm32 */
+        if (second_code[0] == 0x03 && modrm->reg_index == reg)
+            return FUSE_MOV_ADD;
+        /* add rm32 r32, add rm32 imm(81, 83 /0) with rm being the register */
+        if (modrm->mod == 3 && modrm->rm == reg &&
+            (second_code[0] == 0x01 ||
+             ((second_code[0] == 0x81 || second_code[0] == 0x83) && modrm->opcode == 0)))
+            return FUSE_MOV_ADD;
+    }
+    return FUSE_NONE;
+}
+
+/* Pairs up ops from the start of the block. */
+static void fuse_ops(const uint8_t *code, DecodedOp *ops, int count)
+{
+    int i;
+    for (i = 0; i + 1 < count; i++)
+    {
+        int pattern = fusion_pattern(code, &ops[i], &ops[i + 1]);
+        if (pattern == FUSE_NONE)
+            continue;
+        ops[i].fused = pattern;
+        ops[i].fused_handler = ops[i].handler;
+        ops[i].handler = run_fused;
+        i++;
+    }
+}
+
+void print_fusion_stats(void)
+{
+    int i;
+    printf("Fused pairs:\n");
+    for (i = FUSE_NONE + 1; i < FUSION_PATTERNS; i++)
+        printf("%-24s %llu\n", fusion_names[i], (unsigned long long)fusion_counts[i]);
+}
+
+static Block *decode_block(Emulator *emu, uint32_t phys_addr)
+{
+    BlockCache *cache = emu->block_cache;
+    DecodedOp ops[BLOCK_MAX_OPS];
+    uint32_t page_end = (phys_addr | 0xFFF) + 1;
+    uint32_t offset = 0;
+    int count = 0;
+    int ends_block = 0;
+
+    while (count < BLOCK_MAX_OPS && !ends_block)
+    {
+        /* Instructions near the end of the page are left to the interpreter. */
+        if (page_end - (phys_addr + offset) < DECODE_MAX_LENGTH)
+            break;
+        /* and so are the ones at GDB breakpoints, which it stops at. */
+        if (gdb_breakpoint_count != 0 && gdb_breakpoint_at(phys_addr + offset))
+            break;
+        int length = decode_op(emu, emu->memory + phys_addr + offset, &ops[count], &ends_block);
+        if (length == 0)
+            break;
+        ops[count].offset = offset;
+        offset += length;
+        count++;
+    }
+    if (count == 0)
+        return NULL;
+    fuse_ops(emu->memory + phys_addr, ops, count);
+
+    if (cache->block_count >= BLOCK_CACHE_MAX_BLOCKS)
+        invalidate_all(emu);
+
+    Block *block = malloc(sizeof(Block) + sizeof(DecodedOp) * count);
+    block->phys_addr = phys_addr;
+    block->length = offset;
+    block->is_pe = emu->is_pe;
+    block->valid = 1;
+    block->op_count = count;
+    block->hits = 0;
+    block->native = NULL;
+    block->queued = 0;
+    block->chain_generation = cache->generation;
+    memset(block->chain, 0, sizeof(block->chain));
+    block->return_block = NULL;
+    memcpy(block->ops, ops, sizeof(DecodedOp) * count);
+
+    Block **bucket = &cache->hash[phys_addr % BLOCK_HASH_SIZE];
+    block->hash_next = *bucket;
+    *bucket = block;
+    Block **page = &cache->pages[phys_addr >> 12];
+    block->page_next = *page;
+    *page = block;
+    __atomic_fetch_or(&emu->page_info[phys_addr >> 12].code_cpus, 1u << emu->cpu_id, __ATOMIC_RELAXED);
+    cache->block_count++;
+    return block;
+}
+
+static Block *lookup_block(Emulator *emu, uint32_t phys_addr)
+{
+    Block *block = emu->block_cache->hash[phys_addr % BLOCK_HASH_SIZE];
+    while (block != NULL)
+    {
+        if (block->phys_addr == phys_addr && block->is_pe == emu->is_pe)
+            return block;
+        block = block->hash_next;
+    }
+    return NULL;
+}
+
+/* Drops the chains of block if they are from an older generation. */
+static void refresh_chains(BlockCache *cache, Block *block)
+{
+    if (block->chain_generation == cache->generation)
+        return;
+    memset(block->chain, 0, sizeof(block->chain));
+    block->return_block = NULL;
+    block->chain_generation = cache->generation;
+}
+
+static int is_call(DecodedOp *op)
+{
+    return op->op == 0xE8 || (op->op == 0xFF && op->modrm.opcode == 2);
+}
+
+/* Length of a call, whose rel is not counted in the length of the block (D_END) */
+static int call_length(Emulator *emu, DecodedOp *op)
+{
+    if (op->op == 0xE8)
+        return emu->is_pe ? 5 : 3;
+    return 1 + op->modrm_length;
+}
+
+static int is_ret(DecodedOp *op)
+{
+    return op->op == 0xC3 || op->op == 0xC2;
+}
+
+/*
+ * Block at EIP without a lookup, coming off the end of block (left at
+ * its last op): from the return stack after ret, else from its chains.
+ * Pushes the return address of a call. *caller is set to the block the
+ * return block is to be linked to if the return stack has no block yet.
+ */
+static Block *follow_chain(Emulator *emu, Block *block, Block **caller)
+{
+    BlockCache *cache = emu->block_cache;
+    DecodedOp *last = &block->ops[block->op_count - 1];
+    int i;
+    *caller = NULL;
+    if (is_ret(last))
+    {
+        ReturnEntry *entry = &cache->return_stack[--cache->return_top % RETURN_STACK_SIZE];
+        if (entry->generation != cache->generation || entry->eip != emu->eip)
+            return NULL;
+        *caller = entry->caller;
+        refresh_chains(cache, entry->caller);
+        if (entry->caller->return_block != NULL)
+            STAT_INC(stats.block_returns);
+        return entry->caller->return_block;
+    }
+    if (is_call(last))
+    {
+        ReturnEntry *entry = &cache->return_stack[cache->return_top++ % RETURN_STACK_SIZE];
+        entry->eip = cache->current_eip + last->offset + call_length(emu, last);
+        entry->generation = cache->generation;
+        entry->caller = block;
+    }
+    if (block->chain_generation != cache->generation)
+        return NULL;
+    for (i = 0; i < BLOCK_CHAINS; i++)
+    {
+        if (block->chain[i] != NULL && block->chain_eip[i] == emu->eip)
+        {
+            STAT_INC(stats.block_chains);
+            return block->chain[i];
+        }
+    }
+    return NULL;
+}
+
+/* Chains next, looked up at eip, to previous. */
+static void link_block(BlockCache *cache, Block *previous, Block *next, uint32_t eip)
+{
+    refresh_chains(cache, previous);
+    /* The first slot keeps the first successor, the second the latest other one. */
+    int slot = previous->chain[0] == NULL ? 0 : 1;
+    previous->chain[slot] = next;
+    previous->chain_eip[slot] = eip;
+}
+
+DecodedOp *next_decoded_op(Emulator *emu)
+{
+    BlockCache *cache = emu->block_cache;
+    Block *block = cache->current;
+    Block *previous = NULL;
+    Block *caller = NULL;
+
+    /* Falls through to the next instruction in the block. */
+    if (block != NULL)
+    {
+        int index = cache->current_index;
+        int next = index + 1;
+        /* Skips the second op of a pair once it ran. */
+        if (block->ops[index].fused && next + 1 < block->op_count &&
+            emu->eip == cache->current_eip + block->ops[next + 1].offset)
+            next++;
+        if (block->valid && next < block->op_count &&
+            emu->eip == cache->current_eip + block->ops[next].offset)
+        {
+            cache->current_index = next;
+            return &block->ops[next];
+        }
+        cache->current = NULL;
+        /* Left at its last op, or pair */
+        if (block->valid && index + (block->ops[index].fused ? 1 : 0) == block->op_count - 1)
+        {
+            previous = block;
+            Block *chained = follow_chain(emu, block, &caller);
+            if (chained != NULL)
+            {
+                cache->current = chained;
+                cache->current_index = 0;
+                cache->current_eip = emu->eip;
+                return &chained->ops[0];
+            }
+        }
+    }
+    free_retired_blocks(cache);
+
+    /* Real mode code is interpreted. */
+    if (!emu->is_pe)
+        return NULL;
+
+    uint32_t phys_addr = get_physical_address(emu, CS, emu->eip, 0);
+    if (phys_addr >= emu->memory_size)
+        return NULL;
+    STAT_INC(stats.block_lookups);
+    block = lookup_block(emu, phys_addr);
+    if (block == NULL)
+        block = decode_block(emu, phys_addr);
+    if (block == NULL)
+        return NULL;
+    /* Decoding may have dropped every block. */
+    if (caller != NULL && caller->valid)
+        caller->return_block = block;
+    else if (previous != NULL && previous->valid && !is_ret(&previous->ops[previous->op_count - 1]))
+        link_block(cache, previous, block, emu->eip);
+
+    cache->current = block;
+    cache->current_index = 0;
+    cache->current_eip = emu->eip;
+    return &block->ops[0];
+}
+
+void leave_block(Emulator *emu)
+{
+    emu->block_cache->current = NULL;
+}
+
+void unchain_blocks(Emulator *emu)
+{
+    emu->block_cache->generation++;
+}
+
+int use_decoded_modrm(Emulator *emu, ModRM *modrm)
+{
+    DecodedOp *decoded = emu->decoded;
+    if (decoded == NULL || decoded->modrm_length == 0)
+        return 0;
+    uint32_t modrm_eip = emu->block_cache->current_eip + decoded->offset + decoded->modrm_offset;
+    if (emu->eip != modrm_eip)
+        return 0;
+    *modrm = decoded->modrm;
+    emu->eip += decoded->modrm_length;
+    return 1;
+}
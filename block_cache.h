@@ -0,0 +1,200 @@
+#ifndef BLOCK_CACHE_H_
+#define BLOCK_CACHE_H_
+
+#include <stdint.h>
+
+#include "emulator.h"
+#include "instructions.h"
+#include "modrm.h"
+
+/* Maximum number of instructions decoded into a block */
+#define BLOCK_MAX_OPS 32
+#define BLOCK_HASH_SIZE 4096
+/* The whole cache is dropped once this many blocks are alive. */
+#define BLOCK_CACHE_MAX_BLOCKS 65536
+/* Successors a block is chained to, by the EIP it is left at */
+#define BLOCK_CHAINS 2
+/* Calls whose return blocks are predicted */
+#define RETURN_STACK_SIZE 16
+
+/*
+ * Instruction pairs run by one handler
+ * The first op of a pair gets the fused handler, which runs both.
+ */
+enum FusionPattern
+{
+    FUSE_NONE,
+    /* cmp + jcc */
+    FUSE_CMP_JCC,
+    /* test + jcc */
+    FUSE_TEST_JCC,
+    /* push ebp + mov ebp, esp */
+    FUSE_PUSH_MOV,
+    /* mov r32, rm32 + add to the same r32 */
+    FUSE_MOV_ADD,
+    FUSION_PATTERNS
+};
+
+/*
+ * Pre-decoded instruction
+ * handler: resolved handler (two-byte ops point at the 0F xx handler)
+ * fused_handler: own handler of the first op of a pair
+ * offset: bytes from the start of the block
+ * op: first opcode byte (for logs)
+ * fused: FusionPattern if the next op is run together with this one
+ * modrm_offset: bytes from the start of the instruction to ModR/M
+ * modrm_length: 0 if ModR/M was not decoded
+ */
+typedef struct DecodedOp
+{
+    instruction_func_t *handler;
+    instruction_func_t *fused_handler;
+    uint16_t offset;
+    uint8_t op;
+    uint8_t fused;
+    uint8_t modrm_offset;
+    uint8_t modrm_length;
+    ModRM modrm;
+} DecodedOp;
+
+/*
+ * Basic block
+ * Straight-line instructions within one physical page, decoded once.
+ * A block ends with a branch, an instruction that can change how code is
+ * translated, a prefix, or the end of the page.
+ */
+typedef struct Block Block;
+struct Block
+{
+    uint32_t phys_addr;
+    /* Bytes of code decoded, from phys_addr */
+    uint16_t length;
+    uint8_t is_pe;
+    uint8_t valid;
+    int op_count;
+    /* JIT: times entered, and host code once compiled */
+    uint32_t hits;
+    void *native;
+    /* JIT: with the compiler thread, which may still read the block */
+    uint8_t queued;
+    /*
+     * Chaining: blocks run next, once found by the hash lookup, and
+     * for a call the block of its return address. Only used while
+     * chain_generation is the one of the cache.
+     */
+    uint32_t chain_generation;
+    uint32_t chain_eip[BLOCK_CHAINS];
+    Block *chain[BLOCK_CHAINS];
+    Block *return_block;
+    Block *hash_next;
+    Block *page_next;
+    Block *retired_next;
+    DecodedOp ops[];
+};
+
+/* JIT compiler thread of a block cache (jit.c) */
+typedef struct JitCompiler JitCompiler;
+
+/* A call left the block caller, which is to be returned to at eip. */
+typedef struct
+{
+    uint32_t eip;
+    uint32_t generation;
+    Block *caller;
+} ReturnEntry;
+
+/*
+ * Blocks are chained to the blocks run after them, so falling off a
+ * block mostly skips the translation of CS:EIP and the hash lookup;
+ * ret takes the block of the return address from the return stack,
+ * filled at calls. Chains are dropped all at once (generation bumped)
+ * when a block is retired or the translation of CS:EIP may change
+ * (unchain_blocks), so they never point at freed blocks.
+ */
+struct BlockCache
+{
+    Block *hash[BLOCK_HASH_SIZE];
+    /* Blocks per physical page, the vCPU's bit of PageInfo.code_cpus is set while non NULL. */
+    Block **pages;
+    /* Pages written by other vCPUs (bit per page), dropped at ATTENTION_CODE */
+    uint64_t *stale;
+    uint32_t page_count;
+    /* Invalidated blocks, freed once no instruction runs from them. */
+    Block *retired;
+    int block_count;
+    /* Block being executed */
+    Block *current;
+    int current_index;
+    uint32_t current_eip;
+    uint32_t generation;
+    ReturnEntry return_stack[RETURN_STACK_SIZE];
+    /* Pushes done, the top is return_stack[(return_top - 1) % RETURN_STACK_SIZE] */
+    uint32_t return_top;
+    /* JIT: host code of the blocks (JIT_CODE_SIZE), NULL until the first compile */
+    uint8_t *code;
+    uint32_t code_used;
+    /* JIT: compiler thread and its queue (jit.c), NULL until the first hot block */
+    JitCompiler *compiler;
+    /* JIT: block the host code last jumped into from the end of another, and ops run before it */
+    Block *chained;
+    uint32_t chained_ops;
+};
+
+/*
+ * Register-direct handler of one-byte op with Mod: 11, NULL if none.
+ * Defined in instructions_reg.c, runs for decoded ops only.
+ */
+instruction_func_t *reg_form_handler(uint8_t op, ModRM *modrm);
+
+/* page_count: pages of RAM */
+BlockCache *create_block_cache(uint32_t page_count);
+void destroy_block_cache(BlockCache *cache);
+
+/*
+ * Returns pre-decoded instruction at CS:EIP, decoding a new block
+ * if needed. NULL if the instruction can not be run from the cache.
+ */
+DecodedOp *next_decoded_op(Emulator *emu);
+
+/* Stops falling through the current block (CS or translation changed). */
+void leave_block(Emulator *emu);
+/* Drops the chains and return stack: CS:EIP may be translated differently. */
+void unchain_blocks(Emulator *emu);
+
+/* Fills ModR/M from the running instruction if EIP points at it. */
+int use_decoded_modrm(Emulator *emu, ModRM *modrm);
+
+/* EIP of the op running: handlers move EIP on while they decode. */
+static inline uint32_t current_op_eip(Emulator *emu)
+{
+    if (emu->decoded != NULL)
+        return emu->block_cache->current_eip + emu->decoded->offset;
+    return emu->op_eip;
+}
+
+/* Forgets host code of every block (JIT buffer is reused). */
+void drop_native_code(Emulator *emu);
+
+/* Prints how many times each fused pair ran. */
+void print_fusion_stats(void);
+
+/* Drops every block decoded from the physical page. */
+void invalidate_code_page(Emulator *emu, uint32_t page);
+
+/*
+ * Drops the blocks decoded from bytes in [p_address, p_address + size),
+ * which has to be within one page.
+ */
+void invalidate_code_range(Emulator *emu, uint32_t p_address, uint32_t size);
+
+/*
+ * Makes the vCPUs in cpus (PageInfo.code_cpus bits, but emu's own) drop
+ * their blocks of the page before their next instruction.
+ * As on hardware, code written while another vCPU is decoding it
+ * is only seen there after the guest synchronizes.
+ */
+void invalidate_remote_code(Emulator *emu, uint32_t page, uint32_t cpus);
+/* Drops blocks of the pages in BlockCache.stale (ATTENTION_CODE). */
+void drop_stale_code(Emulator *emu);
+
+#endif
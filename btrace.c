@@ -0,0 +1,180 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "btrace.h"
+#include "emulator_functions.h"
+
+/* Full buffers of all vCPUs wait in queue until the writer thread appends them to file. */
+static pthread_mutex_t btrace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t returned = PTHREAD_COND_INITIALIZER;
+static BtraceBuffer *queue_head = NULL;
+static BtraceBuffer **queue_tail = &queue_head;
+static FILE *file = NULL;
+static pthread_t writer;
+static uint32_t regs_every = 0;
+static Btrace *traces = NULL;
+static int closing = 0;
+
+static void write_chunk(BtraceBuffer *buffer, uint32_t used)
+{
+    BtraceChunk chunk = {buffer->owner->cpu_id, used};
+    if (used == 0)
+        return;
+    fwrite(&chunk, sizeof(chunk), 1, file);
+    fwrite(buffer->data, 1, used, file);
+}
+
+static void *writer_loop(void *arg)
+{
+    pthread_mutex_lock(&btrace_lock);
+    while (1)
+    {
+        while (queue_head == NULL && !closing)
+            pthread_cond_wait(&queued, &btrace_lock);
+        if (queue_head == NULL)
+            break;
+        BtraceBuffer *buffer = queue_head;
+        queue_head = buffer->next;
+        if (queue_head == NULL)
+            queue_tail = &queue_head;
+        /* Written without the lock, the vCPUs keep filling their other buffers. */
+        pthread_mutex_unlock(&btrace_lock);
+        write_chunk(buffer, buffer->used);
+        pthread_mutex_lock(&btrace_lock);
+        Btrace *trace = buffer->owner;
+        buffer->used = 0;
+        buffer->next = trace->free;
+        trace->free = buffer;
+        pthread_cond_broadcast(&returned);
+    }
+    pthread_mutex_unlock(&btrace_lock);
+    return NULL;
+}
+
+/*
+ * At exit: the writer drains the queue, then the buffers being filled
+ * are written up to their last complete record.
+ */
+static void close_btrace(void)
+{
+    Btrace *trace;
+    pthread_mutex_lock(&btrace_lock);
+    closing = 1;
+    pthread_cond_signal(&queued);
+    pthread_mutex_unlock(&btrace_lock);
+    pthread_join(writer, NULL);
+    for (trace = traces; trace != NULL; trace = trace->next)
+        write_chunk(trace->buffer, __atomic_load_n(&trace->buffer->used, __ATOMIC_ACQUIRE));
+    fclose(file);
+}
+
+int open_btrace(const char *path, uint32_t regs_interval)
+{
+    BtraceHeader header;
+    file = fopen(path, "wb");
+    if (file == NULL)
+    {
+        printf("Could not open %s.\n", path);
+        return 0;
+    }
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BTRACE_MAGIC, sizeof(header.magic));
+    header.version = BTRACE_VERSION;
+    header.regs_interval = regs_interval;
+    fwrite(&header, sizeof(header), 1, file);
+    regs_every = regs_interval;
+    pthread_create(&writer, NULL, writer_loop, NULL);
+    /* Every exit path (panic, signals, the guest halting) ends the trace. */
+    atexit(close_btrace);
+    return 1;
+}
+
+void init_btrace(Emulator *emu)
+{
+    Btrace *trace = calloc(1, sizeof(Btrace));
+    int i;
+    trace->cpu_id = emu->cpu_id;
+    trace->until_regs = 0;
+    for (i = 0; i < BTRACE_BUFFERS; i++)
+    {
+        BtraceBuffer *buffer = malloc(sizeof(BtraceBuffer));
+        buffer->owner = trace;
+        buffer->used = 0;
+        buffer->next = trace->free;
+        trace->free = buffer;
+    }
+    trace->buffer = trace->free;
+    trace->free = trace->buffer->next;
+    pthread_mutex_lock(&btrace_lock);
+    trace->next = traces;
+    traces = trace;
+    pthread_mutex_unlock(&btrace_lock);
+    emu->btrace = trace;
+}
+
+/* Queues the full buffer and takes a free one, waiting for the writer if there is none. */
+static void next_buffer(Btrace *trace)
+{
+    pthread_mutex_lock(&btrace_lock);
+    trace->buffer->next = NULL;
+    *queue_tail = trace->buffer;
+    queue_tail = &trace->buffer->next;
+    pthread_cond_signal(&queued);
+    while (trace->free == NULL)
+        pthread_cond_wait(&returned, &btrace_lock);
+    trace->buffer = trace->free;
+    trace->free = trace->buffer->next;
+    pthread_mutex_unlock(&btrace_lock);
+}
+
+static uint8_t *put_varint(uint8_t *p, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        *p++ = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    *p++ = value;
+    return p;
+}
+
+void btrace_instruction(Emulator *emu, uint8_t op)
+{
+    Btrace *trace = emu->btrace;
+    if (trace->buffer->used > BTRACE_BUFFER_SIZE - BTRACE_MAX_RECORD)
+        next_buffer(trace);
+    uint8_t *start = trace->buffer->data + trace->buffer->used;
+    uint8_t *p = start;
+
+    uint16_t cs = emu->segment_registers[CS];
+    if (!trace->cs_known || cs != trace->last_cs)
+    {
+        p = put_varint(p, BTRACE_CS);
+        memcpy(p, &cs, 2);
+        p += 2;
+        trace->last_cs = cs;
+        trace->cs_known = 1;
+    }
+    if (regs_every != 0 && trace->until_regs-- == 0)
+    {
+        BtraceRegs regs;
+        memcpy(regs.registers, emu->registers, sizeof(regs.registers));
+        regs.eflags = get_eflags(emu);
+        p = put_varint(p, BTRACE_REGS);
+        memcpy(p, &regs, sizeof(regs));
+        p += sizeof(regs);
+        trace->until_regs = regs_every - 1;
+    }
+    int32_t delta = emu->eip - trace->last_eip;
+    /* zigzag: small deltas of either sign take few bytes */
+    uint32_t zigzag = ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31);
+    p = put_varint(p, ((uint64_t)zigzag << 2) | BTRACE_OP);
+    *p++ = op;
+    trace->last_eip = emu->eip;
+    /* Complete records only, for close_btrace */
+    __atomic_store_n(&trace->buffer->used, trace->buffer->used + (p - start), __ATOMIC_RELEASE);
+}
@@ -0,0 +1,96 @@
+#ifndef BTRACE_H_
+#define BTRACE_H_
+
+#include <stdint.h>
+
+#include "emulator.h"
+
+/*
+ * Binary instruction trace (-btrace file [-btrace-regs N])
+ * Streams each instruction the run loop dispatches (what -v prints) in a
+ * compact form. Each vCPU fills its own buffers, and a writer thread
+ * appends full ones to the file. A vCPU whose buffers are all queued
+ * waits for the writer, so nothing is dropped. The JIT is off while
+ * tracing. A fused pair and a whole REP instruction are one record each.
+ * btrace_decode prints a trace, or the first difference of two.
+ *
+ * File: BtraceHeader, then chunks: BtraceChunk and size bytes of
+ * records of one vCPU, in the order they ran.
+ * Record: LEB128 varint of zigzag(EIP delta) << 2 | BtraceKind, then
+ *   BTRACE_OP: op byte; EIP is the previous op's EIP (0 at first) + delta
+ *   BTRACE_CS: new CS (2 bytes) of the next op, delta 0
+ *   BTRACE_REGS: BtraceRegs before the next op every N ops, delta 0
+ */
+#define BTRACE_MAGIC "DAX86BTR"
+#define BTRACE_VERSION 1
+
+/* Per vCPU */
+#define BTRACE_BUFFER_SIZE (1 << 20)
+#define BTRACE_BUFFERS 4
+/* Bytes the records of one op take at most (BTRACE_CS, BTRACE_REGS, BTRACE_OP) */
+#define BTRACE_MAX_RECORD 48
+
+enum BtraceKind
+{
+    BTRACE_OP,
+    BTRACE_CS,
+    BTRACE_REGS
+};
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    /* -btrace-regs N, 0 if none */
+    uint32_t regs_interval;
+} BtraceHeader;
+
+typedef struct
+{
+    uint32_t cpu_id;
+    uint32_t size;
+} BtraceChunk;
+
+typedef struct
+{
+    uint32_t registers[REGISTERS_COUNT];
+    uint32_t eflags;
+} BtraceRegs;
+
+typedef struct BtraceBuffer BtraceBuffer;
+struct BtraceBuffer
+{
+    BtraceBuffer *next;
+    Btrace *owner;
+    uint32_t used;
+    uint8_t data[BTRACE_BUFFER_SIZE];
+};
+
+/* State of one vCPU, kept until exit to flush what it has buffered. */
+struct Btrace
+{
+    BtraceBuffer *buffer;
+    /* Buffers back from the writer, with its lock held */
+    BtraceBuffer *free;
+    uint32_t cpu_id;
+    uint32_t last_eip;
+    uint16_t last_cs;
+    uint8_t cs_known;
+    /* Ops until the next BTRACE_REGS */
+    uint32_t until_regs;
+    Btrace *next;
+};
+
+/* Creates path and starts the writer thread; returns 0 on failure. */
+int open_btrace(const char *path, uint32_t regs_interval);
+/* Traces emu (after open_btrace). */
+void init_btrace(Emulator *emu);
+void btrace_instruction(Emulator *emu, uint8_t op);
+
+static inline void btrace_append(Emulator *emu, uint8_t op)
+{
+    if (emu->btrace != NULL)
+        btrace_instruction(emu, op);
+}
+
+#endif
@@ -0,0 +1,231 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "btrace.h"
+
+/*
+ * Decoder of -btrace files (btrace.h)
+ * btrace_decode trace [-cpu N]: prints each op as -v does, with the
+ *   registers where they were sampled
+ * btrace_decode trace other [-cpu N]: prints the first op where
+ *   the two differ (of vCPU N, 0 by default); exits with 1 if they do
+ */
+
+#define MAX_TRACED_CPUS 256
+
+typedef struct
+{
+    uint32_t eip;
+    uint16_t cs;
+    uint8_t has_regs;
+    BtraceRegs regs;
+} CpuState;
+
+typedef struct
+{
+    FILE *file;
+    const char *path;
+    uint8_t *chunk;
+    uint32_t chunk_cpu;
+    uint32_t chunk_size;
+    uint32_t position;
+    CpuState cpus[MAX_TRACED_CPUS];
+} Reader;
+
+/* One op with the state it ran in */
+typedef struct
+{
+    uint32_t cpu_id;
+    uint32_t eip;
+    uint16_t cs;
+    uint8_t op;
+    uint8_t has_regs;
+    BtraceRegs regs;
+} Event;
+
+static const char *register_names[REGISTERS_COUNT] = {"EAX", "ECX", "EDX", "EBX", "ESP", "EBP", "ESI", "EDI"};
+
+static void open_reader(Reader *reader, const char *path)
+{
+    BtraceHeader header;
+    memset(reader, 0, sizeof(Reader));
+    reader->path = path;
+    reader->file = fopen(path, "rb");
+    if (reader->file == NULL)
+    {
+        printf("Could not open %s.\n", path);
+        exit(2);
+    }
+    if (fread(&header, sizeof(header), 1, reader->file) != 1 ||
+        memcmp(header.magic, BTRACE_MAGIC, sizeof(header.magic)) != 0 || header.version != BTRACE_VERSION)
+    {
+        printf("%s is not a version %d btrace file.\n", path, BTRACE_VERSION);
+        exit(2);
+    }
+    reader->chunk = malloc(BTRACE_BUFFER_SIZE);
+}
+
+/* Returns 0 at the end of the file; skips chunks of other vCPUs if cpu_id >= 0. */
+static int next_chunk(Reader *reader, int cpu_id)
+{
+    BtraceChunk chunk;
+    while (fread(&chunk, sizeof(chunk), 1, reader->file) == 1)
+    {
+        if (chunk.size > BTRACE_BUFFER_SIZE || chunk.cpu_id >= MAX_TRACED_CPUS)
+        {
+            printf("%s: bad chunk.\n", reader->path);
+            exit(2);
+        }
+        if (cpu_id >= 0 && chunk.cpu_id != (uint32_t)cpu_id)
+        {
+            fseek(reader->file, chunk.size, SEEK_CUR);
+            continue;
+        }
+        if (fread(reader->chunk, 1, chunk.size, reader->file) != chunk.size)
+            return 0;
+        reader->chunk_cpu = chunk.cpu_id;
+        reader->chunk_size = chunk.size;
+        reader->position = 0;
+        return 1;
+    }
+    return 0;
+}
+
+static uint64_t get_varint(Reader *reader)
+{
+    uint64_t value = 0;
+    int shift = 0;
+    while (reader->position < reader->chunk_size)
+    {
+        uint8_t byte = reader->chunk[reader->position++];
+        value |= (uint64_t)(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0)
+            break;
+        shift += 7;
+    }
+    return value;
+}
+
+/* Returns 0 after the last op. */
+static int next_event(Reader *reader, int cpu_id, Event *event)
+{
+    while (1)
+    {
+        if (reader->position >= reader->chunk_size && !next_chunk(reader, cpu_id))
+            return 0;
+        CpuState *cpu = &reader->cpus[reader->chunk_cpu];
+        uint64_t value = get_varint(reader);
+        uint32_t zigzag = value >> 2;
+        int32_t delta = (int32_t)((zigzag >> 1) ^ -(zigzag & 1));
+        switch (value & 3)
+        {
+        case BTRACE_OP:
+            cpu->eip += delta;
+            event->cpu_id = reader->chunk_cpu;
+            event->eip = cpu->eip;
+            event->cs = cpu->cs;
+            event->op = reader->chunk[reader->position++];
+            event->has_regs = cpu->has_regs;
+            event->regs = cpu->regs;
+            cpu->has_regs = 0;
+            return 1;
+        case BTRACE_CS:
+            memcpy(&cpu->cs, reader->chunk + reader->position, 2);
+            reader->position += 2;
+            break;
+        case BTRACE_REGS:
+            memcpy(&cpu->regs, reader->chunk + reader->position, sizeof(BtraceRegs));
+            reader->position += sizeof(BtraceRegs);
+            cpu->has_regs = 1;
+            break;
+        default:
+            printf("%s: bad record.\n", reader->path);
+            exit(2);
+        }
+    }
+}
+
+static void print_event(Event *event)
+{
+    int i;
+    printf("CPU: %u CS: %04X EIP: %08X Op: %02X\n", event->cpu_id, event->cs, event->eip, event->op);
+    if (!event->has_regs)
+        return;
+    for (i = 0; i < REGISTERS_COUNT; i++)
+        printf("%s%s: %08X", i == 0 ? "    " : " ", register_names[i], event->regs.registers[i]);
+    printf(" EFLAGS: %08X\n", event->regs.eflags);
+}
+
+/* Registers are only compared where both traces sampled them. */
+static int same_event(Event *a, Event *b)
+{
+    if (a->cs != b->cs || a->eip != b->eip || a->op != b->op)
+        return 0;
+    if (a->has_regs && b->has_regs)
+        return memcmp(&a->regs, &b->regs, sizeof(BtraceRegs)) == 0;
+    return 1;
+}
+
+static int diff(Reader *a, Reader *b, int cpu_id)
+{
+    Event x, y;
+    uint64_t index;
+    for (index = 0;; index++)
+    {
+        int more_a = next_event(a, cpu_id, &x);
+        int more_b = next_event(b, cpu_id, &y);
+        if (!more_a && !more_b)
+        {
+            printf("Same %llu ops of CPU %d.\n", (unsigned long long)index, cpu_id);
+            return 0;
+        }
+        if (more_a && more_b && same_event(&x, &y))
+            continue;
+        printf("Op %llu of CPU %d differs:\n", (unsigned long long)index, cpu_id);
+        printf("%s: ", a->path);
+        if (more_a)
+            print_event(&x);
+        else
+            printf("ended\n");
+        printf("%s: ", b->path);
+        if (more_b)
+            print_event(&y);
+        else
+            printf("ended\n");
+        return 1;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    Reader readers[2];
+    const char *paths[2];
+    int path_count = 0;
+    int cpu_id = -1;
+    int i;
+    for (i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-cpu") == 0 && i + 1 < argc)
+            cpu_id = strtoul(argv[++i], NULL, 0);
+        else if (path_count < 2)
+            paths[path_count++] = argv[i];
+    }
+    if (path_count == 0)
+    {
+        printf("usage: %s trace [other_trace] [-cpu N]\n", argv[0]);
+        return 2;
+    }
+
+    open_reader(&readers[0], paths[0]);
+    if (path_count == 2)
+    {
+        open_reader(&readers[1], paths[1]);
+        return diff(&readers[0], &readers[1], cpu_id >= 0 ? cpu_id : 0);
+    }
+    Event event;
+    while (next_event(&readers[0], cpu_id, &event))
+        print_event(&event);
+    return 0;
+}
@@ -0,0 +1,223 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "cga.h"
+#include "emulator_functions.h"
+#include "io.h"
+#include "machine.h"
+#include "snapshot.h"
+#include "util.h"
+
+/* ANSI color of each CGA color (CGA: blue is bit 0, ANSI: red is) */
+static const uint8_t ansi_colors[8] = {0, 4, 2, 6, 1, 5, 3, 7};
+
+/* Port handlers, device: the Cga */
+static uint32_t read_cga_port(Emulator *emu, void *device, uint16_t address)
+{
+    Cga *cga = device;
+    if (address == CGA_CRTC_INDEX)
+        return cga->crtc_index;
+    return __atomic_load_n(&cga->crtc[cga->crtc_index % CGA_CRTC_REGISTERS], __ATOMIC_RELAXED);
+}
+
+static void write_cga_port(Emulator *emu, void *device, uint16_t address, uint32_t value)
+{
+    Cga *cga = device;
+    if (address == CGA_CRTC_INDEX)
+        cga->crtc_index = value;
+    else
+        __atomic_store_n(&cga->crtc[cga->crtc_index % CGA_CRTC_REGISTERS], value, __ATOMIC_RELAXED);
+}
+
+static uint8_t glyph(uint8_t c)
+{
+    if (c >= 0x20 && c < 0x7F)
+        return c;
+    /* Blank cells of cleared memory */
+    return c == 0 ? ' ' : '?';
+}
+
+static uint16_t cursor_offset(Cga *cga)
+{
+    uint16_t offset = __atomic_load_n(&cga->crtc[CGA_CURSOR_HIGH], __ATOMIC_RELAXED) << 8 |
+                      __atomic_load_n(&cga->crtc[CGA_CURSOR_LOW], __ATOMIC_RELAXED);
+    return offset < CGA_CELLS ? offset : CGA_CELLS - 1;
+}
+
+/* Writes the cells which differ from shown, then moves the host cursor. */
+static void draw_frame(Cga *cga)
+{
+    uint8_t cells[CGA_CELLS * 2];
+    uint32_t used = 0;
+    int attribute = -1;
+    /* Cell the host cursor is in, -1 if not known */
+    int at = -1;
+    int i;
+    memcpy(cells, cga->emu->memory + CGA_MEMORY, sizeof(cells));
+    uint16_t cursor = cursor_offset(cga);
+
+    for (i = 0; i < CGA_CELLS; i++)
+    {
+        uint16_t cell = cells[i * 2] | cells[i * 2 + 1] << 8;
+        if (cell == cga->shown[i])
+            continue;
+        if (at != i)
+            used += sprintf((char *)cga->frame + used, "\033[%d;%dH", i / CGA_COLUMNS + 1, i % CGA_COLUMNS + 1);
+        if ((cell >> 8) != attribute)
+        {
+            attribute = cell >> 8;
+            used += sprintf((char *)cga->frame + used, "\033[0;%d;%dm",
+                            ((attribute & 8) ? 90 : 30) + ansi_colors[attribute & 7],
+                            40 + ansi_colors[(attribute >> 4) & 7]);
+        }
+        cga->frame[used++] = glyph(cell);
+        /* Terminals differ in where the cursor is after the last column. */
+        at = (i + 1) % CGA_COLUMNS != 0 ? i + 1 : -1;
+        cga->shown[i] = cell;
+    }
+    if (used == 0 && cursor == cga->shown_cursor)
+        return;
+    if (attribute != -1)
+        used += sprintf((char *)cga->frame + used, "\033[0m");
+    used += sprintf((char *)cga->frame + used, "\033[%d;%dH", cursor / CGA_COLUMNS + 1, cursor % CGA_COLUMNS + 1);
+    cga->shown_cursor = cursor;
+    channel_write(cga->output, cga->frame, used);
+}
+
+uint16_t cga_cursor(Cga *cga)
+{
+    return cursor_offset(cga);
+}
+
+void cga_set_cursor(Cga *cga, uint16_t offset)
+{
+    __atomic_store_n(&cga->crtc[CGA_CURSOR_HIGH], offset >> 8, __ATOMIC_RELAXED);
+    __atomic_store_n(&cga->crtc[CGA_CURSOR_LOW], offset & 0xFF, __ATOMIC_RELAXED);
+}
+
+void cga_teletype(Cga *cga, uint8_t c, uint8_t attribute)
+{
+    Emulator *emu = cga->emu;
+    uint16_t cursor = cursor_offset(cga);
+    uint16_t i;
+    switch (c)
+    {
+    case '\r':
+        cursor -= cursor % CGA_COLUMNS;
+        break;
+    case '\n':
+        cursor += CGA_COLUMNS;
+        break;
+    case '\b':
+        if (cursor % CGA_COLUMNS != 0)
+            cursor--;
+        break;
+    case '\a':
+        break;
+    default:
+        _set_memory16(emu, CGA_MEMORY + cursor * 2, c | attribute << 8);
+        cursor++;
+        break;
+    }
+    if (cursor >= CGA_CELLS)
+    {
+        /* The cells are within one page. */
+        uint8_t *cells = emu->memory + CGA_MEMORY;
+        page_written(emu, CGA_MEMORY, CGA_CELLS * 2);
+        memmove(cells, cells + CGA_COLUMNS * 2, (CGA_CELLS - CGA_COLUMNS) * 2);
+        for (i = CGA_CELLS - CGA_COLUMNS; i < CGA_CELLS; i++)
+        {
+            cells[i * 2] = ' ';
+            cells[i * 2 + 1] = attribute;
+        }
+        cursor -= CGA_COLUMNS;
+    }
+    cga_set_cursor(cga, cursor);
+}
+
+static void *render_loop(void *arg)
+{
+    Cga *cga = arg;
+    uint32_t *generation = &cga->emu->page_info[CGA_MEMORY >> 12].generation;
+    draw_frame(cga);
+    while (!__atomic_load_n(&cga->quit, __ATOMIC_ACQUIRE))
+    {
+        usleep(CGA_FRAME_MS * 1000);
+        uint32_t current = __atomic_load_n(generation, __ATOMIC_ACQUIRE);
+        if (current != cga->drawn_generation)
+        {
+            cga->drawn_generation = current;
+            cga->settling = 1;
+        }
+        else if (cga->settling)
+        {
+            cga->settling = 0;
+        }
+        else if (cursor_offset(cga) == cga->shown_cursor)
+        {
+            continue;
+        }
+        draw_frame(cga);
+    }
+    return NULL;
+}
+
+Cga *init_cga(Machine *machine, OutputChannel *output)
+{
+    Cga *cga = calloc(1, sizeof(Cga));
+    cga->emu = machine->emu;
+    cga->output = output;
+    /* Nothing is shown yet, the first frame draws every cell. */
+    memset(cga->shown, 0xFF, sizeof(cga->shown));
+    cga->shown_cursor = 0xFFFF;
+    register_io_ports(machine->io, CGA_CRTC_INDEX, 2, 1, read_cga_port, write_cga_port, cga);
+    machine->cga = cga;
+    return cga;
+}
+
+void start_cga(Cga *cga)
+{
+    cga->drawn_generation = cga->emu->page_info[CGA_MEMORY >> 12].generation;
+    if (pthread_create(&cga->thread, NULL, render_loop, cga) != 0)
+    {
+        printf("Could not start CGA renderer thread.\n");
+        panic();
+    }
+    cga->started = 1;
+}
+
+void destroy_cga(Cga *cga)
+{
+    if (cga->started)
+    {
+        __atomic_store_n(&cga->quit, 1, __ATOMIC_RELEASE);
+        pthread_join(cga->thread, NULL);
+        /* What the guest wrote since the last frame */
+        draw_frame(cga);
+    }
+    close_output_channel(cga->output);
+    free(cga);
+}
+
+void snapshot_cga(struct Snapshot *snapshot, Cga *cga)
+{
+    uint8_t index = 0;
+    uint8_t crtc[CGA_CRTC_REGISTERS];
+    memset(crtc, 0, sizeof(crtc));
+    if (cga != NULL)
+    {
+        index = cga->crtc_index;
+        memcpy(crtc, cga->crtc, sizeof(crtc));
+    }
+    SNAPSHOT_FIELD(snapshot, index);
+    SNAPSHOT_FIELD(snapshot, crtc);
+    if (snapshot->restoring && cga != NULL)
+    {
+        cga->crtc_index = index;
+        memcpy(cga->crtc, crtc, sizeof(crtc));
+    }
+}
@@ -0,0 +1,83 @@
+#ifndef CGA_H_
+#define CGA_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "emulator.h"
+#include "console.h"
+
+/*
+ * <CGA text mode display> (-cga, -cga-out)
+ * 80x25 cells at CGA_MEMORY, two bytes each: character, attribute
+ * (bits 0-3 foreground, 4-6 background). The cells are plain RAM, so
+ * guest stores to them cost nothing extra: the page's
+ * PageInfo.generation, bumped by every write to it, tells the renderer
+ * thread a frame is due. At most every CGA_FRAME_MS it compares the
+ * cells to those on the host terminal and writes the changed ones, with
+ * the cursor, as ANSI sequences in one write.
+ *
+ * Ports (8-bit)
+ * | 0x3d4 | R/W | CRTC index register                           |
+ * | 0x3d5 | R/W | CRTC data register, 14/15: cursor offset hi/lo |
+ */
+#define CGA_MEMORY 0xB8000
+#define CGA_COLUMNS 80
+#define CGA_ROWS 25
+#define CGA_CELLS (CGA_COLUMNS * CGA_ROWS)
+
+#define CGA_CRTC_INDEX 0x3d4
+#define CGA_CRTC_DATA 0x3d5
+#define CGA_CRTC_REGISTERS 32
+#define CGA_CURSOR_HIGH 14
+#define CGA_CURSOR_LOW 15
+
+/* About 30 frames per second */
+#define CGA_FRAME_MS 33
+/* Cursor move, colors and character of every cell */
+#define CGA_FRAME_SIZE (CGA_CELLS * 32)
+
+typedef struct Cga
+{
+    /* Memory the cells are read from */
+    Emulator *emu;
+    OutputChannel *output;
+    /* CRTC, written by the vCPUs */
+    uint8_t crtc_index;
+    uint8_t crtc[CGA_CRTC_REGISTERS];
+    /* Renderer thread: the cells and cursor on the host terminal */
+    uint16_t shown[CGA_CELLS];
+    uint16_t shown_cursor;
+    uint32_t drawn_generation;
+    /*
+     * Set when a frame was drawn for a new generation: the bytes of a
+     * write counted in it may land after the cells were read, so the
+     * next frame compares the cells again.
+     */
+    int settling;
+    int quit;
+    int started;
+    pthread_t thread;
+    uint8_t frame[CGA_FRAME_SIZE];
+} Cga;
+
+/* Registers the ports on machine, frames go to output (owned by the device from here on). */
+Cga *init_cga(Machine *machine, OutputChannel *output);
+/* Starts the renderer thread, once RAM is restored or loaded. */
+void start_cga(Cga *cga);
+/* Cursor offset (cell) in the CRTC registers, set as the guest's out instructions do (BIOS int 10h) */
+uint16_t cga_cursor(Cga *cga);
+void cga_set_cursor(Cga *cga, uint16_t offset);
+/*
+ * On the CPU thread (BIOS teletype): writes c with attribute at the
+ * cursor and moves it on; CR, LF, BS and BEL move it only, the screen
+ * scrolls up at its end.
+ */
+void cga_teletype(Cga *cga, uint8_t c, uint8_t attribute);
+/* Stops the renderer thread, closes the output and frees cga. */
+void destroy_cga(Cga *cga);
+struct Snapshot;
+/* cga may be NULL (no -cga): the CRTC registers are stored as zeros. */
+void snapshot_cga(struct Snapshot *snapshot, Cga *cga);
+
+#endif
@@ -0,0 +1,350 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "checkpoint.h"
+#include "machine.h"
+#include "snapshot.h"
+#include "util.h"
+
+#define PAGE_SIZE 0x1000
+
+static int is_zero_page(const uint8_t *page)
+{
+    const uint64_t *words = (const uint64_t *)page;
+    int i;
+    for (i = 0; i < PAGE_SIZE / 8; i++)
+    {
+        if (words[i] != 0)
+            return 0;
+    }
+    return 1;
+}
+
+/* The page contents of a record start page aligned in the file, so they can be mapped. */
+static uint64_t contents_offset(uint64_t pages_offset, uint32_t pages)
+{
+    return (pages_offset + (uint64_t)pages * sizeof(uint32_t) + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+}
+
+static void *timer_loop(void *arg)
+{
+    Checkpoints *checkpoints = arg;
+    while (1)
+    {
+        usleep(checkpoints->interval_ms * 1000);
+        raise_attention(checkpoints->emu, ATTENTION_CHECKPOINT);
+    }
+    return NULL;
+}
+
+Checkpoints *init_checkpoints(Machine *machine, const char *path, uint32_t interval_ms)
+{
+    Emulator *emu = machine->emu;
+    FILE *file = fopen(path, "wb");
+    CheckpointHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.memory_size = emu->memory_size;
+    if (file == NULL || fwrite(&header, sizeof(header), 1, file) != 1 || fclose(file) != 0)
+    {
+        printf("Could not create checkpoint file: %s\n", path);
+        panic();
+    }
+
+    Checkpoints *checkpoints = calloc(1, sizeof(Checkpoints));
+    checkpoints->emu = emu;
+    checkpoints->path = path;
+    checkpoints->end = sizeof(header);
+    checkpoints->need_base = 1;
+    checkpoints->generations = calloc(emu->memory_size / PAGE_SIZE, sizeof(uint32_t));
+    checkpoints->next_generations = calloc(emu->memory_size / PAGE_SIZE, sizeof(uint32_t));
+    checkpoints->interval_ms = interval_ms;
+    if (emu->disk != NULL && emu->disk->overlay != NULL)
+        overlay_track_writes(emu->disk->overlay);
+    if (interval_ms > 0)
+    {
+        if (pthread_create(&checkpoints->timer, NULL, timer_loop, checkpoints) != 0)
+        {
+            printf("Could not start checkpoint timer.\n");
+            panic();
+        }
+        checkpoints->timer_started = 1;
+    }
+    machine->checkpoints = checkpoints;
+    return checkpoints;
+}
+
+/* In the child: appends the record. Returns 1 if all of it was written. */
+static int write_record(Checkpoints *checkpoints, CheckpointRecord *record, uint32_t *pages, const void *state)
+{
+    Emulator *emu = checkpoints->emu;
+    uint32_t end = CHECKPOINT_END;
+    uint8_t padding[PAGE_SIZE];
+    uint32_t i;
+    if (record->flags & CHECKPOINT_BASE)
+    {
+        record->pages = 0;
+        for (i = 0; i < emu->memory_size / PAGE_SIZE; i++)
+        {
+            if (!is_zero_page(emu->memory + (uint64_t)i * PAGE_SIZE))
+                pages[record->pages++] = i;
+        }
+    }
+    FILE *file = fopen(checkpoints->path, "ab");
+    if (file == NULL)
+        return 0;
+    int ok = fwrite(record, sizeof(*record), 1, file) == 1 &&
+             fwrite(state, 1, record->state_size, file) == record->state_size &&
+             fwrite(pages, sizeof(uint32_t), record->pages, file) == record->pages;
+    /* Only one child writes at a time, the record starts at end. */
+    uint64_t pages_offset = checkpoints->end + sizeof(*record) + record->state_size;
+    size_t padding_size = contents_offset(pages_offset, record->pages) - pages_offset - record->pages * sizeof(uint32_t);
+    memset(padding, 0, padding_size);
+    ok = ok && fwrite(padding, 1, padding_size, file) == padding_size;
+    for (i = 0; ok && i < record->pages; i++)
+        ok = fwrite(emu->memory + (uint64_t)pages[i] * PAGE_SIZE, PAGE_SIZE, 1, file) == 1;
+    ok = ok && fwrite(&end, sizeof(end), 1, file) == 1;
+    return fclose(file) == 0 && ok;
+}
+
+/*
+ * Waits for the child writing the last record if wait, else only looks
+ * whether it is done. Returns 0 if it still runs.
+ * A record which could not be written is cut off the file, and the next
+ * one is a base again (the pages and sectors it had are not in a later delta).
+ */
+static int reap_writer(Checkpoints *checkpoints, int wait)
+{
+    int status;
+    if (checkpoints->writer == 0)
+        return 1;
+    pid_t done;
+    do
+        done = waitpid(checkpoints->writer, &status, wait ? 0 : WNOHANG);
+    while (done < 0 && errno == EINTR);
+    if (done == 0)
+        return 0;
+    checkpoints->writer = 0;
+    struct stat st;
+    if (done > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0 && stat(checkpoints->path, &st) == 0)
+    {
+        checkpoints->end = st.st_size;
+        return 1;
+    }
+    printf("Could not write checkpoint %u: %s\n", checkpoints->count - 1, checkpoints->path);
+    if (truncate(checkpoints->path, checkpoints->end) != 0)
+        printf("Could not cut checkpoint file: %s\n", checkpoints->path);
+    checkpoints->count--;
+    checkpoints->need_base = 1;
+    return 1;
+}
+
+void take_checkpoint(Checkpoints *checkpoints)
+{
+    Emulator *emu = checkpoints->emu;
+    uint32_t count = emu->memory_size / PAGE_SIZE;
+    uint32_t page;
+    if (!reap_writer(checkpoints, 0))
+    {
+        checkpoints->skipped++;
+        return;
+    }
+
+    CheckpointRecord record;
+    memset(&record, 0, sizeof(record));
+    record.magic = CHECKPOINT_RECORD;
+    record.index = checkpoints->count;
+    record.flags = checkpoints->need_base ? CHECKPOINT_BASE : 0;
+    record.icount = emu->icount;
+    /* A base finds the pages which are not zero in the child. */
+    uint32_t *pages = malloc(count * sizeof(uint32_t));
+    for (page = 0; page < count; page++)
+    {
+        uint32_t generation = __atomic_load_n(&emu->page_info[page].generation, __ATOMIC_ACQUIRE);
+        if (!checkpoints->need_base && generation != checkpoints->generations[page])
+            pages[record.pages++] = page;
+        checkpoints->next_generations[page] = generation;
+    }
+
+    char *state = NULL;
+    size_t state_size = 0;
+    Snapshot snapshot = {open_memstream(&state, &state_size), 0,
+                         checkpoints->need_base ? SNAPSHOT_CHECKPOINT_BASE : SNAPSHOT_CHECKPOINT_DELTA};
+    if (snapshot.file == NULL)
+    {
+        printf("Could not take checkpoint.\n");
+        panic();
+    }
+    snapshot_devices(&snapshot, emu);
+    fclose(snapshot.file);
+    record.state_size = state_size;
+
+    pid_t pid = fork();
+    if (pid == 0)
+        _exit(write_record(checkpoints, &record, pages, state) ? 0 : 1);
+    free(state);
+    free(pages);
+    if (pid < 0)
+    {
+        printf("Could not fork for checkpoint: %s\n", strerror(errno));
+        /* The overlay sectors written so far were taken out of the next delta. */
+        checkpoints->need_base = 1;
+        return;
+    }
+    checkpoints->writer = pid;
+    checkpoints->count++;
+    checkpoints->need_base = 0;
+    uint32_t *swap = checkpoints->generations;
+    checkpoints->generations = checkpoints->next_generations;
+    checkpoints->next_generations = swap;
+}
+
+void close_checkpoints(Checkpoints *checkpoints)
+{
+    if (checkpoints->timer_started)
+    {
+        pthread_cancel(checkpoints->timer);
+        pthread_join(checkpoints->timer, NULL);
+    }
+    reap_writer(checkpoints, 1);
+    free(checkpoints->generations);
+    free(checkpoints->next_generations);
+    free(checkpoints);
+}
+
+/* A record and where its parts are in the file */
+typedef struct
+{
+    CheckpointRecord record;
+    uint64_t state_offset;
+    uint64_t pages_offset;
+} RecordInfo;
+
+/* Reads the complete records, returns their number (records is malloc'ed). */
+static uint32_t read_records(FILE *file, RecordInfo **records)
+{
+    uint32_t count = 0, capacity = 16;
+    uint64_t offset = sizeof(CheckpointHeader);
+    *records = malloc(capacity * sizeof(RecordInfo));
+    while (1)
+    {
+        RecordInfo info;
+        uint32_t end;
+        if (fseek(file, offset, SEEK_SET) != 0 || fread(&info.record, sizeof(info.record), 1, file) != 1 ||
+            info.record.magic != CHECKPOINT_RECORD)
+            break;
+        info.state_offset = offset + sizeof(info.record);
+        info.pages_offset = info.state_offset + info.record.state_size;
+        offset = contents_offset(info.pages_offset, info.record.pages) + (uint64_t)info.record.pages * PAGE_SIZE;
+        if (fseek(file, offset, SEEK_SET) != 0 || fread(&end, sizeof(end), 1, file) != 1 || end != CHECKPOINT_END)
+            break;
+        offset += sizeof(end);
+        if (count == capacity)
+        {
+            capacity *= 2;
+            *records = realloc(*records, capacity * sizeof(RecordInfo));
+        }
+        (*records)[count++] = info;
+    }
+    return count;
+}
+
+void restore_checkpoint(Emulator *emu, const char *path, int index)
+{
+    FILE *file = fopen(path, "rb");
+    CheckpointHeader header;
+    uint32_t pages = emu->memory_size / PAGE_SIZE;
+    uint32_t i, page;
+    if (file == NULL || fread(&header, sizeof(header), 1, file) != 1)
+    {
+        printf("Could not open checkpoint file: %s\n", path);
+        panic();
+    }
+    if (memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0 || header.version != SNAPSHOT_VERSION)
+    {
+        printf("Not a checkpoint file of this version: %s\n", path);
+        panic();
+    }
+    if (header.memory_size != emu->memory_size)
+    {
+        printf("Checkpoints need -m %uK.\n", header.memory_size >> 10);
+        panic();
+    }
+    RecordInfo *records;
+    uint32_t count = read_records(file, &records);
+    uint32_t target = index < 0 ? count - 1 : (uint32_t)index;
+    if (count == 0 || target >= count)
+    {
+        printf("%s has %u complete checkpoints.\n", path, count);
+        panic();
+    }
+    uint32_t first = target;
+    while (!(records[first].record.flags & CHECKPOINT_BASE) && first > 0)
+        first--;
+
+    /* File offset of the newest copy of each page, 0 for a zero page */
+    uint64_t *sources = calloc(pages, sizeof(uint64_t));
+    uint32_t *list = malloc(pages * sizeof(uint32_t));
+    for (i = first; i <= target; i++)
+    {
+        RecordInfo *info = &records[i];
+        uint32_t n = info->record.pages;
+        if (n > pages || fseek(file, info->pages_offset, SEEK_SET) != 0 || fread(list, sizeof(uint32_t), n, file) != n)
+        {
+            printf("Could not read checkpoint %u.\n", i);
+            panic();
+        }
+        uint64_t contents = contents_offset(info->pages_offset, n);
+        for (page = 0; page < n; page++)
+        {
+            if (list[page] < pages)
+                sources[list[page]] = contents + (uint64_t)page * PAGE_SIZE;
+        }
+    }
+    free(list);
+
+    /* Pages stored one after the other are mapped copy-on-write at once, as a snapshot's. */
+    madvise(emu->memory, emu->memory_size, MADV_DONTNEED);
+    page = 0;
+    while (page < pages)
+    {
+        if (sources[page] == 0)
+        {
+            page++;
+            continue;
+        }
+        uint32_t run = 1;
+        while (page + run < pages && sources[page + run] == sources[page] + (uint64_t)run * PAGE_SIZE)
+            run++;
+        void *p = mmap(emu->memory + (uint64_t)page * PAGE_SIZE, (uint64_t)run * PAGE_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_FIXED, fileno(file), sources[page]);
+        if (p == MAP_FAILED)
+        {
+            printf("Could not map checkpoint memory.\n");
+            panic();
+        }
+        page += run;
+    }
+    free(sources);
+
+    /* The disk sectors of each record add up, the other state is the target's. */
+    for (i = first; i <= target; i++)
+    {
+        Snapshot snapshot = {file, 1, SNAPSHOT_FULL};
+        fseek(file, records[i].state_offset, SEEK_SET);
+        snapshot_devices(&snapshot, emu);
+    }
+    printf("Restored checkpoint %u of %u: %s\n", target, count, path);
+    free(records);
+    fclose(file);
+}
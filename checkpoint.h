@@ -0,0 +1,97 @@
+#ifndef CHECKPOINT_H_
+#define CHECKPOINT_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "emulator.h"
+
+/*
+ * Incremental checkpoints (-checkpoint)
+ * An append-only file of records. The first one (base) holds every RAM
+ * page which is not zero, each later one the pages whose
+ * PageInfo.generation changed since the one before, and every record
+ * holds the CPU and device state as a snapshot does, with the -overlay
+ * sectors written since the record before.
+ * A checkpoint is taken on the CPU thread between instructions with
+ * the disk idle: it picks the pages, writes the state into memory, then
+ * forks. The child writes the record from its copy-on-write view of RAM
+ * while the vCPU goes on running; a checkpoint due while the last child
+ * still writes is skipped.
+ * Restoring checkpoint N maps in (copy-on-write) the newest copy of
+ * each page from records 0 to N and replays their states in order (the
+ * disk sectors add up, the last state wins).
+ *
+ * <Checkpoint file>
+ * | 0x0 | CheckpointHeader                                          |
+ * | ... | records: CheckpointRecord, state (state_size bytes),      |
+ * |     | page numbers (uint32 each), zeros up to a 4KB boundary,   |
+ * |     | page contents (4KB each), CHECKPOINT_END                  |
+ * A record cut short (the emulator was killed while writing it) ends
+ * the file.
+ */
+#define CHECKPOINT_MAGIC "DAX86CKP"
+#define CHECKPOINT_RECORD 0x54504B43
+#define CHECKPOINT_END 0x444E4543
+#define CHECKPOINT_BASE 1
+
+typedef struct
+{
+    char magic[8];
+    /* SNAPSHOT_VERSION of the states */
+    uint32_t version;
+    uint32_t memory_size;
+} CheckpointHeader;
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t index;
+    uint32_t pages;
+    /* CHECKPOINT_BASE: the record does not build on the ones before */
+    uint32_t flags;
+    uint64_t state_size;
+    uint64_t icount;
+} CheckpointRecord;
+
+typedef struct Checkpoints
+{
+    Emulator *emu;
+    const char *path;
+    /* Records started, the next one's index */
+    uint32_t count;
+    uint32_t skipped;
+    /* The next record is a base (the first one, or one after a failure) */
+    int need_base;
+    /* File size after the last record written */
+    uint64_t end;
+    /* Child writing the last record, 0 if none */
+    pid_t writer;
+    /* PageInfo.generation of each RAM page at the last checkpoint, and at the one being taken */
+    uint32_t *generations;
+    uint32_t *next_generations;
+    /* Milliseconds between checkpoints, 0: on SIGUSR2 only */
+    uint32_t interval_ms;
+    int timer_started;
+    pthread_t timer;
+} Checkpoints;
+
+/*
+ * Creates (truncates) the file at path, machine->checkpoints and,
+ * with interval_ms, the thread raising ATTENTION_CHECKPOINT on the BSP.
+ * Panics if the file can not be created.
+ */
+Checkpoints *init_checkpoints(Machine *machine, const char *path, uint32_t interval_ms);
+/* On the CPU thread between instructions, with the disk idle. */
+void take_checkpoint(Checkpoints *checkpoints);
+/* Stops the timer, waits for the last record and frees checkpoints. */
+void close_checkpoints(Checkpoints *checkpoints);
+
+/*
+ * Restores checkpoint index of the file at path, -1: the last one
+ * complete. After the devices were created, instead of loading the boot sector.
+ */
+void restore_checkpoint(Emulator *emu, const char *path, int index);
+
+#endif
@@ -0,0 +1,212 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "console.h"
+#include "util.h"
+
+static OutputChannel *channels[CONSOLE_MAX_CHANNELS];
+static int channel_count = 0;
+/* Guards adding and removing channels, machines may open theirs from their own threads. */
+static pthread_mutex_t channels_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int connect_unix_socket(const char *path)
+{
+    struct sockaddr_un address;
+    if (strlen(path) >= sizeof(address.sun_path))
+        return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+OutputChannel *open_output_channel(const char *path)
+{
+    int fd;
+    if (path == NULL)
+        fd = STDOUT_FILENO;
+    else if (strncmp(path, "unix:", 5) == 0)
+        fd = connect_unix_socket(path + 5);
+    else
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        printf("Could not open console output: %s\n", path);
+        panic();
+    }
+    return fd_output_channel(fd);
+}
+
+OutputChannel *fd_output_channel(int fd)
+{
+    OutputChannel *channel = calloc(1, sizeof(OutputChannel));
+    channel->fd = fd;
+    pthread_mutex_init(&channel->lock, NULL);
+    pthread_cond_init(&channel->pending, NULL);
+
+    pthread_mutex_lock(&channels_lock);
+    if (channel_count == CONSOLE_MAX_CHANNELS)
+    {
+        printf("Too many console outputs.\n");
+        panic();
+    }
+    channels[channel_count] = channel;
+    __atomic_store_n(&channel_count, channel_count + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&channels_lock);
+    return channel;
+}
+
+/* lock has to be held. */
+static void write_data(OutputChannel *channel, const uint8_t *data, uint32_t length)
+{
+    uint32_t done = 0;
+    /* Messages of the emulator itself go to stdout through stdio. */
+    if (channel->fd == STDOUT_FILENO)
+        fflush(stdout);
+    while (done < length)
+    {
+        ssize_t n = write(channel->fd, data + done, length - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        /* Output which can not be written (closed socket) is dropped. */
+        if (n <= 0)
+            break;
+        done += n;
+    }
+}
+
+/* lock has to be held. */
+static void write_buffer(OutputChannel *channel)
+{
+    write_data(channel, channel->buf, channel->used);
+    channel->used = 0;
+}
+
+/* The flush thread is cancelled by close_output_channel while it waits. */
+static void unlock_channel(void *arg)
+{
+    OutputChannel *channel = arg;
+    pthread_mutex_unlock(&channel->lock);
+}
+
+static void *flush_loop(void *arg)
+{
+    OutputChannel *channel = arg;
+    while (1)
+    {
+        pthread_mutex_lock(&channel->lock);
+        pthread_cleanup_push(unlock_channel, channel);
+        while (channel->used == 0)
+            pthread_cond_wait(&channel->pending, &channel->lock);
+        pthread_cleanup_pop(1);
+
+        usleep(CONSOLE_DELAY_MS * 1000);
+        channel_flush(channel);
+    }
+    return NULL;
+}
+
+void channel_putc(OutputChannel *channel, uint8_t c)
+{
+    pthread_mutex_lock(&channel->lock);
+    channel->buf[channel->used++] = c;
+    /* Verbose output is interleaved with the ops printed. */
+    if (c == '\n' || channel->used == CONSOLE_BUFFER_SIZE || config.verbose)
+    {
+        write_buffer(channel);
+    }
+    else if (channel->used == 1)
+    {
+        if (!channel->thread_started)
+        {
+            channel->thread_started = 1;
+            if (pthread_create(&channel->thread, NULL, flush_loop, channel) != 0)
+            {
+                printf("Could not start console output thread.\n");
+                panic();
+            }
+        }
+        pthread_cond_signal(&channel->pending);
+    }
+    pthread_mutex_unlock(&channel->lock);
+}
+
+void channel_write(OutputChannel *channel, const uint8_t *data, uint32_t length)
+{
+    pthread_mutex_lock(&channel->lock);
+    if (channel->used > 0)
+        write_buffer(channel);
+    write_data(channel, data, length);
+    pthread_mutex_unlock(&channel->lock);
+}
+
+void channel_flush(OutputChannel *channel)
+{
+    pthread_mutex_lock(&channel->lock);
+    if (channel->used > 0)
+        write_buffer(channel);
+    pthread_mutex_unlock(&channel->lock);
+}
+
+void close_output_channel(OutputChannel *channel)
+{
+    if (channel->thread_started)
+    {
+        pthread_cancel(channel->thread);
+        pthread_join(channel->thread, NULL);
+    }
+    channel_flush(channel);
+
+    pthread_mutex_lock(&channels_lock);
+    int i;
+    for (i = 0; i < channel_count; i++)
+    {
+        if (channels[i] == channel)
+        {
+            channels[i] = channels[channel_count - 1];
+            __atomic_store_n(&channel_count, channel_count - 1, __ATOMIC_RELEASE);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&channels_lock);
+
+    if (channel->fd != STDOUT_FILENO)
+        close(channel->fd);
+    pthread_mutex_destroy(&channel->lock);
+    pthread_cond_destroy(&channel->pending);
+    free(channel);
+}
+
+/*
+ * A signal can end the emulator on a thread holding the lock, so a
+ * channel busy at that moment is not flushed.
+ */
+void flush_output_channels(void)
+{
+    int count = __atomic_load_n(&channel_count, __ATOMIC_ACQUIRE);
+    int i;
+    for (i = 0; i < count; i++)
+    {
+        if (pthread_mutex_trylock(&channels[i]->lock) != 0)
+            continue;
+        if (channels[i]->used > 0)
+            write_buffer(channels[i]);
+        pthread_mutex_unlock(&channels[i]->lock);
+    }
+}
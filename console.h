@@ -0,0 +1,55 @@
+#ifndef CONSOLE_H_
+#define CONSOLE_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define CONSOLE_BUFFER_SIZE 4096
+#define CONSOLE_DELAY_MS 20
+/* Channels of all machines in the process */
+#define CONSOLE_MAX_CHANNELS 64
+
+/*
+ * Output channel of a device writing characters to the host (serial port)
+ * Bytes are kept in buf and written with one write(2) on newline, when
+ * the buffer is full, CONSOLE_DELAY_MS after the first byte buffered
+ * (prompts without newline), or on exit.
+ * lock guards buf and used, and keeps writes in order between the
+ * device and the flush thread.
+ */
+typedef struct OutputChannel
+{
+    int fd;
+    pthread_mutex_t lock;
+    /* Signaled when the empty buffer gets its first byte */
+    pthread_cond_t pending;
+    uint32_t used;
+    uint8_t buf[CONSOLE_BUFFER_SIZE];
+    int thread_started;
+    pthread_t thread;
+} OutputChannel;
+
+/*
+ * path: NULL for stdout, "unix:socket_path" to connect to a Unix
+ * domain socket, else a file created or truncated.
+ * Panics if it can not be opened.
+ */
+OutputChannel *open_output_channel(const char *path);
+
+/* Channel writing to fd, which is already open (socket of a fork server job) */
+OutputChannel *fd_output_channel(int fd);
+
+void channel_putc(OutputChannel *channel, uint8_t c);
+/* Writes what is buffered, then length bytes at once (a CGA frame). */
+void channel_write(OutputChannel *channel, const uint8_t *data, uint32_t length);
+void channel_flush(OutputChannel *channel);
+/* Writes what is buffered, closes the fd (but stdout) and frees the channel. */
+void close_output_channel(OutputChannel *channel);
+
+/* Returns the connected stream socket, -1 on error. */
+int connect_unix_socket(const char *path);
+
+/* Flushes every channel opened, called on exit. */
+void flush_output_channels(void);
+
+#endif
@@ -0,0 +1,351 @@
+#include <stdint.h>
+#include <stdio.h>
+
+#include "cpu.h"
+#include "bench.h"
+#include "instructions.h"
+#include "block_cache.h"
+#include "emulator_functions.h"
+#include "gdb.h"
+#include "interrupt.h"
+#include "ide_dma.h"
+#include "lapic.h"
+#include "machine.h"
+#include "replay.h"
+#include "snapshot.h"
+#include "checkpoint.h"
+#include "jit.h"
+#include "stats.h"
+#include "trace.h"
+#include "btrace.h"
+#include "util.h"
+
+/* icount of the next -icount timer expiry or -replay input */
+static uint64_t next_deadline(Emulator *emu)
+{
+    uint64_t deadline = lapic_timer_deadline(emu->lapic);
+    Replay *replay = emu->machine->replay;
+    if (replay != NULL && replay_deadline(replay) < deadline)
+        deadline = replay_deadline(replay);
+    return deadline;
+}
+
+/* Expires the timer and stores the inputs due at emu->icount. */
+static void run_deadlines(Emulator *emu)
+{
+    Replay *replay = emu->machine->replay;
+    if (lapic_timer_deadline(emu->lapic) <= emu->icount)
+    {
+        lapic_timer_expire(emu->lapic);
+        if (replay != NULL)
+            replay_checkpoint(replay, emu, REPLAY_TIMER);
+    }
+    if (replay != NULL)
+        replay_inputs(replay, emu);
+}
+
+/*
+ * Slow path, taken before an instruction while attention is set.
+ * Delivers pending interrupt, sleeps while halted, checks the end of
+ * the test program and prints the instruction in verbose mode.
+ * Returns 0 if the run loop should stop, with the RunExit in exit_reason.
+ */
+static int handle_attention(Emulator *emu, int *exit_reason)
+{
+    uint32_t attention;
+
+    while (1)
+    {
+        attention = emu->attention;
+
+        /* Before anything else runs; GDB may have changed the vCPU and its attention. */
+        if ((attention & ATTENTION_DEBUG) && gdb_attention(emu))
+            continue;
+
+        if (attention & ATTENTION_DISK)
+        {
+            /* Raises IRQ 14, so before interrupts are delivered. */
+            clear_attention(emu, ATTENTION_DISK);
+            complete_disk_command(emu);
+            if (emu->machine->replay != NULL)
+                replay_checkpoint(emu->machine->replay, emu, REPLAY_DISK);
+        }
+        /* Raises IRQ 1 as well */
+        if (attention & ATTENTION_INPUT)
+        {
+            clear_attention(emu, ATTENTION_INPUT);
+            take_input(emu->machine->replay, emu);
+        }
+        attention = emu->attention;
+
+        if (attention & ATTENTION_INTERRUPT)
+        {
+            /* Cleared before reading IRR so a new request raises it again. */
+            clear_attention(emu, ATTENTION_INTERRUPT);
+            /* If not deliverable now, sti or EOI raises it again. */
+            int vector = lapic_accept_intr(emu->lapic);
+            if (vector >= 0)
+            {
+                clear_attention(emu, ATTENTION_HALT);
+                handle_interrupt(emu, vector, 0);
+                if (config.bench)
+                    bench_interrupt(emu, vector);
+            }
+        }
+
+        /* Before STARTUP, which follows INIT when both are pending. */
+        if (attention & ATTENTION_INIT)
+        {
+            clear_attention(emu, ATTENTION_INIT);
+            init_cpu(emu);
+        }
+
+        /* Only the first STARTUP after reset starts an AP, xv6 sends two. */
+        if (attention & ATTENTION_STARTUP)
+        {
+            clear_attention(emu, ATTENTION_STARTUP);
+            if (emu->wait_sipi)
+            {
+                emu->wait_sipi = 0;
+                set_seg_register16(emu, CS, __atomic_load_n(&emu->startup_vector, __ATOMIC_ACQUIRE) << 8);
+                emu->eip = 0;
+                clear_attention(emu, ATTENTION_HALT);
+            }
+        }
+
+        /* Blocks of pages other vCPUs wrote */
+        if (attention & ATTENTION_CODE)
+        {
+            clear_attention(emu, ATTENTION_CODE);
+            drop_stale_code(emu);
+        }
+
+        if (attention & ATTENTION_BENCH)
+        {
+            clear_attention(emu, ATTENTION_BENCH);
+            bench_mark_icount(emu);
+        }
+
+        if (attention & ATTENTION_TIMER)
+        {
+            clear_attention(emu, ATTENTION_TIMER);
+            lapic_timer_restart(emu->lapic);
+        }
+
+        /* The disk has to be idle, so it is retried until its job is done. */
+        if ((attention & ATTENTION_SNAPSHOT) && !emu->disk->busy)
+        {
+            clear_attention(emu, ATTENTION_SNAPSHOT);
+            save_snapshot(emu, config.snapshot_path);
+            printf("Snapshot saved: %s\n", config.snapshot_path);
+        }
+        if ((attention & ATTENTION_CHECKPOINT) && !emu->disk->busy)
+        {
+            clear_attention(emu, ATTENTION_CHECKPOINT);
+            if (emu->machine->checkpoints != NULL)
+                take_checkpoint(emu->machine->checkpoints);
+        }
+
+        if (attention & ATTENTION_STATS)
+        {
+            clear_attention(emu, ATTENTION_STATS);
+            print_stats();
+            print_fusion_stats();
+        }
+
+        if (attention & ATTENTION_STOP)
+        {
+            clear_attention(emu, ATTENTION_STOP);
+            *exit_reason = RUN_STOP;
+            return 0;
+        }
+
+        if (attention & ATTENTION_DEADLINE)
+        {
+            clear_attention(emu, ATTENTION_DEADLINE);
+            *exit_reason = RUN_DEADLINE;
+            return 0;
+        }
+
+        if (attention & ATTENTION_YIELD)
+        {
+            clear_attention(emu, ATTENTION_YIELD);
+            /* Queued again behind the other machines */
+            if (emu->machine->scheduled.scheduler != NULL)
+            {
+                *exit_reason = RUN_LIMIT;
+                return 0;
+            }
+        }
+
+        if (!(emu->attention & ATTENTION_HALT))
+            break;
+        if (config.icount && next_deadline(emu) != UINT64_MAX)
+        {
+            /* Nothing runs until the timer expires (or an input is replayed), so time skips to it. */
+            if (next_deadline(emu) > emu->icount)
+                emu->icount = next_deadline(emu);
+            run_deadlines(emu);
+            continue;
+        }
+        /* A scheduler parks the machine and runs others on the thread. */
+        if (emu->machine->scheduled.scheduler != NULL)
+        {
+            *exit_reason = RUN_HALT;
+            return 0;
+        }
+        /* The host thread sleeps until a device raises an interrupt. */
+        wait_attention(emu, ATTENTION_WAKE);
+    }
+
+    if ((attention & ATTENTION_TEST) && emu->eip == 0x00)
+    {
+        if (config.verbose)
+            printf("End of program :)\n");
+        *exit_reason = RUN_END;
+        return 0;
+    }
+
+    emu->op_eip = emu->eip;
+    if ((attention & ATTENTION_VERBOSE) && ((emu->eip < emu->memory_size) || (emu->is_pg)))
+        printf("CS: %04X EIP: %08X Op: %02X\n", get_seg_register16(emu, CS), emu->eip, get_code8(emu, 0));
+
+    return 1;
+}
+
+/*
+ * Number of instructions run (from this emu_run) when the -icount timer
+ * expires or a -replay input is due next, or limit if that is later.
+ */
+static uint64_t run_bound(Emulator *emu, uint64_t count, uint64_t limit)
+{
+    uint64_t deadline = next_deadline(emu);
+    if (deadline <= emu->icount)
+        return count;
+    if (deadline - emu->icount < limit - count)
+        return count + (deadline - emu->icount);
+    return limit;
+}
+
+/*
+ * A fault (raise_exception) comes back to the setjmp here once it is
+ * delivered, so the state of the loop is kept in memory (volatile);
+ * reason is only set when the loop ends.
+ */
+uint64_t emu_run(Emulator *emu, uint64_t max_insns, int *exit_reason)
+{
+    int reason = RUN_LIMIT;
+    uint64_t limit = max_insns != 0 ? max_insns : UINT64_MAX;
+    volatile uint64_t count = 0;
+    /* Emulator.icount is base + count at the slow path. */
+    volatile uint64_t base = emu->icount;
+    volatile uint64_t bound = run_bound(emu, 0, limit);
+    /* First op of the block or pair being run, NULL if it was not decoded */
+    DecodedOp *volatile step = NULL;
+    jmp_buf fault_return;
+
+    if (config.verbose)
+        raise_attention(emu, ATTENTION_VERBOSE);
+    if (config.test)
+        raise_attention(emu, ATTENTION_TEST);
+
+    if (setjmp(fault_return) != 0)
+    {
+        /* The ops before the one which faulted retired (JIT blocks and those chained into, the first op of a pair). */
+        BlockCache *cache = emu->block_cache;
+        if (cache != NULL && cache->chained != NULL && emu->decoded != NULL)
+            count += cache->chained_ops + (emu->decoded - cache->chained->ops);
+        else if (step != NULL && emu->decoded != NULL)
+            count += emu->decoded - step;
+        if (cache != NULL)
+        {
+            cache->chained = NULL;
+            cache->chained_ops = 0;
+        }
+        emu->decoded = NULL;
+    }
+    emu->fault_return = &fault_return;
+
+    while (1)
+    {
+        if (count >= bound)
+        {
+            emu->icount = base + count;
+            if (count >= limit)
+                break;
+            run_deadlines(emu);
+            bound = run_bound(emu, count, limit);
+            continue;
+        }
+
+        if (emu->attention != 0)
+        {
+            emu->icount = base + count;
+            int run = handle_attention(emu, &reason);
+            /* Time skips forward while halted with -icount. */
+            base = emu->icount - count;
+            bound = run_bound(emu, count, limit);
+            if (!run)
+                break;
+            if (count >= bound)
+                continue;
+        }
+
+        if ((emu->eip >= emu->memory_size) && (!emu->is_pg))
+        {
+            reason = RUN_END;
+            break;
+        }
+
+        /* Instructions from block cache are executed without decoding. */
+        emu->op_eip = emu->eip;
+        DecodedOp *decoded = next_decoded_op(emu);
+        step = decoded;
+        instruction_func_t *handler;
+        uint8_t op;
+        /* Ops are counted and traced one by one, so -stats and -btrace keep the JIT off. */
+        if (decoded != NULL && config.jit && !config.stats && emu->btrace == NULL && emu->attention == 0 && bound - count > BLOCK_MAX_OPS)
+        {
+            uint32_t done = jit_run_block(emu, bound - count);
+            if (done > 0)
+            {
+                count += done;
+                continue;
+            }
+        }
+        /* Blocks end before breakpoints, so only ops decoded here can be at one. */
+        if (decoded == NULL && gdb_breakpoint_count != 0 && gdb_check_breakpoint(emu))
+            continue;
+        if (decoded != NULL)
+        {
+            handler = decoded->handler;
+            op = decoded->op;
+        }
+        else
+        {
+            op = get_code8(emu, 0);
+            handler = instructions[op];
+            if (handler == NULL)
+            {
+                printf("EIP: %08X Op: %x not implemented.\n", emu->eip, op);
+                panic_exit(emu);
+            }
+        }
+
+        trace_append(emu, op);
+        btrace_append(emu, op);
+        if (config.stats)
+            count_op(emu, op);
+
+        emu->decoded = decoded;
+        handler(emu);
+        emu->decoded = NULL;
+        count += (decoded != NULL && decoded->fused) ? emu->retired : 1;
+    }
+
+    emu->fault_return = NULL;
+    emu->icount = base + count;
+    if (exit_reason != NULL)
+        *exit_reason = reason;
+    return count;
+}
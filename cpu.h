@@ -0,0 +1,30 @@
+#ifndef CPU_H_
+#define CPU_H_
+
+#include <stdint.h>
+
+#include "emulator.h"
+
+/* Why emu_run returned */
+enum RunExit
+{
+    RUN_LIMIT,
+    RUN_DEADLINE,
+    RUN_STOP,
+    /* End of the test program, or EIP left RAM with paging off */
+    RUN_END,
+    /* Halted, with a scheduler to run something else meanwhile */
+    RUN_HALT
+};
+
+/*
+ * Runs instructions until the program ends, ATTENTION_STOP or
+ * ATTENTION_DEADLINE is raised, or max_insns instructions have run
+ * (0: no limit). A halted CPU of a scheduled machine returns instead
+ * of sleeping.
+ * Stores the RunExit to exit_reason if not NULL.
+ * Returns the number of instructions run.
+ */
+uint64_t emu_run(Emulator *emu, uint64_t max_insns, int *exit_reason);
+
+#endif
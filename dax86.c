@@ -0,0 +1,416 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "dax86.h"
+#include "emulator.h"
+#include "machine.h"
+#include "instructions.h"
+#include "cpu.h"
+#include "emulator_functions.h"
+#include "paging.h"
+#include "disk.h"
+#include "serial.h"
+#include "ide_dma.h"
+#include "console.h"
+#include "sched.h"
+#include "jit.h"
+#include "util.h"
+
+/* Guest ports handled by the program (dax86_register_io) */
+typedef struct IoCallback
+{
+    dax86_io_read_t *read;
+    dax86_io_write_t *write;
+    void *opaque;
+    struct IoCallback *next;
+} IoCallback;
+
+/*
+ * Machine with what the library adds to it
+ * The deadline thread, started by the first dax86_run with a deadline,
+ * raises ATTENTION_DEADLINE once the host clock reaches deadline.
+ * lock guards deadline and quit.
+ */
+struct Dax86Machine
+{
+    Machine *machine;
+    OutputChannel *console;
+    IoCallback *callbacks;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /* CLOCK_MONOTONIC ns, 0 while no dax86_run has one */
+    uint64_t deadline;
+    int quit;
+    int thread_started;
+    pthread_t thread;
+};
+
+void dax86_init(int options)
+{
+    init_config(0, 0);
+    if (options & DAX86_JIT)
+        config.jit = init_jit();
+    if (options & DAX86_ICOUNT)
+        config.icount = 1;
+    init_instructions();
+}
+
+Dax86Machine *dax86_create(const Dax86Config *config)
+{
+    uint32_t memory_size = config->memory_size != 0 ? config->memory_size : DEFAULT_MEMORY_SIZE;
+    if (memory_size < MIN_MEMORY_SIZE || memory_size > MAX_MEMORY_SIZE || memory_size % 0x1000 != 0)
+        return NULL;
+
+    Dax86Machine *m = calloc(1, sizeof(Dax86Machine));
+    pthread_mutex_init(&m->lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&m->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    /* The devices of the dax86 binary but the disk, which comes with dax86_attach_disk */
+    m->machine = create_machine(memory_size, 1);
+    init_pvblk(m->machine);
+    init_pvnet(m->machine);
+    init_pci(m->machine);
+    m->console = open_output_channel(config->console_out);
+    init_serial(m->machine, m->console);
+    init_kbd(m->machine, config->console_in);
+    if (config->console_in != NULL)
+        start_kbd_input(m->machine->kbd);
+    return m;
+}
+
+void dax86_destroy(Dax86Machine *m)
+{
+    if (m->thread_started)
+    {
+        pthread_mutex_lock(&m->lock);
+        m->quit = 1;
+        pthread_cond_signal(&m->cond);
+        pthread_mutex_unlock(&m->lock);
+        pthread_join(m->thread, NULL);
+    }
+    destroy_machine(m->machine);
+    close_output_channel(m->console);
+    while (m->callbacks != NULL)
+    {
+        IoCallback *next = m->callbacks->next;
+        free(m->callbacks);
+        m->callbacks = next;
+    }
+    pthread_mutex_destroy(&m->lock);
+    pthread_cond_destroy(&m->cond);
+    free(m);
+}
+
+int dax86_attach_disk(Dax86Machine *m, const char *path, const char *overlay, int discard)
+{
+    Emulator *emu = m->machine->emu;
+    if (emu->disk != NULL)
+        return -1;
+    FILE *binary = fopen(path, "rb");
+    if (binary == NULL)
+        return -1;
+    Disk *disk = create_disk_device();
+    load_data_to_disk(disk, binary);
+    fclose(binary);
+    if (overlay != NULL)
+    {
+        disk->overlay = open_overlay(overlay, disk_sectors(disk), discard);
+        if (disk->overlay == NULL)
+        {
+            destroy_disk_device(disk);
+            return -1;
+        }
+    }
+    else
+    {
+        attach_writeback(disk, path);
+    }
+
+    attach_disk(emu, disk);
+    register_disk_ports(m->machine, disk);
+    register_bmide_ports(m->machine, disk);
+    return 0;
+}
+
+int dax86_boot(Dax86Machine *m, const char *kernel)
+{
+    Emulator *emu = m->machine->emu;
+    if (emu->disk == NULL)
+        return -1;
+    if (kernel != NULL)
+        load_kernel(emu, kernel);
+    else
+        load_boot_sector(emu);
+    return 0;
+}
+
+/* The attention is only raised with lock held, so disarming stops it for good. */
+static void *deadline_loop(void *ptr)
+{
+    Dax86Machine *m = (Dax86Machine *)ptr;
+    pthread_mutex_lock(&m->lock);
+    while (!m->quit)
+    {
+        if (m->deadline == 0)
+        {
+            pthread_cond_wait(&m->cond, &m->lock);
+            continue;
+        }
+        if (monotonic_ns() >= m->deadline)
+        {
+            raise_attention(m->machine->emu, ATTENTION_DEADLINE);
+            m->deadline = 0;
+            continue;
+        }
+        struct timespec until;
+        until.tv_sec = m->deadline / 1000000000;
+        until.tv_nsec = m->deadline % 1000000000;
+        pthread_cond_timedwait(&m->cond, &m->lock, &until);
+    }
+    pthread_mutex_unlock(&m->lock);
+    return NULL;
+}
+
+static void set_deadline(Dax86Machine *m, uint64_t deadline)
+{
+    pthread_mutex_lock(&m->lock);
+    if (!m->thread_started)
+    {
+        m->thread_started = 1;
+        pthread_create(&m->thread, NULL, deadline_loop, (void *)m);
+    }
+    m->deadline = deadline;
+    pthread_cond_signal(&m->cond);
+    pthread_mutex_unlock(&m->lock);
+}
+
+static int exit_code(int reason)
+{
+    switch (reason)
+    {
+    case RUN_DEADLINE:
+        return DAX86_EXIT_DEADLINE;
+    case RUN_STOP:
+        return DAX86_EXIT_STOP;
+    case RUN_END:
+        return DAX86_EXIT_END;
+    default:
+        return DAX86_EXIT_INSNS;
+    }
+}
+
+int dax86_run(Dax86Machine *m, uint64_t max_insns, uint64_t deadline)
+{
+    Emulator *emu = m->machine->emu;
+    int reason;
+    if (deadline != 0)
+        set_deadline(m, deadline);
+    emu_run(emu, max_insns, &reason);
+    if (deadline != 0)
+    {
+        /* Raised after the run ended for another reason */
+        set_deadline(m, 0);
+        clear_attention(emu, ATTENTION_DEADLINE);
+    }
+    return exit_code(reason);
+}
+
+void dax86_stop(Dax86Machine *m)
+{
+    raise_attention(m->machine->emu, ATTENTION_STOP);
+}
+
+uint64_t dax86_icount(Dax86Machine *m)
+{
+    return m->machine->emu->icount;
+}
+
+uint32_t dax86_get_register(Dax86Machine *m, int reg)
+{
+    Emulator *emu = m->machine->emu;
+    switch (reg)
+    {
+    case DAX86_EIP:
+        return emu->eip;
+    case DAX86_EFLAGS:
+        return get_eflags(emu);
+    case DAX86_CR0:
+        return get_ctrl_register32(emu, CR0);
+    case DAX86_CR2:
+        return get_ctrl_register32(emu, CR2);
+    case DAX86_CR3:
+        return get_ctrl_register32(emu, CR3);
+    default:
+        /* DAX86_EAX..DAX86_EDI are in the order of the register numbers. */
+        if (reg >= DAX86_EAX && reg <= DAX86_EDI)
+            return get_register32(emu, reg - DAX86_EAX);
+        return 0;
+    }
+}
+
+void dax86_set_register(Dax86Machine *m, int reg, uint32_t value)
+{
+    Emulator *emu = m->machine->emu;
+    switch (reg)
+    {
+    case DAX86_EIP:
+        emu->eip = value;
+        break;
+    case DAX86_EFLAGS:
+        set_eflags(emu, value);
+        break;
+    case DAX86_CR0:
+    case DAX86_CR2:
+    case DAX86_CR3:
+        set_ctrl_register32(emu, reg == DAX86_CR0 ? CR0 : reg == DAX86_CR2 ? CR2 : CR3, value);
+        tlb_flush(emu);
+        break;
+    default:
+        if (reg >= DAX86_EAX && reg <= DAX86_EDI)
+            set_register32(emu, reg - DAX86_EAX, value);
+        break;
+    }
+}
+
+/* Is [address, address + size) in RAM? */
+static int is_ram(Emulator *emu, uint32_t address, uint32_t size)
+{
+    uint32_t page;
+    if (size == 0)
+        return 1;
+    if (address >= emu->memory_size || size > emu->memory_size - address)
+        return 0;
+    for (page = address >> 12; page <= (address + size - 1) >> 12; page++)
+    {
+        if (emu->page_types[page] != PAGE_RAM && emu->page_types[page] != PAGE_WATCH)
+            return 0;
+    }
+    return 1;
+}
+
+int dax86_read_memory(Dax86Machine *m, uint32_t address, void *buf, uint32_t size)
+{
+    Emulator *emu = m->machine->emu;
+    if (!is_ram(emu, address, size))
+        return -1;
+    memcpy(buf, emu->memory + address, size);
+    return 0;
+}
+
+int dax86_write_memory(Dax86Machine *m, uint32_t address, const void *buf, uint32_t size)
+{
+    Emulator *emu = m->machine->emu;
+    if (!is_ram(emu, address, size))
+        return -1;
+    if (size == 0)
+        return 0;
+    memcpy(emu->memory + address, buf, size);
+    device_written(emu, address, size);
+    return 0;
+}
+
+static uint32_t read_callback(void *device, uint16_t address, int size)
+{
+    IoCallback *callback = (IoCallback *)device;
+    if (callback->read == NULL)
+        return 0;
+    return callback->read(callback->opaque, address, size);
+}
+
+static void write_callback(void *device, uint16_t address, int size, uint32_t value)
+{
+    IoCallback *callback = (IoCallback *)device;
+    if (callback->write != NULL)
+        callback->write(callback->opaque, address, size, value);
+}
+
+static uint32_t read_callback8(Emulator *emu, void *device, uint16_t address)
+{
+    return read_callback(device, address, 1);
+}
+
+static uint32_t read_callback16(Emulator *emu, void *device, uint16_t address)
+{
+    return read_callback(device, address, 2);
+}
+
+static uint32_t read_callback32(Emulator *emu, void *device, uint16_t address)
+{
+    return read_callback(device, address, 4);
+}
+
+static void write_callback8(Emulator *emu, void *device, uint16_t address, uint32_t value)
+{
+    write_callback(device, address, 1, value);
+}
+
+static void write_callback16(Emulator *emu, void *device, uint16_t address, uint32_t value)
+{
+    write_callback(device, address, 2, value);
+}
+
+static void write_callback32(Emulator *emu, void *device, uint16_t address, uint32_t value)
+{
+    write_callback(device, address, 4, value);
+}
+
+void dax86_register_io(Dax86Machine *m, uint16_t base, uint32_t count, dax86_io_read_t *read, dax86_io_write_t *write, void *opaque)
+{
+    IoPorts *io = m->machine->io;
+    uint32_t i;
+    IoCallback *callback = malloc(sizeof(IoCallback));
+    callback->read = read;
+    callback->write = write;
+    callback->opaque = opaque;
+    callback->next = m->callbacks;
+    m->callbacks = callback;
+
+    register_io_ports(io, base, count, 1, read_callback8, write_callback8, callback);
+    register_io_ports(io, base, count, 2, read_callback16, write_callback16, callback);
+    register_io_ports(io, base, count, 4, read_callback32, write_callback32, callback);
+    /* REP INSD/OUTSD go through the callbacks one dword at a time. */
+    for (i = 0; i < count; i++)
+        register_io_bulk32(io, base + i, NULL, NULL, NULL);
+}
+
+/* The library's handle of a Scheduler */
+struct Dax86Scheduler
+{
+    Scheduler *scheduler;
+};
+
+Dax86Scheduler *dax86_sched_create(int workers)
+{
+    Dax86Scheduler *s = malloc(sizeof(Dax86Scheduler));
+    s->scheduler = create_scheduler(workers);
+    return s;
+}
+
+void dax86_sched_destroy(Dax86Scheduler *s)
+{
+    destroy_scheduler(s->scheduler);
+    free(s);
+}
+
+int dax86_sched_add(Dax86Scheduler *s, Dax86Machine *m, int quota)
+{
+    return schedule_machine(s->scheduler, m->machine, quota);
+}
+
+int dax86_sched_wait(Dax86Scheduler *s, Dax86Machine *m)
+{
+    return exit_code(unschedule_machine(s->scheduler, m->machine));
+}
+
+uint64_t dax86_sched_cpu_ns(Dax86Machine *m)
+{
+    return scheduled_cpu_ns(m->machine);
+}
@@ -0,0 +1,170 @@
+#ifndef DAX86_H_
+#define DAX86_H_
+
+#include <stdint.h>
+
+/*
+ * libdax86
+ * Runs dax86 machines inside another program. Each Dax86Machine is one
+ * VM, driven in slices by dax86_run from one thread at a time; several
+ * machines may run on their own threads.
+ * Guest errors the emulator can not handle (unimplemented ops, bad
+ * descriptors) end the process, as they do in the dax86 binary.
+ *
+ * Typical use:
+ *   dax86_init(0);
+ *   Dax86Machine *m = dax86_create(&config);
+ *   dax86_attach_disk(m, "xv6.img", "delta", 1);
+ *   dax86_boot(m, NULL);
+ *   while (dax86_run(m, 1000000, 0) == DAX86_EXIT_INSNS)
+ *       ...
+ *   dax86_destroy(m);
+ */
+#define DAX86_API __attribute__((visibility("default")))
+
+typedef struct Dax86Machine Dax86Machine;
+typedef struct Dax86Scheduler Dax86Scheduler;
+
+/* Options of dax86_init, for every machine of the process */
+#define DAX86_JIT 0x1
+/* LAPIC timer on instructions retired instead of host time (-icount) */
+#define DAX86_ICOUNT 0x2
+
+typedef struct
+{
+    /* Bytes of guest RAM (multiple of 4KB), 0 for the default 512MB */
+    uint32_t memory_size;
+    /* Serial output as -console-out: NULL for stdout */
+    const char *console_out;
+    /* Keyboard input as -console-in: NULL for none */
+    const char *console_in;
+} Dax86Config;
+
+enum Dax86Exit
+{
+    /* max_insns instructions have run */
+    DAX86_EXIT_INSNS,
+    /* The deadline passed */
+    DAX86_EXIT_DEADLINE,
+    /* dax86_stop was called */
+    DAX86_EXIT_STOP,
+    /* The guest left RAM with paging off (end of a test program) */
+    DAX86_EXIT_END
+};
+
+enum Dax86Register
+{
+    DAX86_EAX,
+    DAX86_ECX,
+    DAX86_EDX,
+    DAX86_EBX,
+    DAX86_ESP,
+    DAX86_EBP,
+    DAX86_ESI,
+    DAX86_EDI,
+    DAX86_EIP,
+    DAX86_EFLAGS,
+    DAX86_CR0,
+    DAX86_CR2,
+    DAX86_CR3
+};
+
+/*
+ * Guest port access of size bytes (1, 2 or 4).
+ * opaque: as given to dax86_register_io
+ */
+typedef uint32_t dax86_io_read_t(void *opaque, uint16_t port, int size);
+typedef void dax86_io_write_t(void *opaque, uint16_t port, int size, uint32_t value);
+
+/* Once per process, before the first machine. options: DAX86_* bits */
+DAX86_API void dax86_init(int options);
+
+/*
+ * New machine with the chipset, serial port, keyboard, PCI, the
+ * paravirtual block device and the paravirtual NIC (no interface,
+ * frames sent are dropped), no disk yet. NULL if memory_size is invalid.
+ */
+DAX86_API Dax86Machine *dax86_create(const Dax86Config *config);
+DAX86_API void dax86_destroy(Dax86Machine *machine);
+
+/*
+ * Attaches the disk image at path (ATA, bus master DMA and pvblk).
+ * Writes go to the overlay file if overlay is not NULL (discarded at
+ * open with discard), to the image otherwise.
+ * Returns 0, or -1 if the image can not be opened.
+ */
+DAX86_API int dax86_attach_disk(Dax86Machine *machine, const char *path, const char *overlay, int discard);
+
+/*
+ * Boots from the disk's boot sector, or the ELF32 kernel at kernel
+ * (-kernel) if not NULL. Returns 0, or -1 without a disk.
+ */
+DAX86_API int dax86_boot(Dax86Machine *machine, const char *kernel);
+
+/*
+ * Runs until max_insns instructions have run (0: no limit), the host
+ * clock (CLOCK_MONOTONIC, ns) reaches deadline (0: none), or another
+ * exit. A halted guest sleeps until an interrupt or the deadline.
+ * Returns enum Dax86Exit.
+ */
+DAX86_API int dax86_run(Dax86Machine *machine, uint64_t max_insns, uint64_t deadline);
+/* Makes the current (or next) dax86_run return DAX86_EXIT_STOP; from any thread. */
+DAX86_API void dax86_stop(Dax86Machine *machine);
+/* Instructions retired since the machine was created */
+DAX86_API uint64_t dax86_icount(Dax86Machine *machine);
+
+/* Between runs, reg: enum Dax86Register. Writing a CR flushes the TLB. */
+DAX86_API uint32_t dax86_get_register(Dax86Machine *machine, int reg);
+DAX86_API void dax86_set_register(Dax86Machine *machine, int reg, uint32_t value);
+
+/*
+ * Copies guest physical RAM. Returns 0, or -1 if the range is not
+ * all RAM. Code written is retranslated.
+ */
+DAX86_API int dax86_read_memory(Dax86Machine *machine, uint32_t address, void *buf, uint32_t size);
+DAX86_API int dax86_write_memory(Dax86Machine *machine, uint32_t address, const void *buf, uint32_t size);
+
+/*
+ * Handles count ports from base with the callbacks, in place of the
+ * device there if any (e.g. the serial data port 0x3f8 to get the
+ * console output). read or write may be NULL.
+ */
+DAX86_API void dax86_register_io(Dax86Machine *machine, uint16_t base, uint32_t count, dax86_io_read_t *read, dax86_io_write_t *write, void *opaque);
+
+/*
+ * Scheduler
+ * Runs many machines on a pool of host threads in time slices instead
+ * of a thread per machine: each worker runs its own queue of machines
+ * and steals from the others once it is empty. A halted machine is
+ * parked off the queues until an interrupt (or dax86_stop) wakes it,
+ * so idle guests take no worker. A machine with a quota runs at most
+ * that percent of one host CPU.
+ *
+ *   Dax86Scheduler *s = dax86_sched_create(0);
+ *   dax86_sched_add(s, m, 0);           for each booted machine
+ *   ...
+ *   dax86_stop(m);
+ *   dax86_sched_wait(s, m);             for each machine
+ *   dax86_sched_destroy(s);
+ */
+
+/* workers: host threads, 0 for one per host CPU */
+DAX86_API Dax86Scheduler *dax86_sched_create(int workers);
+/* Once every machine added was waited for */
+DAX86_API void dax86_sched_destroy(Dax86Scheduler *scheduler);
+/*
+ * Runs machine on the scheduler from now on, not while dax86_run runs it.
+ * quota: percent of one host CPU (0: no limit). Returns 0, or -1 if it
+ * is already scheduled.
+ */
+DAX86_API int dax86_sched_add(Dax86Scheduler *scheduler, Dax86Machine *machine, int quota);
+/*
+ * Waits until the machine stopped (dax86_stop) or ended and takes it off
+ * the scheduler; dax86_run or dax86_sched_add continue it.
+ * Returns enum Dax86Exit.
+ */
+DAX86_API int dax86_sched_wait(Dax86Scheduler *scheduler, Dax86Machine *machine);
+/* Host CPU time (ns) the machine ran for on the scheduler */
+DAX86_API uint64_t dax86_sched_cpu_ns(Dax86Machine *machine);
+
+#endif
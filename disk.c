@@ -1,37 +1,119 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
 
 #include "disk.h"
+#include "emulator.h"
+#include "ide_dma.h"
+#include "io.h"
+#include "machine.h"
 #include "util.h"
+#include "stats.h"
+#include "snapshot.h"
 
 #define SECTOR_SIZE 512
 
+static void *disk_worker(void *ptr);
+
 Disk *create_disk_device()
 {
     Disk *disk = malloc(sizeof(Disk));
-    disk->storage = malloc(DISK_SIZE);
+    disk->storage = NULL;
+    disk->size = 0;
+    disk->overlay = NULL;
+    disk->writeback = NULL;
     disk->data = 0;
     disk->sec_count = 0;
     disk->lba_low = 0;
     disk->lba_mid = 0;
     disk->lba_high = 0;
     disk->drive_head = 0;
-    disk->status_command = 0x40;
+    disk->status_command = DISK_STATUS_RDY;
+    disk->head_index = 0;
+    disk->transfer_end = 0;
+    disk->dma_command = 0;
+    disk->bm_command = 0;
+    disk->bm_status = BM_STATUS_DRIVE0;
+    disk->bm_prdt = 0;
+    disk->emu = NULL;
+    disk->transfer = malloc(DISK_MAX_TRANSFER);
+    disk->transfer_start = 0;
+    disk->busy = 0;
+    disk->job = DISK_JOB_NONE;
+    disk->job_done = 0;
+    pthread_mutex_init(&disk->lock, NULL);
+    pthread_cond_init(&disk->cond, NULL);
+    disk->worker_started = 0;
     return disk;
 }
 
+void destroy_disk_device(Disk *disk)
+{
+    if (disk->worker_started)
+    {
+        pthread_mutex_lock(&disk->lock);
+        while (disk->job != DISK_JOB_NONE)
+            pthread_cond_wait(&disk->cond, &disk->lock);
+        disk->job = DISK_JOB_QUIT;
+        pthread_cond_broadcast(&disk->cond);
+        pthread_mutex_unlock(&disk->lock);
+        pthread_join(disk->worker, NULL);
+    }
+    if (disk->writeback != NULL)
+        close_writeback(disk->writeback);
+    if (disk->overlay != NULL)
+        close_overlay(disk->overlay);
+    if (disk->storage != NULL)
+        munmap(disk->storage, disk->size);
+    pthread_mutex_destroy(&disk->lock);
+    pthread_cond_destroy(&disk->cond);
+    free(disk->transfer);
+    free(disk);
+}
+
+/*
+ * Maps the image instead of reading it: pages are read from the file
+ * when the guest first accesses them, and are shared with the page cache,
+ * which also makes sectors written back visible here.
+ * Only the part 28-bit LBA can address is mapped.
+ */
 void load_data_to_disk(Disk *disk, FILE *f)
 {
-    fseek(f, 0L, SEEK_END);
-    long binary_size = ftell(f);
-    fseek(f, 0L, SEEK_SET);
-    if (binary_size > DISK_SIZE)
+    struct stat st;
+    if (fstat(fileno(f), &st) != 0)
     {
-        printf("Binary file bigger than disk size.");
+        printf("Could not stat disk image.\n");
         panic();
     }
-    fread(disk->storage, 1, binary_size, f);
+    uint64_t size = st.st_size;
+    if (size > DISK_MAX_SIZE)
+        size = DISK_MAX_SIZE;
+    if (size == 0)
+        return;
+    disk->storage = mmap(NULL, size, PROT_READ, MAP_SHARED, fileno(f), 0);
+    if (disk->storage == MAP_FAILED)
+    {
+        disk->storage = NULL;
+        printf("Could not map disk image.\n");
+        panic();
+    }
+    disk->size = size;
+}
+
+void attach_overlay(Disk *disk, const char *path, int discard)
+{
+    disk->overlay = open_overlay(path, (disk->size + SECTOR_SIZE - 1) / SECTOR_SIZE, discard);
+    if (disk->overlay == NULL)
+        panic();
+}
+
+void attach_writeback(Disk *disk, const char *path)
+{
+    disk->writeback = open_writeback(path);
 }
 
 void set_sec_count(Disk *disk, uint8_t val)
@@ -59,45 +141,437 @@ void set_drive_head(Disk *disk, uint8_t val)
     disk->drive_head = val;
 }
 
+/* DMA sectors are not transferred through the data register. */
+static int data_register_transfer(Disk *disk)
+{
+    return !disk->busy && disk->dma_command == 0 && disk->head_index < disk->transfer_end;
+}
+
 static void set_head_index(Disk *disk)
 {
-    uint32_t head_index = 0 | disk->lba_low | (disk->lba_mid << 8) | (disk->lba_high << 16) |
+    uint64_t head_index = 0 | disk->lba_low | (disk->lba_mid << 8) | (disk->lba_high << 16) |
                           ((disk->drive_head & 0x0F) << 24);
     disk->head_index = head_index * SECTOR_SIZE;
+    disk->transfer_start = disk->head_index;
+    disk->transfer_end = disk->head_index + (uint64_t)(disk->sec_count != 0 ? disk->sec_count : 256) * SECTOR_SIZE;
+}
+
+/* Copies the newest version of the sector to dst. */
+static void load_sector(Disk *disk, uint64_t sector, uint8_t *dst)
+{
+    uint64_t offset = sector * SECTOR_SIZE;
+    if (disk->writeback != NULL && writeback_read(disk->writeback, sector, dst))
+        return;
+    if (disk->overlay != NULL && offset < disk->size && overlay_has(disk->overlay, sector))
+    {
+        memcpy(dst, overlay_sector(disk->overlay, sector), SECTOR_SIZE);
+        return;
+    }
+    /* Past the end of the image reads as zeros. */
+    memset(dst, 0, SECTOR_SIZE);
+    if (offset < disk->size)
+        memcpy(dst, disk->storage + offset, disk->size - offset < SECTOR_SIZE ? disk->size - offset : SECTOR_SIZE);
+}
+
+static void store_sector(Disk *disk, uint64_t sector, const uint8_t *src)
+{
+    if (disk->overlay != NULL && sector < disk->overlay->sectors)
+        overlay_write_sector(disk->overlay, sector, src);
+    else if (disk->writeback != NULL && sector < disk->size / SECTOR_SIZE)
+        writeback_write(disk->writeback, sector, src);
+    else if (config.verbose)
+        printf("Write to sector %llu dropped.\n", (unsigned long long)sector);
+}
+
+uint64_t disk_sectors(Disk *disk)
+{
+    return (disk->size + SECTOR_SIZE - 1) / SECTOR_SIZE;
+}
+
+void read_disk_sectors(Disk *disk, uint64_t sector, uint32_t count, uint8_t *dst)
+{
+    uint32_t i;
+    for (i = 0; i < count; i++)
+        load_sector(disk, sector + i, dst + i * SECTOR_SIZE);
+}
+
+void write_disk_sectors(Disk *disk, uint64_t sector, uint32_t count, const uint8_t *src)
+{
+    uint32_t i;
+    for (i = 0; i < count; i++)
+        store_sector(disk, sector + i, src + i * SECTOR_SIZE);
+}
+
+void flush_disk(Disk *disk)
+{
+    if (disk->writeback != NULL)
+        writeback_flush(disk->writeback);
+    else if (disk->overlay != NULL)
+        overlay_flush(disk->overlay);
+}
+
+/* Runs the job of the command on whichever thread calls it. */
+static void run_job(Disk *disk, int job)
+{
+    uint64_t first = disk->transfer_start / SECTOR_SIZE;
+    uint32_t count = (disk->transfer_end - disk->transfer_start) / SECTOR_SIZE;
+    switch (job)
+    {
+    case DISK_JOB_READ:
+        read_disk_sectors(disk, first, count, disk->transfer);
+        break;
+    case DISK_JOB_WRITE:
+        write_disk_sectors(disk, first, count, disk->transfer);
+        break;
+    case DISK_JOB_FLUSH:
+        flush_disk(disk);
+        break;
+    default:
+        break;
+    }
+}
+
+/*
+ * I/O worker
+ * Runs one job at a time while the drive is BSY, then tells the CPU
+ * thread, which completes the command at its next safe point
+ * (complete_disk_command in ide_dma.c). All registers stay CPU-thread
+ * only; the worker only touches the transfer buffer and the backend.
+ */
+static void *disk_worker(void *ptr)
+{
+    Disk *disk = (Disk *)ptr;
+    pthread_mutex_lock(&disk->lock);
+    while (1)
+    {
+        while (disk->job == DISK_JOB_NONE)
+            pthread_cond_wait(&disk->cond, &disk->lock);
+        int job = disk->job;
+        if (job == DISK_JOB_QUIT)
+            break;
+        pthread_mutex_unlock(&disk->lock);
+
+        run_job(disk, job);
+
+        pthread_mutex_lock(&disk->lock);
+        disk->job = DISK_JOB_NONE;
+        /* For destroy_disk_device, waiting for the job to end */
+        pthread_cond_broadcast(&disk->cond);
+        __atomic_store_n(&disk->job_done, 1, __ATOMIC_RELEASE);
+        raise_attention(disk->emu, ATTENTION_DISK);
+    }
+    pthread_mutex_unlock(&disk->lock);
+    return NULL;
+}
+
+/*
+ * Sets BSY and hands the job to the worker.
+ * With -icount it runs at once, so that completion does not depend on
+ * host timing, and is still completed at the next safe point.
+ */
+void queue_disk_job(Disk *disk, int job)
+{
+    disk->busy = 1;
+    if (config.icount || disk->emu == NULL)
+    {
+        run_job(disk, job);
+        __atomic_store_n(&disk->job_done, 1, __ATOMIC_RELEASE);
+        if (disk->emu != NULL)
+            raise_attention(disk->emu, ATTENTION_DISK);
+        return;
+    }
+    /* Started with the first job, so a fork server's clones each get one. */
+    if (!disk->worker_started)
+    {
+        disk->worker_started = 1;
+        pthread_create(&disk->worker, NULL, disk_worker, (void *)disk);
+    }
+    pthread_mutex_lock(&disk->lock);
+    disk->job = job;
+    pthread_cond_signal(&disk->cond);
+    pthread_mutex_unlock(&disk->lock);
 }
 
+int finish_disk_job(Disk *disk)
+{
+    if (!__atomic_load_n(&disk->job_done, __ATOMIC_ACQUIRE))
+        return 0;
+    __atomic_store_n(&disk->job_done, 0, __ATOMIC_RELAXED);
+    disk->busy = 0;
+    return 1;
+}
+
+/* Commands written while BSY are ignored. */
 void set_disk_command(Disk *disk, uint8_t val)
 {
+    if (disk->busy)
+        return;
     switch (val)
     {
     case 0x20:
-        /* read sectors */
+        /* read sectors: the data register has them once BSY clears */
         set_head_index(disk);
+        STAT_ADD(stats.disk_sectors_read, disk->sec_count != 0 ? disk->sec_count : 256);
+        queue_disk_job(disk, DISK_JOB_READ);
+        break;
+    case 0x30:
+        /* write sectors: stored once the data register has all of them */
+        set_head_index(disk);
+        STAT_ADD(stats.disk_sectors_written, disk->sec_count != 0 ? disk->sec_count : 256);
+        break;
+    case ATA_READ_DMA:
+        /* sectors are read now, copied once the bus master is started */
+        set_head_index(disk);
+        disk->dma_command = val;
+        STAT_ADD(stats.disk_sectors_read, disk->sec_count != 0 ? disk->sec_count : 256);
+        queue_disk_job(disk, DISK_JOB_READ);
+        break;
+    case ATA_WRITE_DMA:
+        /* run by the bus master once it is started (ide_dma.c) */
+        set_head_index(disk);
+        disk->dma_command = val;
+        STAT_ADD(stats.disk_sectors_written, disk->sec_count != 0 ? disk->sec_count : 256);
+        break;
+    case 0xE7:
+        /* flush cache */
+        disk->transfer_end = disk->transfer_start = disk->head_index;
+        queue_disk_job(disk, DISK_JOB_FLUSH);
         break;
     default:
         break;
     }
 }
 
+/* DRQ is set while sectors of the command remain to be transferred. */
 uint8_t get_disk_status(Disk *disk)
 {
+    if (disk->busy)
+        return DISK_STATUS_BSY;
+    if (data_register_transfer(disk))
+        return disk->status_command | DISK_STATUS_DRQ;
     return disk->status_command;
 }
 
+/*
+ * Data register, through the transfer buffer of the command.
+ * Outside of a transfer reads return 0 and writes are dropped.
+ */
 uint8_t read_disk_data8(Disk *disk)
 {
-    uint8_t data = disk->storage[disk->head_index];
+    if (!data_register_transfer(disk))
+        return 0;
+    uint8_t data = disk->transfer[disk->head_index - disk->transfer_start];
     disk->head_index += 1;
     return data;
 }
 
-uint32_t read_disk_data32(Disk *disk)
+static void write_disk_data8(Disk *disk, uint8_t value)
+{
+    if (!data_register_transfer(disk))
+        return;
+    disk->transfer[disk->head_index - disk->transfer_start] = value;
+    disk->head_index += 1;
+    if (disk->head_index == disk->transfer_end)
+        queue_disk_job(disk, DISK_JOB_WRITE);
+}
+
+static uint32_t read_disk_data_n(Disk *disk, int size)
 {
     int i;
     uint32_t data = 0;
-    for (i = 0; i < 4; i++)
+    for (i = 0; i < size; i++)
     {
         data |= read_disk_data8(disk) << (8 * i);
     }
     return data;
-}
\ No newline at end of file
+}
+
+static void write_disk_data_n(Disk *disk, uint32_t value, int size)
+{
+    int i;
+    for (i = 0; i < size; i++)
+    {
+        write_disk_data8(disk, value >> (8 * i));
+    }
+}
+
+uint32_t read_disk_data32(Disk *disk)
+{
+    return read_disk_data_n(disk, 4);
+}
+
+void write_disk_data32(Disk *disk, uint32_t value)
+{
+    write_disk_data_n(disk, value, 4);
+}
+
+/* REP INSD/OUTSD: the part of len still in the command is copied at once. */
+void read_disk_data(Disk *disk, uint8_t *dst, uint32_t len)
+{
+    uint32_t n = 0;
+    if (data_register_transfer(disk))
+    {
+        n = disk->transfer_end - disk->head_index < len ? disk->transfer_end - disk->head_index : len;
+        memcpy(dst, disk->transfer + (disk->head_index - disk->transfer_start), n);
+        disk->head_index += n;
+    }
+    memset(dst + n, 0, len - n);
+}
+
+void write_disk_data(Disk *disk, const uint8_t *src, uint32_t len)
+{
+    if (!data_register_transfer(disk))
+        return;
+    uint32_t n = disk->transfer_end - disk->head_index < len ? disk->transfer_end - disk->head_index : len;
+    memcpy(disk->transfer + (disk->head_index - disk->transfer_start), src, n);
+    disk->head_index += n;
+    if (disk->head_index == disk->transfer_end)
+        queue_disk_job(disk, DISK_JOB_WRITE);
+}
+
+/* Port handlers, device: the Disk */
+static uint32_t read_status_port(Emulator *emu, void *device, uint16_t address)
+{
+    return get_disk_status(device);
+}
+
+static void write_register_port(Emulator *emu, void *device, uint16_t address, uint32_t value)
+{
+    Disk *disk = device;
+    switch (address)
+    {
+    case DISKSECCOUNT:
+        set_sec_count(disk, value);
+        break;
+    case DISKLBALOW:
+        set_lba_low(disk, value);
+        break;
+    case DISKLBAMID:
+        set_lba_mid(disk, value);
+        break;
+    case DISKLBAHIGH:
+        set_lba_high(disk, value);
+        break;
+    case DISKDRVHEAD:
+        set_drive_head(disk, value);
+        break;
+    case DISKSTACMD:
+        set_disk_command(disk, value);
+        start_dma(emu);
+        break;
+    }
+}
+
+static uint32_t read_data_port16(Emulator *emu, void *device, uint16_t address)
+{
+    return read_disk_data_n(device, 2);
+}
+
+static void write_data_port16(Emulator *emu, void *device, uint16_t address, uint32_t value)
+{
+    write_disk_data_n(device, value, 2);
+}
+
+static uint32_t read_data_port32(Emulator *emu, void *device, uint16_t address)
+{
+    return read_disk_data32(device);
+}
+
+static void write_data_port32(Emulator *emu, void *device, uint16_t address, uint32_t value)
+{
+    write_disk_data32(device, value);
+}
+
+static uint32_t read_data_bulk(Emulator *emu, void *device, uint16_t address, uint8_t *dst, uint32_t count)
+{
+    read_disk_data(device, dst, count * 4);
+    return count;
+}
+
+static uint32_t write_data_bulk(Emulator *emu, void *device, uint16_t address, const uint8_t *src, uint32_t count)
+{
+    write_disk_data(device, src, count * 4);
+    return count;
+}
+
+void register_disk_ports(struct Machine *machine, Disk *disk)
+{
+    register_io_ports(machine->io, DISKDATA, 1, 2, read_data_port16, write_data_port16, disk);
+    register_io_ports(machine->io, DISKDATA, 1, 4, read_data_port32, write_data_port32, disk);
+    register_io_bulk32(machine->io, DISKDATA, read_data_bulk, write_data_bulk, disk);
+    register_io_ports(machine->io, DISKSECCOUNT, DISKSTACMD - DISKSECCOUNT + 1, 1, NULL, write_register_port, disk);
+    register_io_ports(machine->io, DISKSTACMD, 1, 1, read_status_port, write_register_port, disk);
+}
+
+/* Overlay sectors a snapshot holds: all, but those written since the last checkpoint for a delta */
+static int snapshot_has_sector(struct Snapshot *snapshot, Overlay *overlay, uint64_t sector)
+{
+    if (!overlay_has(overlay, sector))
+        return 0;
+    if (snapshot->kind == SNAPSHOT_CHECKPOINT_DELTA && overlay->written != NULL)
+        return (overlay->written[sector >> 3] >> (sector & 7)) & 1;
+    return 1;
+}
+
+/*
+ * Registers, the sectors of the command in progress, and sectors written
+ * to the overlay (restored through the overlay or write-back).
+ * Taken only while no job runs.
+ */
+void snapshot_disk(struct Snapshot *snapshot, Disk *disk)
+{
+    uint64_t sector, count = 0;
+    uint8_t data[SECTOR_SIZE];
+
+    SNAPSHOT_FIELD(snapshot, disk->data);
+    SNAPSHOT_FIELD(snapshot, disk->sec_count);
+    SNAPSHOT_FIELD(snapshot, disk->lba_low);
+    SNAPSHOT_FIELD(snapshot, disk->lba_mid);
+    SNAPSHOT_FIELD(snapshot, disk->lba_high);
+    SNAPSHOT_FIELD(snapshot, disk->drive_head);
+    SNAPSHOT_FIELD(snapshot, disk->status_command);
+    SNAPSHOT_FIELD(snapshot, disk->head_index);
+    SNAPSHOT_FIELD(snapshot, disk->transfer_start);
+    SNAPSHOT_FIELD(snapshot, disk->transfer_end);
+    SNAPSHOT_FIELD(snapshot, disk->dma_command);
+    SNAPSHOT_FIELD(snapshot, disk->bm_command);
+    SNAPSHOT_FIELD(snapshot, disk->bm_status);
+    SNAPSHOT_FIELD(snapshot, disk->bm_prdt);
+    if (disk->transfer_end - disk->transfer_start > DISK_MAX_TRANSFER)
+    {
+        printf("Snapshot has a disk transfer too large.\n");
+        panic();
+    }
+    snapshot_data(snapshot, disk->transfer, disk->transfer_end - disk->transfer_start);
+
+    if (!snapshot->restoring)
+    {
+        flush_disk(disk);
+        if (disk->overlay != NULL)
+        {
+            for (sector = 0; sector < disk->overlay->sectors; sector++)
+                count += snapshot_has_sector(snapshot, disk->overlay, sector);
+        }
+        SNAPSHOT_FIELD(snapshot, count);
+        for (sector = 0; count > 0 && sector < disk->overlay->sectors; sector++)
+        {
+            if (!snapshot_has_sector(snapshot, disk->overlay, sector))
+                continue;
+            SNAPSHOT_FIELD(snapshot, sector);
+            snapshot_data(snapshot, overlay_sector(disk->overlay, sector), SECTOR_SIZE);
+        }
+        /* The next checkpoint holds the sectors written from here on. */
+        if (snapshot->kind != SNAPSHOT_FULL && disk->overlay != NULL && disk->overlay->written != NULL)
+            memset(disk->overlay->written, 0, (disk->overlay->sectors + 7) / 8);
+        return;
+    }
+
+    SNAPSHOT_FIELD(snapshot, count);
+    while (count-- > 0)
+    {
+        SNAPSHOT_FIELD(snapshot, sector);
+        SNAPSHOT_FIELD(snapshot, data);
+        if (sector < disk_sectors(disk))
+            write_disk_sectors(disk, sector, 1, data);
+    }
+}
@@ -3,9 +3,13 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <pthread.h>
 
-/* Disk size: 10MB */
-#define DISK_SIZE (1024 * 1024 * 10)
+#include "overlay.h"
+#include "writeback.h"
+
+/* Largest image 28-bit LBA can address: 128GB */
+#define DISK_MAX_SIZE ((uint64_t)0x10000000 * 512)
 
 /*
  * <ATA>
@@ -78,9 +82,39 @@
  * - Status port bit 0 (ERR) sets 
  * - Status port bit 5 (DF) sets
  */
+#define ATA_READ_DMA 0xC8
+#define ATA_WRITE_DMA 0xCA
+
+/* Most sectors of one command: 256 */
+#define DISK_MAX_TRANSFER (256 * 512)
+
+#define DISK_STATUS_DRQ 0x08
+#define DISK_STATUS_BSY 0x80
+#define DISK_STATUS_RDY 0x40
+
+enum DiskJob
+{
+    DISK_JOB_NONE,
+    DISK_JOB_READ,
+    DISK_JOB_WRITE,
+    DISK_JOB_FLUSH,
+    /* Ends the worker (destroy_disk_device) */
+    DISK_JOB_QUIT
+};
+
+struct Emulator;
+
 typedef struct
 {
+    /* Image mapped from the file, size bytes */
     uint8_t *storage;
+    uint64_t size;
+    /* Written sectors if run with -overlay, NULL otherwise */
+    Overlay *overlay;
+    /* Writes to the image itself, NULL if it is read-only */
+    WriteBack *writeback;
+    /* Sectors of the command, from transfer_start */
+    uint8_t *transfer;
     /* Registers */
     uint16_t data;
     uint8_t sec_count;
@@ -90,13 +124,37 @@ typedef struct
     uint8_t drive_head;
     uint8_t status_command;
     /* Utility */
-    uint32_t head_index;
+    uint64_t head_index;
+    /* head_index at the start and the end of the command's sectors */
+    uint64_t transfer_start;
+    uint64_t transfer_end;
+    /* I/O worker: BSY while a job runs (see queue_disk_job) */
+    struct Emulator *emu;
+    uint8_t busy;
+    int job;
+    int job_done;
+    int worker_started;
+    pthread_t worker;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /* READ DMA / WRITE DMA waiting for the bus master, 0 if none */
+    uint8_t dma_command;
+    /* Bus master registers (see ide_dma.h) */
+    uint8_t bm_command;
+    uint8_t bm_status;
+    uint32_t bm_prdt;
 } Disk;
 
 Disk *create_disk_device();
+/* Waits for the job in flight, writes everything out and frees the disk. */
+void destroy_disk_device(Disk *disk);
 
-/* Utility method for loading binary file to emu */
+/* Maps binary file as the disk image. */
 void load_data_to_disk(Disk *disk, FILE *f);
+/* Keeps sectors written in the delta file at path (see overlay.h). */
+void attach_overlay(Disk *disk, const char *path, int discard);
+/* Writes sectors back to the image at path (see writeback.h). */
+void attach_writeback(Disk *disk, const char *path);
 
 void set_sec_count(Disk *disk, uint8_t val);
 void set_lba_low(Disk *disk, uint8_t val);
@@ -107,5 +165,46 @@ void set_disk_command(Disk *disk, uint8_t val);
 
 uint8_t get_disk_status(Disk *disk);
 uint32_t read_disk_data32(Disk *disk);
+void write_disk_data32(Disk *disk, uint32_t value);
+/* Sectors of the image (the last one may be partial) */
+uint64_t disk_sectors(Disk *disk);
+/* Backend access, newest data first (write-back buffer, overlay, image) */
+void read_disk_sectors(Disk *disk, uint64_t sector, uint32_t count, uint8_t *dst);
+void write_disk_sectors(Disk *disk, uint64_t sector, uint32_t count, const uint8_t *src);
+/* Returns once sectors written are on the host disk. */
+void flush_disk(Disk *disk);
+
+/* Sets BSY and runs the DiskJob of the command on the I/O worker. */
+void queue_disk_job(Disk *disk, int job);
+/* Clears BSY if the job is done (CPU thread), returns 0 if it is not. */
+int finish_disk_job(Disk *disk);
+
+/* Transfers len bytes through the data register at once. */
+void read_disk_data(Disk *disk, uint8_t *dst, uint32_t len);
+void write_disk_data(Disk *disk, const uint8_t *src, uint32_t len);
+
+/*
+ * Ports of the primary channel
+ * 0x1F0: in|out: Data Register (16, 32 bits)
+ * 0x1F2: out: Sector Count Register
+ * 0x1F3: out: LBA Low
+ * 0x1F4: out: LBA Mid
+ * 0x1F5: out: LBA High
+ * 0x1F6: out: Drive/Head Register
+ * 0x1F7: in: Status Register | out: Command Register
+ */
+#define DISKDATA 0x1f0
+#define DISKSECCOUNT 0x1f2
+#define DISKLBALOW 0x1f3
+#define DISKLBAMID 0x1f4
+#define DISKLBAHIGH 0x1f5
+#define DISKDRVHEAD 0x1f6
+#define DISKSTACMD 0x1f7
+
+struct Machine;
+void register_disk_ports(struct Machine *machine, Disk *disk);
+
+struct Snapshot;
+void snapshot_disk(struct Snapshot *snapshot, Disk *disk);
 
 #endif
\ No newline at end of file
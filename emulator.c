@@ -2,9 +2,25 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <elf.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
 
 #include "emulator.h"
+#include "machine.h"
 #include "lapic.h"
+#include "ioapic.h"
+#include "emulator_functions.h"
+#include "instructions.h"
+#include "paging.h"
+#include "gdt.h"
+#include "block_cache.h"
+#include "util.h"
 
 /* Util for Print Binary */
 #define BYTE_TO_BINARY_PATTERN "%c%c%c%c%c%c%c%c"
@@ -18,11 +34,68 @@
         (byte & 0x02 ? '1' : '0'), \
         (byte & 0x01 ? '1' : '0')
 
-Emulator *create_emu(uint8_t *memory, uint32_t eip, uint32_t esp)
+static uint64_t memory_map_size(uint32_t memory_size)
 {
-    Emulator *emu = malloc(sizeof(Emulator));
+    return ((uint64_t)memory_size + HUGE_PAGE_SIZE - 1) & ~(uint64_t)(HUGE_PAGE_SIZE - 1);
+}
+
+/*
+ * Guest RAM
+ * Untouched pages are neither committed nor counted against swap.
+ * With -hugepages the mapping is aligned to HUGE_PAGE_SIZE and backed by
+ * transparent huge pages, with -hugetlb by the hugetlbfs pool
+ * (vm.nr_hugepages, reserved at once), so a guest 4MB PSE page is two
+ * host huge pages and RAM accesses need far fewer host TLB entries.
+ * With -share-ram the mapping is MADV_MERGEABLE: KSM merges its pages
+ * with identical ones of other machines (hugetlbfs pages are never merged).
+ */
+static uint8_t *alloc_memory(uint32_t memory_size)
+{
+    uint64_t size = memory_map_size(memory_size);
+    uint8_t *memory;
+    /* config is shared by all machines, the fallback is only this one's. */
+    int huge_pages = config.huge_pages;
+    if (huge_pages == HUGE_PAGES_HUGETLB)
+    {
+        /* Reserved at once: without the pages, faults would be SIGBUS. */
+        memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (memory != MAP_FAILED)
+            return memory;
+        printf("Could not allocate huge pages (vm.nr_hugepages), using transparent huge pages.\n");
+        huge_pages = HUGE_PAGES_TRANSPARENT;
+    }
+
+    /* Mapped one huge page larger and trimmed to be aligned. */
+    uint64_t map_size = huge_pages ? size + HUGE_PAGE_SIZE : size;
+    memory = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (memory == MAP_FAILED)
+    {
+        printf("Could not allocate %u bytes of memory.\n", memory_size);
+        panic();
+    }
+    if (huge_pages != HUGE_PAGES_NONE)
+    {
+        uint8_t *aligned = (uint8_t *)(((uintptr_t)memory + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+        if (aligned > memory)
+            munmap(memory, aligned - memory);
+        munmap(aligned + size, memory + map_size - (aligned + size));
+        if (madvise(aligned, size, MADV_HUGEPAGE) != 0)
+            printf("Transparent huge pages are not available.\n");
+        memory = aligned;
+    }
+    if (config.share_ram && madvise(memory, size, MADV_MERGEABLE) != 0)
+        printf("KSM is not available, RAM is not merged.\n");
+    return memory;
+}
 
-    /* Resets registers. */
+/*
+ * Registers at reset, with EIP and ESP where the BIOS leaves them.
+ * block_cache is set; attention and the other fields of the emulator
+ * are left as they are.
+ */
+static void reset_cpu(Emulator *emu, uint32_t eip, uint32_t esp)
+{
+    int i;
     memset(emu->registers, 0, sizeof(emu->registers));
     memset(emu->segment_registers, 0, sizeof(emu->segment_registers));
     memset(emu->control_registers, 0, sizeof(emu->control_registers));
@@ -30,34 +103,166 @@ Emulator *create_emu(uint8_t *memory, uint32_t eip, uint32_t esp)
     emu->gdtr.limit = 0;
     emu->idtr.base = 0;
     emu->idtr.limit = 0;
+    emu->tr = 0;
+    flush_interrupt_caches(emu);
     emu->eip = eip;
     emu->registers[ESP] = esp;
-    emu->int_r = 0;
-    emu->eflags = 0;
-
-    /* Devices */
-    emu->lapic = create_lapic(emu);
-    emu->memory = memory;
-    emu->disk = NULL;
+    set_eflags(emu, 0);
+    emu->decoded = NULL;
+    clear_prefixes(emu);
+    tlb_flush(emu);
 
-    /* Utility */
     emu->is_pe = 0;
     emu->is_pg = 0;
     emu->int_enabled = 0;
     emu->exception = NO_ERR;
+    emu->delivering = 0;
+    emu->tlb_supervisor = TLB_SUPERVISOR;
 
+    for (i = 0; i < SEGMENT_REGISTERS_COUNT; i++)
+        load_segment_cache(emu, i);
+}
+
+static void init_utility(Emulator *emu)
+{
+    emu->attention = 0;
+    emu->icount = 0;
+    emu->machine = NULL;
+    emu->cpu_id = 0;
+    emu->wait_sipi = 0;
+    emu->startup_vector = 0;
+    emu->trace = NULL;
+    emu->btrace = NULL;
+    emu->fault_return = NULL;
+}
+
+Emulator *create_emu(uint32_t memory_size, uint32_t eip, uint32_t esp)
+{
+    Emulator *emu = malloc(sizeof(Emulator));
+    emu->block_cache = create_block_cache(memory_size >> 12);
+    init_utility(emu);
+    reset_cpu(emu, eip, esp);
+
+    /* Devices */
+    emu->lapic = create_lapic(emu);
+    emu->memory = alloc_memory(memory_size);
+    emu->memory_size = memory_size;
+    emu->page_types = calloc(PHYS_PAGES_COUNT, 1);
+    emu->page_info = calloc(memory_size >> 12, sizeof(PageInfo));
+    set_page_type(emu, 0, memory_size, PAGE_RAM);
+    set_page_type(emu, ROM_BASE, ROM_END, PAGE_ROM);
+    set_page_type(emu, IOAPIC_DEFAULT_BASE, IOAPIC_DEFAULT_BASE + 0x1000, PAGE_IOAPIC);
+    set_page_type(emu, LAPIC_DEFAULT_BASE, LAPIC_DEFAULT_BASE + 0x1000, PAGE_LAPIC);
+    emu->disk = NULL;
+    return emu;
+}
+
+Emulator *create_ap(Emulator *bsp, uint8_t cpu_id)
+{
+    Emulator *emu = malloc(sizeof(Emulator));
+    emu->block_cache = create_block_cache(bsp->memory_size >> 12);
+    init_utility(emu);
+    reset_cpu(emu, 0, 0);
+    emu->lapic = create_lapic(emu);
+    set_lapic_id(emu->lapic, cpu_id);
+    emu->memory = bsp->memory;
+    emu->memory_size = bsp->memory_size;
+    emu->page_types = bsp->page_types;
+    emu->page_info = bsp->page_info;
+    emu->disk = bsp->disk;
+    emu->machine = bsp->machine;
+    emu->cpu_id = cpu_id;
+    /* Halted with IF clear, only STARTUP wakes it. */
+    emu->wait_sipi = 1;
+    emu->attention = ATTENTION_HALT;
     return emu;
 }
 
+/* The LAPIC keeps its state, xv6 only sends INIT to CPUs not yet started. */
+void init_cpu(Emulator *emu)
+{
+    reset_cpu(emu, 0, 0);
+    emu->wait_sipi = 1;
+    raise_attention(emu, ATTENTION_HALT);
+}
+
+void destroy_ap(Emulator *emu)
+{
+    destroy_lapic(emu->lapic);
+    destroy_block_cache(emu->block_cache);
+    free(emu);
+}
+
 void destroy_emu(Emulator *emu)
 {
-    free(emu->memory);
+    destroy_lapic(emu->lapic);
+    destroy_block_cache(emu->block_cache);
+    free(emu->page_types);
+    free(emu->page_info);
+    munmap(emu->memory, memory_map_size(emu->memory_size));
     free(emu);
 }
 
+/*
+ * Can be called from device threads, and from signal handlers unless
+ * the machine is scheduled (waking it takes the scheduler's lock).
+ * Wakes up the CPU thread if it is halted, or queues a parked machine.
+ */
+void raise_attention(Emulator *emu, uint32_t bits)
+{
+    uint32_t old = __atomic_fetch_or(&emu->attention, bits, __ATOMIC_SEQ_CST);
+    if (!(old & ATTENTION_HALT) || (old | bits) == old)
+        return;
+    if (emu->machine != NULL && __atomic_load_n(&emu->machine->scheduled.scheduler, __ATOMIC_ACQUIRE) != NULL)
+        wake_scheduled(emu->machine);
+#ifdef __linux__
+    syscall(SYS_futex, &emu->attention, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#endif
+}
+
+void clear_attention(Emulator *emu, uint32_t bits)
+{
+    __atomic_and_fetch(&emu->attention, ~bits, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Sleeps on the attention word itself (futex), so a raise_attention
+ * between the check and the sleep is not missed.
+ */
+void wait_attention(Emulator *emu, uint32_t bits)
+{
+    uint32_t attention;
+    while (((attention = __atomic_load_n(&emu->attention, __ATOMIC_SEQ_CST)) & bits) == 0)
+    {
+#ifdef __linux__
+        syscall(SYS_futex, &emu->attention, FUTEX_WAIT_PRIVATE, attention, NULL, NULL, 0);
+#else
+        usleep(1000);
+#endif
+    }
+}
+
+void wait_attention_for(Emulator *emu, uint32_t bits, uint64_t ns)
+{
+    uint32_t attention = __atomic_load_n(&emu->attention, __ATOMIC_SEQ_CST);
+    if (attention & bits)
+        return;
+#ifdef __linux__
+    struct timespec timeout = {ns / 1000000000, ns % 1000000000};
+    syscall(SYS_futex, &emu->attention, FUTEX_WAIT_PRIVATE, attention, &timeout, NULL, 0);
+#else
+    usleep(ns / 1000);
+#endif
+}
+
+/* The disk's commands complete on emu, its machine's other vCPUs see it too. */
 void attach_disk(Emulator *emu, Disk *disk)
 {
+    int i;
     emu->disk = disk;
+    disk->emu = emu;
+    for (i = 0; emu->machine != NULL && i < emu->machine->cpu_count; i++)
+        emu->machine->cpus[i]->disk = disk;
 }
 
 /*
@@ -70,7 +275,94 @@ void attach_disk(Emulator *emu, Disk *disk)
  */
 void load_boot_sector(Emulator *emu)
 {
-    memcpy(emu->memory + 0x7c00, emu->disk->storage, 512);
+    memset(emu->memory + 0x7c00, 0, 512);
+    memcpy(emu->memory + 0x7c00, emu->disk->storage, emu->disk->size < 512 ? emu->disk->size : 512);
+}
+
+static void kernel_error(const char *path, const char *msg)
+{
+    printf("Could not load kernel %s: %s\n", path, msg);
+    exit(1);
+}
+
+/*
+ * -share-ram: maps the whole pages of segment ph from the file (fd) over
+ * guest RAM, private: machines booting the same kernel share them in the
+ * host page cache until the guest writes one, which the host copies then
+ * (RAM stays plain memory to the emulator). Pages partly past the file
+ * contents (.bss) are copied.
+ * Returns 0 if no page could be mapped, else the mapped guest pages
+ * [*begin, *end).
+ */
+static int map_kernel_pages(Emulator *emu, int fd, Elf32_Phdr *ph, uint32_t *begin, uint32_t *end)
+{
+    uint32_t first = (ph->p_paddr + 0xFFF) & ~0xFFF;
+    uint32_t last = (ph->p_paddr + ph->p_filesz) & ~0xFFF;
+    /* Pages of the file and of the guest have to line up. */
+    if (((ph->p_offset - ph->p_paddr) & 0xFFF) != 0 || first >= last)
+        return 0;
+    if (mmap(emu->memory + first, last - first, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd,
+             ph->p_offset + (first - ph->p_paddr)) == MAP_FAILED)
+        return 0;
+    *begin = first;
+    *end = last;
+    return 1;
+}
+
+/*
+ * Loads an ELF32 kernel the way the xv6 bootloader (bootmain) does,
+ * without running it: PT_LOAD segments are copied to their physical
+ * addresses and zero filled up to p_memsz.
+ * The CPU is then left as bootasm leaves it: protected mode with flat
+ * segments (GDT at KERNEL_GDT_ADDRESS), interrupts disabled,
+ * ESP at 0x7c00 and EIP at the entry point.
+ */
+void load_kernel(Emulator *emu, const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+        kernel_error(path, "cannot open");
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    uint8_t *elf = malloc(size);
+    if (size < 0 || fread(elf, 1, size, file) != (size_t)size)
+        size = 0;
+
+    Elf32_Ehdr *ehdr = (Elf32_Ehdr *)elf;
+    if (size < (long)sizeof(Elf32_Ehdr) || memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 ||
+        ehdr->e_ident[EI_CLASS] != ELFCLASS32 || ehdr->e_machine != EM_386 || ehdr->e_type != ET_EXEC)
+        kernel_error(path, "not an i386 ELF32 executable");
+    if (ehdr->e_phoff + (uint64_t)ehdr->e_phnum * sizeof(Elf32_Phdr) > (uint64_t)size)
+        kernel_error(path, "program headers out of file");
+
+    Elf32_Phdr *phdrs = (Elf32_Phdr *)(elf + ehdr->e_phoff);
+    int i;
+    for (i = 0; i < ehdr->e_phnum; i++)
+    {
+        Elf32_Phdr *ph = &phdrs[i];
+        if (ph->p_type != PT_LOAD)
+            continue;
+        if (ph->p_filesz > ph->p_memsz || ph->p_offset + (uint64_t)ph->p_filesz > (uint64_t)size)
+            kernel_error(path, "segment out of file");
+        if (ph->p_paddr + (uint64_t)ph->p_memsz > emu->memory_size)
+            kernel_error(path, "segment out of guest RAM");
+        /* Copied around the pages mapped, all of it if none is */
+        uint32_t begin = ph->p_paddr + ph->p_filesz;
+        uint32_t end = begin;
+        if (config.share_ram)
+            map_kernel_pages(emu, fileno(file), ph, &begin, &end);
+        memcpy(emu->memory + ph->p_paddr, elf + ph->p_offset, begin - ph->p_paddr);
+        memcpy(emu->memory + end, elf + ph->p_offset + (end - ph->p_paddr), ph->p_paddr + ph->p_filesz - end);
+        memset(emu->memory + ph->p_paddr + ph->p_filesz, 0, ph->p_memsz - ph->p_filesz);
+    }
+    fclose(file);
+
+    enter_flat_protected_mode(emu, KERNEL_GDT_ADDRESS);
+    set_eflags(emu, 0);
+    emu->registers[ESP] = 0x7c00;
+    emu->eip = ehdr->e_entry;
+    free(elf);
 }
 
 char *register_names[] = {"EAX", "ECX", "EDX", "EBX", "ESP", "EBP", "ESI", "EDI"};
@@ -102,7 +394,7 @@ void dump_registers(Emulator *emu)
 // {
 //     printf("Input:\n");
 //     int i;
-//     for (i = 0; i < MEMORY_SIZE; i++)
+//     for (i = 0; i < emu->memory_size; i++)
 //     {
 //         if (emu->memory[i])
 //         {
@@ -143,7 +435,7 @@ void dump_eflags(Emulator *emu)
     printf("eflags:");
     for (i = 3; i > -1; i--)
     {
-        printf(BYTE_TO_BINARY_PATTERN, BYTE_TO_BINARY(emu->eflags >> (8 * i)));
+        printf(BYTE_TO_BINARY_PATTERN, BYTE_TO_BINARY(get_eflags(emu) >> (8 * i)));
         printf(" ");
     }
     printf("\n");
@@ -3,11 +3,50 @@
 
 #include <stdint.h>
 #include <pthread.h>
+#include <setjmp.h>
 
 #include "disk.h"
 
 /* Memory size: 512MB */
-#define MEMORY_SIZE (1024 * 1024 * 512)
+/* RAM from physical address 0, set with -m */
+#define DEFAULT_MEMORY_SIZE (1024 * 1024 * 512)
+#define MIN_MEMORY_SIZE (1024 * 1024 * 2)
+/* Host huge page backing guest RAM (-hugepages, -hugetlb) */
+#define HUGE_PAGE_SIZE (1024 * 1024 * 2)
+/* Below the IOAPIC and LAPIC pages */
+#define MAX_MEMORY_SIZE 0xC0000000u
+
+/* vCPUs of a machine (-smp), LAPIC IDs 0 to MAX_CPUS - 1 */
+#define MAX_CPUS 8
+
+/* Physical address space is 4GB: 2^20 pages of 4KB. */
+#define PHYS_PAGES_COUNT (1 << 20)
+
+/* Option ROM and BIOS area */
+#define ROM_BASE 0xC0000
+#define ROM_END 0x100000
+
+enum PageType
+{
+    PAGE_UNMAPPED,
+    PAGE_RAM,
+    PAGE_ROM,
+    PAGE_LAPIC,
+    PAGE_IOAPIC,
+    PAGE_WATCH
+};
+
+/*
+ * Metadata of a physical RAM page, shared by the vCPUs
+ * generation: bumped on every write to the page
+ * code_cpus: bit (1 << Emulator.cpu_id) set while the vCPU has blocks
+ * decoded from the page
+ */
+typedef struct
+{
+    uint32_t generation;
+    uint32_t code_cpus;
+} PageInfo;
 
 #define APIC_REGISTERS_SIZE 64
 
@@ -108,7 +147,180 @@ enum Exception
     E_SX
 };
 
+/* How get_physical_address() turns seg:offset into a physical address */
+enum TranslationMode
+{
+    /* Segment base + offset */
+    TRANSLATE_REAL,
+    /* Segment checks and base, no paging */
+    TRANSLATE_SEGMENTED,
+    /* Segment checks and base, then the page tables */
+    TRANSLATE_PAGED
+};
+
+/*
+ * Segment descriptor cache
+ * Hidden part of a segment register, filled when the register is loaded.
+ * limit: last valid offset (granularity already applied)
+ * access: access byte of the descriptor
+ */
+typedef struct
+{
+    uint32_t base;
+    uint32_t limit;
+    uint8_t access;
+    uint8_t dpl;
+    uint8_t rpl;
+} SegmentCache;
+
+/*
+ * Software TLB
+ * Direct-mapped cache of linear to physical page translations.
+ * Separate tables are kept per access type so a hit in the write
+ * (or exec) table already implies the access is permitted.
+ * An entry is empty when its linear page number is TLB_INVALID.
+ * Entries which only the supervisor may use (U/S clear, or for writes
+ * R/W clear with CR0.WP clear) have TLB_SUPERVISOR set in linear_page,
+ * which only matches while Emulator.tlb_supervisor is TLB_SUPERVISOR.
+ */
+#define TLB_SIZE 256
+#define TLB_INVALID 0xFFFFFFFF
+#define TLB_SUPERVISOR 0x80000000
+
+typedef struct
+{
+    uint32_t linear_page;
+    uint32_t phys_page;
+} TlbEntry;
+
+typedef struct
+{
+    TlbEntry read[TLB_SIZE];
+    TlbEntry write[TLB_SIZE];
+    TlbEntry exec[TLB_SIZE];
+} Tlb;
+
+/*
+ * Instruction fetch window
+ * Host pointer to the code page EIP is in, covering EIPs from begin
+ * to begin + size. Empty when size is 0.
+ */
+typedef struct
+{
+    uint8_t *host;
+    uint32_t begin;
+    uint32_t size;
+} FetchWindow;
+
+/*
+ * Stack window
+ * Host pointer to the RAM page SS:ESP is in, covering SS offsets from
+ * begin to begin + size (p_begin physical). Only kept for flat stack
+ * segments (and real mode), as pushes and pops in it need no checks;
+ * writable once filled for a write. Empty when size is 0.
+ */
+typedef struct
+{
+    uint8_t *host;
+    uint32_t begin;
+    uint32_t size;
+    uint32_t p_begin;
+    uint8_t writable;
+} StackWindow;
+
+/*
+ * Decoded IDT gate (interrupt.c)
+ * Valid while the generation of the RAM page it was read from is
+ * unchanged; all are dropped at lidt.
+ */
+typedef struct
+{
+    uint32_t generation;
+    uint32_t offset;
+    uint16_t selector;
+    uint8_t dpl;
+    uint8_t valid;
+} GateCache;
+
+/*
+ * Ring 0 stack of the TSS (interrupt.c)
+ * Valid while neither the GDT page of the TSS descriptor nor the TSS
+ * page was written, and DS has the same base. Dropped at ltr, lgdt
+ * and TLB flushes, as the TSS is read through its linear address.
+ */
+typedef struct
+{
+    uint32_t gdt_generation;
+    uint32_t tss_page;
+    uint32_t tss_generation;
+    uint32_t ds_base;
+    uint32_t esp0;
+    uint16_t ss0;
+    uint8_t valid;
+} TssCache;
+
+/* Spin-loop detector (spin.h): the last poll and how many times it repeated */
+typedef struct
+{
+    uint32_t eip;
+    uint32_t kind;
+    uintptr_t key;
+    uint32_t value;
+    uint32_t repeats;
+    uint32_t sleep_ns;
+    uint64_t last_ns;
+} SpinDetector;
+
+/*
+ * Lazy EFLAGS
+ * ALU instructions only record their operands and result here.
+ * CF, OF and SF (and ZF with zf_pending) are computed from them
+ * when read, or written into eflags once something else needs them.
+ * op: LAZY_NONE, LAZY_ADD, LAZY_SUB or LAZY_LOGIC
+ * width: operand size in bits
+ */
+enum LazyOp
+{
+    LAZY_NONE,
+    LAZY_ADD,
+    LAZY_SUB,
+    LAZY_LOGIC
+};
+
+typedef struct
+{
+    uint8_t op;
+    uint8_t width;
+    uint8_t zf_pending;
+    uint32_t value1;
+    uint32_t value2;
+    uint64_t result;
+    uint64_t zf_result;
+} LazyFlags;
+
+/*
+ * Prefixes of the instruction being executed
+ * The prefix decoder (instructions.c) gathers them before the op and
+ * clears them once it ran, so ops without prefixes see the defaults.
+ * segment: of ModR/M and moffs operands and string sources, DS if none
+ * operand_size, address_size: 66, 67 (the other size than the mode's)
+ * rep: F2 or F3, 0 if none
+ */
+typedef struct
+{
+    uint8_t segment;
+    uint8_t operand_size;
+    uint8_t address_size;
+    uint8_t rep;
+    uint8_t lock;
+} Prefixes;
+
 typedef struct LAPIC LAPIC;
+typedef struct BlockCache BlockCache;
+typedef struct TraceRing TraceRing;
+typedef struct Btrace Btrace;
+typedef struct Machine Machine;
+struct DecodedOp;
 typedef struct Emulator Emulator;
 
 /*
@@ -132,29 +344,124 @@ typedef struct Emulator Emulator;
  * RFLAGS:
  * Rsv...
  */
+/*
+ * Emulator.attention bits
+ * The run loop takes its slow path only while one of them is set.
+ * INTERRUPT: LAPIC may have a vector to deliver
+ * VERBOSE, TEST: sticky, set from config
+ * STOP: leave the run loop
+ * STATS: print -stats counters (SIGUSR1)
+ * HALT: hlt was executed, no instruction runs until an interrupt
+ * TIMER: LAPIC timer was programmed (-icount) or restored
+ * DISK: the disk I/O worker finished a job
+ * SNAPSHOT: write -save-snapshot (SIGUSR2)
+ * DEADLINE: leave the run loop, the host deadline of dax86_run passed
+ * STARTUP: STARTUP IPI received (Emulator.startup_vector)
+ * INIT: INIT IPI received
+ * CODE: another vCPU wrote pages this one has blocks of (BlockCache.stale)
+ * INPUT: the kbd thread posted bytes to store and log (-record)
+ * BENCH: a -bench marker was written, waits for Emulator.icount
+ * DEBUG: GDB stops the vCPU or single-steps it (gdb.h)
+ * YIELD: a scheduled machine spins (spin.h), it ends its slice
+ * CHECKPOINT: take a -checkpoint (its timer or SIGUSR2)
+ */
+#define ATTENTION_INTERRUPT 0x1
+#define ATTENTION_VERBOSE 0x2
+#define ATTENTION_TEST 0x4
+#define ATTENTION_STOP 0x8
+#define ATTENTION_STATS 0x10
+#define ATTENTION_HALT 0x20
+#define ATTENTION_TIMER 0x40
+#define ATTENTION_DISK 0x80
+#define ATTENTION_SNAPSHOT 0x100
+#define ATTENTION_DEADLINE 0x200
+#define ATTENTION_STARTUP 0x400
+#define ATTENTION_CODE 0x800
+#define ATTENTION_INIT 0x1000
+#define ATTENTION_INPUT 0x2000
+#define ATTENTION_BENCH 0x4000
+#define ATTENTION_DEBUG 0x8000
+#define ATTENTION_YIELD 0x10000
+#define ATTENTION_CHECKPOINT 0x20000
+/* Bits which wake up the CPU from hlt */
+#define ATTENTION_WAKE (ATTENTION_INTERRUPT | ATTENTION_STATS | ATTENTION_STOP | ATTENTION_DISK | ATTENTION_DEADLINE | ATTENTION_STARTUP | ATTENTION_INIT | ATTENTION_INPUT | ATTENTION_DEBUG | ATTENTION_CHECKPOINT)
+
 struct Emulator
 {
     /* Registers */
     uint32_t eflags;
+    LazyFlags lazy_flags;
     uint32_t registers[REGISTERS_COUNT];
     uint16_t segment_registers[SEGMENT_REGISTERS_COUNT];
+    SegmentCache segment_caches[SEGMENT_REGISTERS_COUNT];
     uint32_t control_registers[CONTROL_REGISTER_COUNT];
     uint32_t eip;
     Gdtr gdtr;
     Idtr idtr;
     uint16_t tr;
-    uint8_t int_r;
+    Tlb tlb;
+    FetchWindow fetch;
+    StackWindow stack;
+    GateCache gates[256];
+    TssCache tss_cache;
+    SpinDetector spin;
+    BlockCache *block_cache;
+    /* Instruction being executed if it was run from block cache */
+    struct DecodedOp *decoded;
+    /* Instructions the handler of a fused pair retired: 1 if it stopped after the first */
+    uint32_t retired;
+    /* EIP of the instruction being executed if it was not (watch.h) */
+    uint32_t op_eip;
+    /* Where a fault goes back to the run loop (emu_run), NULL outside of it */
+    jmp_buf *fault_return;
+    /* Set while an interrupt is delivered, a fault then is a double fault. */
+    uint8_t delivering;
+    Prefixes prefixes;
+    /* Machine this CPU is part of */
+    Machine *machine;
+    /* LAPIC ID, index in Machine.cpus */
+    uint8_t cpu_id;
+    /* AP waiting for STARTUP since reset, runs nothing until then */
+    uint8_t wait_sipi;
+    uint8_t startup_vector;
     /* Devices */
     struct LAPIC *lapic;
     uint8_t *memory;
+    /* Bytes of RAM at memory */
+    uint32_t memory_size;
+    /* PageType per physical page */
+    uint8_t *page_types;
+    /* PageInfo per physical page of RAM */
+    PageInfo *page_info;
     Disk *disk;
     /* Utility */
     uint8_t is_pe;
     uint8_t is_pg;
+    /* TranslationMode, kept by update_translation() (paging.h) */
+    uint8_t translation;
+    /*
+     * Segments whose offsets are linear addresses as they are (base 0,
+     * 4GB limit, no check failing): bit seg_index for reads and bit
+     * seg_index + 8 for writes
+     */
+    uint16_t flat_segments;
+    /* TLB_SUPERVISOR at CPL 0 to 2, 0 at CPL 3: TLB entries and page checks of the CPL */
+    uint32_t tlb_supervisor;
     uint8_t int_enabled;
     uint8_t exception;
+    /* Instructions retired, kept up to date at the run loop's slow path */
+    uint64_t icount;
+    /* ATTENTION_* bits, written from device threads too */
+    volatile uint32_t attention;
+    /* -trace ring, NULL if not tracing */
+    TraceRing *trace;
+    /* -btrace state, NULL if not tracing */
+    Btrace *btrace;
 };
 
+/* Words of LAPIC IRR/ISR */
+#define VECTOR_WORDS 8
+
 struct LAPIC
 {
     uint32_t registers[APIC_REGISTERS_SIZE];
@@ -163,18 +470,50 @@ struct LAPIC
     /* convenience properties */
     uint8_t unit_enabled;
     uint8_t int_enabled;
-    uint8_t irr[32];
-    uint8_t isr[32];
-    uint8_t isr_index;
-    pthread_mutex_t lock;
-    pthread_t *timer_thread;
+    /* 256-bit vector sets, updated atomically */
+    uint32_t irr[VECTOR_WORDS];
+    uint32_t isr[VECTOR_WORDS];
+    /* Timer: counts per expiration (ICR * divisor), 0 if stopped */
+    uint64_t timer_period;
+    /* -icount: Emulator.icount at the next expiration */
+    uint64_t timer_deadline;
+    /* Host time: timerfd waited on by timer_thread, -1 until started */
+    int timer_fd;
+    pthread_t timer_thread;
+    /* -stats: host time (ns) of the oldest fixed IPI not yet accepted, 0 if none */
+    uint64_t ipi_sent;
+    /* -bench: host time (ns) each vector was requested at, 0 if none pending */
+    uint64_t bench_raised[256];
+    /* -bench: bench_raised of the vector lapic_accept_intr returned last */
+    uint64_t bench_accepted;
 };
 
-Emulator *create_emu(uint8_t *memory, uint32_t eip, uint32_t esp);
+/* Allocates memory_size bytes of RAM, committed by the host as pages are touched. */
+Emulator *create_emu(uint32_t memory_size, uint32_t eip, uint32_t esp);
 void destroy_emu(Emulator *emu);
+/*
+ * Application processor cpu_id of the BSP's machine: shares its RAM and
+ * disk, has its own registers, LAPIC and block cache. It sleeps until a
+ * STARTUP IPI, then starts in real mode at vector << 12.
+ */
+Emulator *create_ap(Emulator *bsp, uint8_t cpu_id);
+/* INIT IPI: registers back to reset and waiting for STARTUP, on the CPU's own thread */
+void init_cpu(Emulator *emu);
+void destroy_ap(Emulator *emu);
+
+void raise_attention(Emulator *emu, uint32_t bits);
+void clear_attention(Emulator *emu, uint32_t bits);
+/* Blocks the calling thread until one of bits is set in attention. */
+void wait_attention(Emulator *emu, uint32_t bits);
+/* The same, but for no longer than about ns (and maybe less). */
+void wait_attention_for(Emulator *emu, uint32_t bits, uint64_t ns);
 
 void attach_disk(Emulator *emu, Disk *disk);
 void load_boot_sector(Emulator *emu);
+/* Where load_kernel places the bootloader's GDT (the boot sector's place) */
+#define KERNEL_GDT_ADDRESS 0x7c00
+/* -kernel: boots an ELF32 kernel directly, exits if it cannot be loaded. */
+void load_kernel(Emulator *emu, const char *path);
 
 void dump_registers(Emulator *emu);
 void dump_memory(Emulator *emu, int from, int len);
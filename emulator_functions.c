@@ -1,4 +1,5 @@
 #include <stdint.h>
+#include <string.h>
 
 #include "emulator_functions.h"
 #include "gdt.h"
@@ -6,7 +7,11 @@
 #include "io.h"
 #include "lapic.h"
 #include "ioapic.h"
+#include "machine.h"
 #include "util.h"
+#include "bench.h"
+#include "block_cache.h"
+#include "watch.h"
 
 /* Register Operations */
 
@@ -66,6 +71,9 @@ uint32_t get_register32(Emulator *emu, int reg_index)
 void set_seg_register16(Emulator *emu, int reg_index, uint16_t value)
 {
     emu->segment_registers[reg_index] = value;
+    load_segment_cache(emu, reg_index);
+    if (reg_index == CS && (value & 3) == 3 && config.bench)
+        bench_milestone(emu, BENCH_USER_MODE);
 }
 
 uint16_t get_seg_register16(Emulator *emu, int reg_index)
@@ -78,6 +86,7 @@ uint16_t get_seg_register16(Emulator *emu, int reg_index)
 void set_ctrl_register32(Emulator *emu, int reg_index, uint32_t value)
 {
     emu->control_registers[reg_index] = value;
+    update_translation(emu);
 }
 
 uint32_t get_ctrl_register32(Emulator *emu, int reg_index)
@@ -87,37 +96,258 @@ uint32_t get_ctrl_register32(Emulator *emu, int reg_index)
 
 /* Physical Memory Operations */
 
+/*
+ * The translation mode and flat segments are precomputed (paging.h):
+ * a flat segment without paging, as xv6 runs with, is the identity.
+ */
 uint32_t get_physical_address(Emulator *emu, int seg_index, uint32_t offset, uint8_t write)
 {
-    uint8_t exec = 0;
-    if (seg_index == CS)
-        exec = 1;
+    uint8_t exec = seg_index == CS;
+    uint32_t linear;
 
-    uint16_t seg_val = get_seg_register16(emu, seg_index);
+    if (emu->flat_segments & (1 << (seg_index + (write ? 8 : 0))))
+        linear = offset;
+    else if (emu->translation == TRANSLATE_REAL)
+        return emu->segment_caches[seg_index].base + offset;
+    else
+        linear = get_linear_addr(emu, seg_index, offset, write, exec);
 
-    /* Protected mode enabled. */
-    if (emu->is_pe)
+    if (emu->translation == TRANSLATE_PAGED)
+        return get_phys_addr(emu, linear, write, exec);
+    return linear;
+}
+
+/*
+ * Physical Memory Map
+ * Every 4KB physical page has a type deciding how it is accessed.
+ * RAM: host memory
+ * ROM: host memory, writes are ignored
+ * LAPIC / IOAPIC: device registers (MMIO)
+ * Watch: RAM with data watchpoints, accessed like MMIO to check them (watch.h)
+ * Unmapped: reads return all ones, writes are ignored
+ */
+void set_page_type(Emulator *emu, uint32_t p_from, uint32_t p_to, uint8_t type)
+{
+    uint32_t page;
+    for (page = p_from >> 12; page < (p_to >> 12); page++)
+    {
+        emu->page_types[page] = type;
+    }
+}
+
+/* Host is assumed to be little endian as i386. */
+static uint16_t load16(const uint8_t *p)
+{
+    uint16_t value;
+    memcpy(&value, p, 2);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    value = __builtin_bswap16(value);
+#endif
+    return value;
+}
+
+static uint32_t load32(const uint8_t *p)
+{
+    uint32_t value;
+    memcpy(&value, p, 4);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    value = __builtin_bswap32(value);
+#endif
+    return value;
+}
+
+static void store16(uint8_t *p, uint16_t value)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    value = __builtin_bswap16(value);
+#endif
+    memcpy(p, &value, 2);
+}
+
+static void store32(uint8_t *p, uint32_t value)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    value = __builtin_bswap32(value);
+#endif
+    memcpy(p, &value, 4);
+}
+
+static uint32_t load_ram(Emulator *emu, uint32_t p_address, int size)
+{
+    if (size == 4)
+        return load32(emu->memory + p_address);
+    if (size == 2)
+        return load16(emu->memory + p_address);
+    return emu->memory[p_address];
+}
+
+/* MMIO registers are 32 bits wide. */
+static uint32_t mmio_read32(Emulator *emu, uint8_t type, uint32_t p_address)
+{
+    switch (type)
+    {
+    case PAGE_LAPIC:
+        return lapic_read_reg(emu->lapic, p_address);
+    case PAGE_IOAPIC:
+        return ioapic_read_reg(emu->machine->ioapic, p_address);
+    default:
+        return 0xFFFFFFFF;
+    }
+}
+
+static void mmio_write32(Emulator *emu, uint8_t type, uint32_t p_address, uint32_t value)
+{
+    switch (type)
+    {
+    case PAGE_LAPIC:
+        lapic_write_reg(emu->lapic, p_address, value);
+        break;
+    case PAGE_IOAPIC:
+        ioapic_write_reg(emu->machine->ioapic, p_address, value);
+        break;
+    }
+}
+
+/*
+ * Reads 1 - 4 bytes from a single page which is not RAM or ROM.
+ * Narrower MMIO reads take bytes out of the 32 bit register.
+ * Watched RAM is read as it is, at any alignment.
+ */
+static uint32_t read_mmio(Emulator *emu, uint8_t type, uint32_t p_address, int size)
+{
+    uint32_t mask = size == 4 ? 0xFFFFFFFF : (1 << (size * 8)) - 1;
+    if (type == PAGE_UNMAPPED)
+        return mask;
+    if (type == PAGE_WATCH)
     {
-        uint32_t linear = get_linear_addr(emu, seg_val, offset, write, exec);
-        check_paging(emu);
-        /* Paging enabled. */
-        if (emu->is_pg)
-            return get_phys_addr(emu, linear, write, exec);
+        uint32_t value = load_ram(emu, p_address, size);
+        watch_access(emu, p_address, size, value, WATCH_READ);
+        return value;
+    }
+    int shift = (p_address & 3) * 8;
+    uint32_t value = mmio_read32(emu, type, p_address & ~3);
+    return (value >> shift) & mask;
+}
+
+/*
+ * Writes 1 - 4 bytes to a single page which is not RAM or ROM.
+ * Narrower MMIO writes are merged into the current 32 bit register value.
+ * Watched RAM is written as it is, at any alignment.
+ */
+static void write_mmio(Emulator *emu, uint8_t type, uint32_t p_address, uint32_t value, int size)
+{
+    if (type == PAGE_UNMAPPED)
+        return;
+    if (type == PAGE_WATCH)
+    {
+        watch_access(emu, p_address, size, value, WATCH_WRITE);
+        page_written(emu, p_address, size);
+        if (size == 4)
+            store32(emu->memory + p_address, value);
+        else if (size == 2)
+            store16(emu->memory + p_address, value);
         else
-            return linear;
+            emu->memory[p_address] = value;
+        return;
     }
-    /* Real mode */
-    uint32_t p_base = ((uint32_t)seg_val) << 4;
-    return p_base + offset;
+    if (size == 4)
+    {
+        mmio_write32(emu, type, p_address, value);
+        return;
+    }
+    uint32_t mask = ((1 << (size * 8)) - 1);
+    int shift = (p_address & 3) * 8;
+    uint32_t reg = mmio_read32(emu, type, p_address & ~3);
+    reg = (reg & ~(mask << shift)) | ((value & mask) << shift);
+    mmio_write32(emu, type, p_address & ~3, reg);
+}
+
+void page_written(Emulator *emu, uint32_t p_address, uint32_t size)
+{
+    PageInfo *info = &emu->page_info[p_address >> 12];
+    info->generation++;
+    uint32_t cpus = __atomic_load_n(&info->code_cpus, __ATOMIC_RELAXED);
+    if (cpus == 0)
+        return;
+    uint32_t self = 1u << emu->cpu_id;
+    /* Only blocks decoded from the bytes written are stale now. */
+    if (cpus & self)
+        invalidate_code_range(emu, p_address, size);
+    if (cpus & ~self)
+        invalidate_remote_code(emu, p_address >> 12, cpus & ~self);
+}
+
+void device_written(Emulator *emu, uint32_t p_address, uint32_t size)
+{
+    uint32_t page;
+    if (size == 0)
+        return;
+    for (page = p_address >> 12; page <= (p_address + size - 1) >> 12; page++)
+    {
+        PageInfo *info = &emu->page_info[page];
+        __atomic_fetch_add(&info->generation, 1, __ATOMIC_RELEASE);
+        uint32_t cpus = __atomic_load_n(&info->code_cpus, __ATOMIC_RELAXED);
+        if (cpus != 0)
+            invalidate_remote_code(emu, page, cpus);
+    }
+}
+
+void *get_atomic_pointer(Emulator *emu, int seg_index, uint32_t offset, int size)
+{
+    uint32_t p_address = get_physical_address(emu, seg_index, offset, 1);
+#if defined(__x86_64__) || defined(__i386__)
+    /* Locked host instructions work on unaligned operands too (split locks), as on the guest. */
+    if ((p_address & 0xFFF) + size > 0x1000)
+        return NULL;
+#else
+    if ((p_address & (size - 1)) != 0)
+        return NULL;
+#endif
+    uint8_t type = emu->page_types[p_address >> 12];
+    /* Locked ops on watched RAM stay atomic, they are reported with the value before. */
+    if (type == PAGE_WATCH)
+        watch_access(emu, p_address, size, load_ram(emu, p_address, size), WATCH_ACCESS);
+    else if (type != PAGE_RAM)
+        return NULL;
+    page_written(emu, p_address, size);
+    return emu->memory + p_address;
 }
 
 void _set_memory8(Emulator *emu, uint32_t p_address, uint8_t value)
 {
-    emu->memory[p_address] = value & 0xFF;
+    uint8_t type = emu->page_types[p_address >> 12];
+    if (type == PAGE_RAM)
+    {
+        page_written(emu, p_address, 1);
+        emu->memory[p_address] = value;
+    }
+    else if (type != PAGE_ROM)
+    {
+        write_mmio(emu, type, p_address, value, 1);
+    }
 }
 
+/*
+ * Wider accesses are done at once if they stay in one page,
+ * byte by byte otherwise (the pages might be of different types).
+ * Unaligned MMIO accesses are also split into bytes (not those to watched RAM).
+ */
 void _set_memory16(Emulator *emu, uint32_t p_address, uint16_t value)
 {
+    uint8_t type = emu->page_types[p_address >> 12];
+    if ((p_address & 0xFFF) <= 0xFFE && (type == PAGE_RAM || type == PAGE_WATCH || (p_address & 1) == 0))
+    {
+        if (type == PAGE_RAM)
+        {
+            page_written(emu, p_address, 2);
+            store16(emu->memory + p_address, value);
+        }
+        else if (type != PAGE_ROM)
+        {
+            write_mmio(emu, type, p_address, value, 2);
+        }
+        return;
+    }
     int i;
     for (i = 0; i < 2; i++)
     {
@@ -128,6 +358,20 @@ void _set_memory16(Emulator *emu, uint32_t p_address, uint16_t value)
 
 void _set_memory32(Emulator *emu, uint32_t p_address, uint32_t value)
 {
+    uint8_t type = emu->page_types[p_address >> 12];
+    if ((p_address & 0xFFF) <= 0xFFC && (type == PAGE_RAM || type == PAGE_WATCH || (p_address & 3) == 0))
+    {
+        if (type == PAGE_RAM)
+        {
+            page_written(emu, p_address, 4);
+            store32(emu->memory + p_address, value);
+        }
+        else if (type != PAGE_ROM)
+        {
+            write_mmio(emu, type, p_address, value, 4);
+        }
+        return;
+    }
     int i;
     for (i = 0; i < 4; i++)
     {
@@ -138,11 +382,22 @@ void _set_memory32(Emulator *emu, uint32_t p_address, uint32_t value)
 
 static uint8_t _get_memory8(Emulator *emu, uint32_t p_address)
 {
-    return emu->memory[p_address];
+    uint8_t type = emu->page_types[p_address >> 12];
+    if (type == PAGE_RAM || type == PAGE_ROM)
+        return emu->memory[p_address];
+    return read_mmio(emu, type, p_address, 1);
 }
 
 static uint16_t _get_memory16(Emulator *emu, uint32_t p_address)
 {
+    uint8_t type = emu->page_types[p_address >> 12];
+    if ((p_address & 0xFFF) <= 0xFFE)
+    {
+        if (type == PAGE_RAM || type == PAGE_ROM)
+            return load16(emu->memory + p_address);
+        if ((p_address & 1) == 0 || type == PAGE_WATCH)
+            return read_mmio(emu, type, p_address, 2);
+    }
     int i;
     uint16_t mem_read = 0;
     for (i = 0; i < 2; i++)
@@ -155,6 +410,14 @@ static uint16_t _get_memory16(Emulator *emu, uint32_t p_address)
 
 uint32_t _get_memory32(Emulator *emu, uint32_t p_address)
 {
+    uint8_t type = emu->page_types[p_address >> 12];
+    if ((p_address & 0xFFF) <= 0xFFC)
+    {
+        if (type == PAGE_RAM || type == PAGE_ROM)
+            return load32(emu->memory + p_address);
+        if ((p_address & 3) == 0 || type == PAGE_WATCH)
+            return read_mmio(emu, type, p_address, 4);
+    }
     int i;
     uint32_t mem_read = 0;
     for (i = 0; i < 4; i++)
@@ -166,11 +429,49 @@ uint32_t _get_memory32(Emulator *emu, uint32_t p_address)
 
 /* Source Instruction Operations */
 
+void flush_fetch_window(Emulator *emu)
+{
+    emu->fetch.size = 0;
+}
+
+/*
+ * Translates the code page containing EIP once and keeps a host pointer
+ * to it. The window never extends past the page, the CS limit or the
+ * end of memory, so every access outside of it takes the checked path.
+ */
+static void fill_fetch_window(Emulator *emu, uint32_t eip)
+{
+    uint32_t p_addr = get_physical_address(emu, CS, eip, 0);
+    uint32_t page_offset = p_addr & 0xFFF;
+    uint32_t begin = eip >= page_offset ? eip - page_offset : 0;
+    uint64_t end = (uint64_t)eip + (0x1000 - page_offset);
+    uint64_t limit_end = (uint64_t)emu->segment_caches[CS].limit + 1;
+    if (end > limit_end)
+        end = limit_end;
+    uint32_t p_begin = p_addr - (eip - begin);
+    if (p_begin + (end - begin) > emu->memory_size)
+    {
+        flush_fetch_window(emu);
+        return;
+    }
+    emu->fetch.host = emu->memory + p_begin;
+    emu->fetch.begin = begin;
+    emu->fetch.size = end - begin;
+}
+
 /* Retrieves code from memory by offset from EIP. */
 uint8_t get_code8(Emulator *emu, int index)
 {
-    uint32_t p_addr = get_physical_address(emu, CS, emu->eip, 0);
-    return emu->memory[p_addr + index];
+    uint32_t eip = emu->eip + index;
+    uint32_t offset = eip - emu->fetch.begin;
+    if (offset < emu->fetch.size)
+        return emu->fetch.host[offset];
+
+    fill_fetch_window(emu, eip);
+    offset = eip - emu->fetch.begin;
+    if (offset < emu->fetch.size)
+        return emu->fetch.host[offset];
+    return _get_memory8(emu, get_physical_address(emu, CS, eip, 0));
 }
 
 int8_t get_sign_code8(Emulator *emu, int index)
@@ -180,6 +481,12 @@ int8_t get_sign_code8(Emulator *emu, int index)
 
 uint16_t get_code16(Emulator *emu, int index)
 {
+    uint32_t offset = emu->eip + index - emu->fetch.begin;
+    if (offset < emu->fetch.size && emu->fetch.size - offset >= 2)
+    {
+        uint8_t *code = emu->fetch.host + offset;
+        return code[0] | (code[1] << 8);
+    }
     int i;
     uint32_t code = 0;
     /* i386 uses little endian (lower bytes to right). */
@@ -198,6 +505,12 @@ int16_t get_sign_code16(Emulator *emu, int index)
 
 uint32_t get_code32(Emulator *emu, int index)
 {
+    uint32_t offset = emu->eip + index - emu->fetch.begin;
+    if (offset < emu->fetch.size && emu->fetch.size - offset >= 4)
+    {
+        uint8_t *code = emu->fetch.host + offset;
+        return code[0] | (code[1] << 8) | (code[2] << 16) | ((uint32_t)code[3] << 24);
+    }
     int i;
     uint32_t code = 0;
     for (i = 0; i < 4; i++)
@@ -214,6 +527,42 @@ int32_t get_sign_code32(Emulator *emu, int index)
 
 /* Memory Operations with Segment Registers */
 
+/*
+ * With paging, data running into the next page is accessed byte by byte,
+ * so both pages are translated (and checked).
+ */
+static int crosses_page(Emulator *emu, int seg_index, uint32_t address, uint32_t bytes)
+{
+    return emu->translation == TRANSLATE_PAGED &&
+           ((emu->segment_caches[seg_index].base + address) & 0xFFF) > 0x1000 - bytes;
+}
+
+/* Byte by byte, so CR2 is the first byte which faults. */
+void probe_write(Emulator *emu, int seg_index, uint32_t address, uint32_t bytes)
+{
+    uint32_t i;
+    for (i = 0; i < bytes; i++)
+        get_physical_address(emu, seg_index, address + i, 1);
+}
+
+/* Nothing is written unless both pages can be. */
+static void set_memory_bytes(Emulator *emu, int seg_index, uint32_t address, uint32_t value, uint32_t bytes)
+{
+    uint32_t i;
+    probe_write(emu, seg_index, address, bytes);
+    for (i = 0; i < bytes; i++)
+        _set_memory8(emu, get_physical_address(emu, seg_index, address + i, 1), value >> (i * 8));
+}
+
+static uint32_t get_memory_bytes(Emulator *emu, int seg_index, uint32_t address, uint32_t bytes)
+{
+    uint32_t i;
+    uint32_t value = 0;
+    for (i = 0; i < bytes; i++)
+        value |= (uint32_t)_get_memory8(emu, get_physical_address(emu, seg_index, address + i, 0)) << (i * 8);
+    return value;
+}
+
 void set_memory8(Emulator *emu, int seg_index, uint32_t address, uint32_t value)
 {
     uint32_t p_address = get_physical_address(emu, seg_index, address, 1);
@@ -222,24 +571,23 @@ void set_memory8(Emulator *emu, int seg_index, uint32_t address, uint32_t value)
 
 void set_memory16(Emulator *emu, int seg_index, uint32_t address, uint16_t value)
 {
+    if (crosses_page(emu, seg_index, address, 2))
+    {
+        set_memory_bytes(emu, seg_index, address, value, 2);
+        return;
+    }
     uint32_t p_address = get_physical_address(emu, seg_index, address, 1);
     _set_memory16(emu, p_address, value);
 }
 
 void set_memory32(Emulator *emu, int seg_index, uint32_t address, uint32_t value)
 {
-    uint32_t p_address = get_physical_address(emu, seg_index, address, 1);
-    /* mmio */
-    if (p_address >= LAPIC_DEFAULT_BASE)
+    if (crosses_page(emu, seg_index, address, 4))
     {
-        lapic_write_reg(emu->lapic, p_address, value);
-        return;
-    }
-    if (p_address >= IOAPIC_DEFAULT_BASE)
-    {
-        ioapic_write_reg(p_address, value);
+        set_memory_bytes(emu, seg_index, address, value, 4);
         return;
     }
+    uint32_t p_address = get_physical_address(emu, seg_index, address, 1);
     _set_memory32(emu, p_address, value);
 }
 
@@ -251,34 +599,82 @@ uint8_t get_memory8(Emulator *emu, int seg_index, uint32_t address)
 
 uint16_t get_memory16(Emulator *emu, int seg_index, uint32_t address)
 {
+    if (crosses_page(emu, seg_index, address, 2))
+        return get_memory_bytes(emu, seg_index, address, 2);
     uint32_t p_address = get_physical_address(emu, seg_index, address, 0);
     return _get_memory16(emu, p_address);
 }
 
 uint32_t get_memory32(Emulator *emu, int seg_index, uint32_t address)
 {
+    if (crosses_page(emu, seg_index, address, 4))
+        return get_memory_bytes(emu, seg_index, address, 4);
     uint32_t p_address = get_physical_address(emu, seg_index, address, 0);
-    /* mmio */
-    if (p_address >= LAPIC_DEFAULT_BASE)
-    {
-        return lapic_read_reg(emu->lapic, p_address);
-    }
-    if (p_address >= IOAPIC_DEFAULT_BASE)
-    {
-        return ioapic_read_reg(p_address);
-    }
     return _get_memory32(emu, p_address);
 }
 
 /* Stack Operations */
 
+void flush_stack_window(Emulator *emu)
+{
+    emu->stack.size = 0;
+}
+
+/*
+ * Translates the stack page containing SS:offset once, for a write if
+ * write. Left empty if SS is not flat, or in paging the translation is
+ * not permitted (not cached in the TLB), so those take the checked path.
+ */
+static void fill_stack_window(Emulator *emu, uint32_t offset, int write)
+{
+    StackWindow *window = &emu->stack;
+    window->size = 0;
+    if (emu->translation != TRANSLATE_REAL && !(emu->flat_segments & (1 << (SS + (write ? 8 : 0)))))
+        return;
+    uint32_t p_addr = get_physical_address(emu, SS, offset, write);
+    uint32_t page_offset = p_addr & 0xFFF;
+    if (emu->translation == TRANSLATE_PAGED && !tlb_cached(emu, offset, write))
+        return;
+    if (offset < page_offset || (p_addr - page_offset) + 0x1000 > emu->memory_size)
+        return;
+    window->begin = offset - page_offset;
+    window->p_begin = p_addr - page_offset;
+    window->host = emu->memory + window->p_begin;
+    window->size = 0x1000;
+    window->writable = write;
+}
+
+/* Host pointer to bytes at SS:offset, NULL if they are not all in one RAM page of the window. */
+static uint8_t *stack_host(Emulator *emu, uint32_t offset, uint32_t bytes, int write)
+{
+    StackWindow *window = &emu->stack;
+    uint32_t index = offset - window->begin;
+    if (index >= window->size || window->size - index < bytes || (write && !window->writable))
+    {
+        fill_stack_window(emu, offset, write);
+        index = offset - window->begin;
+        if (index >= window->size || window->size - index < bytes)
+            return NULL;
+    }
+    uint32_t p_address = window->p_begin + index;
+    /* Watched or MMIO pages take the checked path. */
+    if (emu->page_types[p_address >> 12] != PAGE_RAM)
+        return NULL;
+    if (write)
+        page_written(emu, p_address, bytes);
+    return window->host + index;
+}
+
 void push16(Emulator *emu, uint16_t value)
 {
     /* New offset would be ESP value - 2 bytes.  */
     uint32_t offset = get_register32(emu, ESP) - 2;
+    uint8_t *host = stack_host(emu, offset, 2, 1);
+    if (host != NULL)
+        store16(host, value);
+    else
+        set_memory16(emu, SS, offset, value);
     set_register32(emu, ESP, offset);
-    uint32_t p_address = get_physical_address(emu, SS, offset, 1);
-    _set_memory16(emu, p_address, value);
 }
 
 void push32(Emulator *emu, uint32_t value)
@@ -286,30 +682,75 @@ void push32(Emulator *emu, uint32_t value)
 
     /* New offset would be ESP value - 4 bytes.  */
     uint32_t offset = get_register32(emu, ESP) - 4;
+    uint8_t *host = stack_host(emu, offset, 4, 1);
+    if (host != NULL)
+        store32(host, value);
+    else
+        set_memory32(emu, SS, offset, value);
     /* Updates ESP with the new address. */
     set_register32(emu, ESP, offset);
-    uint32_t p_address = get_physical_address(emu, SS, offset, 1);
-    _set_memory32(emu, p_address, value);
 }
 
 uint16_t pop16(Emulator *emu)
 {
     uint32_t offset = get_register32(emu, ESP);
-    uint32_t p_address = get_physical_address(emu, SS, offset, 0);
-    uint16_t value = _get_memory16(emu, p_address);
+    uint8_t *host = stack_host(emu, offset, 2, 0);
+    uint16_t value;
+    if (host != NULL)
+        value = load16(host);
+    else
+        value = get_memory16(emu, SS, offset);
     set_register32(emu, ESP, offset + 2);
     return value;
 }
 
+uint32_t load_stack32(Emulator *emu, uint32_t offset)
+{
+    uint8_t *host = stack_host(emu, offset, 4, 0);
+    if (host != NULL)
+        return load32(host);
+    return get_memory32(emu, SS, offset);
+}
+
 uint32_t pop32(Emulator *emu)
 {
     uint32_t offset = get_register32(emu, ESP);
-    uint32_t p_address = get_physical_address(emu, SS, offset, 0);
-    uint32_t value = _get_memory32(emu, p_address);
+    uint32_t value = load_stack32(emu, offset);
     set_register32(emu, ESP, offset + 4);
     return value;
 }
 
+void push32_frame(Emulator *emu, const uint32_t *values, int count)
+{
+    uint32_t offset = get_register32(emu, ESP) - count * 4;
+    uint8_t *host = stack_host(emu, offset, count * 4, 1);
+    int i;
+    /* The first value pushed is the highest. */
+    for (i = 0; i < count; i++)
+    {
+        if (host != NULL)
+            store32(host + (count - 1 - i) * 4, values[i]);
+        else
+            set_memory32(emu, SS, offset + (count - 1 - i) * 4, values[i]);
+    }
+    set_register32(emu, ESP, offset);
+}
+
+void read_stack_frame(Emulator *emu, uint32_t offset, uint32_t *values, int count)
+{
+    uint8_t *host = stack_host(emu, offset, count * 4, 0);
+    int i;
+    for (i = 0; i < count; i++)
+        values[i] = host != NULL ? load32(host + i * 4) : load_stack32(emu, offset + i * 4);
+}
+
+void pop32_frame(Emulator *emu, uint32_t *values, int count)
+{
+    uint32_t offset = get_register32(emu, ESP);
+    read_stack_frame(emu, offset, values, count);
+    set_register32(emu, ESP, offset + count * 4);
+}
+
 /* Segment Register to Memory */
 
 void push_segment_register(Emulator *emu, int reg_index)
@@ -342,92 +783,149 @@ void pop_segment_register(Emulator *emu, int reg_index)
 
 /* Eflag Operations */
 
-void set_carry_flag(Emulator *emu, int is_carry)
+static int lazy_sign(LazyFlags *lazy)
 {
-    /* Higher 32 bits are pass as int */
-    if (is_carry)
-    {
-        emu->eflags |= CARRY_FLAG;
-    }
+    return (lazy->result >> (lazy->width - 1)) & 1;
+}
+
+/* Carries out of the most significant bit (borrow for subtraction). */
+static int lazy_carry(LazyFlags *lazy)
+{
+    if (lazy->op == LAZY_LOGIC)
+        return 0;
+    return (lazy->result >> lazy->width) != 0;
+}
+
+/*
+ * For assumed signed numbers.
+ * Addition: Most significant bit (sign bit) is changed.
+ * Happens only with +n + +n or -n + -n.
+ * 0111 1111 (127) + 0111 1111 (127) = 1111 1110 (254)
+ *
+ * Subtraction: Overflow might happen only when 2 values have different signs.
+ * AND overflow changes the sign of value 1 in result. Ex: 4 bit case:
+ * 0111 (7) - 1111 (-1) = 1000 (-8) *wrong (sign1 != sign2 && sign1 != signr)* -> overflow
+ * 0111 (7) - 1000 (-8) = 1111 (-1) *wrong (sign1 != sign2 && sign1 != signr)* -> overflow
+ */
+static int lazy_overflow(LazyFlags *lazy)
+{
+    int sign1 = (lazy->value1 >> (lazy->width - 1)) & 1;
+    int sign2 = (lazy->value2 >> (lazy->width - 1)) & 1;
+    int signr = lazy_sign(lazy);
+    if (lazy->op == LAZY_ADD)
+        return sign1 == sign2 && sign1 != signr;
+    if (lazy->op == LAZY_SUB)
+        return sign1 != sign2 && sign1 != signr;
+    return 0;
+}
+
+static void set_flag(Emulator *emu, uint32_t flag, int is_set)
+{
+    if (is_set)
+        emu->eflags |= flag;
     else
-    {
-        /* Deflag: AND ~(NOT): NOT 0001 = 1110 AND 1001 -> 1000 */
-        emu->eflags &= ~CARRY_FLAG;
-    }
+        emu->eflags &= ~flag;
 }
 
-void set_zero_flag(Emulator *emu, int is_zero)
+/* Writes pending lazy flags into eflags. */
+static void materialize_eflags(Emulator *emu)
 {
-    if (is_zero)
+    LazyFlags *lazy = &emu->lazy_flags;
+    if (lazy->op != LAZY_NONE)
     {
-        emu->eflags |= ZERO_FLAG;
+        set_flag(emu, CARRY_FLAG, lazy_carry(lazy));
+        set_flag(emu, OVERFLOW_FLAG, lazy_overflow(lazy));
+        set_flag(emu, SIGN_FLAG, lazy_sign(lazy));
+        lazy->op = LAZY_NONE;
     }
-    else
+    if (lazy->zf_pending)
     {
-        emu->eflags &= ~ZERO_FLAG;
+        set_flag(emu, ZERO_FLAG, lazy->zf_result == 0);
+        lazy->zf_pending = 0;
     }
 }
 
+static void set_lazy_flags(Emulator *emu, uint8_t op, uint8_t width, uint32_t value1, uint32_t value2, uint64_t result)
+{
+    LazyFlags *lazy = &emu->lazy_flags;
+    lazy->op = op;
+    lazy->width = width;
+    lazy->value1 = value1;
+    lazy->value2 = value2;
+    lazy->result = result;
+}
+
+static void set_lazy_zero_flag(Emulator *emu, uint64_t result)
+{
+    emu->lazy_flags.zf_pending = 1;
+    emu->lazy_flags.zf_result = result;
+}
+
+uint32_t get_eflags(Emulator *emu)
+{
+    materialize_eflags(emu);
+    return emu->eflags;
+}
+
+void set_eflags(Emulator *emu, uint32_t value)
+{
+    emu->lazy_flags.op = LAZY_NONE;
+    emu->lazy_flags.zf_pending = 0;
+    emu->eflags = value;
+}
+
+void set_carry_flag(Emulator *emu, int is_carry)
+{
+    materialize_eflags(emu);
+    set_flag(emu, CARRY_FLAG, is_carry);
+}
+
+void set_zero_flag(Emulator *emu, int is_zero)
+{
+    materialize_eflags(emu);
+    set_flag(emu, ZERO_FLAG, is_zero);
+}
+
 void set_sign_flag(Emulator *emu, int is_sign)
 {
-    if (is_sign)
-    {
-        emu->eflags |= SIGN_FLAG;
-    }
-    else
-    {
-        emu->eflags &= ~SIGN_FLAG;
-    }
+    materialize_eflags(emu);
+    set_flag(emu, SIGN_FLAG, is_sign);
 }
 
 void set_int_flag(Emulator *emu, int is_enabled)
 {
-    if (is_enabled)
-    {
-        emu->eflags |= INT_ENABLE_FLAG;
-    }
-    else
-    {
-        emu->eflags &= ~INT_ENABLE_FLAG;
-    }
+    set_flag(emu, INT_ENABLE_FLAG, is_enabled);
 }
 
 void set_direction_flag(Emulator *emu, int is_down)
 {
-    if (is_down)
-    {
-        emu->eflags |= DIRECTION_FLAG;
-    }
-    else
-    {
-        emu->eflags &= ~DIRECTION_FLAG;
-    }
+    set_flag(emu, DIRECTION_FLAG, is_down);
 }
 
 void set_overflow_flag(Emulator *emu, int is_overflow)
 {
-    if (is_overflow)
-    {
-        emu->eflags |= OVERFLOW_FLAG;
-    }
-    else
-    {
-        emu->eflags &= ~OVERFLOW_FLAG;
-    }
+    materialize_eflags(emu);
+    set_flag(emu, OVERFLOW_FLAG, is_overflow);
 }
 
 int32_t is_carry(Emulator *emu)
 {
+    if (emu->lazy_flags.op != LAZY_NONE)
+        return lazy_carry(&emu->lazy_flags);
     return (emu->eflags & CARRY_FLAG) != 0;
 }
 
 int32_t is_zero(Emulator *emu)
 {
+    if (emu->lazy_flags.zf_pending)
+        return emu->lazy_flags.zf_result == 0;
     return (emu->eflags & ZERO_FLAG) != 0;
 }
 
 int32_t is_sign(Emulator *emu)
 {
+    if (emu->lazy_flags.op != LAZY_NONE)
+        return lazy_sign(&emu->lazy_flags);
     return (emu->eflags & SIGN_FLAG) != 0;
 }
 
@@ -443,118 +941,71 @@ int32_t is_direction_down(Emulator *emu)
 
 int32_t is_overflow(Emulator *emu)
 {
+    if (emu->lazy_flags.op != LAZY_NONE)
+        return lazy_overflow(&emu->lazy_flags);
     return (emu->eflags & OVERFLOW_FLAG) != 0;
 }
 
+/*
+ * Addition updates CF, OF and SF.
+ * 1111 1111 (255) + 1111 1111 (255) = 1 1111 1110 (510) -> carry
+ * ZF is kept as it is.
+ */
 void update_eflags_add(Emulator *emu, uint32_t value1, uint32_t value2, uint64_t result)
 {
-    /* sign bits */
-    int sign1 = value1 >> 31;
-    int sign2 = value2 >> 31;
-    int signr = (result >> 31) & 1;
-
-    /* 1111 1111 (255) + 1111 1111 (255) = 1 1111 1110 (510)*/
-    set_carry_flag(emu, result >> 32);
-    /* 
-     * For assumed signed numbers.
-     * Overflow: Most significant bit (sign bit) is changed. 
-     * Happens only with +n + +n or +n - -n.
-     * 0111 1111 (127) + 0111 1111 (127) = 1111 1110 (254)
-    */
-    set_overflow_flag(emu, sign1 == sign2 && sign1 != signr);
-    set_sign_flag(emu, signr);
+    set_lazy_flags(emu, LAZY_ADD, 32, value1, value2, result);
 }
 
 void update_eflags_add_8bit(Emulator *emu, uint8_t value1, uint8_t value2, uint16_t result)
 {
-    int sign1 = value1 >> 7;
-    int sign2 = value2 >> 7;
-    int signr = (result >> 7) & 1;
-    set_carry_flag(emu, result >> 8);
-    set_overflow_flag(emu, sign1 == sign2 && sign1 != signr);
-    set_sign_flag(emu, signr);
+    set_lazy_flags(emu, LAZY_ADD, 8, value1, value2, result);
 }
 
-void update_eflags_add_16bit(Emulator *emu, uint8_t value1, uint8_t value2, uint16_t result)
+void update_eflags_add_16bit(Emulator *emu, uint16_t value1, uint16_t value2, uint32_t result)
 {
-    int sign1 = value1 >> 15;
-    int sign2 = value2 >> 15;
-    int signr = (result >> 15) & 1;
-    set_carry_flag(emu, result >> 16);
-    set_overflow_flag(emu, sign1 == sign2 && sign1 != signr);
-    set_sign_flag(emu, signr);
+    set_lazy_flags(emu, LAZY_ADD, 16, value1, value2, result);
 }
 
 /* 
+ * Subtraction updates CF, ZF, SF and OF.
  * 1000 (-8) - 0001 (1) = 10111 (-9) -> carry
  * 1000 (-8) - 0010 (2) = 10110 (-10) -> carry
- * Overflow might happen only when 2 values have different signs in subtraction.
- * AND overflow changes the sign of value 1 in result. Ex: 4 bit case:
- * 0111 (7) - 1111 (-1) = 1000 (-8) *wrong (sign1 != sign2 && sign1 != signr)* -> overflow
- * 0111 (7) - 1000 (-8) = 1111 (-1) *wrong (sign1 != sign2 && sign1 != signr)* -> overflow
  */
 void update_eflags_sub(Emulator *emu, uint32_t value1, uint32_t value2, uint64_t result)
 {
-    /* sign bits */
-    int sign1 = value1 >> 31;
-    int sign2 = value2 >> 31;
-    int signr = (result >> 31) & 1;
-
-    set_carry_flag(emu, result >> 32); // higher 32 bits
-    set_zero_flag(emu, result == 0);
-    set_sign_flag(emu, signr);
-    set_overflow_flag(emu, sign1 != sign2 && sign1 != signr);
+    set_lazy_flags(emu, LAZY_SUB, 32, value1, value2, result);
+    set_lazy_zero_flag(emu, result);
 }
 
 void update_eflags_sub_8bit(Emulator *emu, uint8_t value1, uint8_t value2, uint16_t result)
 {
-    int sign1 = value1 >> 7;
-    int sign2 = value2 >> 7;
-    int signr = (result >> 7) & 1;
-
-    set_carry_flag(emu, result >> 8); // higher 32 bits
-    set_zero_flag(emu, result == 0);
-    set_sign_flag(emu, signr);
-    set_overflow_flag(emu, sign1 != sign2 && sign1 != signr);
+    set_lazy_flags(emu, LAZY_SUB, 8, value1, value2, result);
+    set_lazy_zero_flag(emu, result);
 }
 
 void update_eflags_sub_16bit(Emulator *emu, uint16_t value1, uint16_t value2, uint32_t result)
 {
-    int sign1 = value1 >> 15;
-    int sign2 = value2 >> 15;
-    int signr = (result >> 15) & 1;
-
-    set_carry_flag(emu, result >> 16); // higher 32 bits
-    set_zero_flag(emu, result == 0);
-    set_sign_flag(emu, signr);
-    set_overflow_flag(emu, sign1 != sign2 && sign1 != signr);
+    set_lazy_flags(emu, LAZY_SUB, 16, value1, value2, result);
+    set_lazy_zero_flag(emu, result);
 }
 
+/* Logical operations clear CF and OF, and update ZF and SF. */
 void update_eflags_logical_ops(Emulator *emu, uint32_t result)
 {
-    int signr = (result >> 31) & 1;
-    set_carry_flag(emu, 0);
-    set_zero_flag(emu, result == 0);
-    set_sign_flag(emu, signr);
-    set_overflow_flag(emu, 0);
+    set_lazy_flags(emu, LAZY_LOGIC, 32, 0, 0, result);
+    set_lazy_zero_flag(emu, result);
 }
 
 void update_eflags_logical_ops_8bit(Emulator *emu, uint8_t result)
 {
-    int signr = (result >> 7) & 1;
-    set_carry_flag(emu, 0);
-    set_zero_flag(emu, result == 0);
-    set_sign_flag(emu, signr);
-    set_overflow_flag(emu, 0);
+    set_lazy_flags(emu, LAZY_LOGIC, 8, 0, 0, result);
+    set_lazy_zero_flag(emu, result);
 }
 
-void update_eflags_logical_ops_16bit(Emulator *emu, uint8_t result)
+void update_eflags_logical_ops_16bit(Emulator *emu, uint16_t result)
 {
-    int signr = (result >> 15) & 1;
-    set_carry_flag(emu, 0);
-    set_zero_flag(emu, result == 0);
-    set_sign_flag(emu, signr);
-    set_overflow_flag(emu, 0);
+    set_lazy_flags(emu, LAZY_LOGIC, 16, 0, 0, result);
+    set_lazy_zero_flag(emu, result);
 }
 
 /*
@@ -577,16 +1028,25 @@ void update_eflags_mul(Emulator *emu, uint64_t upper_half_result)
 void set_tr(Emulator *emu, uint16_t val)
 {
     emu->tr = val;
+    emu->tss_cache.valid = 0;
 }
 
 void set_gdtr(Emulator *emu, uint16_t limit, uint32_t base)
 {
     emu->gdtr.limit = limit;
     emu->gdtr.base = base;
+    emu->tss_cache.valid = 0;
 }
 
 void set_idtr(Emulator *emu, uint16_t limit, uint32_t base)
 {
     emu->idtr.limit = limit;
     emu->idtr.base = base;
+    memset(emu->gates, 0, sizeof(emu->gates));
+}
+
+void flush_interrupt_caches(Emulator *emu)
+{
+    memset(emu->gates, 0, sizeof(emu->gates));
+    emu->tss_cache.valid = 0;
 }
\ No newline at end of file
@@ -36,6 +36,8 @@ uint32_t get_ctrl_register32(Emulator *emu, int reg_index);
 
 /* Source Instruction Operations */
 
+void flush_fetch_window(Emulator *emu);
+
 uint8_t get_code8(Emulator *emu, int index);
 int8_t get_sign_code8(Emulator *emu, int index);
 
@@ -47,6 +49,28 @@ int32_t get_sign_code32(Emulator *emu, int index);
 
 /* Physical Memory Operations */
 
+void set_page_type(Emulator *emu, uint32_t p_from, uint32_t p_to, uint8_t type);
+
+/*
+ * Has to be called for every write into a RAM page not done by _set_memory*.
+ * Bumps the page generation and drops blocks decoded from the bytes written.
+ * [p_address, p_address + size) has to be within one page.
+ */
+void page_written(Emulator *emu, uint32_t p_address, uint32_t size);
+/*
+ * page_written for device threads, after the bytes were written: every
+ * vCPU is remote. [p_address, p_address + size) may span pages.
+ */
+void device_written(Emulator *emu, uint32_t p_address, uint32_t size);
+
+/*
+ * Host address of size bytes at seg:offset for a read-modify-write done
+ * with one host atomic operation, so that other vCPUs see it whole.
+ * NULL if it is not RAM within one page (naturally aligned on hosts
+ * other than x86); the caller then does separate accesses.
+ */
+void *get_atomic_pointer(Emulator *emu, int seg_index, uint32_t offset, int size);
+
 uint32_t get_physical_address(Emulator *emu, int seg_index, uint32_t offset, uint8_t write);
 
 void _set_memory8(Emulator *emu, uint32_t p_address, uint8_t value);
@@ -64,14 +88,33 @@ void set_memory32(Emulator *emu, int seg_index, uint32_t address, uint32_t value
 uint8_t get_memory8(Emulator *emu, int seg_index, uint32_t address);
 uint16_t get_memory16(Emulator *emu, int seg_index, uint32_t address);
 uint32_t get_memory32(Emulator *emu, int seg_index, uint32_t address);
+/* Faults as a write of bytes at seg_index:address would, without writing (ins). */
+void probe_write(Emulator *emu, int seg_index, uint32_t address, uint32_t bytes);
 
 /* Stack Operations */
 
+/* Drops the stack window (emulator.h): SS or the translation changed. */
+void flush_stack_window(Emulator *emu);
+
+/* Pushes and pops move ESP once the access is done, so it stays as it was if the access faults. */
 void push16(Emulator *emu, uint16_t value);
 uint16_t pop16(Emulator *emu);
 
 void push32(Emulator *emu, uint32_t value);
 uint32_t pop32(Emulator *emu);
+/* Dword at SS:offset, read as a pop (leave) */
+uint32_t load_stack32(Emulator *emu, uint32_t offset);
+
+/*
+ * Multi-dword frames (interrupts, iret, pushad, popad) in one bounds
+ * check while they fit in the stack window, else dword by dword.
+ * push32_frame pushes values[0] first, pop32_frame pops values[0] first.
+ * ESP is moved once for the whole frame, after all of it was accessed.
+ */
+void push32_frame(Emulator *emu, const uint32_t *values, int count);
+void pop32_frame(Emulator *emu, uint32_t *values, int count);
+/* Reads the frame pop32_frame would pop from SS:offset, ESP is not moved. */
+void read_stack_frame(Emulator *emu, uint32_t offset, uint32_t *values, int count);
 
 /* Segment Register to Memory */
 
@@ -80,6 +123,10 @@ void pop_segment_register(Emulator *emu, int reg_index);
 
 /* Eflag Operations */
 
+/* Whole EFLAGS register, with lazily computed flags written in. */
+uint32_t get_eflags(Emulator *emu);
+void set_eflags(Emulator *emu, uint32_t value);
+
 void set_carry_flag(Emulator *emu, int is_carry);
 void set_zero_flag(Emulator *emu, int is_zero);
 void set_sign_flag(Emulator *emu, int is_sign);
@@ -96,7 +143,7 @@ int32_t is_overflow(Emulator *emu);
 
 void update_eflags_add(Emulator *emu, uint32_t value1, uint32_t value2, uint64_t result);
 void update_eflags_add_8bit(Emulator *emu, uint8_t value1, uint8_t value2, uint16_t result);
-void update_eflags_add_16bit(Emulator *emu, uint8_t value1, uint8_t value2, uint16_t result);
+void update_eflags_add_16bit(Emulator *emu, uint16_t value1, uint16_t value2, uint32_t result);
 
 void update_eflags_sub(Emulator *emu, uint32_t value1, uint32_t value2, uint64_t result);
 void update_eflags_sub_8bit(Emulator *emu, uint8_t value1, uint8_t value2, uint16_t result);
@@ -104,7 +151,7 @@ void update_eflags_sub_16bit(Emulator *emu, uint16_t value1, uint16_t value2, ui
 
 void update_eflags_logical_ops(Emulator *emu, uint32_t result);
 void update_eflags_logical_ops_8bit(Emulator *emu, uint8_t result);
-void update_eflags_logical_ops_16bit(Emulator *emu, uint8_t result);
+void update_eflags_logical_ops_16bit(Emulator *emu, uint16_t result);
 
 void update_eflags_mul(Emulator *emu, uint64_t upper_half_result);
 
@@ -113,5 +160,7 @@ void set_tr(Emulator *emu, uint16_t val);
 /* DTR Operations */
 void set_gdtr(Emulator *emu, uint16_t limit, uint32_t base);
 void set_idtr(Emulator *emu, uint16_t limit, uint32_t base);
+/* Drops the IDT gates and TSS stack cached by interrupts (emulator.h): tables set without the above. */
+void flush_interrupt_caches(Emulator *emu);
 
 #endif
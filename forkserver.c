@@ -0,0 +1,67 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "forkserver.h"
+#include "util.h"
+
+static int listen_unix_socket(const char *path)
+{
+    struct sockaddr_un address;
+    if (strlen(path) >= sizeof(address.sun_path))
+        return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(fd, SOMAXCONN) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int run_fork_server(const char *path)
+{
+    int listen_fd = listen_unix_socket(path);
+    if (listen_fd < 0)
+    {
+        printf("Could not listen on: %s\n", path);
+        panic();
+    }
+    /* Children are reaped by the kernel, a client gone just ends writes. */
+    signal(SIGCHLD, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+    printf("Fork server listening on %s\n", path);
+    fflush(stdout);
+
+    while (1)
+    {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            printf("Fork server could not accept: %s\n", strerror(errno));
+            panic();
+        }
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            close(listen_fd);
+            return fd;
+        }
+        if (pid < 0)
+            printf("Fork server could not fork: %s\n", strerror(errno));
+        close(fd);
+    }
+}
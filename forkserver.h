@@ -0,0 +1,20 @@
+#ifndef FORKSERVER_H_
+#define FORKSERVER_H_
+
+/*
+ * Fork server
+ * The machine is set up once (restored from a warm snapshot), then every
+ * connection to the Unix domain socket at path is a job run by a child
+ * forked from it: guest RAM is shared copy-on-write with the server,
+ * the disk overlay is made private to the child, and the connection is
+ * the child's console (keyboard input and serial output).
+ * The job ends when the client closes its side of the connection.
+ * Device threads are started by the child only (kbd input, disk worker,
+ * LAPIC timer, console flush), as threads do not survive fork.
+ *
+ * Returns in each child with the connection's fd, the server itself
+ * never returns.
+ */
+int run_fork_server(const char *path);
+
+#endif
@@ -0,0 +1,739 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+#include "gdb.h"
+#include "block_cache.h"
+#include "emulator_functions.h"
+#include "machine.h"
+#include "paging.h"
+#include "util.h"
+#include "watch.h"
+
+/* i386 register numbers of GDB ('g' packet order) */
+#define GDB_EIP 8
+#define GDB_EFLAGS 9
+#define GDB_REGISTERS 16
+
+enum GdbStep
+{
+    STEP_NONE,
+    /* The next op runs, ATTENTION_DEBUG stays set. */
+    STEP_PENDING,
+    /* The op is running, it does not stop at breakpoints. */
+    STEP_RUNNING
+};
+
+typedef struct
+{
+    int step;
+    /* Continues once the step is done (resuming from a breakpoint). */
+    int continue_after;
+    /* Set by GDB to let the stopped vCPU go */
+    int released;
+} GdbCpu;
+
+int gdb_breakpoint_count = 0;
+static uint32_t breakpoints[GDB_MAX_BREAKPOINTS];
+
+static Machine *gdb_machine = NULL;
+static int client_fd = -1;
+/* A byte is written once every vCPU stopped. */
+static int stopped_pipe[2];
+
+/* Guards everything below */
+static pthread_mutex_t gdb_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t released_cond = PTHREAD_COND_INITIALIZER;
+static GdbCpu gdb_cpus[MAX_CPUS];
+static int stopped_count = 0;
+/* Set while the vCPUs are to stop, with the vCPU and signal reported */
+static int stopping = 0;
+static int stop_cpu = 0;
+static int stop_signal = SIGTRAP;
+/* WatchKind of the watchpoint stop_cpu hit (0 if none), at linear address stop_watch_addr */
+static int stop_watch = 0;
+static uint32_t stop_watch_addr = 0;
+
+/* vCPU of Hg (registers, memory, breakpoints) and Hc (s), -1 for the one that stopped */
+static int general_cpu = -1;
+static int step_cpu = -1;
+
+static const int segment_numbers[SEGMENT_REGISTERS_COUNT] = {[CS] = 10, [SS] = 11, [DS] = 12, [ES] = 13, [FS] = 14, [GS] = 15};
+
+int gdb_breakpoint_at(uint32_t phys_addr)
+{
+    int i;
+    for (i = 0; i < gdb_breakpoint_count; i++)
+    {
+        if (breakpoints[i] == phys_addr)
+            return 1;
+    }
+    return 0;
+}
+
+/* With gdb_lock held: the first caller decides what is reported. */
+static void stop_all(int cpu_id, int signal)
+{
+    int i;
+    if (stopping)
+        return;
+    stopping = 1;
+    stop_cpu = cpu_id;
+    stop_signal = signal;
+    stop_watch = 0;
+    for (i = 0; i < gdb_machine->cpu_count; i++)
+        raise_attention(gdb_machine->cpus[i], ATTENTION_DEBUG);
+}
+
+static int at_breakpoint(Emulator *emu)
+{
+    uint32_t phys_addr;
+    return peek_phys_addr(emu, emu->segment_caches[CS].base + emu->eip, &phys_addr) &&
+           gdb_breakpoint_at(phys_addr);
+}
+
+int gdb_check_breakpoint(Emulator *emu)
+{
+    /* Stepping over the breakpoint it stopped at */
+    if (gdb_cpus[emu->cpu_id].step == STEP_RUNNING || !at_breakpoint(emu))
+        return 0;
+    pthread_mutex_lock(&gdb_lock);
+    stop_all(emu->cpu_id, SIGTRAP);
+    pthread_mutex_unlock(&gdb_lock);
+    return 1;
+}
+
+void gdb_watch_hit(Emulator *emu, int kind, uint32_t linear_addr)
+{
+    pthread_mutex_lock(&gdb_lock);
+    if (!stopping)
+    {
+        stop_all(emu->cpu_id, SIGTRAP);
+        stop_watch = kind;
+        stop_watch_addr = linear_addr;
+    }
+    pthread_mutex_unlock(&gdb_lock);
+}
+
+int gdb_attention(Emulator *emu)
+{
+    GdbCpu *cpu = &gdb_cpus[emu->cpu_id];
+    pthread_mutex_lock(&gdb_lock);
+    if (cpu->step == STEP_PENDING)
+    {
+        cpu->step = STEP_RUNNING;
+        pthread_mutex_unlock(&gdb_lock);
+        return 0;
+    }
+    if (cpu->step == STEP_RUNNING)
+    {
+        cpu->step = STEP_NONE;
+        if (!cpu->continue_after)
+            stop_all(emu->cpu_id, SIGTRAP);
+        cpu->continue_after = 0;
+    }
+    clear_attention(emu, ATTENTION_DEBUG);
+    if (!stopping)
+    {
+        pthread_mutex_unlock(&gdb_lock);
+        return 0;
+    }
+    cpu->released = 0;
+    if (++stopped_count == gdb_machine->cpu_count)
+    {
+        char byte = 0;
+        if (write(stopped_pipe[1], &byte, 1) != 1)
+            panic();
+    }
+    while (!cpu->released)
+        pthread_cond_wait(&released_cond, &gdb_lock);
+    pthread_mutex_unlock(&gdb_lock);
+    return 1;
+}
+
+/* Lets the stopped vCPUs go, or only stepping cpu_id if >= 0. */
+static void resume(int cpu_id)
+{
+    int i;
+    pthread_mutex_lock(&gdb_lock);
+    stopping = 0;
+    for (i = 0; i < gdb_machine->cpu_count; i++)
+    {
+        Emulator *emu = gdb_machine->cpus[i];
+        GdbCpu *cpu = &gdb_cpus[i];
+        if (cpu_id >= 0 && i != cpu_id)
+            continue;
+        if (i == cpu_id || at_breakpoint(emu))
+        {
+            cpu->step = STEP_PENDING;
+            cpu->continue_after = i != cpu_id;
+            raise_attention(emu, ATTENTION_DEBUG);
+        }
+        cpu->released = 1;
+        stopped_count--;
+    }
+    pthread_cond_broadcast(&released_cond);
+    pthread_mutex_unlock(&gdb_lock);
+}
+
+static Emulator *selected_cpu(int cpu_id)
+{
+    return gdb_machine->cpus[cpu_id >= 0 ? cpu_id : stop_cpu];
+}
+
+/* Blocks of the page are decoded again (the vCPUs drop them at ATTENTION_CODE). */
+static void drop_code(uint32_t phys_addr)
+{
+    uint32_t page = phys_addr >> 12;
+    Emulator *emu = gdb_machine->emu;
+    uint32_t cpus = __atomic_load_n(&emu->page_info[page].code_cpus, __ATOMIC_RELAXED);
+    if (cpus != 0)
+        invalidate_remote_code(emu, page, cpus);
+}
+
+/* Physical address of RAM at linear address of emu, 0 if there is none (GDB does not hit watchpoints) */
+static int debug_address(Emulator *emu, uint32_t linear_addr, uint32_t *phys_addr)
+{
+    return peek_phys_addr(emu, linear_addr, phys_addr) && *phys_addr < emu->memory_size &&
+           (emu->page_types[*phys_addr >> 12] == PAGE_RAM || emu->page_types[*phys_addr >> 12] == PAGE_WATCH);
+}
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/* Parses hex up to a non-hex char, which is returned in end. */
+static uint32_t parse_hex(const char *p, const char **end)
+{
+    uint32_t value = 0;
+    while (hex_value(*p) >= 0)
+        value = (value << 4) | hex_value(*p++);
+    if (end != NULL)
+        *end = p;
+    return value;
+}
+
+/* 32-bit register values go in target (little endian) byte order. */
+static char *put_hex32(char *p, uint32_t value)
+{
+    int i;
+    for (i = 0; i < 4; i++)
+        p += sprintf(p, "%02x", (value >> (i * 8)) & 0xFF);
+    return p;
+}
+
+static uint32_t parse_hex32(const char *p)
+{
+    uint32_t value = 0;
+    int i;
+    for (i = 0; i < 4 && hex_value(p[0]) >= 0 && hex_value(p[1]) >= 0; i++, p += 2)
+        value |= (uint32_t)((hex_value(p[0]) << 4) | hex_value(p[1])) << (i * 8);
+    return value;
+}
+
+static uint32_t get_register(Emulator *emu, int number)
+{
+    int i;
+    if (number < REGISTERS_COUNT)
+        return emu->registers[number];
+    if (number == GDB_EIP)
+        return emu->eip;
+    if (number == GDB_EFLAGS)
+        return get_eflags(emu);
+    for (i = 0; i < SEGMENT_REGISTERS_COUNT; i++)
+    {
+        if (segment_numbers[i] == number)
+            return emu->segment_registers[i];
+    }
+    return 0;
+}
+
+static void set_register(Emulator *emu, int number, uint32_t value)
+{
+    int i;
+    if (number < REGISTERS_COUNT)
+        emu->registers[number] = value;
+    else if (number == GDB_EIP)
+        emu->eip = value;
+    else if (number == GDB_EFLAGS)
+        set_eflags(emu, value);
+    for (i = 0; i < SEGMENT_REGISTERS_COUNT; i++)
+    {
+        if (segment_numbers[i] == number)
+            set_seg_register16(emu, i, value);
+    }
+    /* The blocks it ran and the fetched bytes are of the old CS:EIP. */
+    leave_block(emu);
+    flush_fetch_window(emu);
+}
+
+static int read_byte(void)
+{
+    uint8_t byte;
+    ssize_t n;
+    do
+        n = read(client_fd, &byte, 1);
+    while (n < 0 && errno == EINTR);
+    return n == 1 ? byte : -1;
+}
+
+/* Returns 0 once GDB is gone; 0x03 (Ctrl-C) between packets is skipped here. */
+static int read_packet(char *packet)
+{
+    int c;
+    while (1)
+    {
+        do
+            c = read_byte();
+        while (c >= 0 && c != '$');
+        if (c < 0)
+            return 0;
+        int length = 0;
+        uint8_t sum = 0;
+        while ((c = read_byte()) >= 0 && c != '#')
+        {
+            if (length < GDB_PACKET_SIZE - 1)
+                packet[length++] = c;
+            sum += c;
+        }
+        int high = read_byte();
+        int low = read_byte();
+        if (c < 0 || low < 0)
+            return 0;
+        packet[length] = '\0';
+        int ok = hex_value(high) >= 0 && hex_value(low) >= 0 && ((hex_value(high) << 4) | hex_value(low)) == sum;
+        if (write(client_fd, ok ? "+" : "-", 1) != 1)
+            return 0;
+        if (ok)
+            return 1;
+    }
+}
+
+static void send_packet(const char *data)
+{
+    char frame[GDB_PACKET_SIZE + 4];
+    uint8_t sum = 0;
+    const char *p;
+    for (p = data; *p != '\0'; p++)
+        sum += *p;
+    int length = snprintf(frame, sizeof(frame), "$%s#%02x", data, sum);
+    do
+    {
+        if (write(client_fd, frame, length) != length)
+            return;
+    } while (read_byte() == '-');
+}
+
+static void send_stop_reply(void)
+{
+    static const char *watch_names[] = {[WATCH_WRITE] = "watch", [WATCH_READ] = "rwatch", [WATCH_ACCESS] = "awatch"};
+    char reply[64];
+    int length = snprintf(reply, sizeof(reply), "T%02xthread:%x;", stop_signal, stop_cpu + 1);
+    if (stop_watch != 0)
+        snprintf(reply + length, sizeof(reply) - length, "%s:%x;", watch_names[stop_watch], stop_watch_addr);
+    send_packet(reply);
+}
+
+/* Until every vCPU stopped; Ctrl-C from GDB stops them. Returns 0 if GDB is gone. */
+static int wait_stopped(void)
+{
+    struct pollfd fds[2] = {{stopped_pipe[0], POLLIN, 0}, {client_fd, POLLIN, 0}};
+    while (1)
+    {
+        if (poll(fds, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return 0;
+        }
+        if (fds[0].revents & POLLIN)
+        {
+            char byte;
+            if (read(stopped_pipe[0], &byte, 1) != 1)
+                return 0;
+            return 1;
+        }
+        if (fds[1].revents & (POLLIN | POLLHUP | POLLERR))
+        {
+            int c = read_byte();
+            if (c < 0)
+                return 0;
+            if (c == 0x03)
+            {
+                pthread_mutex_lock(&gdb_lock);
+                stop_all(general_cpu >= 0 ? general_cpu : 0, SIGINT);
+                pthread_mutex_unlock(&gdb_lock);
+            }
+        }
+    }
+}
+
+/* When GDB left: with every vCPU stopped, its breakpoints can go. */
+static void stop_and_wait(void)
+{
+    char byte;
+    pthread_mutex_lock(&gdb_lock);
+    stop_all(0, SIGTRAP);
+    pthread_mutex_unlock(&gdb_lock);
+    if (read(stopped_pipe[0], &byte, 1) != 1)
+        panic();
+}
+
+/* Reply to m: up to the first byte which is not RAM, E14 if that is the first one */
+static void read_memory(Emulator *emu, const char *args, char *reply)
+{
+    const char *p;
+    uint32_t address = parse_hex(args, &p);
+    uint32_t length = parse_hex(p + 1, NULL);
+    uint32_t i, phys_addr;
+    char *out = reply;
+    if (length > (GDB_PACKET_SIZE - 1) / 2)
+        length = (GDB_PACKET_SIZE - 1) / 2;
+    for (i = 0; i < length && debug_address(emu, address + i, &phys_addr); i++)
+        out += sprintf(out, "%02x", emu->memory[phys_addr]);
+    if (i == 0 && length > 0)
+        strcpy(reply, "E14");
+}
+
+static void write_memory(Emulator *emu, const char *args, char *reply)
+{
+    const char *p;
+    uint32_t address = parse_hex(args, &p);
+    uint32_t length = parse_hex(p + 1, &p);
+    uint32_t i, phys_addr;
+    if (*p != ':')
+    {
+        strcpy(reply, "E01");
+        return;
+    }
+    p++;
+    for (i = 0; i < length; i++, p += 2)
+    {
+        if (hex_value(p[0]) < 0 || hex_value(p[1]) < 0 || !debug_address(emu, address + i, &phys_addr))
+        {
+            strcpy(reply, "E14");
+            return;
+        }
+        emu->memory[phys_addr] = (hex_value(p[0]) << 4) | hex_value(p[1]);
+        emu->page_info[phys_addr >> 12].generation++;
+        drop_code(phys_addr);
+    }
+    strcpy(reply, "OK");
+}
+
+/* Z0, Z1 (hardware breakpoints are the same here) and z0, z1 */
+static void set_breakpoint(Emulator *emu, const char *packet, char *reply)
+{
+    int insert = packet[0] == 'Z';
+    uint32_t phys_addr;
+    int i;
+    if (packet[1] != '0' && packet[1] != '1')
+        return;
+    if (!peek_phys_addr(emu, parse_hex(packet + 3, NULL), &phys_addr))
+    {
+        strcpy(reply, "E14");
+        return;
+    }
+    for (i = 0; i < gdb_breakpoint_count && breakpoints[i] != phys_addr; i++)
+        ;
+    if (insert && i == gdb_breakpoint_count)
+    {
+        if (gdb_breakpoint_count == GDB_MAX_BREAKPOINTS)
+        {
+            strcpy(reply, "E28");
+            return;
+        }
+        breakpoints[gdb_breakpoint_count++] = phys_addr;
+    }
+    else if (!insert && i < gdb_breakpoint_count)
+    {
+        breakpoints[i] = breakpoints[--gdb_breakpoint_count];
+    }
+    drop_code(phys_addr);
+    strcpy(reply, "OK");
+}
+
+/*
+ * Adds (or removes) a watchpoint of kind on each page of the linear
+ * range; returns the bytes done, length unless a page is not mapped RAM.
+ */
+static uint32_t watch_range(Emulator *emu, uint32_t address, uint32_t length, int kind, int insert)
+{
+    uint32_t done, n, phys_addr;
+    for (done = 0; done < length; done += n)
+    {
+        n = 0x1000 - ((address + done) & 0xFFF);
+        if (n > length - done)
+            n = length - done;
+        if (!peek_phys_addr(emu, address + done, &phys_addr))
+            break;
+        if (insert ? !add_watch(emu, phys_addr, n, kind, 1, address + done) : !remove_watch(emu, phys_addr, n, kind, 1))
+            break;
+    }
+    return done;
+}
+
+/* Z2 (write), Z3 (read), Z4 (access) and z2 - z4 */
+static void set_watchpoint(Emulator *emu, const char *packet, char *reply)
+{
+    static const int kinds[] = {WATCH_WRITE, WATCH_READ, WATCH_ACCESS};
+    int insert = packet[0] == 'Z';
+    const char *p;
+    if (packet[1] < '2' || packet[1] > '4')
+        return;
+    int kind = kinds[packet[1] - '2'];
+    uint32_t address = parse_hex(packet + 3, &p);
+    uint32_t length = parse_hex(p + 1, NULL);
+    uint32_t done = watch_range(emu, address, length, kind, insert);
+    if (done < length || length == 0)
+    {
+        /* All of it or nothing */
+        if (insert)
+            watch_range(emu, address, done, kind, 0);
+        strcpy(reply, "E14");
+        return;
+    }
+    strcpy(reply, "OK");
+}
+
+/* Hg, Hc, T: thread N + 1 is vCPU N, 0 and -1 mean any */
+static int parse_thread(const char *p, int *cpu_id)
+{
+    if (p[0] == '-' || (p[0] == '0' && p[1] == '\0'))
+    {
+        *cpu_id = -1;
+        return 1;
+    }
+    uint32_t thread = parse_hex(p, NULL);
+    if (thread < 1 || thread > (uint32_t)gdb_machine->cpu_count)
+        return 0;
+    *cpu_id = thread - 1;
+    return 1;
+}
+
+static void query(const char *packet, char *reply)
+{
+    int i;
+    if (strncmp(packet, "qSupported", 10) == 0)
+        sprintf(reply, "PacketSize=%x", GDB_PACKET_SIZE);
+    else if (strcmp(packet, "qAttached") == 0)
+        strcpy(reply, "1");
+    else if (strcmp(packet, "qC") == 0)
+        sprintf(reply, "QC%x", stop_cpu + 1);
+    else if (strcmp(packet, "qfThreadInfo") == 0)
+    {
+        char *out = reply + sprintf(reply, "m1");
+        for (i = 1; i < gdb_machine->cpu_count; i++)
+            out += sprintf(out, ",%x", i + 1);
+    }
+    else if (strcmp(packet, "qsThreadInfo") == 0)
+        strcpy(reply, "l");
+}
+
+/* Runs a packet while every vCPU is stopped; returns 0 for a packet that resumed them, 2 to detach. */
+static int handle_packet(char *packet, char *reply)
+{
+    Emulator *emu = selected_cpu(general_cpu);
+    const char *p;
+    int cpu_id, i;
+    reply[0] = '\0';
+    switch (packet[0])
+    {
+    case '?':
+        send_stop_reply();
+        return 1;
+    case 'g':
+        p = reply;
+        for (i = 0; i < GDB_REGISTERS; i++)
+            p = put_hex32((char *)p, get_register(emu, i));
+        break;
+    case 'G':
+        for (i = 0; i < GDB_REGISTERS && strlen(packet + 1) >= (size_t)(i + 1) * 8; i++)
+            set_register(emu, i, parse_hex32(packet + 1 + i * 8));
+        strcpy(reply, "OK");
+        break;
+    case 'p':
+        i = parse_hex(packet + 1, NULL);
+        if (i < GDB_REGISTERS)
+            put_hex32(reply, get_register(emu, i));
+        else
+            strcpy(reply, "E45");
+        break;
+    case 'P':
+        i = parse_hex(packet + 1, &p);
+        if (i < GDB_REGISTERS && *p == '=')
+        {
+            set_register(emu, i, parse_hex32(p + 1));
+            strcpy(reply, "OK");
+        }
+        else
+            strcpy(reply, "E45");
+        break;
+    case 'm':
+        read_memory(emu, packet + 1, reply);
+        break;
+    case 'M':
+        write_memory(emu, packet + 1, reply);
+        break;
+    case 'c':
+    case 's':
+        emu = selected_cpu(packet[0] == 's' ? step_cpu : general_cpu);
+        if (packet[1] != '\0')
+            set_register(emu, GDB_EIP, parse_hex(packet + 1, NULL));
+        resume(packet[0] == 's' ? emu->cpu_id : -1);
+        return 0;
+    case 'H':
+        if (!parse_thread(packet + 2, &cpu_id))
+            strcpy(reply, "E22");
+        else
+        {
+            if (packet[1] == 'g')
+                general_cpu = cpu_id;
+            else
+                step_cpu = cpu_id;
+            strcpy(reply, "OK");
+        }
+        break;
+    case 'T':
+        strcpy(reply, parse_thread(packet + 1, &cpu_id) ? "OK" : "E22");
+        break;
+    case 'Z':
+    case 'z':
+        if (packet[1] == '0' || packet[1] == '1')
+            set_breakpoint(emu, packet, reply);
+        else
+            set_watchpoint(emu, packet, reply);
+        break;
+    case 'q':
+        query(packet, reply);
+        break;
+    case 'D':
+        strcpy(reply, "OK");
+        send_packet(reply);
+        return 2;
+    case 'k':
+        normal_exit(0);
+    default:
+        break;
+    }
+    send_packet(reply);
+    return 1;
+}
+
+/* Without GDB the guest runs on as if it was never attached. */
+static void detach(void)
+{
+    while (gdb_breakpoint_count > 0)
+        drop_code(breakpoints[--gdb_breakpoint_count]);
+    remove_gdb_watches(gdb_machine->emu);
+    close(client_fd);
+    client_fd = -1;
+    resume(-1);
+}
+
+static void *gdb_loop(void *arg)
+{
+    static char packet[GDB_PACKET_SIZE];
+    static char reply[GDB_PACKET_SIZE];
+    printf("GDB connected.\n");
+    if (!wait_stopped())
+    {
+        stop_and_wait();
+        detach();
+        return NULL;
+    }
+    while (read_packet(packet))
+    {
+        int result = handle_packet(packet, reply);
+        if (result == 2)
+            break;
+        if (result == 0)
+        {
+            if (!wait_stopped())
+            {
+                stop_and_wait();
+                break;
+            }
+            send_stop_reply();
+        }
+    }
+    printf("GDB detached.\n");
+    detach();
+    return NULL;
+}
+
+static int listen_tcp(const char *address)
+{
+    char host[256];
+    const char *colon = strrchr(address, ':');
+    const char *port = colon != NULL ? colon + 1 : address;
+    size_t host_length = colon != NULL ? (size_t)(colon - address) : 0;
+    struct addrinfo hints, *result;
+    int fd = -1, one = 1;
+    if (host_length >= sizeof(host))
+        return -1;
+    memcpy(host, address, host_length);
+    host[host_length] = '\0';
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host_length > 0 ? host : "127.0.0.1", port, &hints, &result) != 0)
+        return -1;
+    fd = socket(result->ai_family, result->ai_socktype, 0);
+    if (fd >= 0)
+    {
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, result->ai_addr, result->ai_addrlen) < 0 || listen(fd, 1) < 0)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(result);
+    return fd;
+}
+
+int init_gdb(Machine *machine, const char *address)
+{
+    int i;
+    pthread_t thread;
+    int listen_fd = listen_tcp(address);
+    if (listen_fd < 0)
+    {
+        printf("Could not listen on: %s\n", address);
+        return 0;
+    }
+    printf("Waiting for GDB on %s\n", address);
+    client_fd = accept(listen_fd, NULL, NULL);
+    close(listen_fd);
+    if (client_fd < 0 || pipe(stopped_pipe) < 0)
+    {
+        printf("GDB could not connect: %s\n", strerror(errno));
+        return 0;
+    }
+    gdb_machine = machine;
+    /* Stopped before the first instruction */
+    pthread_mutex_lock(&gdb_lock);
+    for (i = 0; i < machine->cpu_count; i++)
+        memset(&gdb_cpus[i], 0, sizeof(GdbCpu));
+    stop_all(0, SIGTRAP);
+    pthread_mutex_unlock(&gdb_lock);
+    pthread_create(&thread, NULL, gdb_loop, NULL);
+    pthread_detach(thread);
+    return 1;
+}
@@ -0,0 +1,48 @@
+#ifndef GDB_H_
+#define GDB_H_
+
+#include <stdint.h>
+
+#include "emulator.h"
+
+/*
+ * GDB remote stub (-gdb [host]:port)
+ * Serves one GDB over TCP (target remote host:port, host defaults to
+ * 127.0.0.1). It supports registers, memory, continue, single-step,
+ * Ctrl-C, breakpoints (Z0, Z1) and watchpoints (Z2 - Z4, watch.h), and
+ * shows each vCPU as a thread.
+ * The machine waits for GDB before its first instruction, and all vCPUs
+ * stop (ATTENTION_DEBUG) while GDB looks at them; s steps only the Hc
+ * thread.
+ * A breakpoint is kept by physical address, translated with the paging
+ * of the selected vCPU when it is set. Blocks are decoded up to a
+ * breakpoint, never across it. So only the interpreter checks for
+ * breakpoints, for ops not from the block cache, and only while some are
+ * set. Setting or removing one drops the decoded blocks of its page
+ * (ATTENTION_CODE). An attached GDB costs nothing while the guest runs.
+ */
+#define GDB_MAX_BREAKPOINTS 64
+#define GDB_PACKET_SIZE 4096
+
+/* Breakpoints set, only changed while every vCPU is stopped */
+extern int gdb_breakpoint_count;
+
+/* Waits for GDB on address and stops every vCPU of machine for it; returns 0 on failure. */
+int init_gdb(Machine *machine, const char *address);
+/* 1 if a breakpoint is set at phys_addr */
+int gdb_breakpoint_at(uint32_t phys_addr);
+/*
+ * Before an op the interpreter decodes (not from the block cache), while
+ * breakpoints are set: returns 1 if the vCPU is to stop at CS:EIP.
+ */
+int gdb_check_breakpoint(Emulator *emu);
+/* A watchpoint GDB set was hit at linear_addr: stops the vCPUs once the op is done. */
+void gdb_watch_hit(Emulator *emu, int kind, uint32_t linear_addr);
+/*
+ * At ATTENTION_DEBUG: stops the vCPU if GDB asks for it or a single
+ * step is done. Returns 1 if it was stopped, since GDB may have
+ * changed its state and raised other attention bits.
+ */
+int gdb_attention(Emulator *emu);
+
+#endif
@@ -5,9 +5,14 @@
 #include <sys/types.h>
 
 #include "gdt.h"
+#include "stats.h"
+#include "bench.h"
 #include "emulator_functions.h"
 #include "emulator.h"
 #include "util.h"
+#include "block_cache.h"
+#include "paging.h"
+#include "interrupt.h"
 
 /*
  * GDTR:
@@ -80,8 +85,8 @@
 void lgdt(Emulator *emu, ModRM *modrm)
 {
     uint32_t address = calc_memory_address(emu, modrm);
-    uint16_t limit = get_memory16(emu, DS, address);
-    uint32_t base = get_memory32(emu, DS, address + 2);
+    uint16_t limit = get_memory16(emu, emu->prefixes.segment, address);
+    uint32_t base = get_memory32(emu, emu->prefixes.segment, address + 2);
     set_gdtr(emu, limit, get_physical_address(emu, DS, base, 0));
 }
 
@@ -93,7 +98,13 @@ void check_protected_mode_entry(Emulator *emu)
     uint16_t gdt_index = get_seg_register16(emu, CS) >> 3;
     uint16_t gdt_entry_count = (emu->gdtr.limit + 1) / 8;
     if (cr0_pe && gdt_index != 0 && gdt_entry_count > gdt_index)
+    {
         emu->is_pe = 1;
+        /* Other segment registers keep their real mode caches until reloaded. */
+        load_segment_cache(emu, CS);
+        if (config.bench)
+            bench_milestone(emu, BENCH_PROTECTED_MODE);
+    }
 }
 
 static void gdt_access_error(char *msg, Emulator *emu)
@@ -102,31 +113,6 @@ static void gdt_access_error(char *msg, Emulator *emu)
     panic_exit(emu);
 }
 
-static void check_entry_access(Emulator *emu, uint8_t access_byte, uint8_t cpl, uint8_t write, uint8_t exec)
-{
-    if (write)
-    {
-        uint8_t rw = access_byte & 2;
-        if (!rw)
-        {
-            gdt_access_error("not writable", emu);
-        }
-    }
-    if (exec)
-    {
-        uint8_t d_exec = access_byte & 8;
-        if (!d_exec)
-        {
-            gdt_access_error("not executable", emu);
-        }
-    }
-    uint8_t dpl = (access_byte >> 5) & 3;
-    if (dpl < cpl)
-    {
-        gdt_access_error("entry privilege not met", emu);
-    }
-}
-
 uint32_t read_gdt_entry_base(uint32_t entry1, uint32_t entry2)
 {
     uint32_t base_low = (entry1 >> 16);
@@ -135,62 +121,132 @@ uint32_t read_gdt_entry_base(uint32_t entry1, uint32_t entry2)
     return base_low | (base_mid << 16) | (base_high << 24);
 }
 
-static void check_entry_limit(Emulator *emu, uint32_t entry1, uint32_t entry2, uint32_t offset)
+static uint32_t read_gdt_entry_limit(uint32_t entry1, uint32_t entry2)
 {
-    /* If paging is on, limit is most likely set to max. */
-    if (emu->is_pg)
-    {
-        return;
-    }
     uint32_t limit_low = entry1 & 0xFFFF;
     uint32_t limit_high = (entry2 >> 16) & 0xF;
     uint32_t limit = limit_low | (limit_high << 16);
 
     uint8_t flags = (entry2 >> 20) & 0xF;
     uint8_t g = flags & 8;
+    /* Granularity: limit counts 4KB blocks. */
     if (g)
+        return (limit << 12) | 0xFFF;
+    return limit;
+}
+
+/*
+ * Fills the hidden part of a segment register (descriptor cache)
+ * from the selector currently loaded.
+ * Real mode: base is selector * 16 with no limit and no access checks.
+ * Protected mode: the GDT entry is read once here, and translations
+ * only use what is cached until the register is loaded again.
+ */
+static void fill_segment_cache(Emulator *emu, int seg_index)
+{
+    SegmentCache *cache = &emu->segment_caches[seg_index];
+    uint16_t seg_val = emu->segment_registers[seg_index];
+
+    if (seg_index == CS)
     {
-        uint64_t limit_val = limit * (2 ^ 12);
-        if ((uint64_t)offset > limit_val)
-        {
-            gdt_access_error("beyond entry limit", emu);
-        }
+        flush_fetch_window(emu);
+        leave_block(emu);
     }
-    else
+    if (seg_index == SS)
+        flush_stack_window(emu);
+
+    if (!emu->is_pe)
     {
-        if (offset > limit)
-        {
-            gdt_access_error("beyond entry limit", emu);
-        }
+        cache->base = ((uint32_t)seg_val) << 4;
+        cache->limit = 0xFFFFFFFF;
+        cache->access = 0x9A;
+        cache->dpl = 0;
+        cache->rpl = 0;
+        return;
     }
-}
 
-uint32_t get_linear_addr(Emulator *emu, uint16_t seg_val, uint32_t offset, uint8_t write, uint8_t exec)
-{
     int entry_index = seg_val >> 3;
     uint8_t ti = seg_val & (1 << 2);
-    uint8_t cpl = seg_val & 3;
+    cache->rpl = seg_val & 3;
     if (ti)
     {
-        /* LGT */
-        return 0;
+        /* LDT is not supported. */
+        cache->base = 0;
+        cache->limit = 0xFFFFFFFF;
+        cache->access = 0x9A;
+        cache->dpl = 3;
+        return;
+    }
+    /* GDT */
+    STAT_INC(stats.gdt_reads);
+    uint32_t entry_addr = emu->gdtr.base + (entry_index * 8);
+    if (entry_addr > (emu->gdtr.base + emu->gdtr.limit + 1))
+    {
+        gdt_access_error("beyond table limit", emu);
     }
-    else
+    uint32_t entry1 = _get_memory32(emu, entry_addr);
+    uint32_t entry2 = _get_memory32(emu, entry_addr + 4);
+    cache->base = read_gdt_entry_base(entry1, entry2);
+    cache->limit = read_gdt_entry_limit(entry1, entry2);
+    cache->access = (entry2 >> 8) & 0xFF;
+    cache->dpl = (cache->access >> 5) & 3;
+}
+
+void load_segment_cache(Emulator *emu, int seg_index)
+{
+    uint32_t cs_base = emu->segment_caches[CS].base;
+    uint8_t cs_rpl = emu->segment_caches[CS].rpl;
+    uint16_t cs_flat = emu->flat_segments & (1 << CS);
+    fill_segment_cache(emu, seg_index);
+    update_translation(emu);
+    /* Chained blocks skip translating CS:EIP, which a flat CS at the same base and CPL keeps. */
+    if (seg_index == CS && (emu->segment_caches[CS].base != cs_base || emu->segment_caches[CS].rpl != cs_rpl ||
+                            !cs_flat || !(emu->flat_segments & (1 << CS))))
+        unchain_blocks(emu);
+}
+
+/* Raises #SS for accesses through SS and #GP for the others, with error code 0. */
+static void segment_fault(Emulator *emu, int seg_index)
+{
+    raise_exception(emu, seg_index == SS ? T_STACK : T_GPFLT, 0);
+}
+
+uint32_t get_linear_addr(Emulator *emu, int seg_index, uint32_t offset, uint8_t write, uint8_t exec)
+{
+    SegmentCache *cache = &emu->segment_caches[seg_index];
+    /* Not writable, not executable, entry privilege not met, beyond entry limit */
+    if ((write && !(cache->access & 2)) || (exec && !(cache->access & 8)) || cache->dpl < cache->rpl ||
+        offset > cache->limit)
     {
-        /* GDT */
-        uint32_t entry_addr = emu->gdtr.base + (entry_index * 8);
-        if (entry_addr > (emu->gdtr.base + emu->gdtr.limit + 1))
-        {
-            gdt_access_error("beyond table limit", emu);
-        }
-        uint32_t entry1 = _get_memory32(emu, entry_addr);
-        uint32_t entry2 = _get_memory32(emu, entry_addr + 4);
-        uint8_t access_byte = (entry2 >> 8) & 0xFF;
-        check_entry_access(emu, access_byte, cpl, write, exec);
-
-        uint32_t base = read_gdt_entry_base(entry1, entry2);
-        check_entry_limit(emu, entry1, entry2, offset);
-
-        return base + offset;
+        segment_fault(emu, seg_index);
     }
+    return cache->base + offset;
+}
+
+/*
+ * Does what a bootloader does before jumping to a 32-bit kernel:
+ * writes a flat GDT (null, code 0x08, data 0x10, all 4GB from 0) at
+ * address, loads GDTR, sets CR0.PE and reloads the segment registers.
+ * FS and GS get the null selector.
+ */
+void enter_flat_protected_mode(Emulator *emu, uint32_t address)
+{
+    static const uint32_t gdt[6] = {
+        0x00000000, 0x00000000,
+        0x0000FFFF, 0x00CF9A00,
+        0x0000FFFF, 0x00CF9200};
+    int i;
+    for (i = 0; i < 6; i++)
+        _set_memory32(emu, address + i * 4, gdt[i]);
+    set_gdtr(emu, sizeof(gdt) - 1, address);
+    emu->control_registers[CR0] |= CR0_PE;
+    emu->is_pe = 1;
+    emu->segment_registers[CS] = 0x08;
+    emu->segment_registers[DS] = 0x10;
+    emu->segment_registers[ES] = 0x10;
+    emu->segment_registers[SS] = 0x10;
+    emu->segment_registers[FS] = 0;
+    emu->segment_registers[GS] = 0;
+    for (i = 0; i < SEGMENT_REGISTERS_COUNT; i++)
+        load_segment_cache(emu, i);
 }
@@ -11,6 +11,11 @@ void check_protected_mode_entry(Emulator *emu);
 
 uint32_t read_gdt_entry_base(uint32_t entry1, uint32_t entry2);
 
-uint32_t get_linear_addr(Emulator *emu, uint16_t seg_val, uint32_t offset, uint8_t write, uint8_t exec);
+void load_segment_cache(Emulator *emu, int seg_index);
+
+uint32_t get_linear_addr(Emulator *emu, int seg_index, uint32_t offset, uint8_t write, uint8_t exec);
+
+/* Flat 4GB code (0x08) and data (0x10) segments with a GDT at address */
+void enter_flat_protected_mode(Emulator *emu, uint32_t address);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,175 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ide_dma.h"
+#include "disk.h"
+#include "emulator_functions.h"
+#include "interrupt.h"
+#include "io.h"
+#include "ioapic.h"
+#include "machine.h"
+#include "util.h"
+
+/* Port handlers, device: the Disk */
+static uint32_t bmide_read8(Emulator *emu, void *device, uint16_t address)
+{
+    Disk *disk = device;
+    switch (address - BMIDE_BASE)
+    {
+    case BM_COMMAND:
+        return disk->bm_command;
+    case BM_STATUS:
+        return disk->bm_status;
+    default:
+        return 0;
+    }
+}
+
+static void bmide_write8(Emulator *emu, void *device, uint16_t address, uint32_t value)
+{
+    Disk *disk = device;
+    switch (address - BMIDE_BASE)
+    {
+    case BM_COMMAND:
+        disk->bm_command = value & (BM_CMD_START | BM_CMD_TO_MEMORY);
+        if (!(value & BM_CMD_START))
+            disk->bm_status &= ~BM_STATUS_ACTIVE;
+        start_dma(emu);
+        break;
+    case BM_STATUS:
+        /* Error and interrupt are write 1 to clear, drive bits are kept. */
+        disk->bm_status &= ~(value & (BM_STATUS_ERROR | BM_STATUS_INTERRUPT));
+        disk->bm_status = (disk->bm_status & ~0x60) | (value & 0x60);
+        break;
+    default:
+        break;
+    }
+}
+
+static uint32_t bmide_read32(Emulator *emu, void *device, uint16_t address)
+{
+    Disk *disk = device;
+    if (address - BMIDE_BASE == BM_PRDT)
+        return disk->bm_prdt;
+    return bmide_read8(emu, device, address);
+}
+
+static void bmide_write32(Emulator *emu, void *device, uint16_t address, uint32_t value)
+{
+    Disk *disk = device;
+    if (address - BMIDE_BASE == BM_PRDT)
+        disk->bm_prdt = value & ~3u;
+    else
+        bmide_write8(emu, device, address, value);
+}
+
+void register_bmide_ports(Machine *machine, Disk *disk)
+{
+    register_io_ports(machine->io, BMIDE_BASE, BMIDE_SIZE, 1, bmide_read8, bmide_write8, disk);
+    register_io_ports(machine->io, BMIDE_BASE, BMIDE_SIZE, 4, bmide_read32, bmide_write32, disk);
+}
+
+/*
+ * Copies one region of a PRD between guest RAM and the transfer buffer,
+ * page by page. Returns 0 if it is not RAM (the transfer ends with error).
+ */
+static int transfer_region(Emulator *emu, uint32_t p_address, uint32_t len, int to_memory)
+{
+    Disk *disk = emu->disk;
+    while (len > 0)
+    {
+        uint32_t n = 0x1000 - (p_address & 0xFFF);
+        if (n > len)
+            n = len;
+        if (p_address >= emu->memory_size)
+            return 0;
+        /* DMA does not hit watchpoints. */
+        uint8_t type = emu->page_types[p_address >> 12];
+        if (type != PAGE_RAM && type != PAGE_WATCH)
+            return 0;
+        uint8_t *buffer = disk->transfer + (disk->head_index - disk->transfer_start);
+        if (to_memory)
+        {
+            page_written(emu, p_address, n);
+            memcpy(emu->memory + p_address, buffer, n);
+        }
+        else
+        {
+            memcpy(buffer, emu->memory + p_address, n);
+        }
+        disk->head_index += n;
+        p_address += n;
+        len -= n;
+    }
+    return 1;
+}
+
+/* Ends the bus master transfer with IRQ 14. */
+static void end_dma(Emulator *emu, int ok)
+{
+    Disk *disk = emu->disk;
+    disk->dma_command = 0;
+    disk->bm_status &= ~BM_STATUS_ACTIVE;
+    disk->bm_status |= BM_STATUS_INTERRUPT;
+    if (!ok)
+    {
+        disk->bm_status |= BM_STATUS_ERROR;
+        if (config.verbose)
+            printf("IDE DMA failed, PRDT %08X.\n", disk->bm_prdt);
+    }
+    ioapic_int_to_lapic(emu->machine->ioapic, IRQ_IDE);
+}
+
+/*
+ * Sectors of READ DMA are in the transfer buffer once the drive is not
+ * BSY, so they are copied then; WRITE DMA copies guest memory into the
+ * buffer and hands it to the I/O worker.
+ */
+void start_dma(Emulator *emu)
+{
+    Disk *disk = emu->disk;
+    if (disk == NULL || disk->dma_command == 0 || !(disk->bm_command & BM_CMD_START))
+        return;
+    disk->bm_status |= BM_STATUS_ACTIVE;
+    if (disk->busy)
+        return;
+
+    int to_memory = (disk->bm_command & BM_CMD_TO_MEMORY) != 0;
+    uint32_t prd = disk->bm_prdt;
+    int ok = to_memory == (disk->dma_command == ATA_READ_DMA);
+    while (ok && disk->head_index < disk->transfer_end)
+    {
+        uint32_t address = _get_memory32(emu, prd);
+        uint32_t info = _get_memory32(emu, prd + 4);
+        uint32_t len = info & 0xFFFF;
+        if (len == 0)
+            len = 0x10000;
+        if (len > disk->transfer_end - disk->head_index)
+            len = disk->transfer_end - disk->head_index;
+        ok = transfer_region(emu, address, len, to_memory);
+        if (info & 0x80000000)
+            break;
+        prd += 8;
+    }
+    if (ok && !to_memory)
+    {
+        /* Ends when the worker has stored the sectors. */
+        queue_disk_job(disk, DISK_JOB_WRITE);
+        return;
+    }
+    end_dma(emu, ok);
+}
+
+void complete_disk_command(Emulator *emu)
+{
+    Disk *disk = emu->disk;
+    if (disk == NULL || !finish_disk_job(disk))
+        return;
+    if (disk->dma_command == ATA_READ_DMA)
+        start_dma(emu);
+    else if (disk->dma_command == ATA_WRITE_DMA)
+        end_dma(emu, 1);
+    else
+        ioapic_int_to_lapic(emu->machine->ioapic, IRQ_IDE);
+}
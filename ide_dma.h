@@ -0,0 +1,53 @@
+#ifndef IDE_DMA_H_
+#define IDE_DMA_H_
+
+#include <stdint.h>
+
+#include "emulator.h"
+
+/*
+ * <IDE Bus Master (primary channel)>
+ * Ports from BAR4 of the IDE controller (see pci.h)
+ * | +0     | R/W | Command: bit 0: start, bit 3: 1 = device to memory  |
+ * | +2     | R/W | Status: bit 0: active, bit 1: error, bit 2: interrupt |
+ * |        |     | (bits 1, 2 are cleared by writing 1)                  |
+ * | +4 - 7 | R/W | PRDT: physical address of the PRD table               |
+ *
+ * PRD (Physical Region Descriptor): 8 bytes, dword aligned
+ * | 0 - 3 | physical address of the region           |
+ * | 4 - 5 | byte count (0 means 64KB)                |
+ * | 6 - 7 | bit 15: EOT (last entry of the table)     |
+ *
+ * The guest issues READ DMA (C8) or WRITE DMA (CA) to the drive, then
+ * sets start. Sectors move straight between the drive's transfer buffer
+ * and guest memory, the I/O worker reads or stores them, and the
+ * transfer ends with IRQ 14.
+ */
+#define BMIDE_BASE 0xC000
+#define BMIDE_SIZE 16
+
+#define BM_COMMAND 0x0
+#define BM_STATUS 0x2
+#define BM_PRDT 0x4
+
+#define BM_CMD_START 0x01
+#define BM_CMD_TO_MEMORY 0x08
+
+#define BM_STATUS_ACTIVE 0x01
+#define BM_STATUS_ERROR 0x02
+#define BM_STATUS_INTERRUPT 0x04
+/* Drive 0 DMA capable */
+#define BM_STATUS_DRIVE0 0x20
+
+void register_bmide_ports(Machine *machine, Disk *disk);
+
+/* Runs the transfer if both the drive command and start are there. */
+void start_dma(Emulator *emu);
+
+/*
+ * Completes the disk command whose I/O job is done (ATTENTION_DISK):
+ * clears BSY, ends a DMA transfer and raises IRQ 14.
+ */
+void complete_disk_command(Emulator *emu);
+
+#endif
@@ -86,6 +86,7 @@ void push_imm8(Emulator *emu);
 void imul_r32_rm32_imm8(Emulator *emu);
 void imul_r32_rm32_imm32(Emulator *emu);
 void ins_m32_dx(Emulator *emu);
+void outs_dx_m32(Emulator *emu);
 
 /* 0x70 */
 void jo(Emulator *emu);
@@ -107,15 +108,12 @@ void jg(Emulator *emu);
 void code_80(Emulator *emu);
 void code_81(Emulator *emu);
 void code_83(Emulator *emu);
-void code_83_rm16(Emulator *emu);
 void test_rm8_r8(Emulator *emu);
-void test_rm16_r16(Emulator *emu);
 void test_rm32_r32(Emulator *emu);
 void xchg_rm8_r8(Emulator *emu);
 void xchg_rm32_r32(Emulator *emu);
 void mov_rm8_r8(Emulator *emu);
 void mov_rm32_r32(Emulator *emu);
-void mov_rm16_r16(Emulator *emu);
 void mov_r8_rm8(Emulator *emu);
 void mov_r32_rm32(Emulator *emu);
 void mov_rm32_seg(Emulator *emu);
@@ -125,7 +123,6 @@ void pop_rm32(Emulator *emu);
 
 /* 0x90 */
 void xchg_r32_r32(Emulator *emu);
-void xchg_r16_r16(Emulator *emu);
 void cwde(Emulator *emu);
 void cdq(Emulator *emu);
 void ptr_call(Emulator *emu);
@@ -138,7 +135,6 @@ void lahf(Emulator *emu);
 void mov_al_moffs8(Emulator *emu);
 void mov_eax_moffs32(Emulator *emu);
 void mov_moffs8_al(Emulator *emu);
-void mov_moffs16_ax(Emulator *emu);
 void mov_moffs32_eax(Emulator *emu);
 void movsb(Emulator *emu);
 void movsd(Emulator *emu);
@@ -156,7 +152,6 @@ void scasd(Emulator *emu);
 /* 0xB0 */
 void mov_r8_imm8(Emulator *emu);
 void mov_r32_imm32(Emulator *emu);
-void mov_r16_imm16(Emulator *emu);
 
 /* 0xC0 */
 void code_c0(Emulator *emu);
@@ -165,7 +160,6 @@ void ret(Emulator *emu);
 void les(Emulator *emu);
 void lds(Emulator *emu);
 void mov_rm8_imm8(Emulator *emu);
-void mov_rm16_imm16(Emulator *emu);
 void mov_rm32_imm32(Emulator *emu);
 void leave(Emulator *emu);
 void ret_far(Emulator *emu);
@@ -188,6 +182,8 @@ void in_al_imm8(Emulator *emu);
 void in_eax_imm8(Emulator *emu);
 void out_imm8_al(Emulator *emu);
 void out_imm8_eax(Emulator *emu);
+void in_ax_imm8(Emulator *emu);
+void out_imm8_ax(Emulator *emu);
 void call_rel32(Emulator *emu);
 void near_jump(Emulator *emu);
 void ptr_jump(Emulator *emu);
@@ -196,8 +192,11 @@ void in_al_dx(Emulator *emu);
 void in_eax_dx(Emulator *emu);
 void out_dx_al(Emulator *emu);
 void out_dx_eax(Emulator *emu);
+void in_ax_dx(Emulator *emu);
+void out_dx_ax(Emulator *emu);
 
 /* 0xF0 */
+void hlt(Emulator *emu);
 void cmc(Emulator *emu);
 void code_f6(Emulator *emu);
 void code_f7(Emulator *emu);
@@ -244,5 +243,9 @@ void movzx_r32_rm8(Emulator *emu);
 void movzx_r32_rm16(Emulator *emu);
 void movsx_r32_rm8(Emulator *emu);
 void movsx_r32_rm16(Emulator *emu);
+void cmpxchg_rm32_r32(Emulator *emu);
+
+/* 0x0FC0 */
+void xadd_rm32_r32(Emulator *emu);
 
 #endif
\ No newline at end of file
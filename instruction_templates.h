@@ -0,0 +1,356 @@
+#ifndef INSTRUCTION_TEMPLATES_H_
+#define INSTRUCTION_TEMPLATES_H_
+
+#include <stdint.h>
+
+#include "emulator.h"
+#include "emulator_functions.h"
+#include "modrm.h"
+
+/*
+ * Width-generic instruction handlers
+ * Each DEFINE_* macro expands to the static handler of one op with
+ * operands of W (16 or 32) bits, named by the caller. The accessors are
+ * picked by pasting W (uint##W##_t, get_rm##W, get_register##W,
+ * get_code##W, push##W ...) and the flag updaters and wide result types
+ * below; the semantics match the 32-bit handlers of instructions_XX.c.
+ * instructions_16.c instantiates the 16-bit table (66 prefix) from them.
+ * Handlers are entered with EIP at the op, past any prefix.
+ */
+
+/* Result width keeping the carry */
+#define WIDE_16 uint32_t
+#define WIDE_32 uint64_t
+
+#define UPDATE_ADD_16 update_eflags_add_16bit
+#define UPDATE_ADD_32 update_eflags_add
+#define UPDATE_SUB_16 update_eflags_sub_16bit
+#define UPDATE_SUB_32 update_eflags_sub
+#define UPDATE_LOGIC_16 update_eflags_logical_ops_16bit
+#define UPDATE_LOGIC_32 update_eflags_logical_ops
+
+/*
+ * op_<name>##W(emu, a, b): ALU operations updating the flags
+ * adc and sbb add the carry to b as the 32-bit handlers do.
+ */
+#define DEFINE_ALU_OPS(W)                                                                     \
+    static inline uint##W##_t op_add##W(Emulator *emu, uint##W##_t a, uint##W##_t b)           \
+    {                                                                                          \
+        WIDE_##W result = (WIDE_##W)a + b;                                                     \
+        UPDATE_ADD_##W(emu, a, b, result);                                                     \
+        return result;                                                                         \
+    }                                                                                          \
+    static inline uint##W##_t op_or##W(Emulator *emu, uint##W##_t a, uint##W##_t b)            \
+    {                                                                                          \
+        uint##W##_t result = a | b;                                                            \
+        UPDATE_LOGIC_##W(emu, result);                                                         \
+        return result;                                                                         \
+    }                                                                                          \
+    static inline uint##W##_t op_adc##W(Emulator *emu, uint##W##_t a, uint##W##_t b)           \
+    {                                                                                          \
+        return op_add##W(emu, a, b + is_carry(emu));                                           \
+    }                                                                                          \
+    static inline uint##W##_t op_sub##W(Emulator *emu, uint##W##_t a, uint##W##_t b)           \
+    {                                                                                          \
+        WIDE_##W result = (WIDE_##W)a - b;                                                     \
+        UPDATE_SUB_##W(emu, a, b, result);                                                     \
+        return result;                                                                         \
+    }                                                                                          \
+    static inline uint##W##_t op_sbb##W(Emulator *emu, uint##W##_t a, uint##W##_t b)           \
+    {                                                                                          \
+        return op_sub##W(emu, a, b + is_carry(emu));                                           \
+    }                                                                                          \
+    static inline uint##W##_t op_and##W(Emulator *emu, uint##W##_t a, uint##W##_t b)           \
+    {                                                                                          \
+        uint##W##_t result = a & b;                                                            \
+        UPDATE_LOGIC_##W(emu, result);                                                         \
+        return result;                                                                         \
+    }                                                                                          \
+    static inline uint##W##_t op_xor##W(Emulator *emu, uint##W##_t a, uint##W##_t b)           \
+    {                                                                                          \
+        uint##W##_t result = a ^ b;                                                            \
+        UPDATE_LOGIC_##W(emu, result);                                                         \
+        return result;                                                                         \
+    }                                                                                          \
+    static inline uint##W##_t op_mov##W(Emulator *emu, uint##W##_t a, uint##W##_t b)           \
+    {                                                                                          \
+        return b;                                                                              \
+    }                                                                                          \
+    /* By REG of ModR/M in the 80 - 83 groups; cmp is sub without the store. */                \
+    static uint##W##_t (*const alu_ops##W[8])(Emulator *, uint##W##_t, uint##W##_t) = {       \
+        op_add##W, op_or##W, op_adc##W, op_sbb##W, op_and##W, op_sub##W, op_xor##W, op_sub##W};
+
+/* op rm r (01, 09 ... 39, 85, 89): result to rm unless store is 0 (cmp, test) */
+#define DEFINE_RM_R(W, name, fn, store)                                            \
+    static void name(Emulator *emu)                                                \
+    {                                                                              \
+        emu->eip += 1;                                                             \
+        ModRM modrm = create_modrm();                                              \
+        parse_modrm(emu, &modrm);                                                  \
+        uint##W##_t result = fn(emu, get_rm##W(emu, &modrm), get_r##W(emu, &modrm)); \
+        if (store)                                                                 \
+            set_rm##W(emu, &modrm, result);                                        \
+    }
+
+/* op r rm (03, 0B ... 3B, 8B): result to r unless store is 0 (cmp) */
+#define DEFINE_R_RM(W, name, fn, store)                                            \
+    static void name(Emulator *emu)                                                \
+    {                                                                              \
+        emu->eip += 1;                                                             \
+        ModRM modrm = create_modrm();                                              \
+        parse_modrm(emu, &modrm);                                                  \
+        uint##W##_t result = fn(emu, get_r##W(emu, &modrm), get_rm##W(emu, &modrm)); \
+        if (store)                                                                 \
+            set_r##W(emu, &modrm, result);                                         \
+    }
+
+/* op eAX imm (05, 0D ... 3D, A9): result to eAX unless store is 0 (cmp, test) */
+#define DEFINE_A_IMM(W, name, fn, store)                                           \
+    static void name(Emulator *emu)                                                \
+    {                                                                              \
+        uint##W##_t result = fn(emu, get_register##W(emu, EAX), get_code##W(emu, 1)); \
+        if (store)                                                                 \
+            set_register##W(emu, EAX, result);                                     \
+        emu->eip += 1 + W / 8;                                                     \
+    }
+
+/*
+ * 81 (imm of W bits) and 83 (imm8 sign-extended) by REG of ModR/M:
+ * add, or, adc, sbb, and, sub, xor, cmp
+ */
+#define DEFINE_GROUP_IMM(W, name, imm8)                                            \
+    static void name(Emulator *emu)                                                \
+    {                                                                              \
+        emu->eip += 1;                                                             \
+        ModRM modrm = create_modrm();                                              \
+        parse_modrm(emu, &modrm);                                                  \
+        uint##W##_t imm = imm8 ? (uint##W##_t)(int##W##_t)get_sign_code8(emu, 0)   \
+                               : get_code##W(emu, 0);                              \
+        emu->eip += imm8 ? 1 : W / 8;                                              \
+        uint##W##_t result = alu_ops##W[modrm.opcode](emu, get_rm##W(emu, &modrm), imm); \
+        if (modrm.opcode != 7)                                                     \
+            set_rm##W(emu, &modrm, result);                                        \
+    }
+
+/* inc/dec r (40 - 4F): fn is op_add or op_sub of 1 */
+#define DEFINE_INC_DEC_R(W, name, base, fn)                                        \
+    static void name(Emulator *emu)                                                \
+    {                                                                              \
+        uint8_t reg = get_code8(emu, 0) - base;                                    \
+        set_register##W(emu, reg, fn(emu, get_register##W(emu, reg), 1));          \
+        emu->eip += 1;                                                             \
+    }
+
+/* push r (50 - 57), pop r (58 - 5F) */
+#define DEFINE_PUSH_POP_R(W, push_name, pop_name)                                  \
+    static void push_name(Emulator *emu)                                           \
+    {                                                                              \
+        push##W(emu, get_register##W(emu, get_code8(emu, 0) - 0x50));              \
+        emu->eip += 1;                                                             \
+    }                                                                              \
+    static void pop_name(Emulator *emu)                                            \
+    {                                                                              \
+        set_register##W(emu, get_code8(emu, 0) - 0x58, pop##W(emu));               \
+        emu->eip += 1;                                                             \
+    }
+
+/* push imm (68), push imm8 sign-extended (6A) */
+#define DEFINE_PUSH_IMM(W, name, imm8)                                             \
+    static void name(Emulator *emu)                                                \
+    {                                                                              \
+        push##W(emu, imm8 ? (uint##W##_t)(int##W##_t)get_sign_code8(emu, 1)        \
+                          : get_code##W(emu, 1));                                  \
+        emu->eip += 1 + (imm8 ? 1 : W / 8);                                        \
+    }
+
+/* xchg rm r (87), xchg eAX r (90 - 97) */
+#define DEFINE_XCHG(W, rm_name, a_name)                                            \
+    static void rm_name(Emulator *emu)                                             \
+    {                                                                              \
+        emu->eip += 1;                                                             \
+        ModRM modrm = create_modrm();                                              \
+        parse_modrm(emu, &modrm);                                                  \
+        uint##W##_t rm_val = get_rm##W(emu, &modrm);                               \
+        set_rm##W(emu, &modrm, get_r##W(emu, &modrm));                             \
+        set_r##W(emu, &modrm, rm_val);                                             \
+    }                                                                              \
+    static void a_name(Emulator *emu)                                              \
+    {                                                                              \
+        uint8_t reg = get_code8(emu, 0) - 0x90;                                    \
+        uint##W##_t a_val = get_register##W(emu, EAX);                             \
+        set_register##W(emu, EAX, get_register##W(emu, reg));                      \
+        set_register##W(emu, reg, a_val);                                          \
+        emu->eip += 1;                                                             \
+    }
+
+/* mov rm sreg (8C), lea r m (8D), pop rm (8F) */
+#define DEFINE_MODRM_MISC(W, seg_name, lea_name, pop_name)                         \
+    static void seg_name(Emulator *emu)                                            \
+    {                                                                              \
+        emu->eip += 1;                                                             \
+        ModRM modrm = create_modrm();                                              \
+        parse_modrm(emu, &modrm);                                                  \
+        set_rm##W(emu, &modrm, get_seg_r(emu, &modrm));                            \
+    }                                                                              \
+    static void lea_name(Emulator *emu)                                            \
+    {                                                                              \
+        emu->eip += 1;                                                             \
+        ModRM modrm = create_modrm();                                              \
+        parse_modrm(emu, &modrm);                                                  \
+        set_r##W(emu, &modrm, calc_memory_address(emu, &modrm));                   \
+    }                                                                              \
+    static void pop_name(Emulator *emu)                                            \
+    {                                                                              \
+        emu->eip += 1;                                                             \
+        ModRM modrm = create_modrm();                                              \
+        parse_modrm(emu, &modrm);                                                  \
+        set_rm##W(emu, &modrm, pop##W(emu));                                       \
+    }
+
+/* mov r imm (B8 - BF), mov rm imm (C7) */
+#define DEFINE_MOV_IMM(W, r_name, rm_name)                                         \
+    static void r_name(Emulator *emu)                                              \
+    {                                                                              \
+        set_register##W(emu, get_code8(emu, 0) - 0xB8, get_code##W(emu, 1));       \
+        emu->eip += 1 + W / 8;                                                     \
+    }                                                                              \
+    static void rm_name(Emulator *emu)                                             \
+    {                                                                              \
+        emu->eip += 1;                                                             \
+        ModRM modrm = create_modrm();                                              \
+        parse_modrm(emu, &modrm);                                                  \
+        set_rm##W(emu, &modrm, get_code##W(emu, 0));                               \
+        emu->eip += W / 8;                                                         \
+    }
+
+/* mov eAX moffs (A1), mov moffs eAX (A3): moffs32 as in the 32-bit handlers */
+#define DEFINE_MOV_MOFFS(W, load_name, store_name)                                 \
+    static void load_name(Emulator *emu)                                           \
+    {                                                                              \
+        uint32_t offset = get_code32(emu, 1);                                      \
+        set_register##W(emu, EAX, get_memory##W(emu, emu->prefixes.segment, offset)); \
+        emu->eip += 5;                                                             \
+    }                                                                              \
+    static void store_name(Emulator *emu)                                          \
+    {                                                                              \
+        uint32_t offset = get_code32(emu, 1);                                      \
+        set_memory##W(emu, emu->prefixes.segment, offset, get_register##W(emu, EAX)); \
+        emu->eip += 5;                                                             \
+    }
+
+/* Moves ESI/EDI to the next element of W bits. */
+#define STRING_STEP(W, reg_index)                                                  \
+    set_register32(emu, reg_index,                                                 \
+                   get_register32(emu, reg_index) + (is_direction_down(emu) ? -(W / 8) : W / 8))
+
+/*
+ * movs (A5), cmps (A7), stos (AB), lods (AD), scas (AF)
+ * Sources are in the segment of the prefix, destinations in ES;
+ * the rep prefix repeats them.
+ */
+#define DEFINE_STRING_OPS(W, movs_name, cmps_name, stos_name, lods_name, scas_name) \
+    static void movs_name(Emulator *emu)                                           \
+    {                                                                              \
+        uint##W##_t value = get_memory##W(emu, emu->prefixes.segment, get_register32(emu, ESI)); \
+        set_memory##W(emu, ES, get_register32(emu, EDI), value);                   \
+        STRING_STEP(W, ESI);                                                       \
+        STRING_STEP(W, EDI);                                                       \
+        emu->eip += 1;                                                             \
+    }                                                                              \
+    static void cmps_name(Emulator *emu)                                           \
+    {                                                                              \
+        uint##W##_t src = get_memory##W(emu, emu->prefixes.segment, get_register32(emu, ESI)); \
+        uint##W##_t dst = get_memory##W(emu, ES, get_register32(emu, EDI));        \
+        op_sub##W(emu, src, dst);                                                  \
+        STRING_STEP(W, ESI);                                                       \
+        STRING_STEP(W, EDI);                                                       \
+        emu->eip += 1;                                                             \
+    }                                                                              \
+    static void stos_name(Emulator *emu)                                           \
+    {                                                                              \
+        set_memory##W(emu, ES, get_register32(emu, EDI), get_register##W(emu, EAX)); \
+        STRING_STEP(W, EDI);                                                       \
+        emu->eip += 1;                                                             \
+    }                                                                              \
+    static void lods_name(Emulator *emu)                                           \
+    {                                                                              \
+        set_register##W(emu, EAX, get_memory##W(emu, emu->prefixes.segment, get_register32(emu, ESI))); \
+        STRING_STEP(W, ESI);                                                       \
+        emu->eip += 1;                                                             \
+    }                                                                              \
+    static void scas_name(Emulator *emu)                                           \
+    {                                                                              \
+        op_sub##W(emu, get_register##W(emu, EAX), get_memory##W(emu, ES, get_register32(emu, EDI))); \
+        STRING_STEP(W, EDI);                                                       \
+        emu->eip += 1;                                                             \
+    }
+
+/* F7 by REG of ModR/M: test imm, not, neg; mul and div are not generic. */
+#define DEFINE_GROUP_F7(W, name)                                                   \
+    static void name(Emulator *emu)                                                \
+    {                                                                              \
+        emu->eip += 1;                                                             \
+        ModRM modrm = create_modrm();                                              \
+        parse_modrm(emu, &modrm);                                                  \
+        uint##W##_t rm_val = get_rm##W(emu, &modrm);                               \
+        switch (modrm.opcode)                                                      \
+        {                                                                          \
+        case 0:                                                                    \
+        case 1:                                                                    \
+            op_and##W(emu, rm_val, get_code##W(emu, 0));                           \
+            emu->eip += W / 8;                                                     \
+            break;                                                                 \
+        case 2:                                                                    \
+            set_rm##W(emu, &modrm, ~rm_val);                                       \
+            break;                                                                 \
+        case 3:                                                                    \
+            set_rm##W(emu, &modrm, op_sub##W(emu, 0, rm_val));                     \
+            break;                                                                 \
+        default:                                                                   \
+            printf("Not implemented: Op: F7 (%d bits) with ModR/M Op: %d\n", W, modrm.opcode); \
+            panic_exit(emu);                                                       \
+        }                                                                          \
+    }
+
+/* FF by REG of ModR/M: inc, dec, push; near and far calls and jumps are not generic. */
+#define DEFINE_GROUP_FF(W, name)                                                   \
+    static void name(Emulator *emu)                                                \
+    {                                                                              \
+        emu->eip += 1;                                                             \
+        ModRM modrm = create_modrm();                                              \
+        parse_modrm(emu, &modrm);                                                  \
+        switch (modrm.opcode)                                                      \
+        {                                                                          \
+        case 0:                                                                    \
+            set_rm##W(emu, &modrm, op_add##W(emu, get_rm##W(emu, &modrm), 1));     \
+            break;                                                                 \
+        case 1:                                                                    \
+            set_rm##W(emu, &modrm, op_sub##W(emu, get_rm##W(emu, &modrm), 1));     \
+            break;                                                                 \
+        case 6:                                                                    \
+            push##W(emu, get_rm##W(emu, &modrm));                                  \
+            break;                                                                 \
+        default:                                                                   \
+            printf("Not implemented: Op: FF (%d bits) with ModR/M Op: %d\n", W, modrm.opcode); \
+            panic_exit(emu);                                                       \
+        }                                                                          \
+    }
+
+/* movzx r rm8 (0F B6), movsx r rm8 (0F BE) */
+#define DEFINE_MOVX_RM8(W, zx_name, sx_name)                                       \
+    static void zx_name(Emulator *emu)                                             \
+    {                                                                              \
+        emu->eip += 2;                                                             \
+        ModRM modrm = create_modrm();                                              \
+        parse_modrm(emu, &modrm);                                                  \
+        set_r##W(emu, &modrm, get_rm8(emu, &modrm));                               \
+    }                                                                              \
+    static void sx_name(Emulator *emu)                                             \
+    {                                                                              \
+        emu->eip += 2;                                                             \
+        ModRM modrm = create_modrm();                                              \
+        parse_modrm(emu, &modrm);                                                  \
+        set_r##W(emu, &modrm, (uint##W##_t)(int##W##_t)(int8_t)get_rm8(emu, &modrm)); \
+    }
+
+#endif
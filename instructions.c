@@ -9,6 +9,9 @@
 #include "emulator_functions.h"
 #include "modrm.h"
 #include "io.h"
+#include "string_ops.h"
+#include "lock_ops.h"
+#include "spin.h"
 #include "util.h"
 
 instruction_func_t *two_byte_instructions[256];
@@ -29,80 +32,61 @@ static void two_byte_inst(Emulator *emu)
     two_byte_instructions[op](emu);
 }
 
-/*
- * Lock Prefix (F0)
- */
-static void lock_prefix(Emulator *emu)
+/* Stores op into prefixes if it is a prefix; returns 0 if it is not. */
+static int gather_prefix(Prefixes *prefixes, uint8_t op)
 {
-    emu->eip += 1;
-    uint8_t op = get_code8(emu, 0);
-    if (config.verbose)
-        printf("Ignoring lock prefix.\n");
-    instructions[op](emu);
+    switch (op)
+    {
+    case 0x26:
+        prefixes->segment = ES;
+        break;
+    case 0x2E:
+        prefixes->segment = CS;
+        break;
+    case 0x36:
+        prefixes->segment = SS;
+        break;
+    case 0x3E:
+        prefixes->segment = DS;
+        break;
+    case 0x64:
+        prefixes->segment = FS;
+        break;
+    case 0x65:
+        prefixes->segment = GS;
+        break;
+    case 0x66:
+        prefixes->operand_size = 1;
+        break;
+    case 0x67:
+        prefixes->address_size = 1;
+        break;
+    case 0xF0:
+        prefixes->lock = 1;
+        break;
+    case 0xF2:
+    case 0xF3:
+        prefixes->rep = op;
+        break;
+    default:
+        return 0;
+    }
+    return 1;
 }
 
-static void operand_override(Emulator *emu)
+/* String ops, which rep repeats */
+static int is_rep_op(uint8_t op)
 {
-    emu->eip += 1;
-    uint8_t op = get_code8(emu, 0);
-    if (emu->is_pe)
-    {
-        if (op >= 0x90 && op <= 0x97)
-        {
-            xchg_r16_r16(emu);
-            return;
-        }
-        switch (op)
-        {
-        case 0x83:
-            code_83_rm16(emu);
-            break;
-        case 0x85:
-            test_rm16_r16(emu);
-            break;
-        case 0x89:
-            mov_rm16_r16(emu);
-            break;
-        case 0xA3:
-            mov_moffs16_ax(emu);
-            break;
-        case 0xB8:
-            mov_r16_imm16(emu);
-            break;
-        case 0xC7:
-            mov_rm16_imm16(emu);
-            break;
-        default:
-            printf("EIP: %08x Op: 66 %x not implemented.\n", emu->eip, op);
-            panic_exit(emu);
-        }
-    }
-    else
-    {
-        if (op >= 0xB8 && op <= 0xBF)
-        {
-            mov_r32_imm32(emu);
-            return;
-        }
-        switch (op)
-        {
-        case 0x85:
-            test_rm32_r32(emu);
-            break;
-        case 0x01:
-            add_rm32_r32(emu);
-            break;
-        case 0x83:
-            code_83(emu);
-            break;
-        case 0x89:
-            mov_rm32_r32(emu);
-            break;
-        default:
-            printf("EIP: %08x Op: 66 %x not implemented.\n", emu->eip, op);
-            panic_exit(emu);
-        }
-    }
+    return (op >= 0x6C && op <= 0x6F) || (op >= 0xA4 && op <= 0xA7) || (op >= 0xAA && op <= 0xAF);
+}
+
+/*
+ * Ops addressing memory without ModR/M (moffs, string ops, xlat) or
+ * counting in eCX (loop, jecxz), which 67 would change
+ */
+static int uses_address_size(uint8_t op)
+{
+    return (op >= 0xA0 && op <= 0xA3) || is_rep_op(op) || op == 0xD7 || (op >= 0xE0 && op <= 0xE3);
 }
 
 /* 
@@ -123,56 +107,70 @@ static void operand_override(Emulator *emu)
  *     CMPS(A6/A7)
  *     SCAS(AE/AF)
  */
-static void rep(Emulator *emu)
+static void repeat(Emulator *emu, instruction_func_t *handler, uint8_t op)
 {
-    emu->eip += 1;
+    int repne = emu->prefixes.rep == 0xF2;
     uint32_t ecx_value = get_register32(emu, ECX);
-    uint8_t op = get_code8(emu, 0);
     uint32_t op_eip = emu->eip;
-    if (instructions[op] == NULL)
-    {
-        printf("Op: f3 %x not implemented.\n", op);
-        panic_exit(emu);
-    }
-    int i;
-    for (i = 0; i < ecx_value; i++)
+    uint32_t i = 0;
+    /* ECX counts the elements done, a fault restarts the op at the element it stopped at. */
+    while (i < ecx_value)
     {
         emu->eip = op_eip;
+        uint32_t done = repeat_string_op(emu, op, ecx_value - i, repne);
+        if (done > 0)
+        {
+            i += done;
+            set_register32(emu, ECX, ecx_value - i);
+            continue;
+        }
         if (config.verbose)
             printf("CS: %04X EIP: %08X Op: %02X\n", get_seg_register16(emu, CS), emu->eip, op);
-        instructions[op](emu);
-        if ((op == 0xA6 || op == 0xA7 || op == 0xAE || op == 0xAF) && !is_zero(emu))
+        handler(emu);
+        if ((op == 0xA6 || op == 0xA7 || op == 0xAE || op == 0xAF) && is_zero(emu) == repne)
         {
             break;
         }
+        i++;
+        set_register32(emu, ECX, ecx_value - i);
     }
     set_register32(emu, ECX, ecx_value - i);
+    /* String ops are 1 byte, also when ECX was 0. */
+    emu->eip = op_eip + 1;
 }
 
-static void repne(Emulator *emu)
+/*
+ * Prefix decoder (26, 2E, 36, 3E, 64, 65, 66, 67, F0, F2, F3)
+ * Gathers the prefixes in front of an op into emu->prefixes, which the
+ * handlers and ModR/M decoding read, and runs the op from the table of
+ * its operand size: instructions16 after 66 in protected mode. Real mode
+ * runs the 32-bit handlers with or without 66, as for ops without it.
+ * Ops without prefixes never come here, so they pay nothing for them.
+ * LOCK: read-modify-write ops on RAM are done atomically (lock_ops.c),
+ * the others are run as without the prefix.
+ * REP: repeats string ops; the other ops ignore it (rep ret).
+ */
+static void prefixed_op(Emulator *emu)
 {
-    emu->eip += 1;
-    uint32_t ecx_value = get_register32(emu, ECX);
-    uint8_t op = get_code8(emu, 0);
-    uint32_t op_eip = emu->eip;
-    if (instructions[op] == NULL)
+    Prefixes *prefixes = &emu->prefixes;
+    uint8_t op;
+    for (op = get_code8(emu, 0); gather_prefix(prefixes, op); op = get_code8(emu, 0))
+        emu->eip += 1;
+
+    instruction_func_t **table = emu->is_pe && prefixes->operand_size ? instructions16 : instructions;
+    if (table[op] == NULL || (prefixes->address_size && uses_address_size(op)))
     {
-        printf("Op: f2 %x not implemented.\n", op);
+        printf("EIP: %08x Op: %x not implemented with prefixes %s%s.\n", emu->eip, op,
+               prefixes->operand_size ? "66 " : "", prefixes->address_size ? "67" : "");
         panic_exit(emu);
     }
-    int i;
-    for (i = 0; i < ecx_value; i++)
-    {
-        emu->eip = op_eip;
-        if (config.verbose)
-            printf("CS: %04X EIP: %08X Op: %02X\n", get_seg_register16(emu, CS), emu->eip, op);
-        instructions[op](emu);
-        if ((op == 0xA6 || op == 0xA7 || op == 0xAE || op == 0xAF) && is_zero(emu))
-        {
-            break;
-        }
-    }
-    set_register32(emu, ECX, ecx_value - i);
+    if (prefixes->rep == 0xF3 && op == 0x90)
+        spin_pause(emu);
+    if (prefixes->rep && is_rep_op(op))
+        repeat(emu, table[op], op);
+    else if (!prefixes->lock || table != instructions || !run_locked_op(emu))
+        table[op](emu);
+    clear_prefixes(emu);
 }
 
 static void init_two_byte_instructions(void)
@@ -199,10 +197,12 @@ static void init_two_byte_instructions(void)
     two_byte_instructions[0x8F] = jg32;
     two_byte_instructions[0x94] = sete;
     two_byte_instructions[0x95] = setne;
+    two_byte_instructions[0xB1] = cmpxchg_rm32_r32;
     two_byte_instructions[0xB6] = movzx_r32_rm8;
     two_byte_instructions[0xB7] = movzx_r32_rm16;
     two_byte_instructions[0xBE] = movsx_r32_rm8;
     two_byte_instructions[0xBF] = movsx_r32_rm16;
+    two_byte_instructions[0xC1] = xadd_rm32_r32;
 }
 
 void init_instructions(void)
@@ -258,7 +258,7 @@ void init_instructions(void)
     instructions[0x24] = and_al_imm8;
     instructions[0x25] = and_eax_imm32;
 
-    /* instructions[0x26] = prefix_override; */
+    instructions[0x26] = prefixed_op;
 
     instructions[0x28] = sub_rm8_r8;
     instructions[0x29] = sub_rm32_r32;
@@ -267,7 +267,7 @@ void init_instructions(void)
     instructions[0x2C] = sub_al_imm8;
     instructions[0x2D] = sub_eax_imm32;
 
-    /* instructions[0x2E] = prefix_override; */
+    instructions[0x2E] = prefixed_op;
 
     instructions[0x30] = xor_rm8_r8;
     instructions[0x31] = xor_rm32_r32;
@@ -276,6 +276,8 @@ void init_instructions(void)
     instructions[0x34] = xor_al_imm8;
     instructions[0x35] = xor_eax_imm32;
 
+    instructions[0x36] = prefixed_op;
+
     instructions[0x38] = cmp_rm8_r8;
     instructions[0x39] = cmp_rm32_r32;
     instructions[0x3A] = cmp_r8_rm8;
@@ -283,6 +285,8 @@ void init_instructions(void)
     instructions[0x3C] = cmp_al_imm8;
     instructions[0x3D] = cmp_eax_imm32;
 
+    instructions[0x3E] = prefixed_op;
+
     /* op code includes 8 registers in 1 byte: 0x40 ~ 0x47*/
     for (i = 0; i < 8; i++)
     {
@@ -309,12 +313,16 @@ void init_instructions(void)
 
     instructions[0x60] = pushad;
     instructions[0x61] = popad;
-    instructions[0x66] = operand_override;
+    instructions[0x64] = prefixed_op;
+    instructions[0x65] = prefixed_op;
+    instructions[0x66] = prefixed_op;
+    instructions[0x67] = prefixed_op;
     instructions[0x68] = push_imm32;
     instructions[0x69] = imul_r32_rm32_imm32;
     instructions[0x6A] = push_imm8;
     instructions[0x6B] = imul_r32_rm32_imm8;
     instructions[0x6D] = ins_m32_dx;
+    instructions[0x6F] = outs_dx_m32;
 
     instructions[0x70] = jo;
     instructions[0x71] = jno;
@@ -425,9 +433,10 @@ void init_instructions(void)
     instructions[0xEE] = out_dx_al;
     instructions[0xEF] = out_dx_eax;
 
-    instructions[0xF0] = lock_prefix;
-    instructions[0xF2] = repne;
-    instructions[0xF3] = rep;
+    instructions[0xF0] = prefixed_op;
+    instructions[0xF2] = prefixed_op;
+    instructions[0xF3] = prefixed_op;
+    instructions[0xF4] = hlt;
     instructions[0xF5] = cmc;
     instructions[0xF6] = code_f6;
     instructions[0xF7] = code_f7;
@@ -441,4 +450,5 @@ void init_instructions(void)
     instructions[0xFF] = code_ff;
 
     init_two_byte_instructions();
+    init_instructions16();
 }
\ No newline at end of file
@@ -1,6 +1,8 @@
 #ifndef INSTRUCTIONS_H_
 #define INSTRUCTIONS_H_
 
+#include <string.h>
+
 #include "emulator.h"
 
 void init_instructions(void);
@@ -8,5 +10,18 @@ void init_instructions(void);
 typedef void instruction_func_t(Emulator *); // instruction_func_t = void func(Emulator*)
 
 extern instruction_func_t *instructions[256];
+extern instruction_func_t *two_byte_instructions[256];
+
+/* 16-bit operand handlers (instructions_16.c), set up by init_instructions */
+extern instruction_func_t *instructions16[256];
+extern instruction_func_t *two_byte_instructions16[256];
+void init_instructions16(void);
+
+/* Back to no prefixes, once a prefixed op ran or at reset */
+static inline void clear_prefixes(Emulator *emu)
+{
+    memset(&emu->prefixes, 0, sizeof(Prefixes));
+    emu->prefixes.segment = DS;
+}
 
-#endif
\ No newline at end of file
+#endif
@@ -9,6 +9,7 @@
 #include "modrm.h"
 #include "io.h"
 #include "gdt.h"
+#include "paging.h"
 #include "interrupt.h"
 #include "util.h"
 
@@ -44,6 +45,9 @@ void code_0f_01(Emulator *emu)
     case 3:
         lidt(emu, &modrm);
         break;
+    case 7:
+        invlpg(emu, &modrm);
+        break;
     default:
         printf("Not implemented: Op: 0F01 with ModR/M Op: %d\n", modrm.opcode);
         panic_exit(emu);
@@ -7,6 +7,7 @@
 #include "instruction_defs.h"
 #include "emulator_functions.h"
 #include "modrm.h"
+#include "paging.h"
 
 void mov_r32_cr(Emulator *emu)
 {
@@ -24,4 +25,7 @@ void mov_cr_r32(Emulator *emu)
     parse_modrm(emu, &modrm);
     uint32_t r32_val = get_register32(emu, modrm.rm);
     set_ctrl_register32(emu, modrm.reg_index, r32_val);
+    /* Cached translations depend on CR0.PG, CR3 and CR4.PSE. */
+    if (modrm.reg_index == CR0 || modrm.reg_index == CR3 || modrm.reg_index == CR4)
+        tlb_flush(emu);
 }
\ No newline at end of file
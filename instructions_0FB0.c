@@ -4,6 +4,28 @@
 #include "emulator_functions.h"
 #include "modrm.h"
 
+/*
+ * cmpxchg rm32 r32: 3|4 bytes
+ * Compares EAX with rm32: copies r32 to rm32 if equal (ZF: 1),
+ * loads rm32 into EAX otherwise. Flags are set as by cmp eax, rm32.
+ * 2 byte: op (0FB1)
+ * 1|2 bytes: ModR/M
+ */
+void cmpxchg_rm32_r32(Emulator *emu)
+{
+    emu->eip += 2;
+    ModRM modrm = create_modrm();
+    parse_modrm(emu, &modrm);
+    uint32_t rm32_val = get_rm32(emu, &modrm);
+    uint32_t eax_val = get_register32(emu, EAX);
+    uint64_t result = (uint64_t)eax_val - (uint64_t)rm32_val;
+    if (eax_val == rm32_val)
+        set_rm32(emu, &modrm, get_r32(emu, &modrm));
+    else
+        set_register32(emu, EAX, rm32_val);
+    update_eflags_sub(emu, eax_val, rm32_val, result);
+}
+
 /*
  * mov r32 rm8: 2 bytes
  * Copies value of zero-extended rm8 value to r32.
@@ -0,0 +1,33 @@
+#include <stdint.h>
+
+#include "instruction_defs.h"
+#include "emulator_functions.h"
+#include "modrm.h"
+
+/*
+ * xadd rm32 r32: 3|4 bytes
+ * Adds r32 to rm32 and loads the old rm32 into r32.
+ * 2 byte: op (0FC1)
+ * 1|2 bytes: ModR/M
+ */
+void xadd_rm32_r32(Emulator *emu)
+{
+    emu->eip += 2;
+    ModRM modrm = create_modrm();
+    parse_modrm(emu, &modrm);
+    uint32_t rm32_val = get_rm32(emu, &modrm);
+    uint32_t r32_val = get_r32(emu, &modrm);
+    uint64_t result = (uint64_t)rm32_val + (uint64_t)r32_val;
+    /* Memory first, a fault leaves r32 as it was (with Mod: 11, rm32 has to be the last one set). */
+    if (modrm.mod != 3)
+    {
+        set_rm32(emu, &modrm, result);
+        set_r32(emu, &modrm, rm32_val);
+    }
+    else
+    {
+        set_r32(emu, &modrm, rm32_val);
+        set_rm32(emu, &modrm, result);
+    }
+    update_eflags_add(emu, rm32_val, r32_val, result);
+}
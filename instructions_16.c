@@ -0,0 +1,198 @@
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "instructions.h"
+#include "instruction_defs.h"
+#include "instruction_templates.h"
+#include "util.h"
+
+/*
+ * Handlers for 16-bit operands (66 in protected mode)
+ * Generated from the width-generic definitions of instruction_templates.h;
+ * ops whose operands do not depend on the operand size share the
+ * handlers of the 32-bit table. The prefix decoder (instructions.c)
+ * indexes this table instead of instructions[] after 66.
+ */
+
+instruction_func_t *instructions16[256];
+instruction_func_t *two_byte_instructions16[256];
+
+DEFINE_ALU_OPS(16)
+
+DEFINE_RM_R(16, add_rm16_r16, op_add16, 1)
+DEFINE_RM_R(16, or_rm16_r16, op_or16, 1)
+DEFINE_RM_R(16, adc_rm16_r16, op_adc16, 1)
+DEFINE_RM_R(16, sbb_rm16_r16, op_sbb16, 1)
+DEFINE_RM_R(16, and_rm16_r16, op_and16, 1)
+DEFINE_RM_R(16, sub_rm16_r16, op_sub16, 1)
+DEFINE_RM_R(16, xor_rm16_r16, op_xor16, 1)
+DEFINE_RM_R(16, cmp_rm16_r16, op_sub16, 0)
+DEFINE_RM_R(16, test_rm16_r16, op_and16, 0)
+DEFINE_RM_R(16, mov_rm16_r16, op_mov16, 1)
+
+DEFINE_R_RM(16, add_r16_rm16, op_add16, 1)
+DEFINE_R_RM(16, or_r16_rm16, op_or16, 1)
+DEFINE_R_RM(16, adc_r16_rm16, op_adc16, 1)
+DEFINE_R_RM(16, sbb_r16_rm16, op_sbb16, 1)
+DEFINE_R_RM(16, and_r16_rm16, op_and16, 1)
+DEFINE_R_RM(16, sub_r16_rm16, op_sub16, 1)
+DEFINE_R_RM(16, xor_r16_rm16, op_xor16, 1)
+DEFINE_R_RM(16, cmp_r16_rm16, op_sub16, 0)
+DEFINE_R_RM(16, mov_r16_rm16, op_mov16, 1)
+
+DEFINE_A_IMM(16, add_ax_imm16, op_add16, 1)
+DEFINE_A_IMM(16, or_ax_imm16, op_or16, 1)
+DEFINE_A_IMM(16, adc_ax_imm16, op_adc16, 1)
+DEFINE_A_IMM(16, sbb_ax_imm16, op_sbb16, 1)
+DEFINE_A_IMM(16, and_ax_imm16, op_and16, 1)
+DEFINE_A_IMM(16, sub_ax_imm16, op_sub16, 1)
+DEFINE_A_IMM(16, xor_ax_imm16, op_xor16, 1)
+DEFINE_A_IMM(16, cmp_ax_imm16, op_sub16, 0)
+DEFINE_A_IMM(16, test_ax_imm16, op_and16, 0)
+
+DEFINE_GROUP_IMM(16, code_81_16, 0)
+DEFINE_GROUP_IMM(16, code_83_16, 1)
+
+DEFINE_INC_DEC_R(16, inc_r16, 0x40, op_add16)
+DEFINE_INC_DEC_R(16, dec_r16, 0x48, op_sub16)
+DEFINE_PUSH_POP_R(16, push_r16, pop_r16)
+DEFINE_PUSH_IMM(16, push_imm16, 0)
+DEFINE_PUSH_IMM(16, push_imm8_16, 1)
+DEFINE_XCHG(16, xchg_rm16_r16, xchg_ax_r16)
+DEFINE_MODRM_MISC(16, mov_rm16_seg, lea_r16_m, pop_rm16)
+DEFINE_MOV_IMM(16, mov_r16_imm16, mov_rm16_imm16)
+DEFINE_MOV_MOFFS(16, mov_ax_moffs16, mov_moffs16_ax)
+DEFINE_STRING_OPS(16, movsw, cmpsw, stosw, lodsw, scasw)
+DEFINE_GROUP_F7(16, code_f7_16)
+DEFINE_GROUP_FF(16, code_ff_16)
+DEFINE_MOVX_RM8(16, movzx_r16_rm8, movsx_r16_rm8)
+
+/*
+ * cbw: 1 byte
+ * Sign-extends AL to AX.
+ * 1 byte: op (98)
+ */
+static void cbw(Emulator *emu)
+{
+    set_register16(emu, EAX, (int16_t)(int8_t)get_register8(emu, AL));
+    emu->eip += 1;
+}
+
+/*
+ * cwd: 1 byte
+ * Sign-extends AX to DX:AX.
+ * 1 byte: op (99)
+ */
+static void cwd(Emulator *emu)
+{
+    set_register16(emu, EDX, (get_register16(emu, EAX) & 0x8000) ? 0xFFFF : 0);
+    emu->eip += 1;
+}
+
+static void two_byte_inst16(Emulator *emu)
+{
+    uint8_t op = get_code8(emu, 1);
+    if (two_byte_instructions16[op] == NULL)
+    {
+        printf("EIP: %08x Op: 66 0f %x not implemented.\n", emu->eip, op);
+        panic_exit(emu);
+    }
+    two_byte_instructions16[op](emu);
+}
+
+/* Ops of the 32-bit table which do not depend on the operand size */
+static const uint8_t shared_ops[] = {
+    0x00, 0x02, 0x04, 0x08, 0x0A, 0x0C, 0x10, 0x12, 0x14, 0x18, 0x1A, 0x1C,
+    0x20, 0x22, 0x24, 0x28, 0x2A, 0x2C, 0x30, 0x32, 0x34, 0x38, 0x3A, 0x3C,
+    0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7C, 0x7D, 0x7E, 0x7F,
+    0x80, 0x84, 0x86, 0x88, 0x8A, 0x8E, 0x9E, 0x9F,
+    0xA0, 0xA2, 0xA4, 0xA6, 0xA8, 0xAA, 0xAC, 0xAE,
+    0xB0, 0xB1, 0xB2, 0xB3, 0xB4, 0xB5, 0xB6, 0xB7,
+    0xC0, 0xC6, 0xCD, 0xD0, 0xD2, 0xD6,
+    0xE4, 0xE6, 0xEA, 0xEB, 0xEC, 0xEE,
+    0xF4, 0xF5, 0xF6, 0xF8, 0xF9, 0xFA, 0xFB, 0xFC, 0xFD, 0xFE,
+};
+
+static const uint8_t shared_two_byte_ops[] = {0x94, 0x95};
+
+void init_instructions16(void)
+{
+    int i;
+    memset(instructions16, 0, sizeof(instructions16));
+    memset(two_byte_instructions16, 0, sizeof(two_byte_instructions16));
+
+    for (i = 0; i < (int)sizeof(shared_ops); i++)
+        instructions16[shared_ops[i]] = instructions[shared_ops[i]];
+    for (i = 0; i < (int)sizeof(shared_two_byte_ops); i++)
+        two_byte_instructions16[shared_two_byte_ops[i]] = two_byte_instructions[shared_two_byte_ops[i]];
+
+    instructions16[0x01] = add_rm16_r16;
+    instructions16[0x03] = add_r16_rm16;
+    instructions16[0x05] = add_ax_imm16;
+    instructions16[0x09] = or_rm16_r16;
+    instructions16[0x0B] = or_r16_rm16;
+    instructions16[0x0D] = or_ax_imm16;
+    instructions16[0x0F] = two_byte_inst16;
+    instructions16[0x11] = adc_rm16_r16;
+    instructions16[0x13] = adc_r16_rm16;
+    instructions16[0x15] = adc_ax_imm16;
+    instructions16[0x19] = sbb_rm16_r16;
+    instructions16[0x1B] = sbb_r16_rm16;
+    instructions16[0x1D] = sbb_ax_imm16;
+    instructions16[0x21] = and_rm16_r16;
+    instructions16[0x23] = and_r16_rm16;
+    instructions16[0x25] = and_ax_imm16;
+    instructions16[0x29] = sub_rm16_r16;
+    instructions16[0x2B] = sub_r16_rm16;
+    instructions16[0x2D] = sub_ax_imm16;
+    instructions16[0x31] = xor_rm16_r16;
+    instructions16[0x33] = xor_r16_rm16;
+    instructions16[0x35] = xor_ax_imm16;
+    instructions16[0x39] = cmp_rm16_r16;
+    instructions16[0x3B] = cmp_r16_rm16;
+    instructions16[0x3D] = cmp_ax_imm16;
+
+    for (i = 0; i < 8; i++)
+    {
+        instructions16[0x40 + i] = inc_r16;
+        instructions16[0x48 + i] = dec_r16;
+        instructions16[0x50 + i] = push_r16;
+        instructions16[0x58 + i] = pop_r16;
+        instructions16[0x90 + i] = xchg_ax_r16;
+        instructions16[0xB8 + i] = mov_r16_imm16;
+    }
+
+    instructions16[0x68] = push_imm16;
+    instructions16[0x6A] = push_imm8_16;
+    instructions16[0x81] = code_81_16;
+    instructions16[0x83] = code_83_16;
+    instructions16[0x85] = test_rm16_r16;
+    instructions16[0x87] = xchg_rm16_r16;
+    instructions16[0x89] = mov_rm16_r16;
+    instructions16[0x8B] = mov_r16_rm16;
+    instructions16[0x8C] = mov_rm16_seg;
+    instructions16[0x8D] = lea_r16_m;
+    instructions16[0x8F] = pop_rm16;
+    instructions16[0x98] = cbw;
+    instructions16[0x99] = cwd;
+    instructions16[0xA1] = mov_ax_moffs16;
+    instructions16[0xA3] = mov_moffs16_ax;
+    instructions16[0xA5] = movsw;
+    instructions16[0xA7] = cmpsw;
+    instructions16[0xA9] = test_ax_imm16;
+    instructions16[0xAB] = stosw;
+    instructions16[0xAD] = lodsw;
+    instructions16[0xAF] = scasw;
+    instructions16[0xC7] = mov_rm16_imm16;
+    instructions16[0xE5] = in_ax_imm8;
+    instructions16[0xE7] = out_imm8_ax;
+    instructions16[0xED] = in_ax_dx;
+    instructions16[0xEF] = out_dx_ax;
+    instructions16[0xF7] = code_f7_16;
+    instructions16[0xFF] = code_ff_16;
+
+    two_byte_instructions16[0xB6] = movzx_r16_rm8;
+    two_byte_instructions16[0xBE] = movsx_r16_rm8;
+}
@@ -16,15 +16,10 @@
  */
 void pushad(Emulator *emu)
 {
-    uint32_t original_esp = get_register32(emu, ESP);
-    push32(emu, get_register32(emu, EAX));
-    push32(emu, get_register32(emu, ECX));
-    push32(emu, get_register32(emu, EDX));
-    push32(emu, get_register32(emu, EBX));
-    push32(emu, original_esp);
-    push32(emu, get_register32(emu, EBP));
-    push32(emu, get_register32(emu, ESI));
-    push32(emu, get_register32(emu, EDI));
+    uint32_t frame[] = {get_register32(emu, EAX), get_register32(emu, ECX), get_register32(emu, EDX),
+                        get_register32(emu, EBX), get_register32(emu, ESP), get_register32(emu, EBP),
+                        get_register32(emu, ESI), get_register32(emu, EDI)};
+    push32_frame(emu, frame, 8);
     emu->eip += 1;
 }
 
@@ -35,15 +30,16 @@ void pushad(Emulator *emu)
  */
 void popad(Emulator *emu)
 {
-    set_register32(emu, EDI, pop32(emu));
-    set_register32(emu, ESI, pop32(emu));
-    set_register32(emu, EBP, pop32(emu));
-    /* Skips original ESP value by incrementing ESP by 4 bytes. */
-    set_register32(emu, ESP, get_register32(emu, ESP) + 4);
-    set_register32(emu, EBX, pop32(emu));
-    set_register32(emu, EDX, pop32(emu));
-    set_register32(emu, ECX, pop32(emu));
-    set_register32(emu, EAX, pop32(emu));
+    uint32_t frame[8];
+    pop32_frame(emu, frame, 8);
+    set_register32(emu, EDI, frame[0]);
+    set_register32(emu, ESI, frame[1]);
+    set_register32(emu, EBP, frame[2]);
+    /* frame[3]: original ESP value, skipped */
+    set_register32(emu, EBX, frame[4]);
+    set_register32(emu, EDX, frame[5]);
+    set_register32(emu, ECX, frame[6]);
+    set_register32(emu, EAX, frame[7]);
     emu->eip += 1;
 }
 
@@ -138,8 +134,10 @@ void imul_r32_rm32_imm8(Emulator *emu)
 void ins_m32_dx(Emulator *emu)
 {
     uint16_t dx_val = get_register16(emu, EDX);
-    uint32_t in_val = io_in32(emu, dx_val);
     uint32_t edi_val = get_register32(emu, EDI);
+    /* A fault comes before the port is read. */
+    probe_write(emu, ES, edi_val, 4);
+    uint32_t in_val = io_in32(emu, dx_val);
     set_memory32(emu, ES, edi_val, in_val);
     if (is_direction_down(emu))
     {
@@ -150,4 +148,24 @@ void ins_m32_dx(Emulator *emu)
         set_register32(emu, EDI, edi_val + 4);
     }
     emu->eip += 1;
-}
\ No newline at end of file
+}
+/*
+ * outs dx m32
+ * Outputs dword from DS:ESI to DX port
+ * 1 byte: op (6F)
+ */
+void outs_dx_m32(Emulator *emu)
+{
+    uint16_t dx_val = get_register16(emu, EDX);
+    uint32_t esi_val = get_register32(emu, ESI);
+    io_out32(emu, dx_val, get_memory32(emu, emu->prefixes.segment, esi_val));
+    if (is_direction_down(emu))
+    {
+        set_register32(emu, ESI, esi_val - 4);
+    }
+    else
+    {
+        set_register32(emu, ESI, esi_val + 4);
+    }
+    emu->eip += 1;
+}
@@ -9,6 +9,7 @@
 #include "modrm.h"
 #include "io.h"
 #include "util.h"
+#include "spin.h"
 
 /*
  * add rm8 imm8: 3|4 bytes
@@ -559,81 +560,6 @@ void code_83(Emulator *emu)
     }
 }
 
-/*
- * add rm16 imm8: 3|4 bytes
- * Adds imm8 to RM16. Op code 83 and ModR/M op code: 0 execute this.
- * 1 byte: shared op (83)
- * 1|2 byte: ModR/M
- * 1 byte: imm8 to add
- */
-static void add_rm16_imm8(Emulator *emu, ModRM *modrm)
-{
-    uint16_t rm16 = get_rm16(emu, modrm);
-    uint16_t imm8 = (uint16_t)get_sign_code8(emu, 0);
-    emu->eip += 1;
-
-    uint32_t result = (uint32_t)rm16 + (uint32_t)imm8;
-    set_rm16(emu, modrm, result);
-    update_eflags_add_16bit(emu, rm16, imm8, result);
-}
-
-/*
- * cmp rm16 imm8: 3 bytes
- * Compares rm16 value and imm8 value by subtracting in order.
- * Op code 83 and ModR/M op code: 111 execute this.
- * 1 byte: shared op (83)
- * 1 byte: ModR/M
- * 1 byte: imm8 to subtract
- */
-static void cmp_rm16_imm8(Emulator *emu, ModRM *modrm)
-{
-    uint16_t rm16 = get_rm16(emu, modrm);
-    uint16_t imm8 = (int16_t)get_sign_code8(emu, 0);
-    emu->eip += 1;
-
-    uint32_t result = (uint32_t)rm16 - (uint32_t)imm8;
-    update_eflags_sub_16bit(emu, rm16, imm8, result);
-}
-
-void code_83_rm16(Emulator *emu)
-{
-    /* Proceed 1 byte for op code 83. */
-    emu->eip += 1;
-    ModRM modrm = create_modrm();
-    parse_modrm(emu, &modrm);
-
-    switch (modrm.opcode)
-    {
-    case 0:
-        add_rm16_imm8(emu, &modrm);
-        break;
-    // case 1:
-    //     or_rm16_imm8(emu, &modrm);
-    //     break;
-    // case 2:
-    //     adc_rm16_imm8(emu, &modrm);
-    //     break;
-    // case 3:
-    //     sbb_rm16_imm8(emu, &modrm);
-    //     break;
-    // case 4:
-    //     and_rm16_imm8(emu, &modrm);
-    //     break;
-    // case 5:
-    //     sub_rm16_imm8(emu, &modrm);
-    //     break;
-    // case 6:
-    //     xor_rm16_imm8(emu, &modrm);
-    //     break;
-    case 7:
-        cmp_rm16_imm8(emu, &modrm);
-        break;
-    default:
-        printf("Not implemented: Op: 83 with ModR/M Op: %d\n", modrm.opcode);
-        panic_exit(emu);
-    }
-}
-
 /*
  * test rm8 r8: 2|3 bytes
  * Performs logical AND of operands and updates flags. No result store.
@@ -653,24 +579,6 @@ void test_rm8_r8(Emulator *emu)
     update_eflags_logical_ops_8bit(emu, result);
 }
 
-/*
- * test rm16 r16: 2|3 bytes
- * Performs logical AND of operands and updates flags. No result store.
- * 1 byte: op (85)
- * 1|2 byte: ModR/M
- */
-void test_rm16_r16(Emulator *emu)
-{
-    emu->eip += 1;
-    ModRM modrm = create_modrm();
-    parse_modrm(emu, &modrm);
-    uint16_t rm16 = get_rm16(emu, &modrm);
-    uint16_t r16 = get_r16(emu, &modrm);
-
-    uint32_t result = rm16 & r16;
-    update_eflags_logical_ops_16bit(emu, result);
-}
-
 /*
  * test rm32 r32: 2|3 bytes
  * Performs logical AND of operands and updates flags. No result store.
@@ -693,6 +601,7 @@ void test_rm32_r32(Emulator *emu)
 /*
  * xchg rm8 r8: 2|3 bytes
  * Exchanges the contents of operands.
+ * With memory it is always locked (atomic for the other vCPUs).
  * 1 byte: op (86)
  * 1|2 byte: ModR/M
  */
@@ -701,6 +610,19 @@ void xchg_rm8_r8(Emulator *emu)
     emu->eip += 1;
     ModRM modrm = create_modrm();
     parse_modrm(emu, &modrm);
+    if (modrm.mod != 3)
+    {
+        uint8_t *p = get_atomic_pointer(emu, emu->prefixes.segment, calc_memory_address(emu, &modrm), 1);
+        if (p != NULL)
+        {
+            uint8_t r8 = get_r8(emu, &modrm);
+            uint8_t old = __atomic_exchange_n(p, r8, __ATOMIC_SEQ_CST);
+            set_r8(emu, &modrm, old);
+            if (old == r8)
+                spin_lock_word(emu, p, 1, old);
+            return;
+        }
+    }
     uint8_t rm8 = get_rm8(emu, &modrm);
     uint8_t r8 = get_r8(emu, &modrm);
 
@@ -711,6 +633,7 @@ void xchg_rm8_r8(Emulator *emu)
 /*
  * xchg rm32 r32: 2|3 bytes
  * Exchanges the contents of operands.
+ * With memory it is always locked (xv6 spinlocks).
  * 1 byte: op (87)
  * 1|2 byte: ModR/M
  */
@@ -719,6 +642,20 @@ void xchg_rm32_r32(Emulator *emu)
     emu->eip += 1;
     ModRM modrm = create_modrm();
     parse_modrm(emu, &modrm);
+    if (modrm.mod != 3)
+    {
+        uint32_t *p = get_atomic_pointer(emu, emu->prefixes.segment, calc_memory_address(emu, &modrm), 4);
+        if (p != NULL)
+        {
+            uint32_t r32 = get_r32(emu, &modrm);
+            uint32_t old = __atomic_exchange_n(p, r32, __ATOMIC_SEQ_CST);
+            set_r32(emu, &modrm, old);
+            /* Lock already taken (xv6 acquire) */
+            if (old == r32)
+                spin_lock_word(emu, p, 4, old);
+            return;
+        }
+    }
     uint32_t rm32 = get_rm32(emu, &modrm);
     uint32_t r32 = get_r32(emu, &modrm);
 
@@ -760,21 +697,6 @@ void mov_rm32_r32(Emulator *emu)
     set_rm32(emu, &modrm, r32);
 }
 
-/*
- * mov rm16 r16: 2 bytes
- * Copies value of register specified by REG to ModR/M.
- * 1 byte: op (89)
- * 1 byte: ModR/M
- */
-void mov_rm16_r16(Emulator *emu)
-{
-    emu->eip += 1;
-    ModRM modrm = create_modrm();
-    parse_modrm(emu, &modrm);
-    uint16_t r16 = get_r16(emu, &modrm);
-    set_rm16(emu, &modrm, r16);
-}
-
 /*
  * mov r8 rm8: 2 bytes
  * Copies 8-bit value from register or memory specified by ModR/M to the register
@@ -864,5 +786,17 @@ void pop_rm32(Emulator *emu)
     emu->eip += 1;
     ModRM modrm = create_modrm();
     parse_modrm(emu, &modrm);
-    set_rm32(emu, &modrm, pop32(emu));
+    uint32_t esp = get_register32(emu, ESP);
+    uint32_t value = load_stack32(emu, esp);
+    /* The address is taken with ESP popped (pop [esp]), which it is once the store is done. */
+    set_register32(emu, ESP, esp + 4);
+    if (modrm.mod != 3)
+    {
+        uint32_t address = calc_memory_address(emu, &modrm);
+        set_register32(emu, ESP, esp);
+        set_memory32(emu, emu->prefixes.segment, address, value);
+        set_register32(emu, ESP, esp + 4);
+        return;
+    }
+    set_rm32(emu, &modrm, value);
 }
\ No newline at end of file
@@ -23,20 +23,6 @@ void xchg_r32_r32(Emulator *emu)
     emu->eip += 1;
 }
 
-/*
- * xchg r16 r16: 1 byte
- * Exchanges values of AX and r16.
- * 1 byte: op (90 ~ 97)
- */
-void xchg_r16_r16(Emulator *emu)
-{
-    uint8_t reg = get_code8(emu, 0) - 0x90;
-    uint16_t original_val = get_register16(emu, reg);
-    set_register16(emu, reg, get_register16(emu, EAX));
-    set_register16(emu, EAX, original_val);
-    emu->eip += 1;
-}
-
 /*
  * cwde: 1 byte
  * Sign-extend word(AX) to double word(EAX).
@@ -85,7 +71,7 @@ void cdq(Emulator *emu)
 void ptr_call(Emulator *emu)
 {
     push_segment_register(emu, CS);
-    if (emu->is_pe)
+    if (emu->is_pe != emu->prefixes.operand_size)
         push32(emu, emu->eip + 7);
     else
         push32(emu, emu->eip + 5);
@@ -105,7 +91,7 @@ void pushfd(Emulator *emu)
     else
         push16(emu, (uint16_t)emu->eflags);
     */
-    push32(emu, emu->eflags);
+    push32(emu, get_eflags(emu));
     emu->eip += 1;
 };
 
@@ -124,7 +110,7 @@ void popfd(Emulator *emu)
         value = (uint32_t)pop16(emu);
     emu->eflags = value;
     */
-    emu->eflags = pop32(emu);
+    set_eflags(emu, pop32(emu));
     emu->eip += 1;
 };
 
@@ -138,9 +124,9 @@ void sahf(Emulator *emu)
     /* AH value AND 1101 0101  128 64 16 4 1 = 213 */
     uint8_t ah_val = get_register8(emu, AH) & 213;
     /* Higher half of EFLAGS: AND 0xFFFF0000 */
-    uint32_t eflags_h = emu->eflags & 0xFFFF0000;
+    uint32_t eflags_h = get_eflags(emu) & 0xFFFF0000;
 
-    emu->eflags = eflags_h | ah_val;
+    set_eflags(emu, eflags_h | ah_val);
     emu->eip += 1;
 }
 
@@ -151,7 +137,7 @@ void sahf(Emulator *emu)
  */
 void lahf(Emulator *emu)
 {
-    uint8_t eflags_l = emu->eflags & 213;
+    uint8_t eflags_l = get_eflags(emu) & 213;
     set_register8(emu, AH, eflags_l);
     emu->eip += 1;
 }
\ No newline at end of file
@@ -18,7 +18,7 @@
 void mov_al_moffs8(Emulator *emu)
 {
     uint32_t offset = get_code32(emu, 1);
-    uint8_t mem_val = get_memory8(emu, DS, offset);
+    uint8_t mem_val = get_memory8(emu, emu->prefixes.segment, offset);
     set_register8(emu, AL, mem_val);
     emu->eip += 5;
 }
@@ -32,7 +32,7 @@ void mov_al_moffs8(Emulator *emu)
 void mov_eax_moffs32(Emulator *emu)
 {
     uint32_t offset = get_code32(emu, 1);
-    uint32_t mem_val = get_memory32(emu, DS, offset);
+    uint32_t mem_val = get_memory32(emu, emu->prefixes.segment, offset);
     set_register32(emu, EAX, mem_val);
     emu->eip += 5;
 }
@@ -47,21 +47,7 @@ void mov_moffs8_al(Emulator *emu)
 {
     uint32_t offset = get_code32(emu, 1);
     uint8_t al_val = get_register8(emu, AL);
-    set_memory8(emu, DS, offset, al_val);
-    emu->eip += 5;
-}
-
-/*
- * mov moffs16 ax: 5 bytes
- * Copies AX value to moffs. (16 bit)
- * 1 byte: op (A3)
- * 4 byte: moffs
- */
-void mov_moffs16_ax(Emulator *emu)
-{
-    uint32_t offset = get_code32(emu, 1);
-    uint16_t ax_val = get_register32(emu, EAX);
-    set_memory16(emu, DS, offset, ax_val);
+    set_memory8(emu, emu->prefixes.segment, offset, al_val);
     emu->eip += 5;
 }
 
@@ -75,7 +61,7 @@ void mov_moffs32_eax(Emulator *emu)
 {
     uint32_t offset = get_code32(emu, 1);
     uint32_t eax_val = get_register32(emu, EAX);
-    set_memory32(emu, DS, offset, eax_val);
+    set_memory32(emu, emu->prefixes.segment, offset, eax_val);
     emu->eip += 5;
 }
 
@@ -106,7 +92,7 @@ void movsb(Emulator *emu)
 {
     uint32_t esi_val = get_register32(emu, ESI);
     uint32_t edi_val = get_register32(emu, EDI);
-    uint8_t ds_esi_val = get_memory8(emu, DS, esi_val);
+    uint8_t ds_esi_val = get_memory8(emu, emu->prefixes.segment, esi_val);
     set_memory8(emu, ES, edi_val, ds_esi_val);
     update_esi_edi(emu, esi_val, edi_val, 1);
     emu->eip += 1;
@@ -121,7 +107,7 @@ void movsd(Emulator *emu)
 {
     uint32_t esi_val = get_register32(emu, ESI);
     uint32_t edi_val = get_register32(emu, EDI);
-    uint32_t ds_esi_val = get_memory32(emu, DS, esi_val);
+    uint32_t ds_esi_val = get_memory32(emu, emu->prefixes.segment, esi_val);
     set_memory32(emu, ES, edi_val, ds_esi_val);
     update_esi_edi(emu, esi_val, edi_val, 4);
     emu->eip += 1;
@@ -136,7 +122,7 @@ void cmpsb(Emulator *emu)
 {
     uint32_t esi_val = get_register32(emu, ESI);
     uint32_t edi_val = get_register32(emu, EDI);
-    uint8_t ds_esi_val = get_memory8(emu, DS, esi_val);
+    uint8_t ds_esi_val = get_memory8(emu, emu->prefixes.segment, esi_val);
     uint8_t es_edi_val = get_memory8(emu, ES, edi_val);
     uint64_t result = (uint16_t)ds_esi_val - (uint16_t)es_edi_val;
     update_eflags_sub(emu, ds_esi_val, es_edi_val, result);
@@ -153,7 +139,7 @@ void cmpsd(Emulator *emu)
 {
     uint32_t esi_val = get_register32(emu, ESI);
     uint32_t edi_val = get_register32(emu, EDI);
-    uint32_t ds_esi_val = get_memory32(emu, DS, esi_val);
+    uint32_t ds_esi_val = get_memory32(emu, emu->prefixes.segment, esi_val);
     uint32_t es_edi_val = get_memory32(emu, ES, edi_val);
     uint64_t result = (uint64_t)ds_esi_val - (uint64_t)es_edi_val;
     update_eflags_sub(emu, ds_esi_val, es_edi_val, result);
@@ -229,7 +215,7 @@ void stosd(Emulator *emu)
 void lodsb(Emulator *emu)
 {
     uint32_t esi_val = get_register32(emu, ESI);
-    uint8_t ds_esi_val = get_memory8(emu, DS, esi_val);
+    uint8_t ds_esi_val = get_memory8(emu, emu->prefixes.segment, esi_val);
     set_register8(emu, AL, ds_esi_val);
     update_counter(emu, ESI, esi_val, 1);
     emu->eip += 1;
@@ -243,7 +229,7 @@ void lodsb(Emulator *emu)
 void lodsd(Emulator *emu)
 {
     uint32_t esi_val = get_register32(emu, ESI);
-    uint32_t ds_esi_val = get_memory32(emu, DS, esi_val);
+    uint32_t ds_esi_val = get_memory32(emu, emu->prefixes.segment, esi_val);
     set_register32(emu, EAX, ds_esi_val);
     update_counter(emu, ESI, esi_val, 4);
     emu->eip += 1;
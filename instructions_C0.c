@@ -253,8 +253,8 @@ void ret(Emulator *emu)
 void load_seg_r32(Emulator *emu, int seg_index, ModRM *modrm)
 {
     uint32_t address = calc_memory_address(emu, modrm);
-    uint16_t seg_val = get_memory16(emu, DS, address);
-    uint32_t offset = get_memory32(emu, DS, address + 2);
+    uint16_t seg_val = get_memory16(emu, emu->prefixes.segment, address);
+    uint32_t offset = get_memory32(emu, emu->prefixes.segment, address + 2);
     set_seg_register16(emu, seg_index, seg_val);
     set_register32(emu, modrm->reg_index, offset);
 }
@@ -304,23 +304,6 @@ void mov_rm8_imm8(Emulator *emu)
     set_rm8(emu, &modrm, value);
 }
 
-/*
- * mov rm16 imm16: 5 bytes
- * Copies imm value to register or memory specified by ModR/M (rm16).
- * 1 byte: op (C7)
- * 1 byte: ModR/M
- * 2 bytes: value
- */
-void mov_rm16_imm16(Emulator *emu)
-{
-    emu->eip += 1;
-    ModRM modrm = create_modrm();
-    parse_modrm(emu, &modrm);
-    uint16_t value = get_code16(emu, 0);
-    emu->eip += 2;
-    set_rm32(emu, &modrm, value);
-}
-
 /*
  * mov rm32 imm32: 5 bytes
  * Copies imm value to register or memory specified by ModR/M (rm32).
@@ -346,10 +329,10 @@ void mov_rm32_imm32(Emulator *emu)
 void leave(Emulator *emu)
 {
     uint32_t ebp_val = get_register32(emu, EBP);
-    /* Update ESP with current EBP value. */
-    set_register32(emu, ESP, ebp_val);
-    /* Pop from stack and set it on EBP. */
-    set_register32(emu, EBP, pop32(emu));
+    /* Pop from stack at EBP, before ESP moves to it. */
+    uint32_t value = load_stack32(emu, ebp_val);
+    set_register32(emu, ESP, ebp_val + 4);
+    set_register32(emu, EBP, value);
     emu->eip += 1;
 }
 
@@ -360,8 +343,17 @@ void leave(Emulator *emu)
  */
 void ret_far(Emulator *emu)
 {
-    emu->eip = pop32(emu);
-    pop_segment_register(emu, CS);
+    uint32_t frame[2];
+    if (!emu->is_pe)
+    {
+        emu->eip = pop32(emu);
+        pop_segment_register(emu, CS);
+        return;
+    }
+    /* EIP, CS */
+    pop32_frame(emu, frame, 2);
+    emu->eip = frame[0];
+    set_seg_register16(emu, CS, (uint16_t)frame[1]);
 }
 
 /*
@@ -386,16 +378,24 @@ void iret(Emulator *emu)
 {
     // printf("iret\n");
     uint8_t cpl = get_seg_register16(emu, CS) & 3;
-
-    emu->eip = pop32(emu);
-    pop_segment_register(emu, CS);
+    uint32_t esp = get_register32(emu, ESP);
+
+    uint32_t frame[5];
+
+    /* EIP, CS, EFLAGS, and ESP, SS to an outer level: all read before anything changes */
+    read_stack_frame(emu, esp, frame, 3);
+    int outer = (frame[1] & 3) > cpl;
+    if (outer)
+        read_stack_frame(emu, esp + 12, frame + 3, 2);
+    set_register32(emu, ESP, esp + 12);
+    emu->eip = frame[0];
+    set_seg_register16(emu, CS, (uint16_t)frame[1]);
     /* By right each flag such as IOPL should be checked if CPL is 0 or not. */
-    emu->eflags = pop32(emu);
+    set_eflags(emu, frame[2]);
 
-    if ((get_seg_register16(emu, CS) & 3) > cpl)
+    if (outer)
     {
-        uint32_t esp_val = pop32(emu);
-        pop_segment_register(emu, SS);
-        set_register32(emu, ESP, esp_val);
+        set_seg_register16(emu, SS, (uint16_t)frame[4]);
+        set_register32(emu, ESP, frame[3]);
     }
 }
\ No newline at end of file
@@ -170,6 +170,33 @@ void out_imm8_eax(Emulator *emu)
     emu->eip += 2;
 }
 
+/*
+ * in ax imm8: 2 bytes (after 66 prefix)
+ * Inputs a word from port imm8 to AX.
+ * 1 byte: op (E5)
+ * 1 byte: imm8
+ */
+void in_ax_imm8(Emulator *emu)
+{
+    uint16_t address = get_code8(emu, 1);
+    uint16_t value = io_in16(emu, address);
+    set_register16(emu, EAX, value);
+    emu->eip += 2;
+}
+
+/*
+ * out imm8 ax: 2 bytes (after 66 prefix)
+ * Outputs a word on AX to imm8 port.
+ * 1 byte: op (E7)
+ * 1 byte: imm8
+ */
+void out_imm8_ax(Emulator *emu)
+{
+    uint16_t address = get_code8(emu, 1);
+    io_out16(emu, address, get_register16(emu, EAX));
+    emu->eip += 2;
+}
+
 /*
  * call rel32: 5 bytes
  * Jumps by 32-bit number relatively from next address.
@@ -199,17 +226,18 @@ void near_jump(Emulator *emu)
 }
 
 /*
- * jmp ptr16:16/32: 7 bytes
- * Jumps in ptr16:16/32.
+ * jmp ptr16:16/32: 5|7 bytes
+ * Jumps in ptr16:16/32, ptr16:32 in protected mode unless 66 switches
+ * them round (16-bit code entering protected mode uses 66 EA).
  * 1 byte: op (EA)
+ * 2|4 byte: eip
  * 2 byte: cs value
- * 4 byte: eip
  */
 void ptr_jump(Emulator *emu)
 {
     uint32_t eip_val;
     uint16_t cs_val;
-    if (emu->is_pe)
+    if (emu->is_pe != emu->prefixes.operand_size)
     {
         eip_val = get_code32(emu, 1);
         cs_val = get_code16(emu, 5);
@@ -290,4 +318,28 @@ void out_dx_eax(Emulator *emu)
     uint32_t value = get_register32(emu, EAX);
     io_out32(emu, address, value);
     emu->eip += 1;
-}
\ No newline at end of file
+}
+/*
+ * in ax dx: 1 byte (after 66 prefix)
+ * Input a word to AX from IO address specified on DX.
+ * 1 byte: op (ED)
+ */
+void in_ax_dx(Emulator *emu)
+{
+    uint16_t address = get_register32(emu, EDX) & 0xffff;
+    uint16_t value = io_in16(emu, address);
+    set_register16(emu, EAX, value);
+    emu->eip += 1;
+}
+
+/*
+ * out dx ax: 1 byte (after 66 prefix)
+ * Output a word on AX to IO address specified on DX.
+ * 1 byte: op (EF)
+ */
+void out_dx_ax(Emulator *emu)
+{
+    uint16_t address = get_register32(emu, EDX) & 0xffff;
+    io_out16(emu, address, get_register16(emu, EAX));
+    emu->eip += 1;
+}
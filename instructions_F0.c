@@ -13,6 +13,18 @@
 #include "lapic.h"
 #include "util.h"
 
+/*
+ * hlt: 1 byte
+ * Stops executing until an interrupt is delivered,
+ * which returns to the next instruction.
+ * 1 byte: op (F4)
+ */
+void hlt(Emulator *emu)
+{
+    emu->eip += 1;
+    raise_attention(emu, ATTENTION_HALT);
+}
+
 /*
  * cmc: 1 byte
  * Flips carry flag.
@@ -384,7 +396,7 @@ void sti(Emulator *emu)
 {
     set_int_flag(emu, 1);
     emu->int_enabled = 1;
-    lapic_send_intr(emu->lapic);
+    raise_attention(emu, ATTENTION_INTERRUPT);
     emu->eip += 1;
 }
 
@@ -518,21 +530,31 @@ static void jmp_rm32(Emulator *emu, ModRM *modrm)
  * 1 byte: op (FF/5)
  * 1|2 bytes: ModRM
  */
-static void jmp_m_ptr(Emulator *emu, ModRM *modrm)
+static void read_far_pointer(Emulator *emu, ModRM *modrm, uint16_t *cs_val, uint32_t *eip_val)
 {
     uint32_t address = calc_memory_address(emu, modrm);
-    uint16_t cs_val = get_memory16(emu, DS, address);
-    uint32_t eip_val;
+    *cs_val = get_memory16(emu, emu->prefixes.segment, address);
     if (emu->is_pe)
-        eip_val = get_memory32(emu, DS, address + 2);
+        *eip_val = get_memory32(emu, emu->prefixes.segment, address + 2);
     else
-        eip_val = get_memory16(emu, DS, address + 2);
+        *eip_val = get_memory16(emu, emu->prefixes.segment, address + 2);
+}
 
+static void far_jump(Emulator *emu, uint16_t cs_val, uint32_t eip_val)
+{
     set_seg_register16(emu, CS, cs_val);
     emu->eip = eip_val;
     check_protected_mode_entry(emu);
 }
 
+static void jmp_m_ptr(Emulator *emu, ModRM *modrm)
+{
+    uint16_t cs_val;
+    uint32_t eip_val;
+    read_far_pointer(emu, modrm, &cs_val, &eip_val);
+    far_jump(emu, cs_val, eip_val);
+}
+
 /*
  * call m16:32: 2|3 bytes
  * Jumps with m16:16/32 after pushing CS and EIP.
@@ -541,9 +563,21 @@ static void jmp_m_ptr(Emulator *emu, ModRM *modrm)
  */
 static void call_m_ptr(Emulator *emu, ModRM *modrm)
 {
-    push_segment_register(emu, CS);
-    push32(emu, emu->eip);
-    jmp_m_ptr(emu, modrm);
+    uint16_t cs_val;
+    uint32_t eip_val;
+    /* The pointer is read before anything is pushed, as the read can fault. */
+    read_far_pointer(emu, modrm, &cs_val, &eip_val);
+    if (emu->is_pe)
+    {
+        uint32_t frame[] = {get_seg_register16(emu, CS), emu->eip};
+        push32_frame(emu, frame, 2);
+    }
+    else
+    {
+        push_segment_register(emu, CS);
+        push32(emu, emu->eip);
+    }
+    far_jump(emu, cs_val, eip_val);
 }
 
 /*
@@ -0,0 +1,151 @@
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "instructions.h"
+#include "emulator_functions.h"
+#include "block_cache.h"
+
+/*
+ * Register-direct forms of rm32 instructions (Mod: 11)
+ * Picked by the block decoder instead of the generic handler,
+ * they read ModR/M decoded in the block and access registers only.
+ * The semantics of each operation are defined once below and are
+ * shared by the rm32 r32, r32 rm32 and rm32 imm8 forms.
+ */
+
+static inline uint32_t op_add(Emulator *emu, uint32_t a, uint32_t b)
+{
+    uint64_t result = (uint64_t)a + (uint64_t)b;
+    update_eflags_add(emu, a, b, result);
+    return result;
+}
+
+static inline uint32_t op_or(Emulator *emu, uint32_t a, uint32_t b)
+{
+    uint32_t result = a | b;
+    update_eflags_logical_ops(emu, result);
+    return result;
+}
+
+static inline uint32_t op_and(Emulator *emu, uint32_t a, uint32_t b)
+{
+    uint32_t result = a & b;
+    update_eflags_logical_ops(emu, result);
+    return result;
+}
+
+static inline uint32_t op_sub(Emulator *emu, uint32_t a, uint32_t b)
+{
+    uint64_t result = (uint64_t)a - (uint64_t)b;
+    update_eflags_sub(emu, a, b, result);
+    return result;
+}
+
+static inline uint32_t op_xor(Emulator *emu, uint32_t a, uint32_t b)
+{
+    uint32_t result = a ^ b;
+    update_eflags_logical_ops(emu, result);
+    return result;
+}
+
+static inline uint32_t op_mov(Emulator *emu, uint32_t a, uint32_t b)
+{
+    return b;
+}
+
+/* op rm32 r32: 2 bytes, result to rm32 unless store is 0 (cmp, test) */
+#define DEFINE_RM32_R32(name, fn, store)                                           \
+    static void name(Emulator *emu)                                                \
+    {                                                                              \
+        ModRM *modrm = &emu->decoded->modrm;                                       \
+        uint32_t result = fn(emu, emu->registers[modrm->rm], emu->registers[modrm->reg_index]); \
+        if (store)                                                                 \
+            emu->registers[modrm->rm] = result;                                    \
+        emu->eip += 2;                                                             \
+    }
+
+/* op r32 rm32: 2 bytes, result to r32 unless store is 0 (cmp) */
+#define DEFINE_R32_RM32(name, fn, store)                                           \
+    static void name(Emulator *emu)                                                \
+    {                                                                              \
+        ModRM *modrm = &emu->decoded->modrm;                                       \
+        uint32_t result = fn(emu, emu->registers[modrm->reg_index], emu->registers[modrm->rm]); \
+        if (store)                                                                 \
+            emu->registers[modrm->reg_index] = result;                             \
+        emu->eip += 2;                                                             \
+    }
+
+/* op rm32 imm8 (83): 3 bytes, imm8 is sign-extended */
+#define DEFINE_RM32_IMM8(name, fn, store)                                          \
+    static void name(Emulator *emu)                                                \
+    {                                                                              \
+        ModRM *modrm = &emu->decoded->modrm;                                       \
+        uint32_t imm8 = (int32_t)get_sign_code8(emu, 2);                           \
+        uint32_t result = fn(emu, emu->registers[modrm->rm], imm8);                \
+        if (store)                                                                 \
+            emu->registers[modrm->rm] = result;                                    \
+        emu->eip += 3;                                                             \
+    }
+
+DEFINE_RM32_R32(add_rm32_r32_reg, op_add, 1)
+DEFINE_RM32_R32(or_rm32_r32_reg, op_or, 1)
+DEFINE_RM32_R32(and_rm32_r32_reg, op_and, 1)
+DEFINE_RM32_R32(sub_rm32_r32_reg, op_sub, 1)
+DEFINE_RM32_R32(xor_rm32_r32_reg, op_xor, 1)
+DEFINE_RM32_R32(cmp_rm32_r32_reg, op_sub, 0)
+DEFINE_RM32_R32(test_rm32_r32_reg, op_and, 0)
+DEFINE_RM32_R32(mov_rm32_r32_reg, op_mov, 1)
+
+DEFINE_R32_RM32(add_r32_rm32_reg, op_add, 1)
+DEFINE_R32_RM32(or_r32_rm32_reg, op_or, 1)
+DEFINE_R32_RM32(and_r32_rm32_reg, op_and, 1)
+DEFINE_R32_RM32(sub_r32_rm32_reg, op_sub, 1)
+DEFINE_R32_RM32(xor_r32_rm32_reg, op_xor, 1)
+DEFINE_R32_RM32(cmp_r32_rm32_reg, op_sub, 0)
+DEFINE_R32_RM32(mov_r32_rm32_reg, op_mov, 1)
+
+DEFINE_RM32_IMM8(add_rm32_imm8_reg, op_add, 1)
+DEFINE_RM32_IMM8(or_rm32_imm8_reg, op_or, 1)
+DEFINE_RM32_IMM8(and_rm32_imm8_reg, op_and, 1)
+DEFINE_RM32_IMM8(sub_rm32_imm8_reg, op_sub, 1)
+DEFINE_RM32_IMM8(xor_rm32_imm8_reg, op_xor, 1)
+DEFINE_RM32_IMM8(cmp_rm32_imm8_reg, op_sub, 0)
+
+static instruction_func_t *reg_forms[256] = {
+    [0x01] = add_rm32_r32_reg,
+    [0x03] = add_r32_rm32_reg,
+    [0x09] = or_rm32_r32_reg,
+    [0x0B] = or_r32_rm32_reg,
+    [0x21] = and_rm32_r32_reg,
+    [0x23] = and_r32_rm32_reg,
+    [0x29] = sub_rm32_r32_reg,
+    [0x2B] = sub_r32_rm32_reg,
+    [0x31] = xor_rm32_r32_reg,
+    [0x33] = xor_r32_rm32_reg,
+    [0x39] = cmp_rm32_r32_reg,
+    [0x3B] = cmp_r32_rm32_reg,
+    [0x85] = test_rm32_r32_reg,
+    [0x89] = mov_rm32_r32_reg,
+    [0x8B] = mov_r32_rm32_reg,
+};
+
+/* 83 by ModR/M REG; adc and sbb are left to code_83. */
+static instruction_func_t *reg_forms_83[8] = {
+    [0] = add_rm32_imm8_reg,
+    [1] = or_rm32_imm8_reg,
+    [4] = and_rm32_imm8_reg,
+    [5] = sub_rm32_imm8_reg,
+    [6] = xor_rm32_imm8_reg,
+    [7] = cmp_rm32_imm8_reg,
+};
+
+instruction_func_t *reg_form_handler(uint8_t op, ModRM *modrm)
+{
+    if (modrm->mod != 3)
+        return NULL;
+    if (op == 0x83)
+        return reg_forms_83[modrm->opcode];
+    return reg_forms[op];
+}
@@ -2,9 +2,13 @@
 #include <stdlib.h>
 
 #include "interrupt.h"
+#include "bios.h"
 #include "emulator_functions.h"
 #include "util.h"
 #include "gdt.h"
+#include "stats.h"
+#include "instructions.h"
+#include "block_cache.h"
 
 /*
  *
@@ -20,19 +24,93 @@
 void lidt(Emulator *emu, ModRM *modrm)
 {
     uint32_t address = calc_memory_address(emu, modrm);
-    uint16_t limit = get_memory16(emu, DS, address);
-    uint32_t base = get_memory32(emu, DS, address + 2);
+    uint16_t limit = get_memory16(emu, emu->prefixes.segment, address);
+    uint32_t base = get_memory32(emu, emu->prefixes.segment, address + 2);
     set_idtr(emu, limit, get_physical_address(emu, DS, base, 0));
 }
 
-/* 
- * Real mode and VM (Virtual 8086) is not supported.
+/* 8 bytes at p_address are in one RAM page, whose generation tells when they are written. */
+static int cacheable(Emulator *emu, uint32_t p_address)
+{
+    return (p_address & 0xFFF) <= 0xFF8 && p_address < emu->memory_size &&
+           emu->page_types[p_address >> 12] == PAGE_RAM;
+}
+
+static uint32_t page_generation(Emulator *emu, uint32_t p_address)
+{
+    return emu->page_info[p_address >> 12].generation;
+}
+
+/* The generation is taken before the entry is read, so a write meanwhile drops it. */
+static GateCache *read_gate(Emulator *emu, uint8_t vector)
+{
+    GateCache *gate = &emu->gates[vector];
+    uint32_t entry_addr = emu->idtr.base + (vector * 8);
+    if (gate->valid && page_generation(emu, entry_addr) == gate->generation)
+        return gate;
+
+    int valid = cacheable(emu, entry_addr);
+    if (valid)
+        gate->generation = page_generation(emu, entry_addr);
+    uint32_t entry1 = _get_memory32(emu, entry_addr);
+    uint32_t entry2 = _get_memory32(emu, entry_addr + 4);
+    gate->selector = entry1 >> 16;
+    gate->offset = (entry1 & 0xFFFF) | (entry2 & 0xFFFF0000);
+    gate->dpl = (entry2 >> 13) & 0x3;
+    gate->valid = valid;
+    return gate;
+}
+
+static TssCache *read_tss_stack(Emulator *emu)
+{
+    TssCache *tss = &emu->tss_cache;
+    uint8_t tss_desc_index = emu->tr >> 3;
+    uint32_t tss_desc_base = emu->gdtr.base + (tss_desc_index * 8);
+    if (tss->valid && tss->ds_base == emu->segment_caches[DS].base &&
+        page_generation(emu, tss_desc_base) == tss->gdt_generation &&
+        page_generation(emu, tss->tss_page << 12) == tss->tss_generation)
+        return tss;
+
+    int valid = cacheable(emu, tss_desc_base);
+    if (valid)
+        tss->gdt_generation = page_generation(emu, tss_desc_base);
+    uint32_t entry1 = _get_memory32(emu, tss_desc_base);
+    uint32_t entry2 = _get_memory32(emu, tss_desc_base + 4);
+    uint32_t tss_base = read_gdt_entry_base(entry1, entry2);
+    /* ESP0 and SS0 */
+    uint32_t p_stack = get_physical_address(emu, DS, tss_base + 4, 0);
+    valid = valid && cacheable(emu, p_stack);
+    if (valid)
+    {
+        tss->tss_page = p_stack >> 12;
+        tss->tss_generation = page_generation(emu, p_stack);
+    }
+    tss->ss0 = (uint16_t)get_memory32(emu, DS, tss_base + 8);
+    tss->esp0 = get_memory32(emu, DS, tss_base + 4);
+    tss->ds_base = emu->segment_caches[DS].base;
+    tss->valid = valid;
+    return tss;
+}
+
+/* Vectors of the exceptions which push an error code */
+static int has_error_code(uint8_t vector)
+{
+    return vector == T_DBLFLT || (vector >= T_TSS && vector <= T_PGFLT) || vector == T_ALIGN;
+}
+
+/*
+ * Real mode: only the BIOS services of software interrupts (bios.h).
+ * VM (Virtual 8086) is not supported.
+ * The frame is pushed with error_code after EIP for the exceptions which have one.
  */
-void handle_interrupt(Emulator *emu, uint8_t vector, int sw)
+static void deliver_interrupt(Emulator *emu, uint8_t vector, int sw, uint32_t error_code)
 {
+    STAT_INC(stats.interrupts[vector]);
     if (!emu->is_pe)
     {
-        printf("Interrupt in real mode not implemented.\n");
+        if (sw && bios_interrupt(emu, vector))
+            return;
+        printf("Interrupt 0x%02X in real mode not implemented.\n", vector);
         panic_exit(emu);
     }
     uint32_t entry_addr = emu->idtr.base + (vector * 8);
@@ -41,39 +119,35 @@ void handle_interrupt(Emulator *emu, uint8_t vector, int sw)
         printf("IDT entry is beyond table limit.\n");
         panic_exit(emu);
     }
-    uint32_t entry1 = _get_memory32(emu, entry_addr);
-    uint32_t entry2 = _get_memory32(emu, entry_addr + 4);
+    GateCache *gate = read_gate(emu, vector);
 
     uint8_t cpl = get_seg_register16(emu, CS) & 3;
-    uint8_t dpl = (entry2 >> 13) & 0x3;
+    uint8_t dpl = gate->dpl;
 
+    /* #GP, the error code is the IDT entry (index, IDT bit) */
     if (sw && (dpl < cpl))
-    {
-        printf("Privilege not met in software interrupt.\n");
-        panic_exit(emu);
-    }
+        raise_exception(emu, T_GPFLT, vector * 8 + 2);
 
-    uint16_t gate_selector = entry1 >> 16;
+    emu->delivering = 1;
+    int pushes_error = !sw && has_error_code(vector);
+    uint16_t gate_selector = gate->selector;
     uint8_t gate_dpl = gate_selector & 3;
-    uint32_t gate_offset = 0 | (entry1 & 0xFFFF) | (entry2 & 0xFFFF0000);
+    uint32_t gate_offset = gate->offset;
     /* Inter-privilege */
     if (gate_dpl < cpl)
     {
         // printf("inter-privilege interrupt: %d\n", vector);
-        // debug_print();
+        // trace_dump(emu);
         uint16_t cur_ss = get_seg_register16(emu, SS);
         uint32_t cur_esp = get_register32(emu, ESP);
         uint16_t cur_cs = get_seg_register16(emu, CS);
         uint32_t cur_eip = emu->eip;
 
-        /* Get TSS */
-        uint8_t tss_desc_index = emu->tr >> 3;
-        uint32_t tss_desc_base = emu->gdtr.base + (tss_desc_index * 8);
-        uint32_t entry1 = _get_memory32(emu, tss_desc_base);
-        uint32_t entry2 = _get_memory32(emu, tss_desc_base + 4);
-        uint32_t tss_base = read_gdt_entry_base(entry1, entry2);
-        uint16_t tss_ss = (uint16_t)get_memory32(emu, DS, tss_base + 8);
-        uint32_t tss_esp = get_memory32(emu, DS, tss_base + 4);
+        /* Get TSS, which is read with the rights of the supervisor (loading SS sets them back) */
+        emu->tlb_supervisor = TLB_SUPERVISOR;
+        TssCache *tss = read_tss_stack(emu);
+        uint16_t tss_ss = tss->ss0;
+        uint32_t tss_esp = tss->esp0;
 
         set_seg_register16(emu, SS, tss_ss);
         set_register32(emu, ESP, tss_esp);
@@ -81,13 +155,8 @@ void handle_interrupt(Emulator *emu, uint8_t vector, int sw)
         set_seg_register16(emu, CS, gate_selector);
         emu->eip = gate_offset;
 
-        push32(emu, cur_ss);
-        push32(emu, cur_esp);
-        push32(emu, emu->eflags);
-        push32(emu, cur_cs);
-        push32(emu, cur_eip);
-        /* error code */
-        // push32(emu, 0);
+        uint32_t frame[] = {cur_ss, cur_esp, get_eflags(emu), cur_cs, cur_eip, error_code};
+        push32_frame(emu, frame, pushes_error ? 6 : 5);
     }
     /* Kernel mode */
     else
@@ -95,14 +164,33 @@ void handle_interrupt(Emulator *emu, uint8_t vector, int sw)
         // printf("intra-level interrupt: %d\n", vector);
         uint16_t cur_cs = get_seg_register16(emu, CS);
         uint32_t cur_eip = emu->eip;
-        push32(emu, emu->eflags);
-        push32(emu, cur_cs);
-        push32(emu, cur_eip);
-        /* error code */
-        // push32(emu, 0);
+        uint32_t frame[] = {get_eflags(emu), cur_cs, cur_eip, error_code};
+        push32_frame(emu, frame, pushes_error ? 4 : 3);
         set_seg_register16(emu, CS, gate_selector);
         emu->eip = gate_offset;
     }
     if (!sw)
         set_int_flag(emu, 0);
-}
\ No newline at end of file
+    emu->delivering = 0;
+}
+
+void handle_interrupt(Emulator *emu, uint8_t vector, int sw)
+{
+    deliver_interrupt(emu, vector, sw, 0);
+}
+
+void raise_exception(Emulator *emu, uint8_t vector, uint32_t error_code)
+{
+    uint32_t eip = current_op_eip(emu);
+    if (emu->fault_return == NULL || emu->delivering)
+    {
+        printf("Exception %d (error code 0x%X, CR2 %08X) at EIP %08X %s.\n", vector, error_code,
+               emu->control_registers[CR2], eip, emu->delivering ? "while delivering an interrupt" : "outside of the run loop");
+        panic_exit(emu);
+    }
+    /* The op is restarted: EIP back at its first prefix, which is parsed again. */
+    emu->eip = eip;
+    clear_prefixes(emu);
+    deliver_interrupt(emu, vector, 0, error_code);
+    longjmp(*emu->fault_return, 1);
+}
@@ -4,6 +4,15 @@
 #include "emulator.h"
 #include "modrm.h"
 
+/* Exceptions */
+#define T_DBLFLT 8
+#define T_TSS 10
+#define T_SEGNP 11
+#define T_STACK 12
+#define T_GPFLT 13
+#define T_PGFLT 14
+#define T_ALIGN 17
+
 #define T_IRQ0 32 // IRQ 0 corresponds to int T_IRQ
 
 #define IRQ_TIMER 0
@@ -15,5 +24,14 @@
 
 void lidt(Emulator *emu, ModRM *modrm);
 void handle_interrupt(Emulator *emu, uint8_t vector, int sw);
+/*
+ * Faults in the op running (an access it can not do): delivers vector
+ * with error_code (for the exceptions which have one) and goes back to
+ * the run loop, with EIP at the op so it is restarted once the guest
+ * handled the fault. Ops only change registers once their accesses can
+ * no longer fault, so restarting them is the same as running them once.
+ * Panics when the fault is raised while an interrupt is delivered.
+ */
+void raise_exception(Emulator *emu, uint8_t vector, uint32_t error_code) __attribute__((noreturn));
 
 #endif
\ No newline at end of file
@@ -1,132 +1,160 @@
 #include "io.h"
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include "emulator.h"
-#include "kbd.h"
-#include "instructions.h"
+#include "machine.h"
 #include "util.h"
+#include "stats.h"
+#include "spin.h"
 
-/* 
- * PS/2 (keyboard) Controller
- * 0x60: in|out: Data Register
- * 0x64: in: Status Register | out: Command Register
- */
-#define PS2DATA 0x60
-#define PS2STACMD 0x64
-
-/* 
- * Serial (COM1)
- * 0x3f8: in|out: Data port
- * 0x3fd: in: Status port
- */
-#define SERIALSTA 0x3fd
-#define SERIALDATA 0x3f8
-#define SERIALLINESTA 0x3fd
-
-/*
- * Disk
- * 0x1F0: Data Register
- * 0x1F2: in|out: Sector Count Register
- * 0x1F3: in|out: LBA Low
- * 0x1F4: in|out: LBA Mid
- * 0x1F5: in|out: LBA High
- * 0x1F6: in|out: Drive/Head Register
- * 0x1F7: in: Status Register | out: Command Register
- */
-#define DISKDATA 0x1f0
-#define DISKSECCOUNT 0x1f2
-#define DISKLBALOW 0x1f3
-#define DISKLBAMID 0x1f4
-#define DISKLBAHIGH 0x1f5
-#define DISKDRVHEAD 0x1f6
-#define DISKSTACMD 0x1f7
+typedef struct
+{
+    io_read_t *read;
+    io_write_t *write;
+    void *device;
+} PortHandler;
 
-uint8_t io_in8(Emulator *emu, uint16_t address)
+typedef struct
+{
+    io_read_bulk_t *read;
+    io_write_bulk_t *write;
+    void *device;
+} BulkHandler;
+
+struct IoPorts
 {
-    switch (address)
+    /* Index 0: 8 bits, 1: 16 bits, 2: 32 bits */
+    PortHandler handlers[3][IO_PORT_COUNT];
+    BulkHandler bulk_handlers[IO_PORT_COUNT];
+};
+
+IoPorts *create_io_ports(void)
+{
+    return calloc(1, sizeof(IoPorts));
+}
+
+void destroy_io_ports(IoPorts *io)
+{
+    free(io);
+}
+
+static int width_index(int size)
+{
+    switch (size)
     {
-    case PS2DATA:
-        return get_kbd_data();
-    case PS2STACMD:
-        return get_kbd_status();
-    case DISKSTACMD:
-        return get_disk_status(emu->disk);
-    case SERIALDATA:
+    case 1:
         return 0;
-        // return getchar();
-    case SERIALLINESTA:
-        return 0x20;
+    case 2:
+        return 1;
+    case 4:
+        return 2;
     default:
-        if (config.verbose)
-            printf("IN8 on port %x not implemented.\n", address);
-        return 0;
+        printf("I/O access of %d bytes not supported.\n", size);
+        panic();
     }
 }
 
-uint32_t io_in32(Emulator *emu, uint16_t address)
+void register_io_ports(IoPorts *io, uint16_t base, uint32_t count, int size, io_read_t *read, io_write_t *write, void *device)
 {
-    switch (address)
+    int width = width_index(size);
+    uint32_t i;
+    if (base + count > IO_PORT_COUNT)
     {
-    case 0x1F0:
-        return read_disk_data32(emu->disk);
-    case SERIALDATA:
-        return 0;
-        // return getchar();
-    default:
-        if (config.verbose)
-            printf("IN32 on port %x not implemented.\n", address);
-        return 0;
+        printf("I/O ports %x - %x out of range.\n", base, base + count - 1);
+        panic();
+    }
+    for (i = 0; i < count; i++)
+    {
+        PortHandler *handler = &io->handlers[width][base + i];
+        handler->read = read;
+        handler->write = write;
+        handler->device = device;
     }
 }
 
-void io_out8(Emulator *emu, uint16_t address, uint8_t value)
+void register_io_bulk32(IoPorts *io, uint16_t address, io_read_bulk_t *read, io_write_bulk_t *write, void *device)
 {
-    switch (address)
+    io->bulk_handlers[address].read = read;
+    io->bulk_handlers[address].write = write;
+    io->bulk_handlers[address].device = device;
+}
+
+static uint32_t io_in(Emulator *emu, uint16_t address, int width)
+{
+    STAT_INC(stats.ports[address]);
+    PortHandler *handler = &emu->machine->io->handlers[width][address];
+    if (handler->read == NULL)
     {
-    case PS2DATA:
-        write_ps2_config_byte(value);
-        break;
-    case PS2STACMD:
-        write_ps2_output_port(value);
-        break;
-    case DISKSECCOUNT:
-        set_sec_count(emu->disk, value);
-        break;
-    case DISKLBALOW:
-        set_lba_low(emu->disk, value);
-        break;
-    case DISKLBAMID:
-        set_lba_mid(emu->disk, value);
-        break;
-    case DISKLBAHIGH:
-        set_lba_high(emu->disk, value);
-        break;
-    case DISKDRVHEAD:
-        set_drive_head(emu->disk, value);
-        break;
-    case DISKSTACMD:
-        set_disk_command(emu->disk, value);
-        break;
-    case SERIALDATA:
-        putchar(value);
-        break;
-    default:
         if (config.verbose)
-            printf("OUT8 on port %x not implemented.\n", address);
-        break;
+            printf("IN%d on port %x not implemented.\n", 8 << width, address);
+        return 0;
     }
+    uint32_t value = handler->read(emu, handler->device, address);
+    spin_port(emu, address, value);
+    return value;
 }
 
-void io_out32(Emulator *emu, uint16_t address, uint32_t value)
+static void io_out(Emulator *emu, uint16_t address, uint32_t value, int width)
 {
-    switch (address)
+    STAT_INC(stats.ports[address]);
+    spin_reset(emu);
+    PortHandler *handler = &emu->machine->io->handlers[width][address];
+    if (handler->write == NULL)
     {
-    case SERIALDATA:
-        putchar(value);
-        break;
-    default:
         if (config.verbose)
-            printf("OUT32 on port %x not implemented.\n", address);
-        break;
+            printf("OUT%d on port %x not implemented.\n", 8 << width, address);
+        return;
     }
+    handler->write(emu, handler->device, address, value);
+}
+
+uint8_t io_in8(Emulator *emu, uint16_t address)
+{
+    return io_in(emu, address, 0);
+}
+
+uint16_t io_in16(Emulator *emu, uint16_t address)
+{
+    return io_in(emu, address, 1);
+}
+
+uint32_t io_in32(Emulator *emu, uint16_t address)
+{
+    return io_in(emu, address, 2);
+}
+
+void io_out8(Emulator *emu, uint16_t address, uint8_t value)
+{
+    io_out(emu, address, value, 0);
+}
+
+void io_out16(Emulator *emu, uint16_t address, uint16_t value)
+{
+    io_out(emu, address, value, 1);
+}
+
+void io_out32(Emulator *emu, uint16_t address, uint32_t value)
+{
+    io_out(emu, address, value, 2);
+}
+
+uint32_t io_in_bulk32(Emulator *emu, uint16_t address, uint8_t *dst, uint32_t count)
+{
+    BulkHandler *handler = &emu->machine->io->bulk_handlers[address];
+    if (handler->read == NULL)
+        return 0;
+    uint32_t done = handler->read(emu, handler->device, address, dst, count);
+    STAT_ADD(stats.ports[address], done);
+    return done;
+}
+
+uint32_t io_out_bulk32(Emulator *emu, uint16_t address, const uint8_t *src, uint32_t count)
+{
+    BulkHandler *handler = &emu->machine->io->bulk_handlers[address];
+    if (handler->write == NULL)
+        return 0;
+    uint32_t done = handler->write(emu, handler->device, address, src, count);
+    STAT_ADD(stats.ports[address], done);
+    return done;
 }
@@ -5,10 +5,48 @@
 
 #include "emulator.h"
 
+/*
+ * I/O port space
+ * Each of the 64K ports has a handler per access width (8, 16, 32 bits)
+ * registered by the device owning it, with the device's context.
+ * Accesses to ports without a handler read 0 and are ignored otherwise.
+ * Every machine has its own table (Machine.io).
+ */
+#define IO_PORT_COUNT 0x10000
+
+typedef uint32_t io_read_t(Emulator *emu, void *device, uint16_t address);
+typedef void io_write_t(Emulator *emu, void *device, uint16_t address, uint32_t value);
+/*
+ * count dwords of REP INSD/OUTSD at once, for ports which can
+ * (disk data register). Returns the number done, 0 to fall back to
+ * one access at a time.
+ */
+typedef uint32_t io_read_bulk_t(Emulator *emu, void *device, uint16_t address, uint8_t *dst, uint32_t count);
+typedef uint32_t io_write_bulk_t(Emulator *emu, void *device, uint16_t address, const uint8_t *src, uint32_t count);
+
+/* Port table of one machine */
+typedef struct IoPorts IoPorts;
+
+IoPorts *create_io_ports(void);
+void destroy_io_ports(IoPorts *io);
+
+/*
+ * Registers handlers for count ports from base, of the access size
+ * (1, 2 or 4 bytes). read or write may be NULL for a direction the ports
+ * do not have. Registering a port again replaces its handler.
+ */
+void register_io_ports(IoPorts *io, uint16_t base, uint32_t count, int size, io_read_t *read, io_write_t *write, void *device);
+void register_io_bulk32(IoPorts *io, uint16_t address, io_read_bulk_t *read, io_write_bulk_t *write, void *device);
+
 uint8_t io_in8(Emulator *emu, uint16_t address);
+uint16_t io_in16(Emulator *emu, uint16_t address);
 uint32_t io_in32(Emulator *emu, uint16_t address);
 
 void io_out8(Emulator *emu, uint16_t address, uint8_t value);
+void io_out16(Emulator *emu, uint16_t address, uint16_t value);
 void io_out32(Emulator *emu, uint16_t address, uint32_t value);
 
+uint32_t io_in_bulk32(Emulator *emu, uint16_t address, uint8_t *dst, uint32_t count);
+uint32_t io_out_bulk32(Emulator *emu, uint16_t address, const uint8_t *src, uint32_t count);
+
 #endif
@@ -3,45 +3,116 @@
 
 #include "ioapic.h"
 #include "lapic.h"
+#include "snapshot.h"
 
-IOAPIC *ioapic;
-
-void init_ioapic()
+IOAPIC *create_ioapic(void)
 {
-    ioapic = malloc(sizeof(IOAPIC));
+    IOAPIC *ioapic = calloc(1, sizeof(IOAPIC));
+    int i;
     ioapic->select_register = 0x0;
     ioapic->window_register = 0x0;
     ioapic->id_register = 0x0;
     ioapic->ver_register = 0x170011;
     ioapic->arb_register = 0x0;
-    memset(ioapic->redirect_tbl, 0, sizeof(ioapic->redirect_tbl));
+    for (i = 0; i < IOAPIC_PINS; i++)
+    {
+        ioapic->redirect_tbl[i * 2] = IOAPIC_MASKED;
+        ioapic->redirect_tbl[i * 2 + 1] = 0;
+        ioapic->routes[i] = 0;
+    }
+    return ioapic;
 }
 
-void add_lapic(uint8_t index, LAPIC *lapic)
+void add_lapic(IOAPIC *ioapic, uint8_t index, LAPIC *lapic)
 {
     ioapic->lapic[index] = lapic;
 }
 
-static uint8_t get_dest_id(uint8_t irq)
+/* Physical destinations are matched against the APIC IDs now, guests set those up first. */
+static uint32_t decode_route(IOAPIC *ioapic, int pin)
 {
-    uint8_t i;
-    for (i = 0; i < 48; i += 2)
+    uint32_t low = ioapic->redirect_tbl[pin * 2];
+    uint8_t dest = ioapic->redirect_tbl[pin * 2 + 1] >> IOAPIC_DEST_SHIFT;
+    uint32_t route = low & IOAPIC_VECTOR;
+    uint32_t targets = 0;
+    int i;
+    if (low & IOAPIC_MASKED)
+        return 0;
+    switch (low & IOAPIC_DELIVERY_MODE)
+    {
+    case IOAPIC_LOWEST:
+        route |= IOAPIC_ROUTE_LOWEST;
+        break;
+    case IOAPIC_FIXED:
+        break;
+    default:
+        return 0;
+    }
+    if (low & IOAPIC_LOGICAL)
+        return route | IOAPIC_ROUTE_LOGICAL | (uint32_t)dest << IOAPIC_ROUTE_DEST_SHIFT;
+    for (i = 0; i < IOAPIC_MAX_LAPICS; i++)
+    {
+        if (ioapic->lapic[i] != NULL && lapic_matches_destination(ioapic->lapic[i], 0, dest))
+            targets |= 1u << i;
+    }
+    return route | targets << IOAPIC_ROUTE_DEST_SHIFT;
+}
+
+static void update_route(IOAPIC *ioapic, int pin)
+{
+    __atomic_store_n(&ioapic->routes[pin], decode_route(ioapic, pin), __ATOMIC_RELEASE);
+}
+
+void ioapic_int_to_lapic(IOAPIC *ioapic, uint8_t irq)
+{
+    if (irq >= IOAPIC_PINS)
+        return;
+    uint32_t route = __atomic_load_n(&ioapic->routes[irq], __ATOMIC_ACQUIRE);
+    uint32_t targets = (route >> IOAPIC_ROUTE_DEST_SHIFT) & 0xFF;
+    if (targets == 0)
+        return;
+    /* LDR can change after the entry was written, so logical destinations are matched now. */
+    if (route & IOAPIC_ROUTE_LOGICAL)
     {
-        if (irq == ioapic->redirect_tbl[i])
+        uint8_t dest = targets;
+        int i;
+        targets = 0;
+        for (i = 0; i < IOAPIC_MAX_LAPICS; i++)
         {
-            return ioapic->redirect_tbl[i + 1];
+            if (ioapic->lapic[i] != NULL && lapic_matches_destination(ioapic->lapic[i], 1, dest))
+                targets |= 1u << i;
         }
     }
-    return 0;
+    /* Lowest priority goes to the first destination, without arbitration (as IPIs). */
+    while (targets != 0)
+    {
+        lapic_write_to_irr(ioapic->lapic[__builtin_ctz(targets)], route & IOAPIC_VECTOR);
+        if (route & IOAPIC_ROUTE_LOWEST)
+            break;
+        targets &= targets - 1;
+    }
 }
 
-void ioapic_int_to_lapic(uint8_t irq)
+/* Register selected by IOREGSEL, NULL if it is not one to read or write */
+static uint32_t *selected_register(IOAPIC *ioapic)
 {
-    uint8_t dest_id = get_dest_id(irq);
-    lapic_write_to_irr(ioapic->lapic[dest_id], irq);
+    uint32_t select = ioapic->select_register;
+    switch (select)
+    {
+    case 0x0:
+        return &ioapic->id_register;
+    case 0x1:
+        return &ioapic->ver_register;
+    case 0x2:
+        return &ioapic->arb_register;
+    default:
+        if (select >= 0x10 && select < 0x10 + IOAPIC_PINS * 2)
+            return &ioapic->redirect_tbl[select - 0x10];
+        return NULL;
+    }
 }
 
-void ioapic_write_reg(uint32_t addr, uint32_t val)
+void ioapic_write_reg(IOAPIC *ioapic, uint32_t addr, uint32_t val)
 {
     uint8_t offset = addr - IOAPIC_DEFAULT_BASE;
     /* Writing on selector register. */
@@ -49,18 +120,8 @@ void ioapic_write_reg(uint32_t addr, uint32_t val)
     {
         ioapic->select_register = val;
         /* Moves value into window register when selector register is set. */
-        if (val == 0x0)
-        {
-            ioapic->window_register = ioapic->id_register;
-        }
-        else if (val == 0x1)
-        {
-            ioapic->window_register = ioapic->ver_register;
-        }
-        else if (val == 0x2)
-        {
-            ioapic->window_register = ioapic->arb_register;
-        }
+        uint32_t *reg = selected_register(ioapic);
+        ioapic->window_register = reg != NULL ? *reg : 0;
         return;
     }
     /* Writing on window register. */
@@ -68,14 +129,18 @@ void ioapic_write_reg(uint32_t addr, uint32_t val)
     {
         if (ioapic->select_register >= 0x10)
         {
-            uint8_t rdr_tbl_index = ioapic->select_register - 0x10;
-            ioapic->redirect_tbl[rdr_tbl_index] = val;
+            uint32_t *reg = selected_register(ioapic);
+            if (reg == NULL)
+                return;
+            *reg = val;
+            ioapic->window_register = val;
+            update_route(ioapic, (ioapic->select_register - 0x10) / 2);
         }
         return;
     }
 }
 
-uint32_t ioapic_read_reg(uint32_t addr)
+uint32_t ioapic_read_reg(IOAPIC *ioapic, uint32_t addr)
 {
     uint8_t offset = addr - IOAPIC_DEFAULT_BASE;
     if (offset == 0x10)
@@ -85,17 +150,33 @@ uint32_t ioapic_read_reg(uint32_t addr)
     return 0;
 }
 
-void dump_ioapic()
+void dump_ioapic(IOAPIC *ioapic)
 {
     printf("<IO APIC at %p>\n", (void *)ioapic);
     printf("IOREGSEL: %08x IOWIN: %08x IOAPICID: %08x\n", ioapic->select_register, ioapic->window_register, ioapic->id_register);
     printf("Redirection Tables: ");
     uint8_t i;
-    for (i = 0; i < 48; i += 2)
+    for (i = 0; i < IOAPIC_PINS * 2; i += 2)
     {
-        if (ioapic->redirect_tbl[i] > 0)
+        if (!(ioapic->redirect_tbl[i] & IOAPIC_MASKED))
         {
             printf("[IRQ: %08x DESTID: %08x] ", ioapic->redirect_tbl[i], ioapic->redirect_tbl[i + 1]);
         }
     }
-}
\ No newline at end of file
+}
+void snapshot_ioapic(struct Snapshot *snapshot, IOAPIC *ioapic)
+{
+    int i;
+    SNAPSHOT_FIELD(snapshot, ioapic->select_register);
+    SNAPSHOT_FIELD(snapshot, ioapic->window_register);
+    SNAPSHOT_FIELD(snapshot, ioapic->id_register);
+    SNAPSHOT_FIELD(snapshot, ioapic->ver_register);
+    SNAPSHOT_FIELD(snapshot, ioapic->arb_register);
+    SNAPSHOT_FIELD(snapshot, ioapic->redirect_tbl);
+    /* Decoded again, with the restored LAPIC IDs */
+    if (snapshot->restoring)
+    {
+        for (i = 0; i < IOAPIC_PINS; i++)
+            update_route(ioapic, i);
+    }
+}
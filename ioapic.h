@@ -78,6 +78,35 @@
  *   Int Vector:  8-bit field containing the interrupt (10h to FEh).
  */
 
+#define IOAPIC_PINS 24
+#define IOAPIC_MAX_LAPICS 8
+/* IOREDTBL fields (low, and destination in high) */
+#define IOAPIC_VECTOR 0x000000FF
+#define IOAPIC_DELIVERY_MODE 0x00000700
+#define IOAPIC_FIXED 0x00000000
+#define IOAPIC_LOWEST 0x00000100
+#define IOAPIC_LOGICAL 0x00000800
+#define IOAPIC_MASKED 0x00010000
+#define IOAPIC_DEST_SHIFT 24
+/* Physical destination of all CPUs */
+#define IOAPIC_BROADCAST 0xFF
+
+/*
+ * Route of a pin, decoded from its IOREDTBL entry on each write so that
+ * raising the IRQ is one load (from device threads):
+ * | 7 - 0   | vector                                               |
+ * | 15 - 8  | physical: CPUs (IOAPIC.lapic indexes) as a bit set,  |
+ * |         | logical: destination matched against LDR on delivery |
+ * | 16      | logical destination mode                             |
+ * | 17      | lowest priority: only the first destination          |
+ * No destination is 0 in bits 15 - 8, which is how masked pins and
+ * delivery modes other than fixed and lowest priority (SMI, NMI, INIT,
+ * ExtINT, not emulated) are dropped.
+ */
+#define IOAPIC_ROUTE_DEST_SHIFT 8
+#define IOAPIC_ROUTE_LOGICAL 0x00010000
+#define IOAPIC_ROUTE_LOWEST 0x00020000
+
 typedef struct
 {
     uint32_t select_register;
@@ -85,19 +114,30 @@ typedef struct
     uint32_t id_register;
     uint32_t ver_register;
     uint32_t arb_register;
-    uint32_t redirect_tbl[48];
-    LAPIC *lapic[8];
+    /* IOREDTBL0 low, high, IOREDTBL1 low... as the guest wrote them */
+    uint32_t redirect_tbl[IOAPIC_PINS * 2];
+    /* Per pin, written on the CPU thread and read atomically */
+    uint32_t routes[IOAPIC_PINS];
+    LAPIC *lapic[IOAPIC_MAX_LAPICS];
 } IOAPIC;
 
-extern IOAPIC *ioapic;
+/* All pins masked, as after reset */
+IOAPIC *create_ioapic(void);
 
-void init_ioapic();
+void add_lapic(IOAPIC *ioapic, uint8_t index, LAPIC *lapic);
+/*
+ * Raises pin irq (IRQ_KBD, IRQ_IDE...) with the vector and to the CPUs
+ * of its entry. Edge triggered: the trigger mode and polarity bits are
+ * not emulated, a device raises the pin once per event.
+ * Can be called from device threads.
+ */
+void ioapic_int_to_lapic(IOAPIC *ioapic, uint8_t irq);
 
-void add_lapic(uint8_t index, LAPIC *lapic);
-void ioapic_int_to_lapic(uint8_t irq);
+void ioapic_write_reg(IOAPIC *ioapic, uint32_t addr, uint32_t val);
+uint32_t ioapic_read_reg(IOAPIC *ioapic, uint32_t addr);
 
-void ioapic_write_reg(uint32_t addr, uint32_t val);
-uint32_t ioapic_read_reg(uint32_t addr);
+struct Snapshot;
+void snapshot_ioapic(struct Snapshot *snapshot, IOAPIC *ioapic);
 
-void dump_ioapic();
+void dump_ioapic(IOAPIC *ioapic);
 #endif
\ No newline at end of file
@@ -0,0 +1,1391 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+
+#include "jit.h"
+#include "block_cache.h"
+#include "perf_map.h"
+#include "util.h"
+
+/*
+ * Block JIT for x86-64 hosts
+ * A hot block is compiled into a host function. The common ops are
+ * translated into host instructions: 32-bit ALU ops on registers,
+ * immediates and memory operands, mov, movzx, lea, push, pop, jcc and
+ * jmp. Guest registers stay in host registers from one such op to the
+ * next, memory operands are looked up in the TLB inline (pushes and pops
+ * in the stack window), and the lazy flags are stored as the handlers
+ * store them unless a later op of the block overwrites them first.
+ * A jcc after an ALU op tests the host flags it left. At the end of the
+ * block, code jumps straight into the host code of the block chained
+ * after it (Block.chain) while the budget of instructions lasts.
+ *
+ * Every other op, and the slow path of an access (TLB miss, MMIO, a page
+ * with code, a page boundary), calls the interpreter's handler with the
+ * decoded op stored to emu->decoded and the guest registers stored back.
+ * After a call it leaves the block if EIP is not at the next op (jump,
+ * fault), attention is set, or the block was invalidated or left
+ * (self-modifying code, CS change).
+ *
+ * Hot blocks are compiled by a compiler thread per block cache, so the
+ * vCPU never waits for it: the vCPU queues the block (Block.queued set)
+ * and interprets it until the thread publishes Block.native. The code
+ * buffer is the thread's; once it is full, the vCPU drops the native
+ * code of its blocks between blocks (JIT_CODE_FULL, JIT_CODE_DROPPED)
+ * and the thread starts over. Retired blocks are only freed once the
+ * thread is done with them.
+ *
+ * Register use in the generated code:
+ * rbx: emu, r12d: ops run in the blocks chained from, r13d: EIP at entry
+ * of the block, r14d: index past the last op run, [rsp]: budget of ops
+ * r8 - r11, rsi, rdi, rbp, r15: EAX - EDI, rax, rcx, rdx: scratch
+ */
+
+#if defined(__x86_64__)
+
+/* Upper bound of host code bytes per op, and of the rest of a block */
+#define JIT_OP_MAX_SIZE 1024
+#define JIT_FRAME_SIZE 512
+/* Bytes of the prologue; blocks are chained to the code after it. */
+#define JIT_PROLOGUE_SIZE 27
+
+enum HostRegister
+{
+    RAX,
+    RCX,
+    RDX,
+    RBX,
+    RSP,
+    RBP,
+    RSI,
+    RDI,
+    R8,
+    R9,
+    R10,
+    R11,
+    R12,
+    R13,
+    R14,
+    R15
+};
+
+/* Host register of each guest register, EAX to EDI */
+static const uint8_t host_regs[REGISTERS_COUNT] = {R8, R9, R10, R11, RSI, RDI, RBP, R15};
+
+#define REG_OFFSET(reg) (offsetof(Emulator, registers) + (reg) * 4)
+
+typedef struct
+{
+    uint8_t *start;
+    uint8_t *p;
+} CodeWriter;
+
+enum JitCodeState
+{
+    JIT_CODE_IN_USE,
+    /* Set by the compiler thread: it compiles no more */
+    JIT_CODE_FULL,
+    /* Set by the vCPU: no block has native code, the buffer can be reused */
+    JIT_CODE_DROPPED
+};
+
+typedef struct
+{
+    Block *block;
+    uint32_t eip;
+} JitRequest;
+
+/* Single producer (vCPU), single consumer (compiler thread) queue */
+struct JitCompiler
+{
+    JitRequest queue[JIT_QUEUE_SIZE];
+    /* Requests taken by the thread, and queued by the vCPU */
+    uint32_t head;
+    uint32_t tail;
+    /* Posted once per request, and at quit */
+    sem_t pending;
+    int code_state;
+    int quit;
+    /* 0: the thread could not be started, blocks are compiled by the vCPU */
+    int threaded;
+    pthread_t thread;
+};
+
+static void emit8(CodeWriter *w, uint8_t v)
+{
+    *w->p++ = v;
+}
+
+static void emit32(CodeWriter *w, uint32_t v)
+{
+    memcpy(w->p, &v, 4);
+    w->p += 4;
+}
+
+static void emit64(CodeWriter *w, uint64_t v)
+{
+    memcpy(w->p, &v, 8);
+    w->p += 8;
+}
+
+static void emit_rex(CodeWriter *w, int wide, int reg, int index, int base)
+{
+    uint8_t rex = 0x40 | (wide ? 8 : 0) | ((reg & 8) >> 1) | ((index & 8) >> 2) | ((base & 8) >> 3);
+    if (rex != 0x40)
+        emit8(w, rex);
+}
+
+/* Opcodes above 0xFF are two-byte ops (0F xx). */
+static void emit_opcode(CodeWriter *w, int opcode)
+{
+    if (opcode > 0xFF)
+        emit8(w, opcode >> 8);
+    emit8(w, opcode);
+}
+
+/* op reg, rm with Mod: 11 (reg: opcode extension of group ops); 32-bit unless wide */
+static void emit_reg(CodeWriter *w, int wide, int opcode, int reg, int rm)
+{
+    emit_rex(w, wide, reg, 0, rm);
+    emit_opcode(w, opcode);
+    emit8(w, 0xC0 | (reg & 7) << 3 | (rm & 7));
+}
+
+/* op reg, [base + (index << scale) + disp32]; base and index are -1 if not used. */
+static void emit_mem(CodeWriter *w, int wide, int opcode, int reg, int base, int index, int scale, int32_t disp)
+{
+    emit_rex(w, wide, reg, index < 0 ? 0 : index, base < 0 ? 0 : base);
+    emit_opcode(w, opcode);
+    if (base >= 0 && index < 0 && (base & 7) != RSP)
+    {
+        emit8(w, 0x80 | (reg & 7) << 3 | (base & 7));
+    }
+    else
+    {
+        /* SIB: index 100 is none, and base 101 with Mod: 00 is disp32 alone */
+        emit8(w, (base < 0 ? 0x00 : 0x80) | (reg & 7) << 3 | 4);
+        emit8(w, scale << 6 | (index < 0 ? 4 : index & 7) << 3 | (base < 0 ? 5 : base & 7));
+    }
+    emit32(w, disp);
+}
+
+/* op reg, [rbx + offset]: a field of emu */
+static void emit_emu(CodeWriter *w, int wide, int opcode, int reg, uint32_t offset)
+{
+    emit_mem(w, wide, opcode, reg, RBX, -1, 0, offset);
+}
+
+static void emit_mov_imm32(CodeWriter *w, int reg, uint32_t v)
+{
+    emit_rex(w, 0, 0, 0, reg);
+    emit8(w, 0xB8 | (reg & 7));
+    emit32(w, v);
+}
+
+static void emit_mov_imm64(CodeWriter *w, int reg, uint64_t v)
+{
+    emit_rex(w, 1, 0, 0, reg);
+    emit8(w, 0xB8 | (reg & 7));
+    emit64(w, v);
+}
+
+/* jcc rel32 (cc: 0x84 je, 0x85 jne ...); returns where rel32 is patched. */
+static uint8_t *emit_jcc(CodeWriter *w, uint8_t cc)
+{
+    emit8(w, 0x0F);
+    emit8(w, cc);
+    uint8_t *rel = w->p;
+    emit32(w, 0);
+    return rel;
+}
+
+static uint8_t *emit_jmp(CodeWriter *w)
+{
+    emit8(w, 0xE9);
+    uint8_t *rel = w->p;
+    emit32(w, 0);
+    return rel;
+}
+
+static void patch_rel32(uint8_t *rel, uint8_t *target)
+{
+    int32_t v = (int32_t)(target - (rel + 4));
+    memcpy(rel, &v, 4);
+}
+
+/* Ops translated into host instructions */
+enum NativeType
+{
+    /* Run by its handler */
+    NATIVE_NONE,
+    NATIVE_ALU,
+    NATIVE_MOV,
+    NATIVE_LEA,
+    NATIVE_LOAD,
+    NATIVE_STORE,
+    NATIVE_PUSH,
+    NATIVE_POP,
+    NATIVE_JCC,
+    NATIVE_JMP
+};
+
+/* By REG of ModR/M in group 1 (80 - 83), adc and sbb are left to the handlers. */
+enum NativeAlu
+{
+    ALU_ADD,
+    ALU_OR,
+    ALU_AND = 4,
+    ALU_SUB,
+    ALU_XOR,
+    ALU_CMP,
+    ALU_TEST,
+    ALU_INC,
+    ALU_DEC
+};
+
+enum NativeOperand
+{
+    OPERAND_REG,
+    /* AL - BH by the register encoding */
+    OPERAND_REG8,
+    OPERAND_IMM,
+    /* DS:[ModR/M address] */
+    OPERAND_MEM
+};
+
+/*
+ * Op of a block as it is translated
+ * a: destination (first) operand, b: source (second) operand (NativeOperand)
+ * width: operand size of a in bits (movzx: of b; jcc, jmp: of rel)
+ * imm: immediate operand
+ * rel: jcc, jmp: displacement in guest memory, read as the handlers
+ * read it, as it is not in the bytes of the block (Block.length)
+ * next: offset of the op after it in the block
+ */
+typedef struct
+{
+    uint8_t type;
+    uint8_t alu;
+    uint8_t width;
+    uint8_t cc;
+    uint8_t a;
+    uint8_t b;
+    uint8_t reg_a;
+    uint8_t reg_b;
+    uint32_t imm;
+    const uint8_t *rel;
+    uint32_t next;
+} NativeOp;
+
+/* Host flags which hold the guest's flags after the last ALU op */
+#define HOST_CF 1
+#define HOST_ZF 2
+#define HOST_SF 4
+#define HOST_OF 8
+/* Never held: jp and jnp are run by the handlers. */
+#define HOST_PF 16
+
+/* Flags read by jcc, by condition / 2: o, c, z, be, s, p, l, le */
+static const uint8_t cc_flags[8] = {HOST_OF, HOST_CF, HOST_ZF, HOST_CF | HOST_ZF,
+                                    HOST_SF, HOST_PF, HOST_SF | HOST_OF, HOST_ZF | HOST_SF | HOST_OF};
+
+/* Parts of the lazy flags an ALU op has to store */
+#define LAZY_LIVE_MAIN 1
+#define LAZY_LIVE_ZF 2
+
+/*
+ * State of the translation between ops
+ * loaded: guest registers held in their host registers (bit per register)
+ * dirty: those not stored back to emu->registers since they changed
+ * flags: HOST_* flags holding the guest's
+ * eip_synced: emu->eip is up to date (the op to translate, or the end of the block)
+ */
+typedef struct
+{
+    uint8_t loaded;
+    uint8_t dirty;
+    uint8_t flags;
+    uint8_t eip_synced;
+} JitState;
+
+static uint32_t code_imm32(const uint8_t *code)
+{
+    uint32_t v;
+    memcpy(&v, code, 4);
+    return v;
+}
+
+/* Fills native with how op i of block is translated; NATIVE_NONE if it is run by its handler. */
+static void decode_native(Emulator *emu, Block *block, int i, NativeOp *native)
+{
+    DecodedOp *op = &block->ops[i];
+    const uint8_t *code = emu->memory + block->phys_addr + op->offset;
+    ModRM *modrm = &op->modrm;
+    /* Immediate after ModR/M */
+    const uint8_t *imm = code + op->modrm_offset + op->modrm_length;
+    int mem = op->modrm_length != 0 && modrm->mod != 3;
+    uint8_t byte = code[0];
+
+    memset(native, 0, sizeof(NativeOp));
+    native->width = 32;
+    native->next = i + 1 < block->op_count ? block->ops[i + 1].offset : block->length;
+    if (byte >= 0x40 && byte <= 0x4F)
+    {
+        /* inc r32, dec r32 */
+        native->type = NATIVE_ALU;
+        native->alu = byte < 0x48 ? ALU_INC : ALU_DEC;
+        native->reg_a = byte & 7;
+        native->b = OPERAND_IMM;
+        native->imm = 1;
+    }
+    else if (byte >= 0x50 && byte <= 0x5F)
+    {
+        native->type = byte < 0x58 ? NATIVE_PUSH : NATIVE_POP;
+        native->reg_a = byte & 7;
+    }
+    else if (byte >= 0x70 && byte <= 0x7F)
+    {
+        native->type = NATIVE_JCC;
+        native->cc = byte & 0x0F;
+        native->width = 8;
+        native->rel = code + 1;
+        native->next = op->offset + 2;
+    }
+    else if (byte >= 0xB8 && byte <= 0xBF)
+    {
+        native->type = NATIVE_MOV;
+        native->reg_a = byte & 7;
+        native->b = OPERAND_IMM;
+        native->imm = code_imm32(code + 1);
+    }
+    else if (byte == 0x0F && code[1] >= 0x80 && code[1] <= 0x8F)
+    {
+        native->type = NATIVE_JCC;
+        native->cc = code[1] & 0x0F;
+        native->rel = code + 2;
+        native->next = op->offset + 6;
+    }
+    else if (byte == 0x0F && code[1] == 0xB6)
+    {
+        /* movzx r32, rm8 */
+        native->type = mem ? NATIVE_LOAD : NATIVE_MOV;
+        native->width = 8;
+        native->reg_a = modrm->reg_index;
+        native->b = mem ? OPERAND_MEM : OPERAND_REG8;
+        native->reg_b = modrm->rm;
+    }
+    else
+    {
+        switch (byte)
+        {
+        case 0x01:
+        case 0x09:
+        case 0x21:
+        case 0x29:
+        case 0x31:
+        case 0x39:
+        case 0x85:
+            /* op rm32, r32: rm32 from memory only if it is not written */
+            native->alu = byte == 0x85 ? ALU_TEST : byte >> 3;
+            if (!mem || native->alu == ALU_CMP || native->alu == ALU_TEST)
+                native->type = NATIVE_ALU;
+            native->a = mem ? OPERAND_MEM : OPERAND_REG;
+            native->reg_a = modrm->rm;
+            native->reg_b = modrm->reg_index;
+            break;
+        case 0x03:
+        case 0x0B:
+        case 0x23:
+        case 0x2B:
+        case 0x33:
+        case 0x3B:
+            /* op r32, rm32 */
+            native->type = NATIVE_ALU;
+            native->alu = byte >> 3;
+            native->reg_a = modrm->reg_index;
+            native->b = mem ? OPERAND_MEM : OPERAND_REG;
+            native->reg_b = modrm->rm;
+            break;
+        case 0x05:
+        case 0x0D:
+        case 0x25:
+        case 0x2D:
+        case 0x35:
+        case 0x3D:
+        case 0xA9:
+            /* op eax, imm32 */
+            native->type = NATIVE_ALU;
+            native->alu = byte == 0xA9 ? ALU_TEST : byte >> 3;
+            native->reg_a = EAX;
+            native->b = OPERAND_IMM;
+            native->imm = code_imm32(code + 1);
+            break;
+        case 0xA8:
+            /* test al, imm8 */
+            native->type = NATIVE_ALU;
+            native->alu = ALU_TEST;
+            native->width = 8;
+            native->a = OPERAND_REG8;
+            native->reg_a = AL;
+            native->b = OPERAND_IMM;
+            native->imm = code[1];
+            break;
+        case 0x81:
+        case 0x83:
+            /* op rm32, imm32 / imm8 (sign-extended): rm32 from memory for cmp */
+            native->alu = modrm->opcode;
+            if (native->alu != 2 && native->alu != 3 && (!mem || native->alu == ALU_CMP))
+                native->type = NATIVE_ALU;
+            native->a = mem ? OPERAND_MEM : OPERAND_REG;
+            native->reg_a = modrm->rm;
+            native->b = OPERAND_IMM;
+            native->imm = byte == 0x81 ? code_imm32(imm) : (uint32_t)(int8_t)imm[0];
+            break;
+        case 0xF6:
+            /* test rm8, imm8 */
+            if (modrm->opcode == 0)
+                native->type = NATIVE_ALU;
+            native->alu = ALU_TEST;
+            native->width = 8;
+            native->a = mem ? OPERAND_MEM : OPERAND_REG8;
+            native->reg_a = modrm->rm;
+            native->b = OPERAND_IMM;
+            native->imm = imm[0];
+            break;
+        case 0x89:
+            native->type = mem ? NATIVE_STORE : NATIVE_MOV;
+            native->reg_a = modrm->rm;
+            native->reg_b = modrm->reg_index;
+            break;
+        case 0x8B:
+            native->type = mem ? NATIVE_LOAD : NATIVE_MOV;
+            native->reg_a = modrm->reg_index;
+            native->b = mem ? OPERAND_MEM : OPERAND_REG;
+            native->reg_b = modrm->rm;
+            break;
+        case 0xC7:
+            if (modrm->opcode == 0)
+                native->type = mem ? NATIVE_STORE : NATIVE_MOV;
+            native->reg_a = modrm->rm;
+            native->b = OPERAND_IMM;
+            native->imm = code_imm32(imm);
+            break;
+        case 0x8D:
+            if (mem)
+                native->type = NATIVE_LEA;
+            native->reg_a = modrm->reg_index;
+            break;
+        case 0xEB:
+            native->type = NATIVE_JMP;
+            native->width = 8;
+            native->rel = code + 1;
+            native->next = op->offset + 2;
+            break;
+        case 0xE9:
+            native->type = NATIVE_JMP;
+            native->rel = code + 1;
+            native->next = op->offset + 5;
+            break;
+        }
+    }
+}
+
+/*
+ * Lazy flags ALU op i has to store: what ops after it read, or
+ * what is live at the end of the block, before it is overwritten.
+ * Flags stay live past ops which can call a handler (slow paths
+ * and faults read them), as only register ops are skipped.
+ */
+static int lazy_live(NativeOp *natives, int i, int count)
+{
+    int live = LAZY_LIVE_MAIN | LAZY_LIVE_ZF;
+    int k;
+    for (k = i + 1; k < count && live != 0; k++)
+    {
+        NativeOp *native = &natives[k];
+        if (native->type == NATIVE_MOV || native->type == NATIVE_LEA)
+            continue;
+        if (native->type != NATIVE_ALU || native->a == OPERAND_MEM || native->b == OPERAND_MEM)
+            break;
+        live &= ~LAZY_LIVE_MAIN;
+        /* add and inc leave ZF as it is. */
+        if (native->alu != ALU_ADD && native->alu != ALU_INC)
+            live = 0;
+    }
+    return live;
+}
+
+static void load_guest(CodeWriter *w, JitState *state, int reg)
+{
+    if (state->loaded & (1 << reg))
+        return;
+    emit_emu(w, 0, 0x8B, host_regs[reg], REG_OFFSET(reg));
+    state->loaded |= 1 << reg;
+}
+
+/* The guest register is set as a whole in its host register. */
+static void set_guest(JitState *state, int reg)
+{
+    state->loaded |= 1 << reg;
+    state->dirty |= 1 << reg;
+}
+
+static void store_guests(CodeWriter *w, uint8_t regs)
+{
+    int reg;
+    for (reg = 0; reg < REGISTERS_COUNT; reg++)
+    {
+        if (regs & (1 << reg))
+            emit_emu(w, 0, 0x89, host_regs[reg], REG_OFFSET(reg));
+    }
+}
+
+static void reload_guests(CodeWriter *w, uint8_t regs)
+{
+    int reg;
+    for (reg = 0; reg < REGISTERS_COUNT; reg++)
+    {
+        if (regs & (1 << reg))
+            emit_emu(w, 0, 0x8B, host_regs[reg], REG_OFFSET(reg));
+    }
+}
+
+/* emu->eip = EIP at entry + offset */
+static void emit_store_eip(CodeWriter *w, uint32_t offset)
+{
+    emit_mem(w, 0, 0x8D, RAX, R13, -1, 0, offset);
+    emit_emu(w, 0, 0x89, RAX, offsetof(Emulator, eip));
+}
+
+/* Runs op by its handler (the first op of a pair alone); guest registers and EIP have to be in emu. */
+static void emit_call_handler(CodeWriter *w, DecodedOp *op)
+{
+    instruction_func_t *handler = op->fused ? op->fused_handler : op->handler;
+    /* emu->decoded = op; handler(emu) */
+    emit_mov_imm64(w, RAX, (uint64_t)(uintptr_t)op);
+    emit_emu(w, 1, 0x89, RAX, offsetof(Emulator, decoded));
+    emit_reg(w, 1, 0x89, RBX, RDI);
+    emit_mov_imm64(w, RAX, (uint64_t)(uintptr_t)handler);
+    emit_reg(w, 0, 0xFF, 2, RAX);
+}
+
+/*
+ * After a handler: leaves the block unless EIP is at the next op
+ * (next: its offset, -1 after the last op), nothing needs attention,
+ * and the block is still valid and running.
+ */
+static void emit_checks(CodeWriter *w, BlockCache *cache, Block *block, int next, uint8_t **exits, int *exit_count)
+{
+    if (next >= 0)
+    {
+        /* lea eax, [r13 + next]; cmp [rbx + eip], eax; jne exit */
+        emit_mem(w, 0, 0x8D, RAX, R13, -1, 0, next);
+        emit_emu(w, 0, 0x39, RAX, offsetof(Emulator, eip));
+        exits[(*exit_count)++] = emit_jcc(w, 0x85);
+    }
+    /* cmp dword [rbx + attention], 0; jne exit */
+    emit_emu(w, 0, 0x83, 7, offsetof(Emulator, attention));
+    emit8(w, 0);
+    exits[(*exit_count)++] = emit_jcc(w, 0x85);
+    /* cmp byte [&block->valid], 0; je exit */
+    emit_mov_imm64(w, RAX, (uint64_t)(uintptr_t)&block->valid);
+    emit_mem(w, 0, 0x80, 7, RAX, -1, 0, 0);
+    emit8(w, 0);
+    exits[(*exit_count)++] = emit_jcc(w, 0x84);
+    /* cmp [&cache->current], block; jne exit */
+    emit_mov_imm64(w, RAX, (uint64_t)(uintptr_t)&cache->current);
+    emit_mov_imm64(w, RCX, (uint64_t)(uintptr_t)block);
+    emit_mem(w, 1, 0x39, RCX, RAX, -1, 0, 0);
+    exits[(*exit_count)++] = emit_jcc(w, 0x85);
+}
+
+/* Physical page ecx: RAM, and for a write, not holding code (page_written). */
+static void emit_page_checks(CodeWriter *w, int write, uint8_t **slow, int *slow_count)
+{
+    /* mov rdx, page_types; cmp byte [rdx + rcx], PAGE_RAM; jne slow */
+    emit_emu(w, 1, 0x8B, RDX, offsetof(Emulator, page_types));
+    emit_mem(w, 0, 0x80, 7, RDX, RCX, 0, 0);
+    emit8(w, PAGE_RAM);
+    slow[(*slow_count)++] = emit_jcc(w, 0x85);
+    if (!write)
+        return;
+    /* mov rdx, page_info; cmp dword [rdx + rcx * 8 + code_cpus], 0; jne slow; add dword [... generation], 1 */
+    emit_emu(w, 1, 0x8B, RDX, offsetof(Emulator, page_info));
+    emit_mem(w, 0, 0x83, 7, RDX, RCX, 3, offsetof(PageInfo, code_cpus));
+    emit8(w, 0);
+    slow[(*slow_count)++] = emit_jcc(w, 0x85);
+    emit_mem(w, 0, 0x83, 0, RDX, RCX, 3, offsetof(PageInfo, generation));
+    emit8(w, 1);
+}
+
+/*
+ * DS offset eax to be accessed as [rdx + rax] (host memory, physical
+ * address), as get_physical_address() and the RAM path of _get_memory32()
+ * / _set_memory32() do; jumps to slow unless DS is flat, the TLB holds
+ * the page, and the bytes are within the page.
+ */
+static void emit_access(CodeWriter *w, int write, int bytes, uint8_t **slow, int *slow_count)
+{
+    uint32_t table = write ? offsetof(Emulator, tlb.write) : offsetof(Emulator, tlb.read);
+
+    /* test byte [flat_segments], DS bit; jz slow; cmp byte [translation], TRANSLATE_PAGED; jne slow */
+    emit_emu(w, 0, 0xF6, 0, offsetof(Emulator, flat_segments) + (write ? 1 : 0));
+    emit8(w, 1 << DS);
+    slow[(*slow_count)++] = emit_jcc(w, 0x84);
+    emit_emu(w, 0, 0x80, 7, offsetof(Emulator, translation));
+    emit8(w, TRANSLATE_PAGED);
+    slow[(*slow_count)++] = emit_jcc(w, 0x85);
+    if (bytes > 1)
+    {
+        /* mov ecx, eax; and ecx, 0xFFF; cmp ecx, 0x1000 - bytes; ja slow */
+        emit_reg(w, 0, 0x89, RAX, RCX);
+        emit_reg(w, 0, 0x81, 4, RCX);
+        emit32(w, 0xFFF);
+        emit_reg(w, 0, 0x81, 7, RCX);
+        emit32(w, 0x1000 - bytes);
+        slow[(*slow_count)++] = emit_jcc(w, 0x87);
+    }
+    /* ecx = linear page; rdx = TLB entry */
+    emit_reg(w, 0, 0x89, RAX, RCX);
+    emit_reg(w, 0, 0xC1, 5, RCX);
+    emit8(w, 12);
+    emit_reg(w, 0, 0x89, RCX, RDX);
+    emit_reg(w, 0, 0x81, 4, RDX);
+    emit32(w, TLB_SIZE - 1);
+    emit_mem(w, 1, 0x8D, RDX, RBX, RDX, 3, table);
+    /* Hit for any CPL, or tagged TLB_SUPERVISOR at CPL 0 - 2 (tlb_match) */
+    emit_mem(w, 0, 0x39, RCX, RDX, -1, 0, offsetof(TlbEntry, linear_page));
+    uint8_t *hit = emit_jcc(w, 0x84);
+    emit_emu(w, 0, 0x0B, RCX, offsetof(Emulator, tlb_supervisor));
+    emit_mem(w, 0, 0x39, RCX, RDX, -1, 0, offsetof(TlbEntry, linear_page));
+    slow[(*slow_count)++] = emit_jcc(w, 0x85);
+    patch_rel32(hit, w->p);
+    /* eax = phys_page | (eax & 0xFFF); ecx = physical page */
+    emit_reg(w, 0, 0x81, 4, RAX);
+    emit32(w, 0xFFF);
+    emit_mem(w, 0, 0x0B, RAX, RDX, -1, 0, offsetof(TlbEntry, phys_page));
+    emit_reg(w, 0, 0x89, RAX, RCX);
+    emit_reg(w, 0, 0xC1, 5, RCX);
+    emit8(w, 12);
+    emit_page_checks(w, write, slow, slow_count);
+    emit_emu(w, 1, 0x8B, RDX, offsetof(Emulator, memory));
+}
+
+/*
+ * SS offset eax of 4 bytes to be accessed as [rdx + rax] (host memory,
+ * offset in the stack window), as stack_host() does; jumps to slow
+ * unless the window holds them.
+ */
+static void emit_stack_access(CodeWriter *w, int write, uint8_t **slow, int *slow_count)
+{
+    /* cmp dword [stack.size], 0x1000; jne slow; (cmp byte [stack.writable], 0; je slow) */
+    emit_emu(w, 0, 0x81, 7, offsetof(Emulator, stack.size));
+    emit32(w, 0x1000);
+    slow[(*slow_count)++] = emit_jcc(w, 0x85);
+    if (write)
+    {
+        emit_emu(w, 0, 0x80, 7, offsetof(Emulator, stack.writable));
+        emit8(w, 0);
+        slow[(*slow_count)++] = emit_jcc(w, 0x84);
+    }
+    /* sub eax, [stack.begin]; cmp eax, 0xFFC; ja slow */
+    emit_emu(w, 0, 0x2B, RAX, offsetof(Emulator, stack.begin));
+    emit_reg(w, 0, 0x81, 7, RAX);
+    emit32(w, 0xFFC);
+    slow[(*slow_count)++] = emit_jcc(w, 0x87);
+    /* ecx = physical page */
+    emit_emu(w, 0, 0x8B, RCX, offsetof(Emulator, stack.p_begin));
+    emit_reg(w, 0, 0x01, RAX, RCX);
+    emit_reg(w, 0, 0xC1, 5, RCX);
+    emit8(w, 12);
+    emit_page_checks(w, write, slow, slow_count);
+    emit_emu(w, 1, 0x8B, RDX, offsetof(Emulator, stack.host));
+}
+
+/* eax = offset of the ModR/M memory operand, from the guest registers held */
+static void emit_address(CodeWriter *w, ModRM *modrm)
+{
+    int base = modrm->base == MODRM_NO_REG ? -1 : host_regs[modrm->base];
+    int index = modrm->index == MODRM_NO_REG ? -1 : host_regs[modrm->index];
+    /* lea eax, [base + (index << scale) + disp32]: the sum wraps at 32 bits as on the guest. */
+    emit_mem(w, 0, 0x8D, RAX, base, index, modrm->scale, modrm->disp32);
+}
+
+/* dst (scratch) = guest register reg8 (AL - BH), zero-extended */
+static void emit_load_reg8(CodeWriter *w, int dst, int reg8)
+{
+    emit_reg(w, 0, 0x89, host_regs[reg8 & 3], RDX);
+    /* movzx edx, dl / dh (no REX) */
+    emit_reg(w, 0, 0x0FB6, RDX, reg8 & 4 ? 6 : RDX);
+    if (dst != RDX)
+        emit_reg(w, 0, 0x89, RDX, dst);
+}
+
+/*
+ * ALU op on edx (a) and ecx (b): sets the host flags, stores the parts
+ * of the lazy flags in live as update_eflags_*() do, and the result
+ * to guest register a unless it is cmp or test.
+ */
+static void emit_alu(CodeWriter *w, JitState *state, NativeOp *native, int live)
+{
+    int alu = native->alu;
+    uint8_t lazy = LAZY_LOGIC;
+    /* Host op: 00 add, 08 or, 20 and, 28 sub, 30 xor (+1: 32-bit) */
+    int host = alu;
+    uint8_t flags = HOST_CF | HOST_ZF | HOST_SF | HOST_OF;
+
+    if (alu == ALU_ADD || alu == ALU_INC)
+    {
+        lazy = LAZY_ADD;
+        host = ALU_ADD;
+        /* ZF is kept as it is; inc results are 32 bits, so CF is clear. */
+        flags = alu == ALU_ADD ? HOST_CF | HOST_SF | HOST_OF : HOST_SF | HOST_OF;
+    }
+    else if (alu == ALU_SUB || alu == ALU_CMP || alu == ALU_DEC)
+    {
+        lazy = LAZY_SUB;
+        host = ALU_SUB;
+        if (alu == ALU_DEC)
+            flags = HOST_ZF | HOST_SF | HOST_OF;
+    }
+    else if (alu == ALU_TEST)
+    {
+        host = ALU_AND;
+    }
+
+    if (live & LAZY_LIVE_MAIN)
+    {
+        if (lazy == LAZY_LOGIC)
+        {
+            emit_emu(w, 0, 0xC7, 0, offsetof(Emulator, lazy_flags.value1));
+            emit32(w, 0);
+            emit_emu(w, 0, 0xC7, 0, offsetof(Emulator, lazy_flags.value2));
+            emit32(w, 0);
+        }
+        else
+        {
+            emit_emu(w, 0, 0x89, RDX, offsetof(Emulator, lazy_flags.value1));
+            emit_emu(w, 0, 0x89, RCX, offsetof(Emulator, lazy_flags.value2));
+        }
+    }
+    if (lazy != LAZY_LOGIC)
+    {
+        if (live != 0)
+        {
+            /* rax = result as the handlers keep it: 64 bits, inc and dec 32 */
+            int wide = alu != ALU_INC && alu != ALU_DEC;
+            emit_reg(w, wide, 0x89, RDX, RAX);
+            emit_reg(w, wide, host * 8 + 1, RCX, RAX);
+            if (live & LAZY_LIVE_MAIN)
+                emit_emu(w, 1, 0x89, RAX, offsetof(Emulator, lazy_flags.result));
+            if (lazy == LAZY_SUB && (live & LAZY_LIVE_ZF))
+                emit_emu(w, 1, 0x89, RAX, offsetof(Emulator, lazy_flags.zf_result));
+        }
+        emit_reg(w, 0, host * 8 + 1, RCX, RDX);
+    }
+    else
+    {
+        /* edx and ecx are zero-extended, so is the result in rdx. */
+        emit_reg(w, 0, host * 8 + (native->width == 8 ? 0 : 1), RCX, RDX);
+        if (live & LAZY_LIVE_MAIN)
+            emit_emu(w, 1, 0x89, RDX, offsetof(Emulator, lazy_flags.result));
+        if (live & LAZY_LIVE_ZF)
+            emit_emu(w, 1, 0x89, RDX, offsetof(Emulator, lazy_flags.zf_result));
+    }
+    /* Only movs from here: the host flags are kept. */
+    if (live & LAZY_LIVE_MAIN)
+    {
+        emit_emu(w, 0, 0xC6, 0, offsetof(Emulator, lazy_flags.op));
+        emit8(w, lazy);
+        emit_emu(w, 0, 0xC6, 0, offsetof(Emulator, lazy_flags.width));
+        emit8(w, native->width);
+    }
+    if (lazy != LAZY_ADD && (live & LAZY_LIVE_ZF))
+    {
+        emit_emu(w, 0, 0xC6, 0, offsetof(Emulator, lazy_flags.zf_pending));
+        emit8(w, 1);
+    }
+    if (alu != ALU_CMP && alu != ALU_TEST)
+    {
+        emit_reg(w, 0, 0x89, RDX, host_regs[native->reg_a]);
+        set_guest(state, native->reg_a);
+    }
+    state->flags = flags;
+}
+
+/* Guest registers the op reads: they are loaded before any path splits. */
+static void load_operands(CodeWriter *w, JitState *state, DecodedOp *op, NativeOp *native)
+{
+    if (op->modrm_length != 0 && op->modrm.mod != 3 && native->type != NATIVE_NONE)
+    {
+        if (op->modrm.base != MODRM_NO_REG)
+            load_guest(w, state, op->modrm.base);
+        if (op->modrm.index != MODRM_NO_REG)
+            load_guest(w, state, op->modrm.index);
+    }
+    switch (native->type)
+    {
+    case NATIVE_ALU:
+        if (native->a == OPERAND_REG)
+            load_guest(w, state, native->reg_a);
+        else if (native->a == OPERAND_REG8)
+            load_guest(w, state, native->reg_a & 3);
+        if (native->b == OPERAND_REG)
+            load_guest(w, state, native->reg_b);
+        break;
+    case NATIVE_MOV:
+        if (native->b == OPERAND_REG)
+            load_guest(w, state, native->reg_b);
+        else if (native->b == OPERAND_REG8)
+            load_guest(w, state, native->reg_b & 3);
+        break;
+    case NATIVE_STORE:
+        if (native->b == OPERAND_REG)
+            load_guest(w, state, native->reg_b);
+        break;
+    case NATIVE_PUSH:
+        load_guest(w, state, ESP);
+        load_guest(w, state, native->reg_a);
+        break;
+    case NATIVE_POP:
+        load_guest(w, state, ESP);
+        break;
+    }
+}
+
+/* Fast path of an op with a memory operand, or push / pop; jumps to slow for the handler. */
+static void emit_access_op(CodeWriter *w, JitState *state, DecodedOp *op, NativeOp *native, int live,
+                           uint8_t **slow, int *slow_count)
+{
+    switch (native->type)
+    {
+    case NATIVE_LOAD:
+        emit_address(w, &op->modrm);
+        emit_access(w, 0, native->width / 8, slow, slow_count);
+        /* mov r32, [rdx + rax] / movzx r32, byte [rdx + rax] */
+        emit_mem(w, 0, native->width == 8 ? 0x0FB6 : 0x8B, host_regs[native->reg_a], RDX, RAX, 0, 0);
+        set_guest(state, native->reg_a);
+        state->flags = 0;
+        break;
+    case NATIVE_STORE:
+        emit_address(w, &op->modrm);
+        emit_access(w, 1, 4, slow, slow_count);
+        if (native->b == OPERAND_IMM)
+        {
+            emit_mem(w, 0, 0xC7, 0, RDX, RAX, 0, 0);
+            emit32(w, native->imm);
+        }
+        else
+        {
+            emit_mem(w, 0, 0x89, host_regs[native->reg_b], RDX, RAX, 0, 0);
+        }
+        state->flags = 0;
+        break;
+    case NATIVE_PUSH:
+        /* eax = ESP - 4; [eax] = reg; ESP = eax */
+        emit_reg(w, 0, 0x89, host_regs[ESP], RAX);
+        emit_reg(w, 0, 0x83, 5, RAX);
+        emit8(w, 4);
+        emit_stack_access(w, 1, slow, slow_count);
+        emit_mem(w, 0, 0x89, host_regs[native->reg_a], RDX, RAX, 0, 0);
+        emit_reg(w, 0, 0x83, 5, host_regs[ESP]);
+        emit8(w, 4);
+        set_guest(state, ESP);
+        state->flags = 0;
+        break;
+    case NATIVE_POP:
+        /* ESP += 4, then reg = [old ESP], so pop esp gets the value */
+        emit_reg(w, 0, 0x89, host_regs[ESP], RAX);
+        emit_stack_access(w, 0, slow, slow_count);
+        emit_mem(w, 0, 0x8B, RCX, RDX, RAX, 0, 0);
+        emit_reg(w, 0, 0x83, 0, host_regs[ESP]);
+        emit8(w, 4);
+        emit_reg(w, 0, 0x89, RCX, host_regs[native->reg_a]);
+        set_guest(state, ESP);
+        set_guest(state, native->reg_a);
+        state->flags = 0;
+        break;
+    case NATIVE_ALU:
+        emit_address(w, &op->modrm);
+        emit_access(w, 0, native->width / 8, slow, slow_count);
+        if (native->a == OPERAND_MEM)
+        {
+            emit_mem(w, 0, native->width == 8 ? 0x0FB6 : 0x8B, RDX, RDX, RAX, 0, 0);
+            if (native->b == OPERAND_IMM)
+                emit_mov_imm32(w, RCX, native->imm);
+            else
+                emit_reg(w, 0, 0x89, host_regs[native->reg_b], RCX);
+        }
+        else
+        {
+            emit_mem(w, 0, 0x8B, RCX, RDX, RAX, 0, 0);
+            emit_reg(w, 0, 0x89, host_regs[native->reg_a], RDX);
+        }
+        emit_alu(w, state, native, live);
+        break;
+    }
+}
+
+static uint8_t *alloc_code(void)
+{
+    uint8_t *code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return code == MAP_FAILED ? NULL : code;
+}
+
+/* Checks that the host gives executable memory. */
+int init_jit(void)
+{
+    uint8_t *code = alloc_code();
+    if (code == NULL)
+    {
+        printf("Could not allocate executable memory for JIT.\n");
+        return 0;
+    }
+    munmap(code, JIT_CODE_SIZE);
+    return 1;
+}
+
+void free_jit_code(BlockCache *cache)
+{
+    JitCompiler *compiler = cache->compiler;
+    if (compiler != NULL)
+    {
+        if (compiler->threaded)
+        {
+            __atomic_store_n(&compiler->quit, 1, __ATOMIC_RELEASE);
+            sem_post(&compiler->pending);
+            pthread_join(compiler->thread, NULL);
+        }
+        sem_destroy(&compiler->pending);
+        free(compiler);
+        cache->compiler = NULL;
+    }
+    if (cache->code != NULL)
+        munmap(cache->code, JIT_CODE_SIZE);
+    cache->code = NULL;
+}
+
+/*
+ * Runs op i by its handler from state, with the guest registers stored
+ * back, and leaves the block unless it went on to the op at next.
+ */
+static void emit_run_handler(CodeWriter *w, Emulator *emu, Block *block, int i, JitState *state, int next,
+                             uint8_t **exits, int *exit_count)
+{
+    DecodedOp *op = &block->ops[i];
+    if (!state->eip_synced)
+        emit_store_eip(w, op->offset);
+    store_guests(w, state->dirty);
+    emit_call_handler(w, op);
+    emit_mov_imm32(w, R14, i + 1);
+    emit_checks(w, emu->block_cache, block, next, exits, exit_count);
+}
+
+/* jcc, jmp: emu->eip = the target if the condition holds (cc: 0x40 + tttn of cmovcc), else next */
+static void emit_jump(CodeWriter *w, NativeOp *native, int cc)
+{
+    /* ecx = target from rel as the guest memory holds it */
+    emit_mov_imm64(w, RAX, (uint64_t)(uintptr_t)native->rel);
+    emit_mem(w, 0, native->width == 8 ? 0x0FBE : 0x8B, RCX, RAX, -1, 0, 0);
+    emit_mem(w, 0, 0x8D, RCX, R13, RCX, 0, native->next);
+    if (cc >= 0)
+    {
+        /* lea eax, [r13 + next]; cmovcc eax, ecx: mov and lea keep the flags */
+        emit_mem(w, 0, 0x8D, RAX, R13, -1, 0, native->next);
+        emit_reg(w, 0, 0x0F00 | cc, RAX, RCX);
+        emit_emu(w, 0, 0x89, RAX, offsetof(Emulator, eip));
+    }
+    else
+    {
+        emit_emu(w, 0, 0x89, RCX, offsetof(Emulator, eip));
+    }
+}
+
+/*
+ * Left at its end with everything stored: jumps into the host code of
+ * the block chained after this one, as follow_chain() finds it, while
+ * the budget lasts for a whole block more; else to exit. Not after
+ * calls and rets, whose return stack the interpreter keeps.
+ */
+static void emit_chain(CodeWriter *w, BlockCache *cache, Block *block, uint8_t **exits, int *exit_count)
+{
+    uint8_t *misses[BLOCK_CHAINS];
+    uint8_t *found[BLOCK_CHAINS];
+    int k;
+
+    /* lea eax, [r12 + op_count + BLOCK_MAX_OPS]; cmp eax, [rsp]; jae exit */
+    emit_mem(w, 0, 0x8D, RAX, R12, -1, 0, block->op_count + BLOCK_MAX_OPS);
+    emit_mem(w, 0, 0x3B, RAX, RSP, -1, 0, 0);
+    exits[(*exit_count)++] = emit_jcc(w, 0x83);
+    emit_emu(w, 0, 0x83, 7, offsetof(Emulator, attention));
+    emit8(w, 0);
+    exits[(*exit_count)++] = emit_jcc(w, 0x85);
+    /* rdx = cache, rcx = block: still running, valid, and its chains up to date */
+    emit_mov_imm64(w, RDX, (uint64_t)(uintptr_t)cache);
+    emit_mov_imm64(w, RCX, (uint64_t)(uintptr_t)block);
+    emit_mem(w, 1, 0x39, RCX, RDX, -1, 0, offsetof(BlockCache, current));
+    exits[(*exit_count)++] = emit_jcc(w, 0x85);
+    emit_mem(w, 0, 0x80, 7, RCX, -1, 0, offsetof(Block, valid));
+    emit8(w, 0);
+    exits[(*exit_count)++] = emit_jcc(w, 0x84);
+    emit_mem(w, 0, 0x8B, RAX, RDX, -1, 0, offsetof(BlockCache, generation));
+    emit_mem(w, 0, 0x3B, RAX, RCX, -1, 0, offsetof(Block, chain_generation));
+    exits[(*exit_count)++] = emit_jcc(w, 0x85);
+    /* r8 = the block chained at emu->eip */
+    emit_emu(w, 0, 0x8B, RAX, offsetof(Emulator, eip));
+    for (k = 0; k < BLOCK_CHAINS; k++)
+    {
+        emit_mem(w, 0, 0x3B, RAX, RCX, -1, 0, offsetof(Block, chain_eip) + k * sizeof(uint32_t));
+        misses[k] = emit_jcc(w, 0x85);
+        emit_mem(w, 1, 0x8B, R8, RCX, -1, 0, offsetof(Block, chain) + k * sizeof(Block *));
+        emit_reg(w, 1, 0x85, R8, R8);
+        found[k] = emit_jcc(w, 0x85);
+        patch_rel32(misses[k], w->p);
+    }
+    exits[(*exit_count)++] = emit_jmp(w);
+    for (k = 0; k < BLOCK_CHAINS; k++)
+        patch_rel32(found[k], w->p);
+    /* r9 = its host code, if compiled */
+    emit_mem(w, 1, 0x8B, R9, R8, -1, 0, offsetof(Block, native));
+    emit_reg(w, 1, 0x85, R9, R9);
+    exits[(*exit_count)++] = emit_jcc(w, 0x84);
+    /* Entered as next_decoded_op() enters it */
+    emit_mem(w, 1, 0x89, R8, RDX, -1, 0, offsetof(BlockCache, current));
+    emit_mem(w, 0, 0xC7, 0, RDX, -1, 0, offsetof(BlockCache, current_index));
+    emit32(w, 0);
+    emit_mem(w, 0, 0x89, RAX, RDX, -1, 0, offsetof(BlockCache, current_eip));
+    emit_reg(w, 0, 0x81, 0, R12);
+    emit32(w, block->op_count);
+    emit_mem(w, 0, 0x89, R12, RDX, -1, 0, offsetof(BlockCache, chained_ops));
+    emit_mem(w, 1, 0x89, R8, RDX, -1, 0, offsetof(BlockCache, chained));
+    /* add r9, JIT_PROLOGUE_SIZE; jmp r9 */
+    emit_reg(w, 1, 0x83, 0, R9);
+    emit8(w, JIT_PROLOGUE_SIZE);
+    emit_reg(w, 0, 0xFF, 4, R9);
+}
+
+/* Compiles block entered at eip; NULL if the code buffer can not be allocated or is full. */
+static void *compile_block(Emulator *emu, Block *block, uint32_t eip)
+{
+    BlockCache *cache = emu->block_cache;
+    JitCompiler *compiler = cache->compiler;
+    uint32_t size = JIT_FRAME_SIZE + block->op_count * JIT_OP_MAX_SIZE;
+    if (cache->code == NULL)
+    {
+        cache->code = alloc_code();
+        cache->code_used = 0;
+        if (cache->code == NULL)
+            return NULL;
+    }
+    if (cache->code_used + size > JIT_CODE_SIZE)
+    {
+        __atomic_store_n(&compiler->code_state, JIT_CODE_FULL, __ATOMIC_RELEASE);
+        return NULL;
+    }
+
+    CodeWriter writer = {cache->code + cache->code_used, cache->code + cache->code_used};
+    CodeWriter *w = &writer;
+    NativeOp natives[BLOCK_MAX_OPS];
+    uint8_t *exits[BLOCK_MAX_OPS * 16];
+    int exit_count = 0;
+    /* Slow paths which ran the jcc after their op as well */
+    uint8_t *ends[BLOCK_MAX_OPS];
+    int end_count = 0;
+    JitState state = {0, 0, 0, 1};
+    int count = block->op_count;
+    int i, k;
+
+    for (i = 0; i < count; i++)
+        decode_native(emu, block, i, &natives[i]);
+
+    /* push rbx, rbp, r12 - r15; sub rsp, 8 (rsp 16-byte aligned at calls) */
+    emit8(w, 0x53);
+    emit8(w, 0x55);
+    for (k = R12; k <= R15; k++)
+    {
+        emit8(w, 0x41);
+        emit8(w, 0x50 | (k & 7));
+    }
+    emit_reg(w, 1, 0x83, 5, RSP);
+    emit8(w, 8);
+    /* [rsp] = budget; rbx = emu; r12d = 0 */
+    emit_mem(w, 0, 0x89, RSI, RSP, -1, 0, 0);
+    emit_reg(w, 1, 0x89, RDI, RBX);
+    emit_reg(w, 0, 0x31, R12, R12);
+    if (w->p - w->start != JIT_PROLOGUE_SIZE)
+    {
+        printf("JIT prologue is %d bytes.\n", (int)(w->p - w->start));
+        panic(NULL);
+    }
+    /* Blocks chained to start here: mov r13d, [rbx + eip] */
+    emit_emu(w, 0, 0x8B, R13, offsetof(Emulator, eip));
+
+    for (i = 0; i < count; i++)
+    {
+        DecodedOp *op = &block->ops[i];
+        NativeOp *native = &natives[i];
+        int next = i + 1 < count ? (int)native->next : -1;
+        uint8_t *slow[16];
+        int slow_count = 0;
+        int type = native->type;
+        int live = lazy_live(natives, i, count);
+
+        /* jp, jnp, and conditions the host flags do not hold */
+        if (type == NATIVE_JCC && (cc_flags[native->cc >> 1] & ~state.flags) != 0)
+            type = NATIVE_NONE;
+        if (type == NATIVE_NONE)
+        {
+            emit_run_handler(w, emu, block, i, &state, next, exits, &exit_count);
+            state.loaded = 0;
+            state.dirty = 0;
+            state.flags = 0;
+            state.eip_synced = 1;
+            continue;
+        }
+
+        load_operands(w, &state, op, native);
+        JitState before = state;
+        switch (type)
+        {
+        case NATIVE_MOV:
+            if (native->b == OPERAND_IMM)
+                emit_mov_imm32(w, host_regs[native->reg_a], native->imm);
+            else if (native->b == OPERAND_REG8)
+                emit_load_reg8(w, host_regs[native->reg_a], native->reg_b);
+            else if (native->reg_a != native->reg_b)
+                emit_reg(w, 0, 0x89, host_regs[native->reg_b], host_regs[native->reg_a]);
+            set_guest(&state, native->reg_a);
+            break;
+        case NATIVE_LEA:
+            emit_address(w, &op->modrm);
+            emit_reg(w, 0, 0x89, RAX, host_regs[native->reg_a]);
+            set_guest(&state, native->reg_a);
+            break;
+        case NATIVE_JCC:
+            emit_jump(w, native, 0x40 | native->cc);
+            break;
+        case NATIVE_JMP:
+            emit_jump(w, native, -1);
+            break;
+        case NATIVE_ALU:
+            if (native->a != OPERAND_MEM && native->b != OPERAND_MEM)
+            {
+                if (native->a == OPERAND_REG8)
+                    emit_load_reg8(w, RDX, native->reg_a);
+                else
+                    emit_reg(w, 0, 0x89, host_regs[native->reg_a], RDX);
+                if (native->b == OPERAND_IMM)
+                    emit_mov_imm32(w, RCX, native->imm);
+                else
+                    emit_reg(w, 0, 0x89, host_regs[native->reg_b], RCX);
+                emit_alu(w, &state, native, live);
+                break;
+            }
+            /* Fall through: memory operand */
+        default:
+            emit_access_op(w, &state, op, native, live, slow, &slow_count);
+            break;
+        }
+        state.eip_synced = type == NATIVE_JCC || type == NATIVE_JMP;
+        if (slow_count == 0)
+            continue;
+
+        /* Slow path: the handler from the state before the op, then the registers it set reloaded */
+        uint8_t *done = emit_jmp(w);
+        for (k = 0; k < slow_count; k++)
+            patch_rel32(slow[k], w->p);
+        emit_run_handler(w, emu, block, i, &before, next, exits, &exit_count);
+        if (i + 1 < count && natives[i + 1].type == NATIVE_JCC &&
+            (cc_flags[natives[i + 1].cc >> 1] & ~state.flags) == 0)
+        {
+            /* The jcc after it tests the host flags of the fast path, so here its handler runs too. */
+            JitState stored = {0, 0, 0, 1};
+            emit_run_handler(w, emu, block, i + 1, &stored, -1, exits, &exit_count);
+            ends[end_count++] = emit_jmp(w);
+            patch_rel32(done, w->p);
+        }
+        else
+        {
+            reload_guests(w, state.loaded);
+            patch_rel32(done, w->p);
+            state.flags = 0;
+        }
+    }
+
+    /* Left at the end of the block */
+    if (!state.eip_synced)
+        emit_store_eip(w, block->length);
+    store_guests(w, state.dirty);
+    emit_mov_imm32(w, R14, count);
+    for (k = 0; k < end_count; k++)
+        patch_rel32(ends[k], w->p);
+    DecodedOp *last = &block->ops[count - 1];
+    int is_call = last->op == 0xE8 || (last->op == 0xFF && last->modrm.opcode == 2);
+    int is_ret = last->op == 0xC3 || last->op == 0xC2;
+    if (!is_call && !is_ret)
+        emit_chain(w, cache, block, exits, &exit_count);
+
+    for (i = 0; i < exit_count; i++)
+        patch_rel32(exits[i], w->p);
+    /* emu->decoded = NULL; return r12d + r14d */
+    emit_emu(w, 1, 0xC7, 0, offsetof(Emulator, decoded));
+    emit32(w, 0);
+    emit_reg(w, 0, 0x89, R12, RAX);
+    emit_reg(w, 0, 0x01, R14, RAX);
+    emit_reg(w, 1, 0x83, 0, RSP);
+    emit8(w, 8);
+    for (k = R15; k >= R12; k--)
+    {
+        emit8(w, 0x41);
+        emit8(w, 0x58 | (k & 7));
+    }
+    emit8(w, 0x5D);
+    emit8(w, 0x5B);
+    emit8(w, 0xC3);
+
+    if (config.perf)
+        perf_map_code(w->start, w->p - w->start, eip);
+    cache->code_used += w->p - w->start;
+    /* Keeps the next function 16-byte aligned. */
+    cache->code_used = (cache->code_used + 15) & ~15u;
+    return w->start;
+}
+
+/* In the compiler thread (or the vCPU if there is none): publishes the code of a queued block. */
+static void compile_request(Emulator *emu, JitRequest *request)
+{
+    JitCompiler *compiler = emu->block_cache->compiler;
+    int state = __atomic_load_n(&compiler->code_state, __ATOMIC_ACQUIRE);
+    if (state == JIT_CODE_DROPPED)
+    {
+        emu->block_cache->code_used = 0;
+        __atomic_store_n(&compiler->code_state, JIT_CODE_IN_USE, __ATOMIC_RELAXED);
+    }
+    /* Blocks invalidated meanwhile are never entered again. */
+    if (state != JIT_CODE_FULL && __atomic_load_n(&request->block->valid, __ATOMIC_RELAXED))
+    {
+        void *native = compile_block(emu, request->block, request->eip);
+        if (native != NULL)
+            __atomic_store_n(&request->block->native, native, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&request->block->queued, 0, __ATOMIC_RELEASE);
+}
+
+static void *compiler_loop(void *arg)
+{
+    Emulator *emu = (Emulator *)arg;
+    JitCompiler *compiler = emu->block_cache->compiler;
+    while (1)
+    {
+        sem_wait(&compiler->pending);
+        uint32_t head = compiler->head;
+        if (head == __atomic_load_n(&compiler->tail, __ATOMIC_ACQUIRE))
+            break;
+        JitRequest *request = &compiler->queue[head % JIT_QUEUE_SIZE];
+        if (__atomic_load_n(&compiler->quit, __ATOMIC_ACQUIRE))
+            __atomic_store_n(&request->block->queued, 0, __ATOMIC_RELEASE);
+        else
+            compile_request(emu, request);
+        __atomic_store_n(&compiler->head, head + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+/* Started on the first hot block, so it runs in the process that runs the guest (fork server). */
+static void start_compiler(Emulator *emu)
+{
+    JitCompiler *compiler = malloc(sizeof(JitCompiler));
+    memset(compiler, 0, sizeof(JitCompiler));
+    sem_init(&compiler->pending, 0, 0);
+    emu->block_cache->compiler = compiler;
+    compiler->threaded = pthread_create(&compiler->thread, NULL, compiler_loop, (void *)emu) == 0;
+}
+
+/* Once the thread found the code buffer full: between blocks, no native code is running. */
+static void reuse_full_code(Emulator *emu)
+{
+    JitCompiler *compiler = emu->block_cache->compiler;
+    if (__atomic_load_n(&compiler->code_state, __ATOMIC_ACQUIRE) != JIT_CODE_FULL)
+        return;
+    drop_native_code(emu);
+    __atomic_store_n(&compiler->code_state, JIT_CODE_DROPPED, __ATOMIC_RELEASE);
+}
+
+static void queue_block(Emulator *emu, Block *block)
+{
+    BlockCache *cache = emu->block_cache;
+    if (cache->compiler == NULL)
+        start_compiler(emu);
+    JitCompiler *compiler = cache->compiler;
+    reuse_full_code(emu);
+    JitRequest request = {block, cache->current_eip};
+
+    if (!compiler->threaded)
+    {
+        compile_request(emu, &request);
+        reuse_full_code(emu);
+        if (block->native == NULL)
+            compile_request(emu, &request);
+        return;
+    }
+    uint32_t tail = compiler->tail;
+    if (tail - __atomic_load_n(&compiler->head, __ATOMIC_ACQUIRE) == JIT_QUEUE_SIZE)
+    {
+        /* Queued again once hot again */
+        block->hits = 0;
+        return;
+    }
+    compiler->queue[tail % JIT_QUEUE_SIZE] = request;
+    __atomic_store_n(&block->queued, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&compiler->tail, tail + 1, __ATOMIC_RELEASE);
+    sem_post(&compiler->pending);
+}
+
+uint32_t jit_run_block(Emulator *emu, uint64_t budget)
+{
+    BlockCache *cache = emu->block_cache;
+    Block *block = cache->current;
+    if (block == NULL || cache->current_index != 0)
+        return 0;
+
+    jit_func_t *native = (jit_func_t *)__atomic_load_n(&block->native, __ATOMIC_ACQUIRE);
+    if (native == NULL)
+    {
+        if (!__atomic_load_n(&block->queued, __ATOMIC_ACQUIRE) && ++block->hits >= JIT_HOT_THRESHOLD)
+            queue_block(emu, block);
+        return 0;
+    }
+
+    uint32_t done = native(emu, budget > UINT32_MAX ? UINT32_MAX : (uint32_t)budget);
+    /* Falls through from the last op run, as the interpreter does, in the block chained into last. */
+    Block *last = cache->chained != NULL ? cache->chained : block;
+    if (cache->current == last)
+        cache->current_index = done - cache->chained_ops - 1;
+    cache->chained = NULL;
+    cache->chained_ops = 0;
+    return done;
+}
+
+#else
+
+int init_jit(void)
+{
+    printf("JIT is only supported on x86-64 hosts.\n");
+    return 0;
+}
+
+void free_jit_code(BlockCache *cache)
+{
+}
+
+uint32_t jit_run_block(Emulator *emu, uint64_t budget)
+{
+    return 0;
+}
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef JIT_H_
+#define JIT_H_
+
+#include <stdint.h>
+
+#include "emulator.h"
+
+/* Executions of a block before it is compiled */
+#define JIT_HOT_THRESHOLD 16
+/* Size of host code buffer; everything is dropped once it is full. */
+#define JIT_CODE_SIZE (16 * 1024 * 1024)
+/* Hot blocks waiting for the compiler thread; once full, blocks get hot again before they are queued. */
+#define JIT_QUEUE_SIZE 64
+
+/*
+ * Native code of a block
+ * Runs at most budget ops, going on into the blocks chained after it.
+ * Returns the ops run: those of the blocks it went through, and the
+ * index past the last op it ran in the last one.
+ */
+typedef uint32_t jit_func_t(Emulator *emu, uint32_t budget);
+
+/* Returns 0 if the JIT can not be used on this host. */
+int init_jit(void);
+/*
+ * Each block cache (vCPU) has its own code buffer and compiler thread,
+ * started on first use. Stops the thread and frees the buffer.
+ */
+void free_jit_code(BlockCache *cache);
+
+/*
+ * Runs the block entered by next_decoded_op as host code, once the
+ * compiler thread compiled it, and the compiled blocks chained after it
+ * while budget (more than BLOCK_MAX_OPS) lasts; queues it once it got hot.
+ * Returns the number of instructions run (0: interpret instead).
+ */
+uint32_t jit_run_block(Emulator *emu, uint64_t budget);
+
+#endif
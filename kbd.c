@@ -5,15 +5,26 @@
 #include <stdlib.h>
 #include <sys/types.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
 
 #include "kbd.h"
+#include "bench.h"
 #include "emulator.h"
 #include "emulator_functions.h"
 #include "interrupt.h"
+#include "io.h"
+#include "machine.h"
+#include "console.h"
+#include "snapshot.h"
+#include "replay.h"
+#include "util.h"
 
 #define KBD_DIB 0x01
 
-uint8_t scmap[128] = {
+static const uint8_t scmap[128] = {
     /* 0x00 */
     NO,
     NO,
@@ -157,32 +168,38 @@ uint8_t scmap[128] = {
     0x0e  // delete character
 };
 
-KBD *kbd;
+/*
+ * buf is a single-producer (kbd thread), single-consumer (CPU thread)
+ * ring: each side only writes its own index, and publishes it with
+ * release after the slot was written / read.
+ */
+static int buf_empty(KBD *kbd)
+{
+    return __atomic_load_n(&kbd->buf_index, __ATOMIC_ACQUIRE) == kbd->buf_out_index;
+}
 
-uint8_t get_kbd_status()
+static uint8_t get_kbd_status(KBD *kbd)
 {
-    if (kbd->buf_index != kbd->buf_out_index)
+    if (!buf_empty(kbd))
         kbd->status |= KBD_DIB;
     else
         kbd->status &= 0xFE;
     return kbd->status;
 }
 
-uint8_t get_kbd_data()
+/* Reading with the buffer empty returns the last scan code again. */
+static uint8_t get_kbd_data(KBD *kbd)
 {
+    if (buf_empty(kbd))
+        return kbd->buf[(uint8_t)(kbd->buf_out_index - 1)];
     uint8_t data = kbd->buf[kbd->buf_out_index];
-    if (kbd->buf_out_index > 254)
-    {
-        kbd->buf_out_index = 0;
-    }
-    else
-    {
-        kbd->buf_out_index += 1;
-    }
+    if (config.bench)
+        bench_key_read(kbd->stored_ns[kbd->buf_out_index]);
+    __atomic_store_n(&kbd->buf_out_index, (uint8_t)(kbd->buf_out_index + 1), __ATOMIC_RELEASE);
     return data;
 }
 
-void write_ps2_output_port(uint8_t value)
+static void write_ps2_output_port(uint8_t value)
 {
     switch (value)
     {
@@ -194,7 +211,7 @@ void write_ps2_output_port(uint8_t value)
     }
 }
 
-void write_ps2_config_byte(uint8_t value)
+static void write_ps2_config_byte(uint8_t value)
 {
     switch (value)
     {
@@ -206,41 +223,276 @@ void write_ps2_config_byte(uint8_t value)
     }
 }
 
-static int append_to_buf(uint8_t c)
+/*
+ * Interrupts are coalesced: one is raised for the bytes stored since
+ * the last one only if the guest already read everything before them.
+ * Otherwise it is still draining the buffer (its handler reads until
+ * the status shows it empty) and gets to them without another one.
+ */
+static void notify_guest(KBD *kbd, uint8_t start)
+{
+    if (start != kbd->buf_index && __atomic_load_n(&kbd->buf_out_index, __ATOMIC_ACQUIRE) == start)
+        ioapic_int_to_lapic(kbd->ioapic, IRQ_KBD);
+}
+
+/* Waits for the CPU to read if the buffer is full, so no key is lost. */
+static void append_to_buf(KBD *kbd, const uint8_t *chunk, ssize_t len)
+{
+    uint8_t start = kbd->buf_index;
+    ssize_t i;
+    for (i = 0; i < len; i++)
+    {
+        uint8_t c = chunk[i];
+        if (c < 1 || c > 127 || !scmap[c])
+            continue;
+        uint8_t next = kbd->buf_index + 1;
+        if (next == __atomic_load_n(&kbd->buf_out_index, __ATOMIC_ACQUIRE))
+        {
+            notify_guest(kbd, start);
+            while (next == __atomic_load_n(&kbd->buf_out_index, __ATOMIC_ACQUIRE))
+                usleep(1000);
+            start = kbd->buf_index;
+        }
+        kbd->buf[kbd->buf_index] = scmap[c];
+        if (config.bench)
+            kbd->stored_ns[kbd->buf_index] = monotonic_ns();
+        __atomic_store_n(&kbd->buf_index, next, __ATOMIC_RELEASE);
+    }
+    notify_guest(kbd, start);
+}
+
+/*
+ * -record: the CPU thread stores the bytes, so they are posted as they
+ * fit in the buffer. Each post returns once they are stored.
+ */
+static void record_input(KBD *kbd, const uint8_t *chunk, ssize_t len)
 {
-    if (c < 1 || c > 127)
-        return 0;
-    uint8_t sc = scmap[c];
-    if (!sc)
-        return 0;
-    kbd->buf[kbd->buf_index] = sc;
-    if (kbd->buf_index > 254)
+    while (len > 0)
     {
-        kbd->buf_index = 0;
+        uint8_t used = __atomic_load_n(&kbd->buf_index, __ATOMIC_ACQUIRE) - __atomic_load_n(&kbd->buf_out_index, __ATOMIC_ACQUIRE);
+        ssize_t n = 255 - used;
+        if (n == 0)
+        {
+            usleep(1000);
+            continue;
+        }
+        if (n > len)
+            n = len;
+        post_input(kbd->record, chunk, n);
+        chunk += n;
+        len -= n;
     }
-    else
+}
+
+void kbd_deliver(KBD *kbd, const uint8_t *bytes, int length)
+{
+    uint8_t start = kbd->buf_index;
+    int i;
+    if (length == 0)
+    {
+        if (!buf_empty(kbd))
+            ioapic_int_to_lapic(kbd->ioapic, IRQ_KBD);
+        return;
+    }
+    /* The log holds what fitted when it was recorded, so this only drops bytes of a diverged replay. */
+    for (i = 0; i < length; i++)
     {
-        kbd->buf_index += 1;
+        uint8_t c = bytes[i];
+        if (c < 1 || c > 127 || !scmap[c])
+            continue;
+        uint8_t next = kbd->buf_index + 1;
+        if (next == kbd->buf_out_index)
+            break;
+        kbd->buf[kbd->buf_index] = scmap[c];
+        if (config.bench)
+            kbd->stored_ns[kbd->buf_index] = monotonic_ns();
+        __atomic_store_n(&kbd->buf_index, next, __ATOMIC_RELEASE);
     }
-    return 1;
+    notify_guest(kbd, start);
+}
+
+/* Raises the interrupt again if the guest read nothing since out_index. */
+static void retry_interrupt(KBD *kbd, uint8_t out_index)
+{
+    if (buf_empty(kbd) || __atomic_load_n(&kbd->buf_out_index, __ATOMIC_ACQUIRE) != out_index)
+        return;
+    if (kbd->record != NULL)
+        post_input(kbd->record, NULL, 0);
+    else
+        ioapic_int_to_lapic(kbd->ioapic, IRQ_KBD);
+}
+
+/* The kbd thread is cancelled by destroy_kbd while it waits. */
+static void close_epoll(void *ptr)
+{
+    int epoll_fd = *(int *)ptr;
+    if (epoll_fd >= 0)
+        close(epoll_fd);
 }
 
-static void *kbd_loop()
+/*
+ * Host event loop of the input: waits for the fd to be readable, then
+ * reads whatever arrived at once (pasted or piped input comes in one
+ * chunk). Regular files can not be polled and are just read.
+ * If the guest leaves bytes unread for KBD_RETRY_MS (the interrupt came
+ * before its driver was ready), the interrupt is raised again.
+ * Input ends at EOF (end of a file or pipe, socket closed).
+ */
+static void *kbd_loop(void *ptr)
 {
+    KBD *kbd = (KBD *)ptr;
+    uint8_t chunk[KBD_CHUNK_SIZE];
+    struct epoll_event event;
+    int input_open = 1;
+    int epoll_fd = epoll_create1(0);
+    event.events = EPOLLIN;
+    event.data.fd = kbd->input_fd;
+    if (epoll_fd >= 0 && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, kbd->input_fd, &event) < 0)
+    {
+        close(epoll_fd);
+        epoll_fd = -1;
+    }
+    pthread_cleanup_push(close_epoll, &epoll_fd);
     while (1)
     {
-        uint8_t c = getchar();
-        if (append_to_buf(c))
-            ioapic_int_to_lapic(T_IRQ0 + IRQ_KBD);
+        uint8_t out_index = __atomic_load_n(&kbd->buf_out_index, __ATOMIC_ACQUIRE);
+        int timeout = buf_empty(kbd) ? -1 : KBD_RETRY_MS;
+        if (!input_open)
+        {
+            /* Nothing left to wait for */
+            if (timeout < 0)
+                break;
+            usleep(KBD_RETRY_MS * 1000);
+            retry_interrupt(kbd, out_index);
+            continue;
+        }
+        if (epoll_fd >= 0)
+        {
+            int ready = epoll_wait(epoll_fd, &event, 1, timeout);
+            if (ready < 0 && errno == EINTR)
+                continue;
+            if (ready < 0)
+                break;
+            if (ready == 0)
+            {
+                retry_interrupt(kbd, out_index);
+                continue;
+            }
+        }
+        ssize_t n = read(kbd->input_fd, chunk, sizeof(chunk));
+        if (n < 0 && (errno == EINTR || errno == EAGAIN))
+            continue;
+        if (n <= 0)
+        {
+            input_open = 0;
+            if (kbd->stop_at_eof != NULL)
+                raise_attention(kbd->stop_at_eof, ATTENTION_STOP);
+        }
+        else
+        {
+            if (kbd->record != NULL)
+                record_input(kbd, chunk, n);
+            else
+                append_to_buf(kbd, chunk, n);
+            __atomic_store_n(&kbd->input_bytes, kbd->input_bytes + n, __ATOMIC_RELEASE);
+        }
     }
+    pthread_cleanup_pop(1);
     return NULL;
 }
 
-void init_kbd(IOAPIC *ioapic)
+/* NULL: stdin, "unix:socket_path": a Unix domain socket, else a file or FIFO */
+static int open_input(const char *path)
 {
-    kbd = malloc(sizeof(KBD));
+    int fd;
+    if (path == NULL)
+        return STDIN_FILENO;
+    if (strncmp(path, "unix:", 5) == 0)
+        fd = connect_unix_socket(path + 5);
+    else
+        fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        printf("Could not open console input: %s\n", path);
+        panic();
+    }
+    return fd;
+}
+
+static uint32_t read_kbd_port(Emulator *emu, void *device, uint16_t address)
+{
+    KBD *kbd = (KBD *)device;
+    if (address == PS2DATA)
+    {
+        if (config.bench)
+            bench_milestone(emu, BENCH_KBD_READ);
+        return get_kbd_data(kbd);
+    }
+    return get_kbd_status(kbd);
+}
+
+static void write_kbd_port(Emulator *emu, void *device, uint16_t address, uint32_t value)
+{
+    if (address == PS2DATA)
+        write_ps2_config_byte(value);
+    else
+        write_ps2_output_port(value);
+}
+
+KBD *init_kbd(Machine *machine, const char *input)
+{
+    KBD *kbd = malloc(sizeof(KBD));
+    register_io_ports(machine->io, PS2DATA, 1, 1, read_kbd_port, write_kbd_port, kbd);
+    register_io_ports(machine->io, PS2STACMD, 1, 1, read_kbd_port, write_kbd_port, kbd);
     kbd->status = 0;
-    kbd->ioapic = ioapic;
-    pthread_t kbd_thread_id;
-    pthread_create(&kbd_thread_id, NULL, kbd_loop, NULL);
-}
\ No newline at end of file
+    kbd->ioapic = machine->ioapic;
+    kbd->buf_index = 0;
+    kbd->buf_out_index = 0;
+    memset(kbd->stored_ns, 0, sizeof(kbd->stored_ns));
+    kbd->input_fd = open_input(input);
+    kbd->input_bytes = 0;
+    kbd->stop_at_eof = NULL;
+    kbd->record = NULL;
+    kbd->started = 0;
+    machine->kbd = kbd;
+    return kbd;
+}
+
+void set_kbd_input(KBD *kbd, int fd, Emulator *stop_at_eof)
+{
+    kbd->input_fd = fd;
+    kbd->stop_at_eof = stop_at_eof;
+}
+
+void start_kbd_input(KBD *kbd)
+{
+    kbd->started = 1;
+    pthread_create(&kbd->thread, NULL, kbd_loop, (void *)kbd);
+}
+
+int kbd_input_read(KBD *kbd, uint64_t bytes)
+{
+    return __atomic_load_n(&kbd->input_bytes, __ATOMIC_ACQUIRE) >= bytes &&
+           __atomic_load_n(&kbd->buf_out_index, __ATOMIC_ACQUIRE) == __atomic_load_n(&kbd->buf_index, __ATOMIC_ACQUIRE);
+}
+
+void destroy_kbd(KBD *kbd)
+{
+    if (kbd->started)
+    {
+        pthread_cancel(kbd->thread);
+        pthread_join(kbd->thread, NULL);
+    }
+    if (kbd->input_fd != STDIN_FILENO)
+        close(kbd->input_fd);
+    free(kbd);
+}
+
+/* Before start_kbd_input, so the kbd thread does not write the ring yet. */
+void snapshot_kbd(struct Snapshot *snapshot, KBD *kbd)
+{
+    SNAPSHOT_FIELD(snapshot, kbd->status);
+    SNAPSHOT_FIELD(snapshot, kbd->buf);
+    SNAPSHOT_FIELD(snapshot, kbd->buf_index);
+    SNAPSHOT_FIELD(snapshot, kbd->buf_out_index);
+}
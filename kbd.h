@@ -2,13 +2,25 @@
 #define KBD_H_
 
 #include <stdint.h>
+#include <pthread.h>
 
 #include "ioapic.h"
 
-#define KBD_BUF_SIZE 255
+/* Bytes read from the input at once */
+#define KBD_CHUNK_SIZE 256
+/* Interrupt raised again if the guest did not read for this long */
+#define KBD_RETRY_MS 20
 #define KBD_STATUS_IN 2
 
 #define NO 0
+
+/*
+ * PS/2 (keyboard) Controller
+ * 0x60: in|out: Data Register
+ * 0x64: in: Status Register | out: Command Register
+ */
+#define PS2DATA 0x60
+#define PS2STACMD 0x64
 /*
  * Status Register
  * |_b_|_meaning________________________________________|
@@ -24,20 +36,44 @@
  * a. must be set before attempting to read data from IO port 0x60
  * b. must be clear before attempting to write data to IO port 0x60 or IO port 0x64
  */
-typedef struct
+typedef struct KBD
 {
     uint8_t status;
     IOAPIC *ioapic;
-    unsigned int buf[256];
+    /* Ring of scan codes, indexes wrap at 256 */
+    uint8_t buf[256];
     uint8_t buf_index;
     uint8_t buf_out_index;
-    uint8_t buf_index_reset;
+    /* -bench: host time (ns) each byte of buf was stored at */
+    uint64_t stored_ns[256];
+    /* Host input, read by the kbd thread */
+    int input_fd;
+    /* Bytes taken from the input so far, written by the kbd thread */
+    uint64_t input_bytes;
+    /* Stopped when the input ends, NULL to keep running */
+    Emulator *stop_at_eof;
+    /* -record: the bytes go through the log to the CPU thread, NULL without */
+    struct Replay *record;
+    int started;
+    pthread_t thread;
 } KBD;
 
-void init_kbd(IOAPIC *ioapic);
-uint8_t get_kbd_status();
-uint8_t get_kbd_data();
-void write_ps2_output_port(uint8_t value);
-void write_ps2_config_byte(uint8_t value);
+/* Registers the ports on machine. input: NULL for stdin, see -console-in */
+KBD *init_kbd(Machine *machine, const char *input);
+/* Input already open (a fork server job's connection), before start_kbd_input */
+void set_kbd_input(KBD *kbd, int fd, Emulator *stop_at_eof);
+/* Starts reading the input (kbd thread). */
+void start_kbd_input(KBD *kbd);
+/* Whether the first bytes of the input were taken and the guest read every scan code (-script) */
+int kbd_input_read(KBD *kbd, uint64_t bytes);
+/*
+ * On the CPU thread (-record, -replay): stores length bytes as the kbd
+ * thread does, length 0 raises the interrupt again if bytes are unread.
+ */
+void kbd_deliver(KBD *kbd, const uint8_t *bytes, int length);
+/* Stops the kbd thread, closes the input and frees kbd. */
+void destroy_kbd(KBD *kbd);
+struct Snapshot;
+void snapshot_kbd(struct Snapshot *snapshot, KBD *kbd);
 
 #endif
\ No newline at end of file
@@ -4,136 +4,438 @@
 #include <string.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <time.h>
+#include <sys/timerfd.h>
 
 #include "lapic.h"
+#include "machine.h"
 #include "interrupt.h"
-
-#define IRR_L 32
+#include "stats.h"
+#include "util.h"
+#include "snapshot.h"
 
 LAPIC *create_lapic(Emulator *emu)
 {
     LAPIC *lapic = malloc(sizeof(LAPIC));
     memset(lapic->registers, 0, sizeof(lapic->registers));
+    memset(lapic->irr, 0, sizeof(lapic->irr));
+    memset(lapic->isr, 0, sizeof(lapic->isr));
+    lapic->unit_enabled = 0;
+    lapic->int_enabled = 0;
     lapic->emu = emu;
-    pthread_t timer_thread;
-    lapic->timer_thread = &timer_thread;
+    lapic->timer_period = 0;
+    lapic->timer_deadline = UINT64_MAX;
+    lapic->timer_fd = -1;
+    lapic->ipi_sent = 0;
+    memset(lapic->bench_raised, 0, sizeof(lapic->bench_raised));
+    lapic->bench_accepted = 0;
     return lapic;
 }
 
-void lapic_send_intr(LAPIC *lapic)
+void destroy_lapic(LAPIC *lapic)
+{
+    if (lapic->timer_fd >= 0)
+    {
+        /* The thread only waits in read, a cancellation point. */
+        pthread_cancel(lapic->timer_thread);
+        pthread_join(lapic->timer_thread, NULL);
+        close(lapic->timer_fd);
+    }
+    free(lapic);
+}
+
+void set_lapic_id(LAPIC *lapic, uint8_t id)
+{
+    lapic->registers[ID >> 4] = (uint32_t)id << 24;
+}
+
+/* Highest vector set in 256-bit vector set, -1 if none. */
+static int highest_vector(uint32_t *bits)
 {
-    if (!lapic->int_enabled || !lapic->unit_enabled || !lapic->emu->int_enabled || lapic->registers[EOI >> 4] != 0)
+    int i;
+    for (i = VECTOR_WORDS - 1; i >= 0; i--)
     {
+        uint32_t word = __atomic_load_n(&bits[i], __ATOMIC_ACQUIRE);
+        if (word != 0)
+            return i * 32 + 31 - __builtin_clz(word);
+    }
+    return -1;
+}
+
+static void set_vector(uint32_t *bits, uint8_t vector)
+{
+    __atomic_fetch_or(&bits[vector >> 5], 1u << (vector & 31), __ATOMIC_RELEASE);
+}
+
+static void clear_vector(uint32_t *bits, uint8_t vector)
+{
+    __atomic_fetch_and(&bits[vector >> 5], ~(1u << (vector & 31)), __ATOMIC_RELEASE);
+}
+
+/* -stats: an interrupt accepted after an IPI ends that IPI's latency. */
+static void count_ipi_latency(LAPIC *lapic)
+{
+    uint64_t sent = __atomic_exchange_n(&lapic->ipi_sent, 0, __ATOMIC_RELAXED);
+    if (sent == 0)
         return;
+    uint64_t latency = monotonic_ns() - sent;
+    uint64_t max = __atomic_load_n(&stats.ipi_latency_max_ns, __ATOMIC_RELAXED);
+    STAT_INC_ATOMIC(stats.ipis);
+    __atomic_fetch_add(&stats.ipi_latency_ns, latency, __ATOMIC_RELAXED);
+    while (latency > max && !__atomic_compare_exchange_n(&stats.ipi_latency_max_ns, &max, latency, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/*
+ * Requested vector with the highest priority is accepted
+ * if its class (vector >> 4) is above the ones in service and TPR.
+ */
+int lapic_accept_intr(LAPIC *lapic)
+{
+    if (!lapic->int_enabled || !lapic->unit_enabled || !lapic->emu->int_enabled)
+    {
+        return -1;
     }
-    pthread_mutex_lock(&lapic->lock);
-    uint8_t i;
-    for (i = 0; i < IRR_L; i++)
+    int vector = highest_vector(lapic->irr);
+    if (vector < 0)
     {
-        if (lapic->irr[i] > 0)
-        {
-            lapic->isr[i] = lapic->irr[i];
-            lapic->isr_index = i;
-            lapic->emu->int_r = lapic->irr[i];
-            lapic->registers[EOI >> 4] = 1;
-            lapic->irr[i] = 0;
-            break;
-        }
+        return -1;
+    }
+    int in_service = highest_vector(lapic->isr);
+    if (in_service >= 0 && (vector >> 4) <= (in_service >> 4))
+    {
+        return -1;
+    }
+    if ((vector >> 4) <= ((lapic->registers[TPR >> 4] >> 4) & 0xF))
+    {
+        return -1;
     }
-    pthread_mutex_unlock(&lapic->lock);
+    clear_vector(lapic->irr, vector);
+    set_vector(lapic->isr, vector);
+    if (config.stats)
+        count_ipi_latency(lapic);
+    /* After IRR: a request merged into this one leaves no stamp, not a stale one. */
+    if (config.bench)
+        lapic->bench_accepted = __atomic_exchange_n(&lapic->bench_raised[vector], 0, __ATOMIC_RELAXED);
+    return vector;
 }
 
 static void lapic_eoi(LAPIC *lapic)
 {
-    pthread_mutex_lock(&lapic->lock);
-    lapic->isr[lapic->isr_index] = 0;
-    lapic->registers[EOI >> 4] = 0;
-    pthread_mutex_unlock(&lapic->lock);
-    lapic_send_intr(lapic);
+    int vector = highest_vector(lapic->isr);
+    if (vector >= 0)
+    {
+        clear_vector(lapic->isr, vector);
+    }
+    if (highest_vector(lapic->irr) >= 0)
+    {
+        raise_attention(lapic->emu, ATTENTION_INTERRUPT);
+    }
 }
 
+/*
+ * Can be called from device threads, without a lock:
+ * the request is a bit set atomically in IRR, and attention makes
+ * the CPU thread run lapic_accept_intr before its next instruction.
+ * Requests for one vector before it is accepted merge into one bit,
+ * as on hardware, but none is lost.
+ */
 void lapic_write_to_irr(LAPIC *lapic, uint8_t irq)
 {
-    if (!lapic->unit_enabled || !lapic->int_enabled)
+    if (!__atomic_load_n(&lapic->unit_enabled, __ATOMIC_ACQUIRE) || !__atomic_load_n(&lapic->int_enabled, __ATOMIC_ACQUIRE))
     {
         return;
     }
-    pthread_mutex_lock(&lapic->lock);
-    uint8_t i;
-    for (i = 0; i < IRR_L; i++)
+    if (config.bench)
     {
-        if (lapic->irr[i] == 0)
-        {
-            lapic->irr[i] = irq;
-            pthread_mutex_unlock(&lapic->lock);
-            lapic_send_intr(lapic);
-            return;
-        }
+        /* The oldest request not accepted yet */
+        uint64_t none = 0;
+        __atomic_compare_exchange_n(&lapic->bench_raised[irq], &none, monotonic_ns(), 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
     }
-    pthread_mutex_unlock(&lapic->lock);
+    set_vector(lapic->irr, irq);
+    raise_attention(lapic->emu, ATTENTION_INTERRUPT);
 }
 
 /*
- * Timer interrupt
- * Decrement Rate: bus frequency / DCR (divide configuration register)
- * ICR (Initial Count Register) - 1 at decrement rate above
- * Interrupt is generated at ICR:0 and counter is reset to ICR.
- * For xv6 it's aimed to be 100 times/sec, so the loop below just waits 10ms.
+ * Timer
+ * Current count decrements at bus frequency / DCR (divide configuration
+ * register) from ICR (initial count register). An interrupt with the
+ * vector of LVT Timer is generated at 0, then the count is reloaded from
+ * ICR in periodic mode or stops in one-shot mode. Writing ICR (re)starts
+ * it, 0 stops it.
+ * Time is the host's monotonic clock (one timerfd, waited on by one
+ * thread), or with -icount the number of instructions retired, which
+ * makes the interrupts reproducible.
  */
+
+/* Divisor of DCR bits 0, 1 and 3 */
+static uint32_t timer_divisor(LAPIC *lapic)
+{
+    uint32_t dcr = lapic->registers[TDCR >> 4];
+    uint32_t value = (dcr & 0x3) | ((dcr >> 1) & 0x4);
+    return value == 0x7 ? 1 : 2u << value;
+}
+
+static int timer_periodic(LAPIC *lapic)
+{
+    return (lapic->registers[TIMER >> 4] & LVT_TIMER_PERIODIC) != 0;
+}
+
+static void timer_fire(LAPIC *lapic)
+{
+    uint32_t lvt = lapic->registers[TIMER >> 4];
+    STAT_INC_ATOMIC(stats.timer_ticks);
+    if (!(lvt & MASKED))
+        lapic_write_to_irr(lapic, lvt & 0xFF);
+}
+
 static void *timer_loop(void *ptr)
 {
     LAPIC *lapic = (LAPIC *)ptr;
+    uint64_t expirations;
     while (1)
     {
-        lapic_write_to_irr(lapic, T_IRQ0 + IRQ_TIMER);
-        usleep(10 * 1000);
+        /* Blocks while the timer is stopped. */
+        if (read(lapic->timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+            continue;
+        /* Missed periods are merged, IRR holds one request per vector anyway. */
+        timer_fire(lapic);
     }
     return NULL;
 }
 
+static uint64_t counts_to_ns(uint64_t counts)
+{
+    return counts * (1000000000ull / LAPIC_BUS_HZ);
+}
+
+static void start_host_timer(LAPIC *lapic)
+{
+    if (lapic->timer_fd < 0)
+    {
+        lapic->timer_fd = timerfd_create(CLOCK_MONOTONIC, 0);
+        if (lapic->timer_fd < 0)
+        {
+            printf("Could not create LAPIC timer.\n");
+            panic_exit(lapic->emu);
+        }
+        pthread_create(&lapic->timer_thread, NULL, timer_loop, (void *)lapic);
+    }
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    uint64_t ns = counts_to_ns(lapic->timer_period);
+    spec.it_value.tv_sec = ns / 1000000000;
+    spec.it_value.tv_nsec = ns % 1000000000;
+    if (timer_periodic(lapic))
+        spec.it_interval = spec.it_value;
+    timerfd_settime(lapic->timer_fd, 0, &spec, NULL);
+}
+
+static void start_timer(LAPIC *lapic)
+{
+    lapic->timer_period = (uint64_t)lapic->registers[TICR >> 4] * timer_divisor(lapic);
+    if (config.icount)
+    {
+        /* Emulator.icount is only current at the run loop's slow path. */
+        lapic->timer_deadline = UINT64_MAX;
+        raise_attention(lapic->emu, ATTENTION_TIMER);
+        return;
+    }
+    if (lapic->timer_period != 0 || lapic->timer_fd >= 0)
+        start_host_timer(lapic);
+}
+
+void lapic_timer_restart(LAPIC *lapic)
+{
+    if (!config.icount)
+    {
+        if (lapic->timer_period != 0)
+            start_host_timer(lapic);
+        return;
+    }
+    if (lapic->timer_period != 0)
+        lapic->timer_deadline = lapic->emu->icount + lapic->timer_period;
+}
+
+uint64_t lapic_timer_deadline(LAPIC *lapic)
+{
+    return lapic->timer_deadline;
+}
+
+void lapic_timer_expire(LAPIC *lapic)
+{
+    timer_fire(lapic);
+    if (timer_periodic(lapic) && lapic->timer_period != 0)
+        lapic->timer_deadline += lapic->timer_period;
+    else
+        lapic->timer_deadline = UINT64_MAX;
+}
+
+/* With -icount, as of the last slow path of the run loop */
+static uint32_t timer_current_count(LAPIC *lapic)
+{
+    uint64_t remaining = 0;
+    if (config.icount)
+    {
+        if (lapic->timer_deadline != UINT64_MAX && lapic->timer_deadline > lapic->emu->icount)
+            remaining = lapic->timer_deadline - lapic->emu->icount;
+    }
+    else if (lapic->timer_fd >= 0)
+    {
+        struct itimerspec spec;
+        timerfd_gettime(lapic->timer_fd, &spec);
+        uint64_t ns = (uint64_t)spec.it_value.tv_sec * 1000000000 + spec.it_value.tv_nsec;
+        remaining = ns / counts_to_ns(1);
+    }
+    return remaining / timer_divisor(lapic);
+}
+
 static void check_int_enabled(LAPIC *lapic)
 {
     if (lapic->registers[LINT0 >> 4] == MASKED && lapic->registers[LINT1 >> 4] == MASKED)
     {
-        lapic->int_enabled = 1;
+        __atomic_store_n(&lapic->int_enabled, 1, __ATOMIC_RELEASE);
     }
     else
     {
-        lapic->int_enabled = 0;
+        __atomic_store_n(&lapic->int_enabled, 0, __ATOMIC_RELEASE);
+    }
+}
+
+/*
+ * Physical: APIC ID or ICR_BROADCAST. Logical: flat model only, a bit
+ * of the destination set in LDR.
+ */
+int lapic_matches_destination(LAPIC *lapic, int logical, uint8_t dest)
+{
+    if (logical)
+        return (lapic->registers[LDR >> 4] >> 24) & dest;
+    return dest == ICR_BROADCAST || dest == lapic->registers[ID >> 4] >> 24;
+}
+
+/* Is the CPU of target one of the destinations of ICRHI? */
+static int ipi_destination(LAPIC *target, uint32_t icr_low, uint8_t dest)
+{
+    return lapic_matches_destination(target, (icr_low & ICR_LOGICAL) != 0, dest);
+}
+
+static void deliver_ipi(Emulator *target, uint32_t icr_low)
+{
+    switch (icr_low & ICR_DELIVERY_MODE)
+    {
+    case ICR_FIXED:
+    case ICR_LOWEST:
+        /* Lock-free like device interrupts: IRR bit, then the target's attention */
+        if (config.stats)
+        {
+            uint64_t none = 0;
+            __atomic_compare_exchange_n(&target->lapic->ipi_sent, &none, monotonic_ns(), 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+        }
+        lapic_write_to_irr(target->lapic, icr_low & 0xFF);
+        break;
+    case ICR_INIT:
+        /* Level de-assert only matters to old (82489DX) APICs. */
+        if ((icr_low & ICR_LEVEL) && !(icr_low & ICR_ASSERT))
+            break;
+        raise_attention(target, ATTENTION_INIT);
+        break;
+    case ICR_STARTUP:
+        __atomic_store_n(&target->startup_vector, icr_low & 0xFF, __ATOMIC_RELEASE);
+        raise_attention(target, ATTENTION_STARTUP);
+        break;
+    default:
+        /* SMI, NMI and ExtINT are not emulated. */
+        break;
+    }
+}
+
+/*
+ * IPI of ICRLO/ICRHI from this LAPIC's CPU, run on its thread.
+ * Delivery is immediate, so the delivery status bit always reads 0.
+ * Lowest priority goes to the first destination, without arbitration.
+ */
+static void send_ipi(LAPIC *lapic, uint32_t icr_low)
+{
+    Machine *machine = lapic->emu->machine;
+    uint8_t dest = lapic->registers[ICRHI >> 4] >> 24;
+    int i;
+    if (machine == NULL)
+        return;
+    for (i = 0; i < machine->cpu_count; i++)
+    {
+        Emulator *target = machine->cpus[i];
+        int self = target == lapic->emu;
+        switch (icr_low & ICR_SHORTHAND)
+        {
+        case ICR_SELF:
+            if (!self)
+                continue;
+            break;
+        case ICR_ALL:
+            break;
+        case ICR_OTHERS:
+            if (self)
+                continue;
+            break;
+        default:
+            if (!ipi_destination(target->lapic, icr_low, dest))
+                continue;
+            break;
+        }
+        deliver_ipi(target, icr_low);
+        if ((icr_low & ICR_DELIVERY_MODE) == ICR_LOWEST)
+            break;
     }
 }
 
 void lapic_write_reg(LAPIC *lapic, uint32_t addr, uint32_t val)
 {
     uint32_t offset = (addr - LAPIC_DEFAULT_BASE);
-    uint8_t index = offset >> 4;
+    uint32_t index = offset >> 4;
+    if (index >= APIC_REGISTERS_SIZE)
+        return;
     lapic->registers[index] = val;
     if (offset == SVR)
     {
         if (val & 0x100)
         {
-            lapic->unit_enabled = 1;
+            __atomic_store_n(&lapic->unit_enabled, 1, __ATOMIC_RELEASE);
         }
         return;
     }
     else if (offset == TICR)
     {
-        pthread_create(lapic->timer_thread, NULL, timer_loop, (void *)lapic);
+        start_timer(lapic);
     }
     else if (offset == TPR)
     {
         check_int_enabled(lapic);
+        raise_attention(lapic->emu, ATTENTION_INTERRUPT);
     }
     else if (offset == EOI && val == 0)
     {
         check_int_enabled(lapic);
         lapic_eoi(lapic);
     }
+    else if (offset == ICRLO)
+    {
+        lapic->registers[index] = val & ~ICR_DELIVS;
+        send_ipi(lapic, val);
+    }
 }
 
 uint32_t lapic_read_reg(LAPIC *lapic, uint32_t addr)
 {
-    uint8_t index = (addr - LAPIC_DEFAULT_BASE) >> 4;
+    uint32_t offset = (addr - LAPIC_DEFAULT_BASE);
+    uint32_t index = offset >> 4;
+    if (index >= APIC_REGISTERS_SIZE)
+        return 0;
+    if (offset >= ISR && offset < ISR + VECTOR_WORDS * 0x10)
+        return __atomic_load_n(&lapic->isr[(offset - ISR) >> 4], __ATOMIC_ACQUIRE);
+    if (offset >= IRR && offset < IRR + VECTOR_WORDS * 0x10)
+        return __atomic_load_n(&lapic->irr[(offset - IRR) >> 4], __ATOMIC_ACQUIRE);
+    if (offset == TCCR)
+        return timer_current_count(lapic);
     return lapic->registers[index];
 }
 
@@ -141,6 +443,24 @@ void dump_lapic(LAPIC *lapic)
 {
     printf("<LAPIC at %p>\n", (void *)lapic);
     printf("TPR: %08x EOI: %08x SVR: %08x\n", lapic->registers[TPR >> 4], lapic->registers[EOI >> 4], lapic->registers[SVR >> 4]);
-    printf("TIMER: %08x TICR: %08x\n", lapic->registers[TIMER >> 4], lapic->registers[TICR >> 4]);
+    printf("TIMER: %08x TICR: %08x TCCR: %08x TDCR: %08x\n", lapic->registers[TIMER >> 4], lapic->registers[TICR >> 4], timer_current_count(lapic), lapic->registers[TDCR >> 4]);
     printf("LINT0: %08x LINT1: %08x\n", lapic->registers[LINT0 >> 4], lapic->registers[LINT1 >> 4]);
-}
\ No newline at end of file
+}
+/*
+ * The host timer starts a new period on the CPU thread (not before a
+ * fork server clones the machine), -icount keeps the deadline.
+ */
+void snapshot_lapic(struct Snapshot *snapshot, LAPIC *lapic)
+{
+    SNAPSHOT_FIELD(snapshot, lapic->registers);
+    SNAPSHOT_FIELD(snapshot, lapic->unit_enabled);
+    SNAPSHOT_FIELD(snapshot, lapic->int_enabled);
+    SNAPSHOT_FIELD(snapshot, lapic->irr);
+    SNAPSHOT_FIELD(snapshot, lapic->isr);
+    SNAPSHOT_FIELD(snapshot, lapic->timer_period);
+    SNAPSHOT_FIELD(snapshot, lapic->timer_deadline);
+    if (!snapshot->restoring || lapic->timer_period == 0)
+        return;
+    if (!config.icount || lapic->timer_deadline == UINT64_MAX)
+        raise_attention(lapic->emu, ATTENTION_TIMER);
+}
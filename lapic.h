@@ -64,24 +64,79 @@
 
 #define LAPIC_DEFAULT_BASE 0xFEE00000
 
+#define ID 0x0020         // ID
 #define TPR 0x0080        // Task Priority
 #define EOI 0x00B0        // EOI
+#define LDR 0x00D0        // Logical Destination
 #define SVR 0x00F0        // Spurious Interrupt Vector
+#define ISR 0x0100        // In-service (8 registers)
+#define IRR 0x0200        // Interrupt Request (8 registers)
+#define ICRLO 0x0300      // Interrupt Command
+#define ICRHI 0x0310      // Interrupt Command [63:32]
 #define TIMER 0x0320      // Local Vector Table 0 (TIMER)
 #define TICR 0x0380       // Timer Initial Count
+#define TCCR 0x0390       // Timer Current Count
+#define TDCR 0x03E0       // Timer Divide Configuration
 #define LINT0 0x0350      // Local Vector Table 1 (LINT0)
 #define LINT1 0x0360      // Local Vector Table 2 (LINT1)
 #define ERROR 0x0370      // Local Vector Table 3 (ERROR)
 #define MASKED 0x00010000 // Interrupt masked
+#define LVT_TIMER_PERIODIC 0x00020000
+/* ICRLO fields */
+#define ICR_DELIVERY_MODE 0x00000700
+#define ICR_FIXED 0x00000000
+#define ICR_LOWEST 0x00000100
+#define ICR_INIT 0x00000500
+#define ICR_STARTUP 0x00000600
+#define ICR_LOGICAL 0x00000800
+#define ICR_DELIVS 0x00001000 // Delivery status
+#define ICR_ASSERT 0x00004000 // Level assert (INIT level de-assert if clear)
+#define ICR_LEVEL 0x00008000
+#define ICR_SHORTHAND 0x000C0000
+#define ICR_SELF 0x00040000
+#define ICR_ALL 0x00080000
+#define ICR_OTHERS 0x000C0000
+/* Physical destination of all CPUs */
+#define ICR_BROADCAST 0xFF
+
+/*
+ * Timer counts per second (divide by 1)
+ * xv6 does not calibrate and loads 10000000, which makes 100 ticks/sec.
+ * With -icount one count is one instruction retired.
+ */
+#define LAPIC_BUS_HZ 1000000000
 
 LAPIC *create_lapic(Emulator *emu);
+/* Stops the host timer thread and frees the LAPIC. */
+void destroy_lapic(LAPIC *lapic);
+/* Sets the ID register (APIC ID in bits 31:24). */
+void set_lapic_id(LAPIC *lapic, uint8_t id);
 
-void lapic_send_intr(LAPIC *lapic);
+/*
+ * Moves the highest priority deliverable vector from IRR to ISR.
+ * Returns the vector, -1 if none can be delivered now.
+ */
+int lapic_accept_intr(LAPIC *lapic);
 void lapic_write_to_irr(LAPIC *lapic, uint8_t irq);
+/* Is lapic's CPU one of dest, a physical (APIC ID) or logical (LDR) destination? */
+int lapic_matches_destination(LAPIC *lapic, int logical, uint8_t dest);
+
+/*
+ * -icount: starts counting from Emulator.icount after ICR was written.
+ * Host time: starts the timer thread (after restore).
+ */
+void lapic_timer_restart(LAPIC *lapic);
+/* -icount: instruction count of the next timer expiration, UINT64_MAX if none */
+uint64_t lapic_timer_deadline(LAPIC *lapic);
+/* -icount: generates the timer interrupt due at lapic_timer_deadline. */
+void lapic_timer_expire(LAPIC *lapic);
 
 void lapic_write_reg(LAPIC *lapic, uint32_t addr, uint32_t val);
 uint32_t lapic_read_reg(LAPIC *lapic, uint32_t addr);
 
+struct Snapshot;
+void snapshot_lapic(struct Snapshot *snapshot, LAPIC *lapic);
+
 void dump_lapic(LAPIC *lapic);
 
 #endif
\ No newline at end of file
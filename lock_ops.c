@@ -0,0 +1,263 @@
+#include <stdint.h>
+
+#include "lock_ops.h"
+#include "emulator_functions.h"
+#include "modrm.h"
+
+/*
+ * There is no global lock: each op is one atomic instruction of the host
+ * (or a compare-exchange loop) on the RAM of the operand, flags are then
+ * computed from the value it replaced, as the unlocked handlers do.
+ */
+
+/* ModR/M REG of 80 - 83, bits 5:3 of 00 - 3F */
+enum AluOp
+{
+    ALU_ADD,
+    ALU_OR,
+    ALU_ADC,
+    ALU_SBB,
+    ALU_AND,
+    ALU_SUB,
+    ALU_XOR,
+    ALU_CMP
+};
+
+/* Host pointer of the memory operand, NULL if it can not be accessed atomically */
+static void *locked_operand(Emulator *emu, ModRM *modrm, int size)
+{
+    if (modrm->mod == 3)
+        return NULL;
+    return get_atomic_pointer(emu, emu->prefixes.segment, calc_memory_address(emu, modrm), size);
+}
+
+static void locked_alu8(Emulator *emu, uint8_t *p, int alu, uint8_t src)
+{
+    uint8_t old;
+    /* The carry is added to the result, src + cf may wrap. */
+    int cf = (alu == ALU_ADC || alu == ALU_SBB) ? is_carry(emu) : 0;
+    switch (alu)
+    {
+    case ALU_ADD:
+    case ALU_ADC:
+        old = __atomic_fetch_add(p, (uint8_t)(src + cf), __ATOMIC_SEQ_CST);
+        update_eflags_add_8bit(emu, old, src, (uint16_t)old + (uint16_t)src + cf);
+        break;
+    case ALU_SUB:
+    case ALU_SBB:
+        old = __atomic_fetch_sub(p, (uint8_t)(src + cf), __ATOMIC_SEQ_CST);
+        update_eflags_sub_8bit(emu, old, src, (uint16_t)old - (uint16_t)src - cf);
+        break;
+    case ALU_OR:
+        update_eflags_logical_ops_8bit(emu, __atomic_or_fetch(p, src, __ATOMIC_SEQ_CST));
+        break;
+    case ALU_AND:
+        update_eflags_logical_ops_8bit(emu, __atomic_and_fetch(p, src, __ATOMIC_SEQ_CST));
+        break;
+    case ALU_XOR:
+        update_eflags_logical_ops_8bit(emu, __atomic_xor_fetch(p, src, __ATOMIC_SEQ_CST));
+        break;
+    }
+}
+
+static void locked_alu32(Emulator *emu, uint32_t *p, int alu, uint32_t src)
+{
+    uint32_t old;
+    /* The carry is added to the result, src + cf may wrap. */
+    int cf = (alu == ALU_ADC || alu == ALU_SBB) ? is_carry(emu) : 0;
+    switch (alu)
+    {
+    case ALU_ADD:
+    case ALU_ADC:
+        old = __atomic_fetch_add(p, (uint32_t)(src + cf), __ATOMIC_SEQ_CST);
+        update_eflags_add(emu, old, src, (uint64_t)old + (uint64_t)src + cf);
+        break;
+    case ALU_SUB:
+    case ALU_SBB:
+        old = __atomic_fetch_sub(p, (uint32_t)(src + cf), __ATOMIC_SEQ_CST);
+        update_eflags_sub(emu, old, src, (uint64_t)old - (uint64_t)src - cf);
+        break;
+    case ALU_OR:
+        update_eflags_logical_ops(emu, __atomic_or_fetch(p, src, __ATOMIC_SEQ_CST));
+        break;
+    case ALU_AND:
+        update_eflags_logical_ops(emu, __atomic_and_fetch(p, src, __ATOMIC_SEQ_CST));
+        break;
+    case ALU_XOR:
+        update_eflags_logical_ops(emu, __atomic_xor_fetch(p, src, __ATOMIC_SEQ_CST));
+        break;
+    }
+}
+
+/* 00 - 31: op rm, r */
+static int locked_alu_rm_r(Emulator *emu, uint8_t op)
+{
+    ModRM modrm = create_modrm();
+    emu->eip += 1;
+    parse_modrm(emu, &modrm);
+    if (op & 1)
+    {
+        uint32_t *p = locked_operand(emu, &modrm, 4);
+        if (p == NULL)
+            return 0;
+        locked_alu32(emu, p, op >> 3, get_r32(emu, &modrm));
+    }
+    else
+    {
+        uint8_t *p = locked_operand(emu, &modrm, 1);
+        if (p == NULL)
+            return 0;
+        locked_alu8(emu, p, op >> 3, get_r8(emu, &modrm));
+    }
+    return 1;
+}
+
+/* 80: op rm8, imm8; 81: op rm32, imm32; 83: op rm32, imm8 (sign-extended) */
+static int locked_alu_rm_imm(Emulator *emu, uint8_t op)
+{
+    ModRM modrm = create_modrm();
+    emu->eip += 1;
+    parse_modrm(emu, &modrm);
+    if (modrm.opcode == ALU_CMP)
+        return 0;
+    if (op == 0x80)
+    {
+        uint8_t *p = locked_operand(emu, &modrm, 1);
+        if (p == NULL)
+            return 0;
+        uint8_t imm8 = get_code8(emu, 0);
+        emu->eip += 1;
+        locked_alu8(emu, p, modrm.opcode, imm8);
+        return 1;
+    }
+    uint32_t *p = locked_operand(emu, &modrm, 4);
+    if (p == NULL)
+        return 0;
+    uint32_t imm;
+    if (op == 0x81)
+    {
+        imm = get_code32(emu, 0);
+        emu->eip += 4;
+    }
+    else
+    {
+        imm = (int32_t)get_sign_code8(emu, 0);
+        emu->eip += 1;
+    }
+    locked_alu32(emu, p, modrm.opcode, imm);
+    return 1;
+}
+
+/* FE, FF: inc, dec (ModR/M REG 0, 1) */
+static int locked_inc_dec(Emulator *emu, uint8_t op)
+{
+    ModRM modrm = create_modrm();
+    emu->eip += 1;
+    parse_modrm(emu, &modrm);
+    if (modrm.opcode > 1)
+        return 0;
+    int alu = modrm.opcode == 0 ? ALU_ADD : ALU_SUB;
+    if (op == 0xFF)
+    {
+        uint32_t *p = locked_operand(emu, &modrm, 4);
+        if (p == NULL)
+            return 0;
+        locked_alu32(emu, p, alu, 1);
+    }
+    else
+    {
+        uint8_t *p = locked_operand(emu, &modrm, 1);
+        if (p == NULL)
+            return 0;
+        locked_alu8(emu, p, alu, 1);
+    }
+    return 1;
+}
+
+/* F6, F7: not, neg (ModR/M REG 2, 3), which set no flags as unlocked */
+static int locked_not_neg(Emulator *emu, uint8_t op)
+{
+    ModRM modrm = create_modrm();
+    emu->eip += 1;
+    parse_modrm(emu, &modrm);
+    if (modrm.opcode != 2 && modrm.opcode != 3)
+        return 0;
+    int neg = modrm.opcode == 3;
+    if (op == 0xF7)
+    {
+        uint32_t *p = locked_operand(emu, &modrm, 4);
+        if (p == NULL)
+            return 0;
+        uint32_t old = __atomic_load_n(p, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(p, &old, neg ? -old : ~old, 1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            ;
+    }
+    else
+    {
+        uint8_t *p = locked_operand(emu, &modrm, 1);
+        if (p == NULL)
+            return 0;
+        uint8_t old = __atomic_load_n(p, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(p, &old, neg ? -old : ~old, 1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            ;
+    }
+    return 1;
+}
+
+/* 0F B1: cmpxchg rm32, r32 */
+static int locked_cmpxchg(Emulator *emu)
+{
+    ModRM modrm = create_modrm();
+    emu->eip += 2;
+    parse_modrm(emu, &modrm);
+    uint32_t *p = locked_operand(emu, &modrm, 4);
+    if (p == NULL)
+        return 0;
+    uint32_t eax_val = get_register32(emu, EAX);
+    uint32_t old = eax_val;
+    /* On failure old is what rm32 holds. */
+    if (!__atomic_compare_exchange_n(p, &old, get_r32(emu, &modrm), 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+        set_register32(emu, EAX, old);
+    update_eflags_sub(emu, eax_val, old, (uint64_t)eax_val - (uint64_t)old);
+    return 1;
+}
+
+/* 0F C1: xadd rm32, r32 */
+static int locked_xadd(Emulator *emu)
+{
+    ModRM modrm = create_modrm();
+    emu->eip += 2;
+    parse_modrm(emu, &modrm);
+    uint32_t *p = locked_operand(emu, &modrm, 4);
+    if (p == NULL)
+        return 0;
+    uint32_t r32_val = get_r32(emu, &modrm);
+    uint32_t old = __atomic_fetch_add(p, r32_val, __ATOMIC_SEQ_CST);
+    set_r32(emu, &modrm, old);
+    update_eflags_add(emu, old, r32_val, (uint64_t)old + (uint64_t)r32_val);
+    return 1;
+}
+
+int run_locked_op(Emulator *emu)
+{
+    uint32_t start = emu->eip;
+    uint8_t op = get_code8(emu, 0);
+    int done = 0;
+
+    if (op < 0x38 && (op & 0x7) <= 1)
+        done = locked_alu_rm_r(emu, op);
+    else if (op == 0x80 || op == 0x81 || op == 0x83)
+        done = locked_alu_rm_imm(emu, op);
+    else if (op == 0xFE || op == 0xFF)
+        done = locked_inc_dec(emu, op);
+    else if (op == 0xF6 || op == 0xF7)
+        done = locked_not_neg(emu, op);
+    else if (op == 0x0F && get_code8(emu, 1) == 0xB1)
+        done = locked_cmpxchg(emu);
+    else if (op == 0x0F && get_code8(emu, 1) == 0xC1)
+        done = locked_xadd(emu);
+
+    if (!done)
+        emu->eip = start;
+    return done;
+}
@@ -0,0 +1,17 @@
+#ifndef LOCK_OPS_H_
+#define LOCK_OPS_H_
+
+#include "emulator.h"
+
+/*
+ * Runs the op after a LOCK prefix (EIP at the op) as one host atomic
+ * operation on guest RAM, so vCPUs on other host threads see it whole:
+ * add, or, adc, sbb, and, sub, xor (00 - 31, 80 - 83), inc, dec (FE, FF),
+ * not, neg (F6, F7), cmpxchg (0F B1) and xadd (0F C1) of a memory operand.
+ * Returns 0 without running it if the op is not one of them or its
+ * operand is not in one page of RAM; the caller runs it as usual then.
+ * (xchg is atomic with or without the prefix.)
+ */
+int run_locked_op(Emulator *emu);
+
+#endif
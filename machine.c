@@ -0,0 +1,79 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "machine.h"
+#include "disk.h"
+#include "mp.h"
+#include "cpu.h"
+#include "replay.h"
+#include "checkpoint.h"
+#include "script.h"
+
+Machine *create_machine(uint32_t memory_size, int cpu_count)
+{
+    Machine *machine = calloc(1, sizeof(Machine));
+    int i;
+    machine->io = create_io_ports();
+    machine->ioapic = create_ioapic();
+
+    machine->emu = create_emu(memory_size, 0x7c00, 0x7c00);
+    machine->emu->machine = machine;
+    machine->cpus[0] = machine->emu;
+    for (i = 1; i < cpu_count; i++)
+        machine->cpus[i] = create_ap(machine->emu, i);
+    machine->cpu_count = cpu_count;
+    for (i = 0; i < cpu_count; i++)
+        add_lapic(machine->ioapic, i, machine->cpus[i]->lapic);
+
+    /* BIOS configures MP settings */
+    set_mp_config(machine->emu, cpu_count);
+    return machine;
+}
+
+static void *ap_loop(void *ptr)
+{
+    emu_run((Emulator *)ptr, 0, NULL);
+    return NULL;
+}
+
+void start_aps(Machine *machine)
+{
+    int i;
+    for (i = 1; i < machine->cpu_count; i++)
+        pthread_create(&machine->threads[i], NULL, ap_loop, (void *)machine->cpus[i]);
+    machine->threads_started = 1;
+}
+
+/* Devices with threads go first, those threads raise interrupts. */
+void destroy_machine(Machine *machine)
+{
+    int i;
+    for (i = 1; i < machine->cpu_count && machine->threads_started; i++)
+    {
+        raise_attention(machine->cpus[i], ATTENTION_STOP);
+        pthread_join(machine->threads[i], NULL);
+    }
+    /* The script thread waits on the keyboard. */
+    if (machine->script != NULL)
+        destroy_script(machine->script);
+    if (machine->kbd != NULL)
+        destroy_kbd(machine->kbd);
+    if (machine->cga != NULL)
+        destroy_cga(machine->cga);
+    if (machine->pvnet != NULL)
+        destroy_pvnet(machine->pvnet);
+    if (machine->replay != NULL)
+        close_replay(machine->replay);
+    if (machine->checkpoints != NULL)
+        close_checkpoints(machine->checkpoints);
+    if (machine->emu->disk != NULL)
+        destroy_disk_device(machine->emu->disk);
+    for (i = 1; i < machine->cpu_count; i++)
+        destroy_ap(machine->cpus[i]);
+    destroy_emu(machine->emu);
+    destroy_io_ports(machine->io);
+    free(machine->ioapic);
+    free(machine->pci);
+    free(machine->pvblk);
+    free(machine);
+}
@@ -0,0 +1,69 @@
+#ifndef MACHINE_H_
+#define MACHINE_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "emulator.h"
+#include "cga.h"
+#include "io.h"
+#include "ioapic.h"
+#include "kbd.h"
+#include "pci.h"
+#include "pvblk.h"
+#include "pvnet.h"
+#include "sched.h"
+
+/*
+ * Machine
+ * One VM: the CPU with its RAM and disk (Emulator), the chipset, the
+ * devices and the port table they register in. Everything a VM changes
+ * is reached from here, through emu->machine or the device a port
+ * handler was registered with, so a process can run several machines,
+ * each on its own threads.
+ * Shared by all machines, and only written before the first one is
+ * created: the opcode tables (init_instructions) and config.
+ */
+struct Machine
+{
+    /* The BSP, cpus[0] */
+    Emulator *emu;
+    /* vCPUs, cpus[i] has LAPIC ID i; APs run on threads, emu on the caller's */
+    Emulator *cpus[MAX_CPUS];
+    int cpu_count;
+    pthread_t threads[MAX_CPUS];
+    int threads_started;
+    IOAPIC *ioapic;
+    IoPorts *io;
+    /* Set by the device's init function, NULL without the device */
+    KBD *kbd;
+    Pci *pci;
+    Pvblk *pvblk;
+    Pvnet *pvnet;
+    Cga *cga;
+    /* -script, NULL without */
+    struct Script *script;
+    /* -checkpoint, NULL without */
+    struct Checkpoints *checkpoints;
+    /* -record or -replay log, NULL without */
+    struct Replay *replay;
+    /* Run by a Scheduler (libdax86) if scheduled.scheduler is not NULL */
+    Scheduled scheduled;
+};
+
+/*
+ * Creates cpu_count vCPUs with memory_size bytes of RAM and the chipset
+ * (IOAPIC with the LAPICs, MP tables as the BIOS writes them), no devices.
+ * The BSP starts where the BIOS leaves it: EIP and ESP at 0x7c00, the
+ * APs wait for the guest to start them (INIT, STARTUP IPIs).
+ */
+Machine *create_machine(uint32_t memory_size, int cpu_count);
+/* Starts the threads of the APs, before the BSP's emu_run. */
+void start_aps(Machine *machine);
+/*
+ * Stops the APs and the device threads and frees the machine with its
+ * devices, the disk attached and the replay log. Not while the BSP's emu_run runs.
+ */
+void destroy_machine(Machine *machine);
+
+#endif
@@ -5,13 +5,32 @@
 #include <signal.h>
 
 #include "emulator.h"
+#include "machine.h"
 #include "instructions.h"
+#include "cpu.h"
 #include "emulator_functions.h"
 #include "ioapic.h"
 #include "disk.h"
+#include "serial.h"
+#include "cga.h"
+#include "script.h"
+#include "ide_dma.h"
+#include "pci.h"
+#include "pvblk.h"
+#include "bench.h"
+#include "snapshot.h"
+#include "checkpoint.h"
+#include "forkserver.h"
+#include "replay.h"
 #include "kbd.h"
-#include "mp.h"
 #include "interrupt.h"
+#include "jit.h"
+#include "profile.h"
+#include "perf_map.h"
+#include "trace.h"
+#include "btrace.h"
+#include "gdb.h"
+#include "watch.h"
 #include "util.h"
 
 int remove_arg_at(int argc, char *argv[], int index)
@@ -32,17 +51,59 @@ int remove_arg_at(int argc, char *argv[], int index)
     }
 }
 
-IOAPIC *ioapic;
-Emulator *emu;
+/* Size with an optional K, M or G suffix, rounded down to pages */
+uint32_t parse_memory_size(const char *arg)
+{
+    char *end;
+    uint64_t size = strtoull(arg, &end, 0);
+    switch (*end)
+    {
+    case 'G':
+    case 'g':
+        size <<= 10;
+    case 'M':
+    case 'm':
+        size <<= 10;
+    case 'K':
+    case 'k':
+        size <<= 10;
+        end++;
+        break;
+    }
+    if (*end != '\0' || size < MIN_MEMORY_SIZE || size > MAX_MEMORY_SIZE)
+    {
+        printf("Memory size must be from %uM to %uM: %s\n", MIN_MEMORY_SIZE >> 20, MAX_MEMORY_SIZE >> 20, arg);
+        exit(1);
+    }
+    return size & ~0xFFFu;
+}
+
+/* The machine run by this process, for the signal handlers */
+static Machine *machine;
 
 void termination_handler(int signum)
 {
     if (signum == SIGSEGV)
     {
-        printf("Segmentation fault at EIP: %08X.\n", emu->eip);
-        panic_exit(emu);
+        printf("Segmentation fault at EIP: %08X.\n", machine->emu->eip);
+        panic_exit(machine->emu);
     }
-    sig_exit(emu);
+    sig_exit(machine->emu);
+}
+
+/* Snapshots and checkpoints are taken by the CPU thread between instructions. */
+void snapshot_handler(int signum)
+{
+    if (config.snapshot_path != NULL)
+        raise_attention(machine->emu, ATTENTION_SNAPSHOT);
+    if (machine->checkpoints != NULL)
+        raise_attention(machine->emu, ATTENTION_CHECKPOINT);
+}
+
+/* Stats are printed by the CPU thread. */
+void stats_handler(int signum)
+{
+    raise_attention(machine->emu, ATTENTION_STATS);
 }
 
 void set_signals()
@@ -68,6 +129,14 @@ void set_signals()
     sigaction(SIGQUIT, NULL, &old_action);
     if (old_action.sa_handler != SIG_IGN)
         sigaction(SIGQUIT, &new_action, NULL);
+    new_action.sa_handler = stats_handler;
+    sigaction(SIGUSR1, &new_action, NULL);
+    if (config.snapshot_path != NULL || machine->checkpoints != NULL)
+    {
+        new_action.sa_handler = snapshot_handler;
+        sigaction(SIGUSR2, &new_action, NULL);
+    }
+    new_action.sa_handler = termination_handler;
     sigaction(SIGSTOP, NULL, &old_action);
     if (old_action.sa_handler != SIG_IGN)
         sigaction(SIGSTOP, &new_action, NULL);
@@ -77,6 +146,32 @@ int main(int argc, char *argv[])
 {
     FILE *binary; // FILE: pointer to stream
     int i = 0;
+    uint32_t profile_interval = 0;
+    uint32_t trace_size = 0;
+    char *btrace_path = NULL;
+    char *gdb_address = NULL;
+    char *watch_args[WATCH_MAX];
+    int watch_arg_count = 0;
+    uint32_t btrace_regs = 0;
+    char *overlay_path = NULL;
+    int overlay_discard = 0;
+    char *console_path = NULL;
+    uint32_t memory_size = DEFAULT_MEMORY_SIZE;
+    char *console_in_path = NULL;
+    int cga = 0;
+    char *net_arg = NULL;
+    char *cga_path = NULL;
+    char *restore_path = NULL;
+    char *checkpoint_path = NULL;
+    uint32_t checkpoint_interval = 0;
+    char *restore_checkpoint_path = NULL;
+    int restore_checkpoint_index = -1;
+    char *server_path = NULL;
+    char *kernel_path = NULL;
+    char *record_path = NULL;
+    char *replay_path = NULL;
+    char *script_path = NULL;
+    int cpu_count = 1;
     init_config(0, 0);
 
     while (i < argc)
@@ -86,6 +181,240 @@ int main(int argc, char *argv[])
             config.verbose = 1;
             argc = remove_arg_at(argc, argv, i);
         }
+        else if (strcmp(argv[i], "-trace") == 0 && i + 1 < argc)
+        {
+            trace_size = strtoul(argv[i + 1], NULL, 0);
+            argc = remove_arg_at(argc, argv, i);
+            argc = remove_arg_at(argc, argv, i);
+        }
+        else if (strcmp(argv[i], "-btrace") == 0 && i + 1 < argc)
+        {
+            btrace_path = argv[i + 1];
+            argc = remove_arg_at(argc, argv, i);
+            argc = remove_arg_at(argc, argv, i);
+        }
+        else if (strcmp(argv[i], "-btrace-regs") == 0 && i + 1 < argc)
+        {
+            btrace_regs = strtoul(argv[i + 1], NULL, 0);
+            argc = remove_arg_at(argc, argv, i);
+            argc = remove_arg_at(argc, argv, i);
+        }
+        else if (strcmp(argv[i], "-gdb") == 0 && i + 1 < argc)
+        {
+            gdb_address = argv[i + 1];
+            argc = remove_arg_at(argc, argv, i);
+            argc = remove_arg_at(argc, argv, i);
+        }
+        else if (strcmp(argv[i], "-watch") == 0 && i + 1 < argc && watch_arg_count < WATCH_MAX)
+        {
+            watch_args[watch_arg_count++] = argv[i + 1];
+            argc = remove_arg_at(argc, argv, i);
+            argc = remove_arg_at(argc, argv, i);
+        }
+        else if (strcmp(argv[i], "-jit") == 0)
+        {
+            config.jit = init_jit();
+            argc = remove_arg_at(argc, argv, i);
+        }
+        else if (strcmp(argv[i], "-perf-map") == 0)
+        {
+            config.perf |= PERF_MAP;
+            argc = remove_arg_at(argc, argv, i);
+        }
+        else if (strcmp(argv[i], "-perf-jitdump") == 0)
+        {
+            config.perf |= PERF_JITDUMP;
+            argc = remove_arg_at(argc, argv, i);
+        }
+        else if (strcmp(argv[i], "-no-spin-wait") == 0)
+        {
+            config.spin_wait = 0;
+            argc = remove_arg_at(argc, argv, i);
+        }
+        else if (strcmp(argv[i], "-stats") == 0)
+        {
+            config.stats = 1;
+            argc = remove_arg_at(argc, argv, i);
+        }
+        else if (strcmp(argv[i], "-bench") == 0)
+        {
+            config.bench = BENCH_TEXT;
+            argc = remove_arg_at(argc, argv, i);
+        }
+        else if (strcmp(argv[i], "-bench-json") == 0)
+        {
+            config.bench = BENCH_JSON;
+            argc = remove_arg_at(argc, argv, i);
+        }
+        else if (strcmp(argv[i], "-overlay") == 0 && i + 1 < argc)
+        {
+            overlay_path = argv[i + 1];
+            argc = remove_arg_at(argc, argv, i);
+            argc = remove_arg_at(argc, argv, i);
+        }
+        else if (strcmp(argv[i], "-overlay-discard") == 0)
+        {
+            overlay_discard = 1;
+            argc = remove_arg_at(argc, argv, i);
+        }
+        else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc)
+        {
+            memory_size = parse_memory_size(argv[i + 1]);
+            argc = remove_arg_at(argc, argv, i);
+            argc = remove_arg_at(argc, argv, i);
+        }
+        else if (strcmp(argv[i], "-smp") == 0 && i + 1 < argc)
+        {
+            cpu_count = atoi(argv[i + 1]);
+            if (cpu_count < 1 || cpu_count > MAX_CPUS)
+            {
+                printf("-smp must be from 1 to %d.\n", MAX_CPUS);
+                return 1;
+            }
+            argc = remove_arg_at(argc, argv, i);
+            argc = remove_arg_at(argc, argv, i);
+        }
+        else if (strcmp(argv[i], "-hugepages") == 0)
+        {
+            config.huge_pages = HUGE_PAGES_TRANSPARENT;
+            argc = remove_arg_at(argc, argv, i);
+        }
+        else if (strcmp(argv[i], "-hugetlb") == 0)
+        {
+            config.huge_pages = HUGE_PAGES_HUGETLB;
+            argc = remove_arg_at(argc, argv, i);
+        }
+        else if (strcmp(argv[i], "-share-ram") == 0)
+        {
+            config.share_ram = 1;
+            argc = remove_arg_at(argc, argv, i);
+        }
+        else if (strcmp(argv[i], "-save-snapshot") == 0 && i + 1 < argc)
+        {
+            config.snapshot_path = argv[i + 1];
+            argc = remove_arg_at(argc, argv, i);
+            argc = remove_arg_at(argc, argv, i);
+        }
+        else if (strcmp(argv[i], "-restore") == 0 && i + 1 < argc)
+        {
+            restore_path = argv[i + 1];
+            argc = remove_arg_at(argc, argv, i);
+            argc = remove_arg_at(argc, argv, i);
+        }
+        else if (strcmp(argv[i], "-checkpoint") == 0 && i + 1 < argc)
+        {
+            checkpoint_path = argv[i + 1];
+            argc = remove_arg_at(argc, argv, i);
+            argc = remove_arg_at(argc, argv, i);
+        }
+        else if (strcmp(argv[i], "-checkpoint-every") == 0 && i + 1 < argc)
+        {
+            checkpoint_interval = strtoul(argv[i + 1], NULL, 0);
+            argc = remove_arg_at(argc, argv, i);
+            argc = remove_arg_at(argc, argv, i);
+        }
+        else if (strcmp(argv[i], "-restore-checkpoint") == 0 && i + 1 < argc)
+        {
+            /* file[:index] */
+            restore_checkpoint_path = argv[i + 1];
+            char *colon = strrchr(restore_checkpoint_path, ':');
+            if (colon != NULL)
+            {
+                *colon = '\0';
+                restore_checkpoint_index = atoi(colon + 1);
+            }
+            argc = remove_arg_at(argc, argv, i);
+            argc = remove_arg_at(argc, argv, i);
+        }
+        else if (strcmp(argv[i], "-kernel") == 0 && i + 1 < argc)
+        {
+            kernel_path = argv[i + 1];
+            argc = remove_arg_at(argc, argv, i);
+            argc = remove_arg_at(argc, argv, i);
+        }
+        else if (strcmp(argv[i], "-fork-server") == 0 && i + 1 < argc)
+        {
+            server_path = argv[i + 1];
+            argc = remove_arg_at(argc, argv, i);
+            argc = remove_arg_at(argc, argv, i);
+        }
+        else if (strcmp(argv[i], "-console-out") == 0 && i + 1 < argc)
+        {
+            console_path = argv[i + 1];
+            argc = remove_arg_at(argc, argv, i);
+            argc = remove_arg_at(argc, argv, i);
+        }
+        else if (strcmp(argv[i], "-cga") == 0)
+        {
+            cga = 1;
+            argc = remove_arg_at(argc, argv, i);
+        }
+        else if (strcmp(argv[i], "-cga-out") == 0 && i + 1 < argc)
+        {
+            cga = 1;
+            cga_path = argv[i + 1];
+            argc = remove_arg_at(argc, argv, i);
+            argc = remove_arg_at(argc, argv, i);
+        }
+        else if (strcmp(argv[i], "-net") == 0 && i + 1 < argc)
+        {
+            net_arg = argv[i + 1];
+            if (strncmp(net_arg, "tap:", 4) != 0 || net_arg[4] == '\0')
+            {
+                printf("-net tap:ifname expected, got %s.\n", net_arg);
+                return 1;
+            }
+            argc = remove_arg_at(argc, argv, i);
+            argc = remove_arg_at(argc, argv, i);
+        }
+        else if (strcmp(argv[i], "-console-in") == 0 && i + 1 < argc)
+        {
+            console_in_path = argv[i + 1];
+            argc = remove_arg_at(argc, argv, i);
+            argc = remove_arg_at(argc, argv, i);
+        }
+        else if (strcmp(argv[i], "-script") == 0 && i + 1 < argc)
+        {
+            script_path = argv[i + 1];
+            argc = remove_arg_at(argc, argv, i);
+            argc = remove_arg_at(argc, argv, i);
+        }
+        else if (strcmp(argv[i], "-icount") == 0)
+        {
+            config.icount = 1;
+            argc = remove_arg_at(argc, argv, i);
+        }
+        else if (strcmp(argv[i], "-record") == 0 && i + 1 < argc)
+        {
+            record_path = argv[i + 1];
+            config.icount = 1;
+            argc = remove_arg_at(argc, argv, i);
+            argc = remove_arg_at(argc, argv, i);
+        }
+        else if (strcmp(argv[i], "-replay") == 0 && i + 1 < argc)
+        {
+            replay_path = argv[i + 1];
+            config.icount = 1;
+            argc = remove_arg_at(argc, argv, i);
+            argc = remove_arg_at(argc, argv, i);
+        }
+        else if (strcmp(argv[i], "-fusion-stats") == 0)
+        {
+            config.fusion_stats = 1;
+            argc = remove_arg_at(argc, argv, i);
+        }
+        else if (strcmp(argv[i], "-profile") == 0 && i + 1 < argc)
+        {
+            profile_interval = strtoul(argv[i + 1], NULL, 0);
+            argc = remove_arg_at(argc, argv, i);
+            argc = remove_arg_at(argc, argv, i);
+        }
+        else if (strcmp(argv[i], "-profile-elf") == 0 && i + 1 < argc)
+        {
+            load_profile_symbols(argv[i + 1]);
+            argc = remove_arg_at(argc, argv, i);
+            argc = remove_arg_at(argc, argv, i);
+        }
         else if (strcmp(argv[i], "test") == 0)
         {
             config.test = 1;
@@ -102,18 +431,74 @@ int main(int argc, char *argv[])
         printf("Usage: dax86 [filename]\n");
         return 1;
     }
-
-    /* Main memory */
-    uint8_t *memory = malloc(MEMORY_SIZE);
+    if (server_path != NULL && (restore_path == NULL || overlay_path == NULL))
+    {
+        printf("-fork-server needs -restore and -overlay.\n");
+        return 1;
+    }
+    /* Snapshots hold one CPU. */
+    if (cpu_count > 1 && (config.snapshot_path != NULL || restore_path != NULL || checkpoint_path != NULL ||
+                          restore_checkpoint_path != NULL))
+    {
+        printf("-smp can not be used with snapshots.\n");
+        return 1;
+    }
+    if (restore_path != NULL && restore_checkpoint_path != NULL)
+    {
+        printf("-restore and -restore-checkpoint can not be used together.\n");
+        return 1;
+    }
+    /* Restored pages are mapped from the file by 4K, hugetlbfs RAM can not hold them. */
+    if ((restore_path != NULL || restore_checkpoint_path != NULL) && config.huge_pages == HUGE_PAGES_HUGETLB)
+    {
+        printf("-restore and -restore-checkpoint can not be used with -hugetlb.\n");
+        return 1;
+    }
+    /* A clone per job would write into the same file. */
+    if (checkpoint_path != NULL && server_path != NULL)
+    {
+        printf("-checkpoint can not be used with -fork-server.\n");
+        return 1;
+    }
+    /* The order vCPUs touch memory in is not logged, nor are the jobs of a fork server. */
+    if (record_path != NULL && replay_path != NULL)
+    {
+        printf("-record and -replay can not be used together.\n");
+        return 1;
+    }
+    if ((record_path != NULL || replay_path != NULL) && (cpu_count > 1 || server_path != NULL))
+    {
+        printf("-record and -replay need one vCPU and no -fork-server.\n");
+        return 1;
+    }
+    /* The script is the keyboard input. */
+    if (script_path != NULL && (console_in_path != NULL || replay_path != NULL || server_path != NULL))
+    {
+        printf("-script can not be used with -console-in, -replay or -fork-server.\n");
+        return 1;
+    }
+    /* Frames received are not logged. */
+    if ((record_path != NULL || replay_path != NULL || server_path != NULL) && net_arg != NULL)
+    {
+        printf("-net can not be used with -record, -replay or -fork-server.\n");
+        return 1;
+    }
 
     /*
      * Initial setup: EIP: 0x7c00, ESP: 0x7c00
      * BIOS places instructions at 0x7c00.
      */
-    emu = create_emu(memory, 0x7c00, 0x7c00);
-
-    /* BIOS configures MP settings */
-    set_mp_config(emu);
+    machine = create_machine(memory_size, cpu_count);
+    Emulator *emu = machine->emu;
+    if (trace_size > 0)
+        init_trace(emu, trace_size);
+    if (btrace_path != NULL)
+    {
+        if (!open_btrace(btrace_path, btrace_regs))
+            return 1;
+        for (i = 0; i < cpu_count; i++)
+            init_btrace(machine->cpus[i]);
+    }
 
     /* Binary file loading */
     binary = fopen(argv[1], "rb"); // rb: read-binary (r: translated mode for "\n")
@@ -125,59 +510,104 @@ int main(int argc, char *argv[])
     Disk *disk = create_disk_device();
     load_data_to_disk(disk, binary);
     fclose(binary);
+    if (overlay_path != NULL)
+        attach_overlay(disk, overlay_path, overlay_discard);
+    else
+        attach_writeback(disk, argv[1]);
 
     attach_disk(emu, disk);
 
-    init_ioapic();
-    add_lapic(0, emu->lapic);
+    /* Devices register their I/O ports. */
+    register_disk_ports(machine, disk);
+    register_bmide_ports(machine, disk);
+    init_pvblk(machine);
+    init_pvnet(machine);
+    if (net_arg != NULL)
+        open_pvnet_tap(machine->pvnet, net_arg + 4);
+    if (config.bench)
+        init_bench(machine);
+    init_pci(machine);
+    /* The screen takes the terminal, the guest prints the same text to the serial port. */
+    if (cga && cga_path == NULL && console_path == NULL)
+        console_path = "/dev/null";
+    init_serial(machine, open_output_channel(console_path));
+    init_kbd(machine, console_in_path);
+    if (script_path != NULL)
+        init_script(machine, script_path);
+    if (cga)
+        init_cga(machine, open_output_channel(cga_path));
 
-    load_boot_sector(emu);
+    /* A snapshot replaces the boot: machine state and RAM as they were saved */
+    if (restore_path != NULL)
+        restore_snapshot(emu, restore_path);
+    else if (restore_checkpoint_path != NULL)
+        restore_checkpoint(emu, restore_checkpoint_path, restore_checkpoint_index);
+    /* The kernel replaces the bootloader, the disk stays attached for the filesystem. */
+    else if (kernel_path != NULL)
+        load_kernel(emu, kernel_path);
+    else
+        load_boot_sector(emu);
 
-    init_kbd(ioapic);
+    if (server_path != NULL)
+    {
+        /* From here on in a clone, one per job */
+        int job_fd = run_fork_server(server_path);
+        set_kbd_input(machine->kbd, job_fd, emu);
+        init_serial(machine, fd_output_channel(job_fd));
+        overlay_make_private(disk->overlay);
+    }
+    /* From the machine as restored or booted */
+    if (record_path != NULL)
+    {
+        machine->replay = open_record(machine, record_path);
+        machine->kbd->record = machine->replay;
+    }
+    if (replay_path != NULL)
+        machine->replay = open_replay(machine, replay_path);
+    /* A replay takes its input from the log. */
+    else
+        start_kbd_input(machine->kbd);
+    if (machine->script != NULL)
+        start_script(machine->script);
+    if (machine->cga != NULL)
+        start_cga(machine->cga);
+    /* The base holds the machine as restored or loaded. */
+    if (checkpoint_path != NULL)
+        init_checkpoints(machine, checkpoint_path, checkpoint_interval);
+    start_pvnet(machine->pvnet);
 
     /* dump_input(emu); */
 
     init_instructions();
 
     set_signals();
-    remove_canon_echo();
+    /* A script runs without a terminal, the one there may be is left as it is. */
+    if (script_path == NULL)
+        remove_canon_echo();
 
-    while ((emu->eip < MEMORY_SIZE) || (emu->is_pg))
-    {
-        uint8_t op = get_code8(emu, 0);
-        if (config.verbose)
-            printf("CS: %04X EIP: %08X Op: %02X\n", get_seg_register16(emu, CS), emu->eip, op);
+    if (profile_interval > 0)
+        init_profile(emu, profile_interval);
+    if (config.perf)
+        init_perf_map();
 
-        if (instructions[op] == NULL)
-        {
-            printf("EIP: %08X Op: %x not implemented.\n", emu->eip, op);
-            panic_exit(emu);
-        }
-
-        debug_append(emu->segment_registers[CS], emu->eip, op, emu->segment_registers[SS], emu->registers[ESP]);
-
-        instructions[op](emu);
-
-        if (emu->int_enabled == 1 && emu->int_r > 0)
-        {
-            handle_interrupt(emu, emu->int_r, 0);
-            emu->int_r = 0;
-        }
+    /* On RAM as restored or loaded */
+    for (i = 0; i < watch_arg_count; i++)
+    {
+        if (!parse_watch(emu, watch_args[i]))
+            return 1;
+    }
 
-        // dump_registers(emu);
+    if (gdb_address != NULL && !init_gdb(machine, gdb_address))
+        panic();
 
-        if (config.test && emu->eip == 0x00)
-        {
-            if (config.verbose)
-                printf("End of program :)\n");
-            break;
-        }
-    }
+    start_aps(machine);
+    emu_run(emu, 0, NULL);
 
     if (config.verbose)
     {
         print_emu(emu);
     }
-    destroy_emu(emu);
-    normal_exit();
+    int status = machine->script != NULL ? finish_script(machine->script) : 0;
+    destroy_machine(machine);
+    normal_exit(status);
 }
\ No newline at end of file
@@ -2,10 +2,10 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
-#include <math.h>
 
 #include "emulator_functions.h"
 #include "modrm.h"
+#include "block_cache.h"
 #include "util.h"
 
 /*
@@ -58,206 +58,159 @@ ModRM create_modrm()
     return modrm;
 }
 
-void parse_modrm(Emulator *emu, ModRM *modrm)
+/*
+ * ModR/M decode tables
+ * Per ModR/M byte: displacement bytes, whether SIB follows and
+ * the base register (MODRM_NO_REG for disp only, SIB or register direct).
+ * Protected mode uses 32-bit addressing. Real mode is the same except
+ * Mod: 00 R/M: 110, which is [disp16].
+ */
+typedef struct
 {
-    uint8_t code;
+    uint8_t disp_size;
+    uint8_t has_sib;
+    uint8_t base;
+} ModRMInfo;
 
-    memset(modrm, 0, sizeof(ModRM));
+#define M_MOD(m) ((m) >> 6)
+#define M_RM(m) ((m)&7)
+#define M32_DISP(m) (M_MOD(m) == 1 ? 1 : (M_MOD(m) == 2 || (M_MOD(m) == 0 && M_RM(m) == 5)) ? 4 : 0)
+#define M32_SIB(m) (M_MOD(m) != 3 && M_RM(m) == 4)
+#define M32_BASE(m) ((M_MOD(m) == 3 || M_RM(m) == 4 || (M_MOD(m) == 0 && M_RM(m) == 5)) ? MODRM_NO_REG : M_RM(m))
+#define M16_DISP16(m) (M_MOD(m) == 0 && M_RM(m) == 6)
 
-    code = get_code8(emu, 0);
+#define M32(m) {M32_DISP(m), M32_SIB(m), M32_BASE(m)}
+#define M16(m) {M16_DISP16(m) ? 2 : M32_DISP(m), M32_SIB(m), M16_DISP16(m) ? MODRM_NO_REG : M32_BASE(m)}
 
-    /* Mod (2 bits) Reg (3 bits) R/M (3 bits) */
-    modrm->mod = ((code & 0xC0) >> 6);    /* 1100 0000 */
-    modrm->opcode = ((code & 0x38) >> 3); /* 0011 1000 */
-    modrm->rm = code & 0x07;              /* 0000 0111 */
+#define ROW8(E, m) E(m), E(m + 1), E(m + 2), E(m + 3), E(m + 4), E(m + 5), E(m + 6), E(m + 7)
+#define ROW64(E, m) ROW8(E, m), ROW8(E, m + 8), ROW8(E, m + 16), ROW8(E, m + 24), \
+                    ROW8(E, m + 32), ROW8(E, m + 40), ROW8(E, m + 48), ROW8(E, m + 56)
+#define TABLE256(E) ROW64(E, 0), ROW64(E, 64), ROW64(E, 128), ROW64(E, 192)
 
-    emu->eip += 1;
+static const ModRMInfo modrm_table32[256] = {TABLE256(M32)};
+static const ModRMInfo modrm_table16[256] = {TABLE256(M16)};
 
-    /* Real mode workaround for [disp16] */
-    if (!emu->is_pe)
-    {
-        if (modrm->mod == 0 && modrm->rm == 6)
-        {
-            modrm->disp16 = get_sign_code16(emu, 0);
-            emu->eip += 2;
-            return;
-        }
-    }
+/*
+ * Number of bytes taken by ModR/M, SIB and displacement.
+ * SIB byte (code[1]) is only read when ModR/M says it exists.
+ */
+int modrm_length(const uint8_t *code, uint8_t is_pe)
+{
+    const ModRMInfo *info = is_pe ? &modrm_table32[code[0]] : &modrm_table16[code[0]];
+    int length = 1 + info->has_sib + info->disp_size;
+
+    /* SIB Base: 101 with Mod: 00 is disp32 */
+    if (info->has_sib && M_MOD(code[0]) == 0 && (code[1] & 0x07) == 5)
+        length += 4;
+    return length;
+}
+
+/*
+ * Decodes ModR/M, SIB and displacement from a buffer holding
+ * at least modrm_length() bytes. Returns the number of bytes used.
+ * Displacement is stored sign-extended to disp32.
+ */
+int decode_modrm(const uint8_t *code, uint8_t is_pe, ModRM *modrm)
+{
+    uint8_t byte = code[0];
+    const ModRMInfo *info = is_pe ? &modrm_table32[byte] : &modrm_table16[byte];
+    int i = 1;
+    int disp_size = info->disp_size;
 
-    /*
-     * SIB after ModR/M Byte
-     * mod/RM:
-     * 00/100: [-][-]
-     * 01/100: [-][-] + disp8
-     * 10/100: [-][-] + disp32
-     */
-    if (modrm->mod != 3 && modrm->rm == 4)
+    /* Mod (2 bits) Reg (3 bits) R/M (3 bits) */
+    modrm->mod = M_MOD(byte);
+    modrm->opcode = (byte & 0x38) >> 3;
+    modrm->rm = M_RM(byte);
+    modrm->base = info->base;
+    modrm->index = MODRM_NO_REG;
+    modrm->scale = 0;
+
+    if (info->has_sib)
     {
-        u_int8_t sib_byte = get_code8(emu, 0);
-        /* SIB sib; */
+        uint8_t sib_byte = code[i];
         modrm->sib.scale = ((sib_byte & 0xC0) >> 6);
         modrm->sib.index = ((sib_byte & 0x38) >> 3);
         modrm->sib.base = sib_byte & 0x07;
-        /* modrm->sib = &sib;*/
-        emu->eip += 1;
-    }
-
-    /*
-     * Stores disp32.
-     * mod/RM:
-     * 00/101: disp32
-     * 10/[000 - 111]: [reg] + disp32
-     */
-    if ((modrm->mod == 0 && modrm->rm == 5) || (modrm->mod == 0 && modrm->sib.base == 5) || modrm->mod == 2)
-    {
-        modrm->disp32 = get_sign_code32(emu, 0);
-        emu->eip += 4;
+        i += 1;
+        modrm->scale = modrm->sib.scale;
+        /* Index: 100 is none */
+        if (modrm->sib.index != 4)
+            modrm->index = modrm->sib.index;
+        if (modrm->mod == 0 && modrm->sib.base == 5)
+            disp_size = 4;
+        else
+            modrm->base = modrm->sib.base;
     }
-    else if (modrm->mod == 1)
+    else
     {
-        /*
-         * Stores disp8.
-         * mod/RM:
-         * 01/[000 - 111]: [reg] + disp8
-         */
-        modrm->disp8 = get_sign_code8(emu, 0);
-        emu->eip += 1;
+        modrm->sib.scale = 0;
+        modrm->sib.index = 0;
+        modrm->sib.base = 0;
     }
+
+    if (disp_size == 4)
+        modrm->disp32 = code[i] | (code[i + 1] << 8) | (code[i + 2] << 16) | ((uint32_t)code[i + 3] << 24);
+    else if (disp_size == 2)
+        modrm->disp32 = (int16_t)(code[i] | (code[i + 1] << 8));
+    else if (disp_size == 1)
+        modrm->disp32 = (int8_t)code[i];
+    else
+        modrm->disp32 = 0;
+    return i + disp_size;
+}
+
+void parse_modrm(Emulator *emu, ModRM *modrm)
+{
+    uint8_t code[MODRM_MAX_LENGTH];
+    int i, length;
+
+    /* Already decoded in block cache. */
+    if (use_decoded_modrm(emu, modrm))
+        return;
+
+    /* 67 switches to the addressing of the other mode. */
+    uint8_t address32 = emu->is_pe != emu->prefixes.address_size;
+    code[0] = get_code8(emu, 0);
+    if ((code[0] & 0xC0) != 0xC0 && (code[0] & 0x07) == 4)
+        code[1] = get_code8(emu, 1);
+    length = modrm_length(code, address32);
+    for (i = 1; i < length; i++)
+        code[i] = get_code8(emu, i);
+
+    emu->eip += decode_modrm(code, address32, modrm);
 }
 
 /*
+ * Address from the registers and displacement decoded by the tables:
+ * [Base + (Index << Scale) + disp]
+ *
  *  _Mod:00________________________________________________________________________________
  * | Scale | Index REG | Base REG |                                                        |
- * | 00: 1 |           | 000: eax | 001 | 010 | 011 | 100 |  101 (ebp) |   110   |   111   | 
+ * | 00: 1 |           | 000: eax | 001 | 010 | 011 | 100 |  101 (ebp) |   110   |   111   |
  * | 01: 2 | 000: eax  |                                  |            |                   |
  * | 10: 4 | 001: ecx  |    [Base + (Index * Scale)]      | [(I * S)   | [Base + (I * S)]  |
  * | 11: 8 | 010: edx  |                                  |  + disp32] |                   |
- * |_______| 011: ebx  |__________________________________|____________|___________________|                
+ * |_______| 011: ebx  |__________________________________|____________|___________________|
  *         | 100: esp  |_____________[base]_______________|__[disp32]__|_____[base]________|
  *         | 101: ebp  |                                  |            |                   |
  *         | 110: esi  |    [Base + (Index + Scale)]      | [(I * S)   | [Base + (I * S)]  |
  *         | 111: edi  |                                  |  + disp32] |                   |
  *         |___________|__________________________________|____________|___________________|
- *  _Mod:01________________________________________________________________________________
- * | Scale | Index REG | Base REG |                                                        |
- * | 00: 1 |           | 000: eax | 001 | 010 | 011 | 100 |    101     |   110   |   111   | 
- * | 01: 2 | 000: eax  |                                                                   |
- * | 10: 4 | 001: ecx  |                [Base + (Index * Scale) + disp8]                   |
- * | 11: 8 | 010: edx  |                                                                   |
- * |_______| 011: ebx  |___________________________________________________________________|                
- *         | 100: esp  |________________________[base + disp8]_____________________________|
- *         | 101: ebp  |                                                                   | 
- *         | 110: esi  |                [Base + (Index * Scale) + disp8]                   | 
- *         | 111: edi  |                                                                   |
- *         |___________|___________________________________________________________________|
- *  _Mod:10________________________________________________________________________________
- * | Scale | Index REG | Base REG |                                                        |
- * | 00: 1 |           | 000: eax | 001 | 010 | 011 | 100 |    101     |   110   |   111   | 
- * | 01: 2 | 000: eax  |                                                                   |
- * | 10: 4 | 001: ecx  |                [Base + (Index * Scale) + disp32]                  |
- * | 11: 8 | 010: edx  |                                                                   |
- * |_______| 011: ebx  |___________________________________________________________________|                
- *         | 100: esp  |________________________[base + disp32]____________________________|
- *         | 101: ebp  |                                                                   | 
- *         | 110: esi  |                [Base + (Index * Scale) + disp32]                  | 
- *         | 111: edi  |                                                                   |
- *         |___________|___________________________________________________________________|  
+ * Mod: 01 and 10 always use Base, adding disp8 or disp32.
  */
-uint32_t calc_cib_address(Emulator *emu, ModRM *modrm)
-{
-    uint32_t base_val = get_register32(emu, modrm->sib.base);
-    uint32_t scale = pow(2, modrm->sib.scale);
-    uint32_t index_val = get_register32(emu, modrm->sib.index);
-    // printf("modrm sib mod %d index: %d base %d\n", modrm->mod, modrm->sib.index, modrm->sib.base);
-    if (modrm->mod == 0)
-    {
-        if (modrm->sib.index == 4 && modrm->sib.base == 5)
-            return modrm->disp32;
-        if (modrm->sib.index == 4)
-            return base_val;
-        if (modrm->sib.base == 5)
-            return (index_val * scale) + modrm->disp32;
-        return index_val * scale + base_val;
-    }
-    if (modrm->mod == 1)
-    {
-        if (modrm->sib.index == 4)
-            return base_val + modrm->disp8;
-        return base_val + (index_val * scale) + modrm->disp8;
-    }
-    if (modrm->mod == 2)
-    {
-        if (modrm->sib.index == 4)
-            return base_val + modrm->disp32;
-        return base_val + (index_val * scale) + modrm->disp32;
-    }
-
-    printf("Invalid Mod value for SIB");
-    panic_exit(emu);
-}
-
 uint32_t calc_memory_address(Emulator *emu, ModRM *modrm)
 {
-    /* Real mode workaround for [disp16] */
-    if (!emu->is_pe)
-    {
-        if (modrm->mod == 0 && modrm->rm == 6)
-        {
-            return modrm->disp16;
-        }
-    }
-    /* Mod:0 [reg] */
-    if (modrm->mod == 0)
-    {
-        /* SIB (Mod: 00 R/M: 100) */
-        if (modrm->rm == 4)
-        {
-            return calc_cib_address(emu, modrm);
-        }
-        /* Mod:0 R/M: 101 uses disp32 as memory address. */
-        else if (modrm->rm == 5)
-        {
-            return modrm->disp32;
-        }
-        /* Mod:0 R/M: 000 - 011, 110, 111 uses [reg] */
-        else
-        {
-            return get_register32(emu, modrm->rm);
-        }
-    }
-    /* Mod: 01 [reg] + disp8 */
-    else if (modrm->mod == 1)
-    {
-        /* SIB (Mod: 01 R/M: 100) */
-        if (modrm->rm == 4)
-        {
-            return calc_cib_address(emu, modrm);
-        }
-        /* Mod: 1 R/M: 000 - 011, 101 - 111 uses [reg] + disp8 */
-        else
-        {
-            return get_register32(emu, modrm->rm) + modrm->disp8;
-        }
-    }
-    /* Mod: 10 [reg] + disp32 */
-    else if (modrm->mod == 2)
-    {
-        /* SIB (MOD: 10 R/M: 100) */
-        if (modrm->rm == 4)
-        {
-            return calc_cib_address(emu, modrm);
-        }
-        /* Mod: 10 R/M: 000 - 011, 101 - 111 uses [reg] + disp32 */
-        else
-        {
-            return get_register32(emu, modrm->rm) + modrm->disp32;
-        }
-    }
-    else
+    if (modrm->mod == 3)
     {
         printf("ModRM with mod: 00 - 10 are only implemented.");
         panic_exit(emu);
     }
+    uint32_t address = modrm->disp32;
+    if (modrm->base != MODRM_NO_REG)
+        address += get_register32(emu, modrm->base);
+    if (modrm->index != MODRM_NO_REG)
+        address += get_register32(emu, modrm->index) << modrm->scale;
+    return address;
 }
 
 void set_rm8(Emulator *emu, ModRM *modrm, uint8_t value)
@@ -276,7 +229,7 @@ void set_rm8(Emulator *emu, ModRM *modrm, uint8_t value)
          * 10: [eax] + disp32 etc, [ecx] + disp32...
          */
         uint32_t address = calc_memory_address(emu, modrm);
-        set_memory8(emu, DS, address, value);
+        set_memory8(emu, emu->prefixes.segment, address, value);
     }
 }
 
@@ -289,7 +242,7 @@ uint8_t get_rm8(Emulator *emu, ModRM *modrm)
     else
     {
         uint32_t address = calc_memory_address(emu, modrm);
-        return get_memory8(emu, DS, address);
+        return get_memory8(emu, emu->prefixes.segment, address);
     }
 }
 
@@ -309,7 +262,7 @@ void set_rm16(Emulator *emu, ModRM *modrm, uint16_t value)
          * 10: [eax] + disp32 etc, [ecx] + disp32...
          */
         uint32_t address = calc_memory_address(emu, modrm);
-        set_memory16(emu, DS, address, value);
+        set_memory16(emu, emu->prefixes.segment, address, value);
     }
 }
 
@@ -322,7 +275,7 @@ uint16_t get_rm16(Emulator *emu, ModRM *modrm)
     else
     {
         uint32_t address = calc_memory_address(emu, modrm);
-        return get_memory16(emu, DS, address);
+        return get_memory16(emu, emu->prefixes.segment, address);
     }
 }
 
@@ -342,7 +295,7 @@ void set_rm32(Emulator *emu, ModRM *modrm, uint32_t value)
          * 10: [eax] + disp32 etc, [ecx] + disp32...
          */
         uint32_t address = calc_memory_address(emu, modrm);
-        set_memory32(emu, DS, address, value);
+        set_memory32(emu, emu->prefixes.segment, address, value);
     }
 }
 
@@ -355,7 +308,7 @@ uint32_t get_rm32(Emulator *emu, ModRM *modrm)
     else
     {
         uint32_t address = calc_memory_address(emu, modrm);
-        return get_memory32(emu, DS, address);
+        return get_memory32(emu, emu->prefixes.segment, address);
     }
 }
 
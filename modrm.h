@@ -23,6 +23,12 @@ typedef struct
     };
     uint8_t rm; // 3 bits
     SIB sib;    // 1 byte
+    /* Registers for the address, MODRM_NO_REG if not used */
+    uint8_t base;
+    uint8_t index;
+    /* Index is shifted by scale. */
+    uint8_t scale;
+    /* Displacement (sign-extended) */
     union {
         int8_t disp8;
         int16_t disp16;
@@ -30,8 +36,16 @@ typedef struct
     };
 } ModRM;
 
+#define MODRM_NO_REG 0xFF
+
+/* ModR/M (1) + SIB (1) + disp32 (4) */
+#define MODRM_MAX_LENGTH 6
+
 ModRM create_modrm();
 
+int modrm_length(const uint8_t *code, uint8_t is_pe);
+int decode_modrm(const uint8_t *code, uint8_t is_pe, ModRM *modrm);
+
 /*
  * Parses ModR/M, SIB and Displacement.
  * EIP of Emulator needs to be pointing ModR/M Byte.
@@ -41,7 +55,10 @@ void parse_modrm(Emulator *emu, ModRM *modrm);
 /* Calcurates the memory address. Exposed for LEA instruction. */
 uint32_t calc_memory_address(Emulator *emu, ModRM *modrm);
 
-/* Sets 8-bit value to register or memory depending on Mod of ModR/M byte. */
+/*
+ * Sets 8-bit value to register or memory depending on Mod of ModR/M byte.
+ * Memory is in the segment of the override prefix, DS if none.
+ */
 void set_rm8(Emulator *emu, ModRM *modrm, uint8_t value);
 
 /* Gets 8-bit value from register or memory depending on Mod of ModR/M byte. */
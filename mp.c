@@ -222,7 +222,13 @@ static void create_ebda(Emulator *emu)
     _set_memory32(emu, EBDA_LOC + 12, 0x0);
 }
 
-static void create_mp_conf_tbl_header(Emulator *emu)
+/* Bytes of the base table: header, one entry per CPU, the IOAPIC entry */
+static uint16_t mp_conf_tbl_length(int cpu_count)
+{
+    return 44 + 20 * cpu_count + 8;
+}
+
+static void create_mp_conf_tbl_header(Emulator *emu, int cpu_count)
 {
     /*
      * MP Configuration Table Header
@@ -240,17 +246,15 @@ static void create_mp_conf_tbl_header(Emulator *emu)
      * |____P_____|________M_________|____C_____|____P_____| 0x00
      */
     _set_memory32(emu, MP_CONF_TBL_HD_BASE, (int32_t)0x504d4350);
-    /* 
-     * 1 CPU entry (20 bytes) + 1 IOAPIC entry (8 bytes) = 28 bytes
-     * "Including the header": 44 bytes = 72 bytes (0x48)
-     * Version 01 indicates 1.1
-     */
-    _set_memory32(emu, MP_CONF_TBL_HD_BASE + 0x4, 0xe9010048);
+    /* Version 01 indicates 1.1, the checksum is set once the entries are written. */
+    _set_memory32(emu, MP_CONF_TBL_HD_BASE + 0x4, 0x00010000 | mp_conf_tbl_length(cpu_count));
+    _set_memory32(emu, MP_CONF_TBL_HD_BASE + 0x20, (uint32_t)(cpu_count + 1) << 16);
     _set_memory32(emu, MP_CONF_TBL_HD_BASE + 0x24, LAPIC_DEFAULT_BASE);
 }
 
-static void create_mp_conf_tbl_entries(Emulator *emu)
+static void create_mp_conf_tbl_entries(Emulator *emu, int cpu_count)
 {
+    int i;
     /* |31_________|23______________|15______________|7_________0|
      * |                         Reserved                        |
      * |                         Reserved                        |
@@ -258,22 +262,38 @@ static void create_mp_conf_tbl_entries(Emulator *emu)
      * |_______________________CPU Signature_____________________|
      * | CPU Flags | Local APIC Ver | Local APIC ID | Entry Type |
      * |_____|BP|EN|________________|_______________|_____0______|
+     * CPU 0 is the bootstrap processor.
      */
-    _set_memory32(emu, MP_CONF_TBL_ENT_BASE, 0x0);
+    for (i = 0; i < cpu_count; i++)
+    {
+        uint32_t flags = i == 0 ? 0x3 : 0x1;
+        _set_memory32(emu, MP_CONF_TBL_ENT_BASE + 20 * i, (flags << 24) | (0x14 << 16) | (i << 8));
+    }
     /*
      * |31_____________|23______________|15______________|7_________0|
      * |_______________Memory-mapped Address of IO APIC______________|
      * | IO APIC Flags |    IO APIC     |  IO APIC ID   | Entry Type |
      * |____________|EN|____Version_____|_______________|_____2______|
      */
-    _set_memory32(emu, MP_CONF_TBL_ENT_BASE + 0x14, 0x2);
-    _set_memory32(emu, MP_CONF_TBL_ENT_BASE + 0x18, IOAPIC_DEFAULT_BASE);
+    _set_memory32(emu, MP_CONF_TBL_ENT_BASE + 20 * cpu_count, 0x2);
+    _set_memory32(emu, MP_CONF_TBL_ENT_BASE + 20 * cpu_count + 4, IOAPIC_DEFAULT_BASE);
 }
 
-void set_mp_config(Emulator *emu)
+/* Bytes of the table sum up to 0. */
+static void set_mp_conf_tbl_checksum(Emulator *emu, int cpu_count)
+{
+    uint8_t sum = 0;
+    uint16_t i;
+    for (i = 0; i < mp_conf_tbl_length(cpu_count); i++)
+        sum += emu->memory[MP_CONF_TBL_HD_BASE + i];
+    _set_memory8(emu, MP_CONF_TBL_HD_BASE + 0x7, -sum);
+}
+
+void set_mp_config(Emulator *emu, int cpu_count)
 {
     create_bda(emu);
     create_ebda(emu);
-    create_mp_conf_tbl_header(emu);
-    create_mp_conf_tbl_entries(emu);
-}
\ No newline at end of file
+    create_mp_conf_tbl_header(emu, cpu_count);
+    create_mp_conf_tbl_entries(emu, cpu_count);
+    set_mp_conf_tbl_checksum(emu, cpu_count);
+}
@@ -3,6 +3,7 @@
 
 #include "emulator.h"
 
-void set_mp_config(Emulator *emu);
+/* Writes the MP tables of cpu_count processors (LAPIC IDs 0 to cpu_count - 1) with one IOAPIC. */
+void set_mp_config(Emulator *emu, int cpu_count);
 
 #endif
\ No newline at end of file
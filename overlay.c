@@ -0,0 +1,108 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "overlay.h"
+
+static uint64_t page_align(uint64_t size)
+{
+    return (size + 0xFFF) & ~(uint64_t)0xFFF;
+}
+
+Overlay *open_overlay(const char *path, uint64_t sectors, int discard)
+{
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+    {
+        printf("Could not open overlay: %s\n", path);
+        return NULL;
+    }
+    if (discard)
+        unlink(path);
+
+    uint64_t bitmap_size = page_align((sectors + 7) / 8);
+    uint64_t map_size = OVERLAY_HEADER_SIZE + bitmap_size + sectors * 512;
+
+    struct stat st;
+    fstat(fd, &st);
+    uint8_t header[16];
+    int valid = (uint64_t)st.st_size == map_size &&
+                pread(fd, header, sizeof(header), 0) == sizeof(header) &&
+                memcmp(header, OVERLAY_MAGIC, 8) == 0 &&
+                memcmp(header + 8, &sectors, 8) == 0;
+    if (!valid)
+    {
+        /* Truncating first drops old sectors, the new size is all holes. */
+        if (ftruncate(fd, 0) != 0 || ftruncate(fd, map_size) != 0)
+        {
+            printf("Could not resize overlay: %s\n", path);
+            close(fd);
+            return NULL;
+        }
+        memcpy(header, OVERLAY_MAGIC, 8);
+        memcpy(header + 8, &sectors, 8);
+        if (pwrite(fd, header, sizeof(header), 0) != sizeof(header))
+        {
+            close(fd);
+            return NULL;
+        }
+    }
+
+    uint8_t *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        printf("Could not map overlay: %s\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    Overlay *overlay = malloc(sizeof(Overlay));
+    overlay->fd = fd;
+    overlay->sectors = sectors;
+    overlay->map = map;
+    overlay->map_size = map_size;
+    overlay->bitmap = map + OVERLAY_HEADER_SIZE;
+    overlay->data = overlay->bitmap + bitmap_size;
+    overlay->written = NULL;
+    return overlay;
+}
+
+void overlay_track_writes(Overlay *overlay)
+{
+    if (overlay->written == NULL)
+        overlay->written = calloc((overlay->sectors + 7) / 8, 1);
+}
+
+/* The bit is set once the whole sector is in the delta. */
+void overlay_write_sector(Overlay *overlay, uint64_t sector, const uint8_t *data)
+{
+    memcpy(overlay_sector(overlay, sector), data, 512);
+    overlay->bitmap[sector >> 3] |= 1 << (sector & 7);
+    if (overlay->written != NULL)
+        overlay->written[sector >> 3] |= 1 << (sector & 7);
+}
+
+void overlay_make_private(Overlay *overlay)
+{
+    if (mmap(overlay->map, overlay->map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, overlay->fd, 0) == MAP_FAILED)
+        printf("Could not make overlay private, writes are shared.\n");
+}
+
+void overlay_flush(Overlay *overlay)
+{
+    msync(overlay->map, overlay->map_size, MS_SYNC);
+}
+
+void close_overlay(Overlay *overlay)
+{
+    overlay_flush(overlay);
+    munmap(overlay->map, overlay->map_size);
+    close(overlay->fd);
+    free(overlay->written);
+    free(overlay);
+}
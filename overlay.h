@@ -0,0 +1,68 @@
+#ifndef OVERLAY_H_
+#define OVERLAY_H_
+
+#include <stdint.h>
+
+/*
+ * Copy-on-write overlay of a disk image
+ * Sectors written by the guest go to a per-instance delta file,
+ * the base image is never written and can be shared by many VMs.
+ *
+ * <Delta file>
+ * | 0x0000 | header: magic "DAX86OVL", sectors (uint64)              |
+ * | 0x1000 | bitmap: bit set if the sector is in the delta             |
+ * | data   | sector n at data + n * 512 (page aligned after bitmap)    |
+ * The file is sparse, so only the sectors written take up space.
+ * Truncating it to 0 resets the instance to the base image.
+ */
+typedef struct
+{
+    int fd;
+    uint64_t sectors;
+    /* The whole delta file, mapped shared */
+    uint8_t *map;
+    uint64_t map_size;
+    uint8_t *bitmap;
+    uint8_t *data;
+    /* -checkpoint: bit set if the sector was written since the last checkpoint, NULL without */
+    uint8_t *written;
+} Overlay;
+
+#define OVERLAY_MAGIC "DAX86OVL"
+#define OVERLAY_HEADER_SIZE 0x1000
+
+/*
+ * Opens (or creates) the delta file at path for a disk of sectors.
+ * A delta file of another size is reset. With discard it is unlinked
+ * at once, so it goes away when the emulator exits.
+ * Returns NULL on failure.
+ */
+Overlay *open_overlay(const char *path, uint64_t sectors, int discard);
+
+/* Starts setting Overlay.written. */
+void overlay_track_writes(Overlay *overlay);
+
+/* Is the sector in the delta? */
+static inline int overlay_has(Overlay *overlay, uint64_t sector)
+{
+    return (overlay->bitmap[sector >> 3] >> (sector & 7)) & 1;
+}
+
+static inline uint8_t *overlay_sector(Overlay *overlay, uint64_t sector)
+{
+    return overlay->data + sector * 512;
+}
+
+/* Copies 512 bytes of data to the delta. */
+void overlay_write_sector(Overlay *overlay, uint64_t sector, const uint8_t *data);
+/*
+ * Keeps sectors written from now on in this process's memory
+ * (copy-on-write of the delta), for a fork server's clones.
+ */
+void overlay_make_private(Overlay *overlay);
+/* Returns once the delta is on the disk. */
+void overlay_flush(Overlay *overlay);
+/* Flushes, unmaps and frees the overlay. */
+void close_overlay(Overlay *overlay);
+
+#endif
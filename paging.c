@@ -6,14 +6,48 @@
 #include <sys/types.h>
 
 #include "paging.h"
+#include "stats.h"
+#include "bench.h"
+#include "util.h"
 #include "emulator_functions.h"
+#include "block_cache.h"
+#include "interrupt.h"
 
-void check_paging(Emulator *emu)
+/* Whether get_linear_addr() would pass offsets through unchecked */
+static int is_flat_segment(Emulator *emu, int seg_index, uint8_t write)
 {
-    if (emu->is_pg)
-        return;
-    if ((emu->control_registers[CR0] & CR0_PG) != 0)
+    SegmentCache *cache = &emu->segment_caches[seg_index];
+    if (cache->base != 0)
+        return 0;
+    if (!emu->is_pe)
+        return 1;
+    return cache->limit == 0xFFFFFFFF && cache->dpl >= cache->rpl && (!write || (cache->access & 2)) &&
+           (seg_index != CS || (cache->access & 8));
+}
+
+void update_translation(Emulator *emu)
+{
+    int i;
+    if (!emu->is_pg && (emu->control_registers[CR0] & CR0_PG) != 0)
+    {
         emu->is_pg = 1;
+        if (config.bench)
+            bench_milestone(emu, BENCH_PAGING);
+    }
+    emu->translation = !emu->is_pe ? TRANSLATE_REAL : emu->is_pg ? TRANSLATE_PAGED : TRANSLATE_SEGMENTED;
+    uint32_t tlb_supervisor = (emu->segment_registers[CS] & 3) == 3 && emu->is_pe ? 0 : TLB_SUPERVISOR;
+    /* The stack window was checked at the CPL before. */
+    if (tlb_supervisor != emu->tlb_supervisor)
+        flush_stack_window(emu);
+    emu->tlb_supervisor = tlb_supervisor;
+    emu->flat_segments = 0;
+    for (i = 0; i < SEGMENT_REGISTERS_COUNT; i++)
+    {
+        if (is_flat_segment(emu, i, 0))
+            emu->flat_segments |= 1 << i;
+        if (is_flat_segment(emu, i, 1))
+            emu->flat_segments |= 1 << (i + 8);
+    }
 }
 
 /*
@@ -43,8 +77,9 @@ void check_paging(Emulator *emu)
  * 
  * Add
  */
-uint32_t get_phys_addr(Emulator *emu, uint32_t linear_addr, uint8_t write, uint8_t exec)
+static uint32_t walk_page_table(Emulator *emu, uint32_t linear_addr, uint32_t *flags)
 {
+    STAT_INC(stats.page_walks);
     uint32_t pde_index = linear_addr >> 22;
     uint32_t pde = _get_memory32(emu, emu->control_registers[CR3] + (pde_index * 4));
     uint8_t cr4_pse = emu->control_registers[CR4] & CR4_PSE;
@@ -58,6 +93,7 @@ uint32_t get_phys_addr(Emulator *emu, uint32_t linear_addr, uint8_t write, uint8
     {
         uint32_t phys_base = pde & 0xFFFFF000;
         uint32_t phys_offset = linear_addr & 0x3FFFFF;
+        *flags = pde;
         return phys_base + phys_offset;
     }
     /* 
@@ -73,6 +109,110 @@ uint32_t get_phys_addr(Emulator *emu, uint32_t linear_addr, uint8_t write, uint8
         uint32_t pte = _get_memory32(emu, pt_base + (pte_index * 4));
         uint32_t phys_base = pte & 0xFFFFF000;
         uint32_t phys_offset = linear_addr & 0xFFF;
+        /* Both levels have to allow an access. */
+        *flags = pde & pte;
         return phys_base + phys_offset;
     }
-}
\ No newline at end of file
+}
+
+/* Sets CR2 and delivers #PF, does not return. */
+static void raise_page_fault(Emulator *emu, uint32_t linear_addr, uint32_t error_code)
+{
+    emu->control_registers[CR2] = linear_addr;
+    raise_exception(emu, T_PGFLT, error_code);
+}
+
+/* The entry matches the page at the CPL. */
+static int tlb_match(Emulator *emu, TlbEntry *entry, uint32_t linear_page)
+{
+    return entry->linear_page == linear_page || entry->linear_page == (linear_page | emu->tlb_supervisor);
+}
+
+/*
+ * Translates linear address through the software TLB.
+ * On a miss, page tables are walked, the access is checked and the
+ * translation is cached in the table for the access type. Only
+ * translations which are permitted are cached, tagged with
+ * TLB_SUPERVISOR unless CPL 3 may use them as well, so a hit needs
+ * no checks.
+ */
+uint32_t get_phys_addr(Emulator *emu, uint32_t linear_addr, uint8_t write, uint8_t exec)
+{
+    uint32_t linear_page = linear_addr >> 12;
+    TlbEntry *table = write ? emu->tlb.write : (exec ? emu->tlb.exec : emu->tlb.read);
+    TlbEntry *entry = &table[linear_page % TLB_SIZE];
+
+    if (tlb_match(emu, entry, linear_page))
+        return entry->phys_page | (linear_addr & 0xFFF);
+
+    uint32_t flags;
+    uint32_t phys_addr = walk_page_table(emu, linear_addr, &flags);
+    int user = emu->tlb_supervisor == 0;
+    uint32_t error_code = (write ? PF_WRITE : 0) | (user ? PF_USER : 0);
+    if (!(flags & PTE_P))
+        raise_page_fault(emu, linear_addr, error_code);
+
+    /* The supervisor may write read-only pages unless CR0.WP is set. */
+    int user_permitted = (flags & PTE_US) && (!write || (flags & PTE_RW));
+    int permitted = user ? user_permitted
+                         : !write || (flags & PTE_RW) || !(emu->control_registers[CR0] & CR0_WP);
+    if (!permitted)
+        raise_page_fault(emu, linear_addr, error_code | PF_PROTECTION);
+
+    entry->linear_page = linear_page | (user_permitted ? 0 : TLB_SUPERVISOR);
+    entry->phys_page = phys_addr & 0xFFFFF000;
+    return phys_addr;
+}
+
+int tlb_cached(Emulator *emu, uint32_t linear_addr, uint8_t write)
+{
+    uint32_t linear_page = linear_addr >> 12;
+    TlbEntry *table = write ? emu->tlb.write : emu->tlb.read;
+    return tlb_match(emu, &table[linear_page % TLB_SIZE], linear_page);
+}
+
+int peek_phys_addr(Emulator *emu, uint32_t linear_addr, uint32_t *phys_addr)
+{
+    uint32_t flags = PTE_P;
+    *phys_addr = emu->is_pg ? walk_page_table(emu, linear_addr, &flags) : linear_addr;
+    return (flags & PTE_P) != 0;
+}
+
+void tlb_flush(Emulator *emu)
+{
+    memset(&emu->tlb, 0xFF, sizeof(Tlb));
+    flush_fetch_window(emu);
+    flush_stack_window(emu);
+    emu->tss_cache.valid = 0;
+    leave_block(emu);
+    unchain_blocks(emu);
+}
+
+void tlb_flush_page(Emulator *emu, uint32_t linear_addr)
+{
+    uint32_t linear_page = linear_addr >> 12;
+    int i = linear_page % TLB_SIZE;
+    if ((emu->tlb.read[i].linear_page & ~TLB_SUPERVISOR) == linear_page)
+        emu->tlb.read[i].linear_page = TLB_INVALID;
+    if ((emu->tlb.write[i].linear_page & ~TLB_SUPERVISOR) == linear_page)
+        emu->tlb.write[i].linear_page = TLB_INVALID;
+    if ((emu->tlb.exec[i].linear_page & ~TLB_SUPERVISOR) == linear_page)
+        emu->tlb.exec[i].linear_page = TLB_INVALID;
+    flush_fetch_window(emu);
+    flush_stack_window(emu);
+    emu->tss_cache.valid = 0;
+    leave_block(emu);
+    unchain_blocks(emu);
+}
+
+/*
+ * invlpg m: 3 bytes
+ * Invalidates TLB entries for the page containing m.
+ * 2 bytes: op (0F 01)
+ * 1 byte: ModR/M (Op: 7)
+ */
+void invlpg(Emulator *emu, ModRM *modrm)
+{
+    uint32_t address = calc_memory_address(emu, modrm);
+    tlb_flush_page(emu, emu->segment_caches[emu->prefixes.segment].base + address);
+}
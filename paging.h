@@ -2,14 +2,46 @@
 #define PAGING_H_
 
 #include "emulator.h"
+#include "modrm.h"
 
+#define CR0_WP (1 << 16)
 #define CR0_PG (1 << 31)
 #define CR4_PSE (1 << 4)
 
+#define PTE_P (1 << 0)
+#define PTE_RW (1 << 1)
+#define PTE_US (1 << 2)
 #define PDE_PS (1 << 7)
 
-void check_paging(Emulator *emu);
+/* Page fault error code */
+#define PF_PROTECTION (1 << 0)
+#define PF_WRITE (1 << 1)
+#define PF_USER (1 << 2)
 
+/*
+ * Derives the translation mode and flat segments from PE, CR0.PG and the
+ * segment caches; called whenever a control register or segment cache
+ * changes, so translations don't test them on every access.
+ */
+void update_translation(Emulator *emu);
+
+/*
+ * Raises a page fault (CR2 set to linear_addr) if the access is not
+ * permitted at the CPL: P clear, U/S clear at CPL 3, or R/W clear for a
+ * write at CPL 3 or with CR0.WP set.
+ */
 uint32_t get_phys_addr(Emulator *emu, uint32_t linear_addr, uint8_t write, uint8_t exec);
+/*
+ * Translation for debuggers: walks the page tables (if paging is on)
+ * without faults or TLB fills. Returns 0 if linear_addr is not present.
+ */
+int peek_phys_addr(Emulator *emu, uint32_t linear_addr, uint32_t *phys_addr);
+
+/* Software TLB */
+/* 1 if a read (write) of linear_addr is cached, so it is permitted. */
+int tlb_cached(Emulator *emu, uint32_t linear_addr, uint8_t write);
+void tlb_flush(Emulator *emu);
+void tlb_flush_page(Emulator *emu, uint32_t linear_addr);
+void invlpg(Emulator *emu, ModRM *modrm);
 
 #endif
\ No newline at end of file
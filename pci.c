@@ -0,0 +1,88 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "pci.h"
+#include "ide_dma.h"
+#include "io.h"
+#include "machine.h"
+#include "snapshot.h"
+
+#define PCI_IDE_DEVFN ((1 << 3) | 1)
+
+static void pci_write_address(Emulator *emu, void *device, uint16_t address, uint32_t value)
+{
+    ((Pci *)device)->config_address = value;
+}
+
+static uint32_t pci_read_address(Emulator *emu, void *device, uint16_t address)
+{
+    return ((Pci *)device)->config_address;
+}
+
+static int ide_selected(Pci *pci)
+{
+    uint8_t bus = (pci->config_address >> 16) & 0xFF;
+    uint8_t devfn = (pci->config_address >> 8) & 0xFF;
+    return (pci->config_address & 0x80000000) && bus == 0 && devfn == PCI_IDE_DEVFN;
+}
+
+static uint32_t pci_read_data(Emulator *emu, void *device, uint16_t address)
+{
+    Pci *pci = (Pci *)device;
+    if (!ide_selected(pci))
+        return 0xFFFFFFFF;
+    switch (pci->config_address & 0xFC)
+    {
+    case 0x00:
+        /* PIIX3 IDE: device 7010, vendor 8086 */
+        return 0x70108086;
+    case 0x04:
+        return pci->ide_command;
+    case 0x08:
+        /* Class: mass storage, IDE, prog if: bus master capable */
+        return 0x01018000;
+    case 0x20:
+        if (pci->bar4_sizing)
+            return ~(uint32_t)(BMIDE_SIZE - 1) | 1;
+        return BMIDE_BASE | 1;
+    default:
+        return 0;
+    }
+}
+
+/* BAR4 can not be moved, writes other than sizing are ignored. */
+static void pci_write_data(Emulator *emu, void *device, uint16_t address, uint32_t value)
+{
+    Pci *pci = (Pci *)device;
+    if (!ide_selected(pci))
+        return;
+    switch (pci->config_address & 0xFC)
+    {
+    case 0x04:
+        pci->ide_command = value & 0xFFFF;
+        break;
+    case 0x20:
+        pci->bar4_sizing = value == 0xFFFFFFFF;
+        break;
+    default:
+        break;
+    }
+}
+
+void init_pci(Machine *machine)
+{
+    Pci *pci = malloc(sizeof(Pci));
+    pci->config_address = 0;
+    pci->ide_command = 0x5;
+    pci->bar4_sizing = 0;
+    register_io_ports(machine->io, PCI_CONFIG_ADDRESS, 1, 4, pci_read_address, pci_write_address, pci);
+    register_io_ports(machine->io, PCI_CONFIG_DATA, 1, 4, pci_read_data, pci_write_data, pci);
+    machine->pci = pci;
+}
+
+void snapshot_pci(struct Snapshot *snapshot, Pci *pci)
+{
+    SNAPSHOT_FIELD(snapshot, pci->config_address);
+    SNAPSHOT_FIELD(snapshot, pci->ide_command);
+    SNAPSHOT_FIELD(snapshot, pci->bar4_sizing);
+}
@@ -0,0 +1,37 @@
+#ifndef PCI_H_
+#define PCI_H_
+
+#include <stdint.h>
+
+#include "emulator.h"
+
+/*
+ * PCI configuration mechanism #1
+ * 0xCF8: out32: CONFIG_ADDRESS
+ * |31_____|30___24|23__16|15____11|10______8|7_________2|1_0|
+ * |Enable_|_Rsvd__|_Bus__|_Device_|Function_|_Register__|_0_|
+ * 0xCFC: in32|out32: CONFIG_DATA of the register selected
+ *
+ * Only the IDE controller (PIIX3 IDE, 00:01.1) is present, its BAR4 is the
+ * bus master register block at BMIDE_BASE (see ide_dma.h).
+ * Reads of other devices return all ones (no device).
+ */
+#define PCI_CONFIG_ADDRESS 0xCF8
+#define PCI_CONFIG_DATA 0xCFC
+
+typedef struct Pci
+{
+    uint32_t config_address;
+    /* IDE command register, bit 0: I/O space, bit 2: bus master */
+    uint16_t ide_command;
+    /* BAR4 reads its size mask after all ones were written. */
+    uint8_t bar4_sizing;
+} Pci;
+
+/* Creates machine->pci and registers its ports. */
+void init_pci(Machine *machine);
+
+struct Snapshot;
+void snapshot_pci(struct Snapshot *snapshot, Pci *pci);
+
+#endif
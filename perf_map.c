@@ -0,0 +1,135 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <elf.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "perf_map.h"
+#include "profile.h"
+#include "util.h"
+
+/* jitdump format (tools/perf/Documentation/jitdump-specification.txt) */
+#define JITDUMP_MAGIC 0x4A695444
+#define JITDUMP_VERSION 1
+#define JIT_CODE_LOAD 0
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t total_size;
+    uint32_t elf_mach;
+    uint32_t pad1;
+    uint32_t pid;
+    uint64_t timestamp;
+    uint64_t flags;
+} JitdumpHeader;
+
+/* Followed by the name (NUL terminated) and the code */
+typedef struct
+{
+    uint32_t id;
+    uint32_t total_size;
+    uint64_t timestamp;
+    uint32_t pid;
+    uint32_t tid;
+    uint64_t vma;
+    uint64_t code_addr;
+    uint64_t code_size;
+    uint64_t code_index;
+} JitdumpCodeLoad;
+
+/* Blocks are compiled by the CPU threads of every machine. */
+static pthread_mutex_t perf_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *map_file = NULL;
+static FILE *jitdump_file = NULL;
+static uint64_t code_index = 0;
+
+static FILE *open_jitdump(const char *path)
+{
+    FILE *file = fopen(path, "w+");
+    if (file == NULL)
+        return NULL;
+    JitdumpHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = JITDUMP_MAGIC;
+    header.version = JITDUMP_VERSION;
+    header.total_size = sizeof(header);
+    header.elf_mach = EM_X86_64;
+    header.pid = getpid();
+    header.timestamp = monotonic_ns();
+    fwrite(&header, sizeof(header), 1, file);
+    fflush(file);
+    /* perf record finds the file by this executable mapping of it. */
+    if (mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ | PROT_EXEC, MAP_PRIVATE, fileno(file), 0) == MAP_FAILED)
+    {
+        fclose(file);
+        return NULL;
+    }
+    return file;
+}
+
+void init_perf_map(void)
+{
+    char path[64];
+    if (config.perf & PERF_MAP)
+    {
+        snprintf(path, sizeof(path), "/tmp/perf-%d.map", getpid());
+        map_file = fopen(path, "w");
+        if (map_file == NULL)
+        {
+            printf("Could not open %s.\n", path);
+            config.perf &= ~PERF_MAP;
+        }
+    }
+    if (config.perf & PERF_JITDUMP)
+    {
+        snprintf(path, sizeof(path), "/tmp/jit-%d.dump", getpid());
+        jitdump_file = open_jitdump(path);
+        if (jitdump_file == NULL)
+        {
+            printf("Could not open %s.\n", path);
+            config.perf &= ~PERF_JITDUMP;
+        }
+    }
+}
+
+void perf_map_code(void *code, uint32_t size, uint32_t eip)
+{
+    char name[256];
+    uint32_t offset;
+    const char *symbol = profile_symbol(eip, &offset);
+    if (symbol != NULL)
+        snprintf(name, sizeof(name), "guest %s+0x%x (0x%08x)", symbol, offset, eip);
+    else
+        snprintf(name, sizeof(name), "guest 0x%08x", eip);
+
+    pthread_mutex_lock(&perf_lock);
+    if (map_file != NULL)
+    {
+        fprintf(map_file, "%lx %x %s\n", (unsigned long)(uintptr_t)code, size, name);
+        fflush(map_file);
+    }
+    if (jitdump_file != NULL)
+    {
+        JitdumpCodeLoad record;
+        uint32_t name_size = strlen(name) + 1;
+        record.id = JIT_CODE_LOAD;
+        record.total_size = sizeof(record) + name_size + size;
+        record.timestamp = monotonic_ns();
+        record.pid = getpid();
+        record.tid = syscall(SYS_gettid);
+        record.vma = (uintptr_t)code;
+        record.code_addr = (uintptr_t)code;
+        record.code_size = size;
+        record.code_index = code_index++;
+        fwrite(&record, sizeof(record), 1, jitdump_file);
+        fwrite(name, name_size, 1, jitdump_file);
+        fwrite(code, size, 1, jitdump_file);
+        fflush(jitdump_file);
+    }
+    pthread_mutex_unlock(&perf_lock);
+}
@@ -0,0 +1,30 @@
+#ifndef PERF_MAP_H_
+#define PERF_MAP_H_
+
+#include <stdint.h>
+
+/*
+ * Host perf symbols for JIT code
+ * Every block compiled by the JIT is named after its guest EIP, and the
+ * -profile-elf symbol it is in if one was loaded, e.g.
+ * "guest sys_write+0x1c (0x80105a3c)":
+ *   -perf-map: /tmp/perf-<pid>.map, read by perf report / perf top.
+ *     Code buffer reuse (JIT_CODE_SIZE full) is not recorded there, so
+ *     older entries for reused addresses stay.
+ *   -perf-jitdump: /tmp/jit-<pid>.dump in the jitdump format, with the
+ *     host code and load time of each block. Needs
+ *     perf record -k mono, then perf inject --jit.
+ * Interpreter handlers are the dax86 binary's own symbols.
+ */
+enum PerfOutput
+{
+    PERF_MAP = 1,
+    PERF_JITDUMP = 2
+};
+
+/* Opens the files of config.perf, clearing the bits of those it could not open. */
+void init_perf_map(void);
+/* Host code of size bytes at code now runs the guest block at eip. */
+void perf_map_code(void *code, uint32_t size, uint32_t eip);
+
+#endif
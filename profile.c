@@ -0,0 +1,239 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <elf.h>
+
+#include "profile.h"
+
+typedef struct
+{
+    uint32_t eip;
+    uint32_t count;
+} ProfileSlot;
+
+typedef struct
+{
+    uint32_t addr;
+    uint32_t size;
+    const char *name;
+} ProfileSymbol;
+
+static Emulator *profiled_emu = NULL;
+static ProfileSlot *slots = NULL;
+static volatile uint64_t sample_count = 0;
+static volatile uint64_t dropped_count = 0;
+
+static ProfileSymbol *symbols = NULL;
+static int symbol_count = 0;
+static char *symbol_file = NULL;
+
+/* Runs in signal context: no allocation, open addressing on EIP. */
+static void profile_handler(int signum)
+{
+    uint32_t eip = profiled_emu->eip;
+    uint32_t i = (eip * 2654435761u) >> 16;
+    int probe;
+    sample_count++;
+    for (probe = 0; probe < 64; probe++)
+    {
+        ProfileSlot *slot = &slots[(i + probe) & (PROFILE_SLOTS - 1)];
+        if (slot->count == 0)
+            slot->eip = eip;
+        if (slot->eip == eip)
+        {
+            slot->count++;
+            return;
+        }
+    }
+    dropped_count++;
+}
+
+void init_profile(Emulator *emu, uint32_t interval_us)
+{
+    if (interval_us == 0)
+        interval_us = 100;
+    profiled_emu = emu;
+    slots = calloc(PROFILE_SLOTS, sizeof(ProfileSlot));
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = profile_handler;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGPROF, &action, NULL);
+
+    struct itimerval timer;
+    timer.it_interval.tv_sec = interval_us / 1000000;
+    timer.it_interval.tv_usec = interval_us % 1000000;
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+static int compare_symbols(const void *a, const void *b)
+{
+    const ProfileSymbol *x = a, *y = b;
+    return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+void load_profile_symbols(const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        printf("Could not open: %s\n", path);
+        return;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    symbol_file = malloc(size);
+    if (fread(symbol_file, 1, size, file) != (size_t)size)
+        size = 0;
+    fclose(file);
+
+    Elf32_Ehdr *ehdr = (Elf32_Ehdr *)symbol_file;
+    if (size < (long)sizeof(Elf32_Ehdr) || memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 ||
+        ehdr->e_ident[EI_CLASS] != ELFCLASS32 ||
+        ehdr->e_shoff + (uint64_t)ehdr->e_shnum * sizeof(Elf32_Shdr) > (uint64_t)size)
+    {
+        printf("%s is not an ELF32 file.\n", path);
+        return;
+    }
+
+    Elf32_Shdr *sections = (Elf32_Shdr *)(symbol_file + ehdr->e_shoff);
+    int i;
+    for (i = 0; i < ehdr->e_shnum; i++)
+    {
+        if (sections[i].sh_type != SHT_SYMTAB || sections[i].sh_link >= ehdr->e_shnum)
+            continue;
+        Elf32_Shdr *strtab = &sections[sections[i].sh_link];
+        if (sections[i].sh_offset + (uint64_t)sections[i].sh_size > (uint64_t)size ||
+            strtab->sh_offset + (uint64_t)strtab->sh_size > (uint64_t)size)
+            continue;
+        Elf32_Sym *syms = (Elf32_Sym *)(symbol_file + sections[i].sh_offset);
+        int count = sections[i].sh_size / sizeof(Elf32_Sym);
+        int j;
+        symbols = realloc(symbols, sizeof(ProfileSymbol) * (symbol_count + count));
+        for (j = 0; j < count; j++)
+        {
+            uint8_t type = ELF32_ST_TYPE(syms[j].st_info);
+            if ((type != STT_FUNC && type != STT_NOTYPE) || syms[j].st_name >= strtab->sh_size ||
+                syms[j].st_shndx == SHN_UNDEF || syms[j].st_shndx >= SHN_LORESERVE)
+                continue;
+            symbols[symbol_count].addr = syms[j].st_value;
+            symbols[symbol_count].size = syms[j].st_size;
+            symbols[symbol_count].name = symbol_file + strtab->sh_offset + syms[j].st_name;
+            symbol_count++;
+        }
+    }
+    qsort(symbols, symbol_count, sizeof(ProfileSymbol), compare_symbols);
+}
+
+/* Closest symbol at or below addr, NULL if none. */
+static ProfileSymbol *find_symbol(uint32_t addr)
+{
+    int low = 0, high = symbol_count - 1;
+    ProfileSymbol *found = NULL;
+    while (low <= high)
+    {
+        int mid = (low + high) / 2;
+        if (symbols[mid].addr <= addr)
+        {
+            found = &symbols[mid];
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid - 1;
+        }
+    }
+    if (found != NULL && found->size != 0 && addr >= found->addr + found->size)
+        return NULL;
+    return found;
+}
+
+const char *profile_symbol(uint32_t addr, uint32_t *offset)
+{
+    ProfileSymbol *symbol = find_symbol(addr);
+    if (symbol == NULL)
+        return NULL;
+    *offset = addr - symbol->addr;
+    return symbol->name;
+}
+
+static int compare_slots(const void *a, const void *b)
+{
+    const ProfileSlot *x = a, *y = b;
+    return x->count > y->count ? -1 : x->count < y->count;
+}
+
+static void print_histogram(ProfileSlot *entries, int count, uint64_t total, int by_symbol)
+{
+    int i;
+    qsort(entries, count, sizeof(ProfileSlot), compare_slots);
+    for (i = 0; i < count && i < PROFILE_TOP; i++)
+    {
+        ProfileSymbol *symbol = find_symbol(entries[i].eip);
+        printf("%6.2f%% %10u  %08X", entries[i].count * 100.0 / total, entries[i].count, entries[i].eip);
+        if (symbol != NULL && by_symbol)
+            printf("  %s", symbol->name);
+        else if (symbol != NULL)
+            printf("  %s+0x%x", symbol->name, entries[i].eip - symbol->addr);
+        printf("\n");
+    }
+}
+
+void print_profile(void)
+{
+    if (slots == NULL)
+        return;
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, NULL);
+
+    uint64_t total = sample_count;
+    if (total == 0)
+        return;
+    ProfileSlot *entries = malloc(sizeof(ProfileSlot) * PROFILE_SLOTS);
+    int count = 0;
+    int i;
+    for (i = 0; i < PROFILE_SLOTS; i++)
+    {
+        if (slots[i].count > 0)
+            entries[count++] = slots[i];
+    }
+    printf("Profile: %llu samples (%llu dropped)\n", (unsigned long long)total, (unsigned long long)dropped_count);
+    printf("By EIP:\n");
+    print_histogram(entries, count, total, 0);
+
+    if (symbol_count > 0)
+    {
+        /* Folds samples into the functions they fall in. */
+        int functions = 0;
+        for (i = 0; i < count; i++)
+        {
+            ProfileSymbol *symbol = find_symbol(entries[i].eip);
+            uint32_t addr = symbol != NULL ? symbol->addr : entries[i].eip;
+            uint32_t samples = entries[i].count;
+            int j;
+            for (j = 0; j < functions; j++)
+            {
+                if (entries[j].eip == addr)
+                    break;
+            }
+            if (j == functions)
+            {
+                entries[functions].eip = addr;
+                entries[functions].count = 0;
+                functions++;
+            }
+            entries[j].count += samples;
+        }
+        printf("By function:\n");
+        print_histogram(entries, functions, total, 1);
+    }
+    free(entries);
+}
@@ -0,0 +1,26 @@
+#ifndef PROFILE_H_
+#define PROFILE_H_
+
+#include <stdint.h>
+
+#include "emulator.h"
+
+/*
+ * Guest profiler
+ * Samples EIP with a host CPU-time timer (SIGPROF) every interval_us,
+ * printing a histogram on exit, symbolized if an ELF file was loaded.
+ */
+
+/* Number of distinct EIPs kept; further samples are counted as dropped. */
+#define PROFILE_SLOTS (1 << 16)
+/* Lines printed per histogram */
+#define PROFILE_TOP 40
+
+void init_profile(Emulator *emu, uint32_t interval_us);
+/* Loads function symbols from ELF32 (e.g. xv6 kernel). */
+void load_profile_symbols(const char *path);
+/* Name of the loaded symbol containing addr and addr's offset in it, NULL if none. */
+const char *profile_symbol(uint32_t addr, uint32_t *offset);
+void print_profile(void);
+
+#endif
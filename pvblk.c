@@ -0,0 +1,154 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pvblk.h"
+#include "disk.h"
+#include "emulator_functions.h"
+#include "interrupt.h"
+#include "io.h"
+#include "ioapic.h"
+#include "machine.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "util.h"
+
+/* Is [p_address, p_address + len) in RAM? */
+static int is_ram(Emulator *emu, uint32_t p_address, uint32_t len)
+{
+    uint32_t page;
+    if (len == 0 || p_address >= emu->memory_size || len > emu->memory_size - p_address)
+        return 0;
+    for (page = p_address >> 12; page <= (p_address + len - 1) >> 12; page++)
+    {
+        if (emu->page_types[page] != PAGE_RAM && emu->page_types[page] != PAGE_WATCH)
+            return 0;
+    }
+    return 1;
+}
+
+static int run_request(Emulator *emu, PvblkRequest *request)
+{
+    Disk *disk = emu->disk;
+    uint32_t count = request->len / 512;
+    uint32_t page;
+
+    if (request->type == PVBLK_FLUSH)
+    {
+        flush_disk(disk);
+        return 1;
+    }
+    if (request->len % 512 != 0 || !is_ram(emu, request->address, request->len))
+        return 0;
+    if (request->sector > disk_sectors(disk) || count > disk_sectors(disk) - request->sector)
+        return 0;
+
+    uint8_t *buffer = emu->memory + request->address;
+    switch (request->type)
+    {
+    case PVBLK_READ:
+        for (page = request->address >> 12; page <= (request->address + request->len - 1) >> 12; page++)
+        {
+            uint32_t from = page << 12 > request->address ? page << 12 : request->address;
+            uint32_t to = (page + 1) << 12 < request->address + request->len ? (page + 1) << 12 : request->address + request->len;
+            page_written(emu, from, to - from);
+        }
+        read_disk_sectors(disk, request->sector, count, buffer);
+        STAT_ADD(stats.disk_sectors_read, count);
+        return 1;
+    case PVBLK_WRITE:
+        write_disk_sectors(disk, request->sector, count, buffer);
+        STAT_ADD(stats.disk_sectors_written, count);
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/* Runs every request queued, then raises one interrupt for all of them. */
+static void ring_doorbell(Emulator *emu, Pvblk *pvblk)
+{
+    uint32_t header_size = 8;
+    if (emu->disk == NULL || pvblk->ring_entries == 0 || !is_ram(emu, pvblk->ring_address, header_size + pvblk->ring_entries * sizeof(PvblkRequest)))
+        return;
+
+    uint8_t *ring = emu->memory + pvblk->ring_address;
+    uint32_t avail, done = 0;
+    memcpy(&avail, ring, 4);
+    while (pvblk->next_request != avail)
+    {
+        uint8_t *entry = ring + header_size + (pvblk->next_request & (pvblk->ring_entries - 1)) * sizeof(PvblkRequest);
+        PvblkRequest request;
+        memcpy(&request, entry, sizeof(request));
+        request.status = run_request(emu, &request) ? 0 : 1;
+        memcpy(entry + 4, &request.status, 4);
+        pvblk->next_request++;
+        done++;
+    }
+    if (done == 0)
+        return;
+    device_written(emu, pvblk->ring_address, header_size + pvblk->ring_entries * sizeof(PvblkRequest));
+    memcpy(ring + 4, &pvblk->next_request, 4);
+    pvblk->isr = 1;
+    ioapic_int_to_lapic(emu->machine->ioapic, PVBLK_IRQ);
+}
+
+static uint32_t pvblk_read32(Emulator *emu, void *device, uint16_t address)
+{
+    Pvblk *pvblk = (Pvblk *)device;
+    uint64_t sectors = emu->disk != NULL ? disk_sectors(emu->disk) : 0;
+    uint32_t value;
+    switch (address - PVBLK_BASE)
+    {
+    case PVBLK_ISR:
+        value = pvblk->isr;
+        pvblk->isr = 0;
+        return value;
+    case PVBLK_CAPACITY_LOW:
+        return sectors;
+    case PVBLK_CAPACITY_HIGH:
+        return sectors >> 32;
+    case PVBLK_MAGIC:
+        return PVBLK_MAGIC_VALUE;
+    default:
+        return 0;
+    }
+}
+
+static void pvblk_write32(Emulator *emu, void *device, uint16_t address, uint32_t value)
+{
+    Pvblk *pvblk = (Pvblk *)device;
+    switch (address - PVBLK_BASE)
+    {
+    case PVBLK_RING:
+        pvblk->ring_address = value & ~0xFFFu;
+        pvblk->next_request = 0;
+        break;
+    case PVBLK_ENTRIES:
+        /* Not a power of 2 (or too many) disables the ring. */
+        pvblk->ring_entries = (value != 0 && (value & (value - 1)) == 0 && value <= PVBLK_MAX_ENTRIES) ? value : 0;
+        pvblk->next_request = 0;
+        break;
+    case PVBLK_DOORBELL:
+        ring_doorbell(emu, pvblk);
+        break;
+    default:
+        break;
+    }
+}
+
+void init_pvblk(Machine *machine)
+{
+    Pvblk *pvblk = calloc(1, sizeof(Pvblk));
+    register_io_ports(machine->io, PVBLK_BASE, PVBLK_SIZE, 4, pvblk_read32, pvblk_write32, pvblk);
+    machine->pvblk = pvblk;
+}
+
+void snapshot_pvblk(struct Snapshot *snapshot, Pvblk *pvblk)
+{
+    SNAPSHOT_FIELD(snapshot, pvblk->ring_address);
+    SNAPSHOT_FIELD(snapshot, pvblk->ring_entries);
+    SNAPSHOT_FIELD(snapshot, pvblk->next_request);
+    SNAPSHOT_FIELD(snapshot, pvblk->isr);
+}
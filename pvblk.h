@@ -0,0 +1,82 @@
+#ifndef PVBLK_H_
+#define PVBLK_H_
+
+#include <stdint.h>
+
+#include "emulator.h"
+
+/*
+ * <Paravirtual block device>
+ * Same image as the ATA disk, driven through a request ring in guest
+ * memory instead of the data register.
+ *
+ * Ports (PVBLK_BASE + offset, 32-bit)
+ * | +0x00 | W | ring physical address (page aligned)                |
+ * | +0x04 | W | ring entries (power of 2, at most PVBLK_MAX_ENTRIES) |
+ * | +0x08 | W | doorbell: runs requests up to avail                  |
+ * | +0x0C | R | interrupt status, 1 if requests completed (cleared)  |
+ * | +0x10 | R | capacity in sectors (low 32 bits)                    |
+ * | +0x14 | R | capacity in sectors (high 32 bits)                   |
+ * | +0x18 | R | magic "DXBK"                                         |
+ *
+ * Ring: header followed by entries
+ * | 0 - 3 | avail: requests queued by the guest (free running)     |
+ * | 4 - 7 | used: requests completed by the device (free running)  |
+ * Request (24 bytes), entry avail % entries is the next one
+ * | 0 - 3   | type: 0 read, 1 write, 2 flush                      |
+ * | 4 - 7   | status: written by the device, 0 ok, 1 error         |
+ * | 8 - 15  | first sector                                         |
+ * | 16 - 19 | buffer physical address                              |
+ * | 20 - 23 | bytes (multiple of 512, buffer contiguous in RAM)    |
+ *
+ * All requests rung for are completed before the doorbell write returns,
+ * sectors go straight between the image and the guest buffer, and the
+ * whole batch raises IRQ 15 once.
+ */
+#define PVBLK_BASE 0xC100
+#define PVBLK_SIZE 0x20
+
+#define PVBLK_RING 0x00
+#define PVBLK_ENTRIES 0x04
+#define PVBLK_DOORBELL 0x08
+#define PVBLK_ISR 0x0C
+#define PVBLK_CAPACITY_LOW 0x10
+#define PVBLK_CAPACITY_HIGH 0x14
+#define PVBLK_MAGIC 0x18
+
+#define PVBLK_MAGIC_VALUE 0x4B425844
+#define PVBLK_MAX_ENTRIES 1024
+#define PVBLK_IRQ 15
+
+enum PvblkRequestType
+{
+    PVBLK_READ,
+    PVBLK_WRITE,
+    PVBLK_FLUSH
+};
+
+typedef struct
+{
+    uint32_t type;
+    uint32_t status;
+    uint64_t sector;
+    uint32_t address;
+    uint32_t len;
+} PvblkRequest;
+
+typedef struct Pvblk
+{
+    uint32_t ring_address;
+    uint32_t ring_entries;
+    /* Requests taken from the ring so far (free running like avail) */
+    uint32_t next_request;
+    uint32_t isr;
+} Pvblk;
+
+/* Creates machine->pvblk and registers its ports. */
+void init_pvblk(Machine *machine);
+
+struct Snapshot;
+void snapshot_pvblk(struct Snapshot *snapshot, Pvblk *pvblk);
+
+#endif
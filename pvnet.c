@@ -0,0 +1,405 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <linux/if.h>
+#include <linux/if_tun.h>
+
+#include "pvnet.h"
+#include "emulator_functions.h"
+#include "io.h"
+#include "ioapic.h"
+#include "machine.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "util.h"
+
+#define RING_HEADER_SIZE 8
+
+/* Locally administered, as QEMU's default */
+static const uint8_t default_mac[6] = {0x52, 0x54, 0x00, 0x12, 0x34, 0x56};
+
+/* Is [p_address, p_address + len) in RAM? */
+static int is_ram(Emulator *emu, uint32_t p_address, uint32_t len)
+{
+    uint32_t page;
+    if (len == 0 || p_address >= emu->memory_size || len > emu->memory_size - p_address)
+        return 0;
+    for (page = p_address >> 12; page <= (p_address + len - 1) >> 12; page++)
+    {
+        if (emu->page_types[page] != PAGE_RAM && emu->page_types[page] != PAGE_WATCH)
+            return 0;
+    }
+    return 1;
+}
+
+static uint32_t ring_size(Pvnet *pvnet)
+{
+    return RING_HEADER_SIZE + pvnet->ring_entries * sizeof(PvnetEntry);
+}
+
+/* Host pointer to ring, NULL if the rings are not set up. */
+static uint8_t *ring_pointer(Pvnet *pvnet, uint32_t ring)
+{
+    if (pvnet->ring_entries == 0 || !is_ram(pvnet->emu, ring, ring_size(pvnet)))
+        return NULL;
+    return pvnet->emu->memory + ring;
+}
+
+static PvnetEntry *ring_entry(Pvnet *pvnet, uint8_t *ring, uint32_t index)
+{
+    return (PvnetEntry *)(ring + RING_HEADER_SIZE + (index & (pvnet->ring_entries - 1)) * sizeof(PvnetEntry));
+}
+
+static uint32_t load_avail(uint8_t *ring)
+{
+    return __atomic_load_n((uint32_t *)ring, __ATOMIC_ACQUIRE);
+}
+
+static void store_used(uint8_t *ring, uint32_t used)
+{
+    __atomic_store_n((uint32_t *)(ring + 4), used, __ATOMIC_RELEASE);
+}
+
+/* Sets bit in the interrupt status, the IRQ is raised if the guest had seen the last one. */
+static void raise_status(Pvnet *pvnet, uint32_t bit)
+{
+    if (__atomic_fetch_or(&pvnet->isr, bit, __ATOMIC_ACQ_REL) & bit)
+        return;
+    STAT_INC_ATOMIC(stats.net_interrupts);
+    ioapic_int_to_lapic(pvnet->emu->machine->ioapic, PVNET_IRQ);
+}
+
+static void wake_net_thread(Pvnet *pvnet)
+{
+    uint64_t one = 1;
+    if (pvnet->event_fd >= 0 && write(pvnet->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        perror("pvnet eventfd");
+}
+
+/* One frame from count entries, 0 if a buffer is not RAM or the frame is too long. */
+static int send_frame(Pvnet *pvnet, uint8_t *ring, uint32_t first, uint32_t count)
+{
+    Emulator *emu = pvnet->emu;
+    struct iovec iov[PVNET_MAX_SEGMENTS];
+    uint32_t total = 0;
+    uint32_t i;
+    for (i = 0; i < count; i++)
+    {
+        PvnetEntry *entry = ring_entry(pvnet, ring, first + i);
+        if (!is_ram(emu, entry->address, entry->len))
+            return 0;
+        iov[i].iov_base = emu->memory + entry->address;
+        iov[i].iov_len = entry->len;
+        total += entry->len;
+    }
+    if (total > PVNET_FRAME_SIZE || (ring_entry(pvnet, ring, first + count - 1)->flags & PVNET_MORE))
+        return 0;
+    /* With no interface the cable is unplugged. */
+    if (pvnet->tap_fd < 0)
+        return 1;
+    ssize_t n;
+    do
+        n = writev(pvnet->tap_fd, iov, count);
+    while (n < 0 && errno == EINTR);
+    return n == (ssize_t)total;
+}
+
+/* Sends every complete frame queued, then raises one interrupt for all of them. */
+static void ring_tx_doorbell(Pvnet *pvnet)
+{
+    uint8_t *ring = ring_pointer(pvnet, pvnet->tx_ring);
+    uint32_t frames = 0;
+    if (ring == NULL)
+        return;
+    uint32_t avail = load_avail(ring);
+    while (pvnet->tx_next != avail)
+    {
+        uint32_t count = 1;
+        while ((ring_entry(pvnet, ring, pvnet->tx_next + count - 1)->flags & PVNET_MORE) && count < PVNET_MAX_SEGMENTS &&
+               pvnet->tx_next + count != avail)
+            count++;
+        /* The rest of the frame comes with the next doorbell, longer chains are an error. */
+        if ((ring_entry(pvnet, ring, pvnet->tx_next + count - 1)->flags & PVNET_MORE) && count < PVNET_MAX_SEGMENTS)
+            break;
+        uint32_t status = send_frame(pvnet, ring, pvnet->tx_next, count) ? 0 : 1;
+        uint32_t i;
+        for (i = 0; i < count; i++)
+            ring_entry(pvnet, ring, pvnet->tx_next + i)->status = status;
+        pvnet->tx_next += count;
+        frames++;
+    }
+    if (frames == 0)
+        return;
+    page_written(pvnet->emu, pvnet->tx_ring, ring_size(pvnet));
+    store_used(ring, pvnet->tx_next);
+    STAT_ADD(stats.net_frames_sent, frames);
+    raise_status(pvnet, PVNET_ISR_TX);
+}
+
+/*
+ * lock has to be held. Reads one frame into the free RX buffers.
+ * Returns the number of entries it filled, 0 if the TAP has no frame
+ * queued, -1 if there are not enough buffers for one.
+ */
+static int receive_frame(Pvnet *pvnet, uint8_t *ring, uint32_t avail)
+{
+    Emulator *emu = pvnet->emu;
+    struct iovec iov[PVNET_MAX_SEGMENTS];
+    uint32_t count = 0, room = 0;
+    while (room < PVNET_FRAME_SIZE && count < PVNET_MAX_SEGMENTS && pvnet->rx_next + count != avail)
+    {
+        PvnetEntry *entry = ring_entry(pvnet, ring, pvnet->rx_next + count);
+        /* A bad buffer is passed over, it stays empty. */
+        uint32_t len = is_ram(emu, entry->address, entry->len) ? entry->len : 0;
+        iov[count].iov_base = emu->memory + (len > 0 ? entry->address : 0);
+        iov[count].iov_len = len;
+        room += len;
+        count++;
+    }
+    if (room < PVNET_FRAME_SIZE && count < PVNET_MAX_SEGMENTS)
+        return -1;
+
+    ssize_t n;
+    do
+        n = readv(pvnet->tap_fd, iov, count);
+    while (n < 0 && errno == EINTR);
+    if (n <= 0)
+        return 0;
+
+    uint32_t left = n, i;
+    for (i = 0; i < count; i++)
+    {
+        PvnetEntry *entry = ring_entry(pvnet, ring, pvnet->rx_next + i);
+        uint32_t len = left < iov[i].iov_len ? left : iov[i].iov_len;
+        device_written(emu, entry->address, len);
+        left -= len;
+        entry->len = len;
+        entry->flags = left > 0 ? PVNET_MORE : 0;
+        entry->status = iov[i].iov_len > 0 ? 0 : 1;
+        if (left == 0)
+            break;
+    }
+    return i + 1;
+}
+
+/* Drains the frames queued on the TAP into the RX ring, returns 0 if it ran out of buffers. */
+static int receive_frames(Pvnet *pvnet)
+{
+    uint32_t frames = 0;
+    int filled;
+    pthread_mutex_lock(&pvnet->lock);
+    uint8_t *ring = ring_pointer(pvnet, pvnet->rx_ring);
+    if (ring == NULL)
+    {
+        pthread_mutex_unlock(&pvnet->lock);
+        return 0;
+    }
+    uint32_t avail = load_avail(ring);
+    while ((filled = receive_frame(pvnet, ring, avail)) > 0)
+    {
+        pvnet->rx_next += filled;
+        frames++;
+    }
+    if (frames > 0)
+    {
+        device_written(pvnet->emu, pvnet->rx_ring, ring_size(pvnet));
+        store_used(ring, pvnet->rx_next);
+        __atomic_fetch_add(&stats.net_frames_received, frames, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&pvnet->lock);
+    if (frames > 0)
+        raise_status(pvnet, PVNET_ISR_RX);
+    /* Less than a frame of buffers left: the TAP is not read until the guest gives more. */
+    return filled == 0;
+}
+
+static void watch_tap(int epoll_fd, int tap_fd, int events)
+{
+    struct epoll_event event;
+    event.events = events;
+    event.data.fd = tap_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, tap_fd, &event);
+}
+
+/* Net thread: waits for frames on the TAP while there are RX buffers, and for the doorbell. */
+static void *net_loop(void *arg)
+{
+    Pvnet *pvnet = arg;
+    struct epoll_event events[2];
+    int epoll_fd = epoll_create1(0);
+    int tap_events = EPOLLIN;
+    int i;
+    if (epoll_fd < 0)
+    {
+        perror("pvnet epoll");
+        return NULL;
+    }
+    events[0].events = EPOLLIN;
+    events[0].data.fd = pvnet->event_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pvnet->event_fd, &events[0]);
+    events[0].events = tap_events;
+    events[0].data.fd = pvnet->tap_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pvnet->tap_fd, &events[0]);
+
+    while (!__atomic_load_n(&pvnet->quit, __ATOMIC_ACQUIRE))
+    {
+        int ready = epoll_wait(epoll_fd, events, 2, -1);
+        if (ready < 0 && errno == EINTR)
+            continue;
+        if (ready < 0)
+            break;
+        int receive = 0;
+        for (i = 0; i < ready; i++)
+        {
+            if (events[i].data.fd == pvnet->event_fd)
+            {
+                uint64_t count;
+                if (read(pvnet->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                    perror("pvnet eventfd");
+            }
+            /* The doorbell may have given buffers for frames already queued. */
+            receive = 1;
+        }
+        if (!receive)
+            continue;
+        int events_wanted = receive_frames(pvnet) ? EPOLLIN : 0;
+        if (events_wanted != tap_events)
+        {
+            tap_events = events_wanted;
+            watch_tap(epoll_fd, pvnet->tap_fd, tap_events);
+        }
+    }
+    close(epoll_fd);
+    return NULL;
+}
+
+static uint32_t pvnet_read32(Emulator *emu, void *device, uint16_t address)
+{
+    Pvnet *pvnet = (Pvnet *)device;
+    switch (address - PVNET_BASE)
+    {
+    case PVNET_ISR:
+        return __atomic_exchange_n(&pvnet->isr, 0, __ATOMIC_ACQ_REL);
+    case PVNET_MAC_LOW:
+        return pvnet->mac[0] | pvnet->mac[1] << 8 | pvnet->mac[2] << 16 | (uint32_t)pvnet->mac[3] << 24;
+    case PVNET_MAC_HIGH:
+        return pvnet->mac[4] | pvnet->mac[5] << 8;
+    case PVNET_MAGIC:
+        return PVNET_MAGIC_VALUE;
+    default:
+        return 0;
+    }
+}
+
+static void pvnet_write32(Emulator *emu, void *device, uint16_t address, uint32_t value)
+{
+    Pvnet *pvnet = (Pvnet *)device;
+    switch (address - PVNET_BASE)
+    {
+    case PVNET_TX_RING:
+        pvnet->tx_ring = value & ~0xFFFu;
+        pvnet->tx_next = 0;
+        break;
+    case PVNET_RX_RING:
+        pthread_mutex_lock(&pvnet->lock);
+        pvnet->rx_ring = value & ~0xFFFu;
+        pvnet->rx_next = 0;
+        pthread_mutex_unlock(&pvnet->lock);
+        wake_net_thread(pvnet);
+        break;
+    case PVNET_ENTRIES:
+        pthread_mutex_lock(&pvnet->lock);
+        /* Not a power of 2 (or too many) disables the rings. */
+        pvnet->ring_entries = (value != 0 && (value & (value - 1)) == 0 && value <= PVNET_MAX_ENTRIES) ? value : 0;
+        pvnet->tx_next = 0;
+        pvnet->rx_next = 0;
+        pthread_mutex_unlock(&pvnet->lock);
+        wake_net_thread(pvnet);
+        break;
+    case PVNET_TX_DOORBELL:
+        ring_tx_doorbell(pvnet);
+        break;
+    case PVNET_RX_DOORBELL:
+        wake_net_thread(pvnet);
+        break;
+    default:
+        break;
+    }
+}
+
+void init_pvnet(Machine *machine)
+{
+    Pvnet *pvnet = calloc(1, sizeof(Pvnet));
+    pvnet->emu = machine->emu;
+    memcpy(pvnet->mac, default_mac, sizeof(pvnet->mac));
+    pthread_mutex_init(&pvnet->lock, NULL);
+    pvnet->tap_fd = -1;
+    pvnet->event_fd = -1;
+    register_io_ports(machine->io, PVNET_BASE, PVNET_SIZE, 4, pvnet_read32, pvnet_write32, pvnet);
+    machine->pvnet = pvnet;
+}
+
+void open_pvnet_tap(Pvnet *pvnet, const char *ifname)
+{
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+    strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+    int fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0 || ioctl(fd, TUNSETIFF, &ifr) < 0)
+    {
+        printf("Could not open TAP interface %s: %s\n", ifname, strerror(errno));
+        panic();
+    }
+    pvnet->tap_fd = fd;
+}
+
+void start_pvnet(Pvnet *pvnet)
+{
+    if (pvnet->tap_fd < 0)
+        return;
+    pvnet->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (pvnet->event_fd < 0 || pthread_create(&pvnet->thread, NULL, net_loop, pvnet) != 0)
+    {
+        printf("Could not start network thread.\n");
+        panic();
+    }
+    pvnet->started = 1;
+}
+
+void destroy_pvnet(Pvnet *pvnet)
+{
+    if (pvnet->started)
+    {
+        __atomic_store_n(&pvnet->quit, 1, __ATOMIC_RELEASE);
+        wake_net_thread(pvnet);
+        pthread_join(pvnet->thread, NULL);
+    }
+    if (pvnet->tap_fd >= 0)
+        close(pvnet->tap_fd);
+    if (pvnet->event_fd >= 0)
+        close(pvnet->event_fd);
+    pthread_mutex_destroy(&pvnet->lock);
+    free(pvnet);
+}
+
+void snapshot_pvnet(struct Snapshot *snapshot, Pvnet *pvnet)
+{
+    pthread_mutex_lock(&pvnet->lock);
+    SNAPSHOT_FIELD(snapshot, pvnet->tx_ring);
+    SNAPSHOT_FIELD(snapshot, pvnet->rx_ring);
+    SNAPSHOT_FIELD(snapshot, pvnet->ring_entries);
+    SNAPSHOT_FIELD(snapshot, pvnet->tx_next);
+    SNAPSHOT_FIELD(snapshot, pvnet->rx_next);
+    SNAPSHOT_FIELD(snapshot, pvnet->isr);
+    pthread_mutex_unlock(&pvnet->lock);
+}
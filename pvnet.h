@@ -0,0 +1,116 @@
+#ifndef PVNET_H_
+#define PVNET_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "emulator.h"
+
+/*
+ * <Paravirtual network device> (-net tap:ifname)
+ * Ethernet frames between two rings in guest memory and a Linux TAP
+ * interface, without the device copying them: frames are written from
+ * and read into the guest buffers with writev / readv.
+ *
+ * Ports (PVNET_BASE + offset, 32-bit)
+ * | +0x00 | W | TX ring physical address (page aligned)             |
+ * | +0x04 | W | RX ring physical address (page aligned)             |
+ * | +0x08 | W | ring entries, both rings (power of 2, at most       |
+ * |       |   | PVNET_MAX_ENTRIES); resets them                     |
+ * | +0x0C | W | TX doorbell: sends the frames up to avail           |
+ * | +0x10 | W | RX doorbell: buffers up to avail can be filled      |
+ * | +0x14 | R | interrupt status: PVNET_ISR_* (cleared)             |
+ * | +0x18 | R | MAC address bytes 0 - 3                             |
+ * | +0x1C | R | MAC address bytes 4 - 5                             |
+ * | +0x20 | R | magic "DXNT"                                        |
+ *
+ * Ring: header followed by entries, as the pvblk ring
+ * | 0 - 3 | avail: entries queued by the guest (free running)      |
+ * | 4 - 7 | used: entries completed by the device (free running)   |
+ * Entry (16 bytes), entry index % entries
+ * | 0 - 3   | buffer physical address (contiguous in RAM)          |
+ * | 4 - 7   | TX: bytes to send / RX: buffer size, then the bytes  |
+ * |         | received (written by the device)                     |
+ * | 8 - 11  | flags: PVNET_MORE, the frame goes on in the next     |
+ * |         | entry (TX: set by the guest, RX: by the device)      |
+ * | 12 - 15 | status: written by the device, 0 ok, 1 error         |
+ *
+ * TX frames are sent on the CPU thread before the doorbell write
+ * returns. Received frames are written by the net thread, which drains
+ * every frame the TAP has queued while buffers last before it publishes
+ * used, so a burst raises IRQ 11 once. An interrupt is only raised when
+ * its status bit was clear: the guest reads the status, then takes
+ * every entry up to used. A frame takes up to PVNET_MAX_SEGMENTS
+ * entries, the ones it did not fill stay free.
+ */
+#define PVNET_BASE 0xC140
+#define PVNET_SIZE 0x24
+
+#define PVNET_TX_RING 0x00
+#define PVNET_RX_RING 0x04
+#define PVNET_ENTRIES 0x08
+#define PVNET_TX_DOORBELL 0x0C
+#define PVNET_RX_DOORBELL 0x10
+#define PVNET_ISR 0x14
+#define PVNET_MAC_LOW 0x18
+#define PVNET_MAC_HIGH 0x1C
+#define PVNET_MAGIC 0x20
+
+#define PVNET_MAGIC_VALUE 0x544E5844
+#define PVNET_MAX_ENTRIES 1024
+#define PVNET_MAX_SEGMENTS 16
+/* Ethernet frame without FCS */
+#define PVNET_FRAME_SIZE 1514
+#define PVNET_IRQ 11
+
+#define PVNET_MORE 1
+
+#define PVNET_ISR_TX 1
+#define PVNET_ISR_RX 2
+
+typedef struct
+{
+    uint32_t address;
+    uint32_t len;
+    uint32_t flags;
+    uint32_t status;
+} PvnetEntry;
+
+typedef struct Pvnet
+{
+    Emulator *emu;
+    uint8_t mac[6];
+    /*
+     * Ring setup and the RX state, shared with the net thread. The TX
+     * state is only used on the CPU thread.
+     */
+    pthread_mutex_t lock;
+    uint32_t tx_ring;
+    uint32_t rx_ring;
+    uint32_t ring_entries;
+    /* Entries taken from the rings so far (free running like avail) */
+    uint32_t tx_next;
+    uint32_t rx_next;
+    uint32_t isr;
+    /* TAP interface, -1 without: frames sent are dropped */
+    int tap_fd;
+    /* Wakes the net thread: RX doorbell, ring setup, quit */
+    int event_fd;
+    int quit;
+    int started;
+    pthread_t thread;
+} Pvnet;
+
+/* Creates machine->pvnet and registers its ports. */
+void init_pvnet(Machine *machine);
+/* Connects the device to the TAP interface ifname. Panics if it can not be opened. */
+void open_pvnet_tap(Pvnet *pvnet, const char *ifname);
+/* Starts receiving (net thread) with a TAP, once RAM is restored or loaded. */
+void start_pvnet(Pvnet *pvnet);
+/* Stops the net thread, closes the TAP and frees pvnet. */
+void destroy_pvnet(Pvnet *pvnet);
+
+struct Snapshot;
+void snapshot_pvnet(struct Snapshot *snapshot, Pvnet *pvnet);
+
+#endif
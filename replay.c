@@ -0,0 +1,356 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "replay.h"
+#include "emulator_functions.h"
+#include "machine.h"
+#include "kbd.h"
+#include "util.h"
+
+#define REPLAY_MAGIC "DAX86REC"
+#define REPLAY_MAGIC_SIZE 8
+
+/* Logs written by the exit handler */
+static Replay *exit_replays = NULL;
+static pthread_mutex_t exit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *event_names[] = {"", "input", "timer", "disk"};
+
+static void write_buffer(Replay *replay, const uint8_t *buf, uint32_t size, uint64_t offset)
+{
+    if (size > 0 && pwrite(replay->fd, buf, size, offset) != (ssize_t)size)
+        printf("Replay log write failed.\n");
+}
+
+static void *log_loop(void *ptr)
+{
+    Replay *replay = (Replay *)ptr;
+    pthread_mutex_lock(&replay->lock);
+    while (1)
+    {
+        while (replay->active_used == 0 && !replay->quit)
+            pthread_cond_wait(&replay->work, &replay->lock);
+        if (replay->active_used == 0)
+            break;
+        if (replay->active_used < REPLAY_BUFFER_SIZE / 2 && !replay->quit)
+        {
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_nsec += REPLAY_DELAY_MS * 1000000;
+            if (until.tv_nsec >= 1000000000)
+            {
+                until.tv_sec += 1;
+                until.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&replay->work, &replay->lock, &until);
+        }
+
+        uint8_t *buf = replay->active;
+        replay->active = replay->flushing;
+        replay->flushing = buf;
+        replay->flushing_used = replay->active_used;
+        replay->flushing_offset = replay->active_offset;
+        replay->active_offset += replay->active_used;
+        replay->active_used = 0;
+        pthread_mutex_unlock(&replay->lock);
+
+        write_buffer(replay, replay->flushing, replay->flushing_used, replay->flushing_offset);
+
+        pthread_mutex_lock(&replay->lock);
+        replay->flushing_used = 0;
+        pthread_cond_broadcast(&replay->done);
+    }
+    pthread_mutex_unlock(&replay->lock);
+    return NULL;
+}
+
+/*
+ * Runs at exit, possibly from a signal handler interrupting the CPU
+ * thread inside append_record, so the lock is not taken. Each buffer
+ * goes to its own offset: a buffer in flight is just written twice.
+ */
+static void write_at_exit(void)
+{
+    Replay *replay;
+    for (replay = exit_replays; replay != NULL; replay = replay->exit_next)
+    {
+        write_buffer(replay, replay->flushing, replay->flushing_used, replay->flushing_offset);
+        write_buffer(replay, replay->active, replay->active_used, replay->active_offset);
+        fdatasync(replay->fd);
+    }
+}
+
+static Replay *new_replay(Machine *machine, int fd, int recording)
+{
+    Replay *replay = calloc(1, sizeof(Replay));
+    replay->machine = machine;
+    replay->fd = fd;
+    replay->recording = recording;
+    replay->posted_length = -1;
+    return replay;
+}
+
+Replay *open_record(Machine *machine, const char *path)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        printf("Could not create replay log: %s\n", path);
+        panic();
+    }
+
+    Replay *replay = new_replay(machine, fd, 1);
+    pthread_mutex_init(&replay->lock, NULL);
+    pthread_cond_init(&replay->work, NULL);
+    pthread_cond_init(&replay->done, NULL);
+    pthread_cond_init(&replay->taken, NULL);
+    replay->active = malloc(REPLAY_BUFFER_SIZE);
+    replay->flushing = malloc(REPLAY_BUFFER_SIZE);
+    memcpy(replay->active, REPLAY_MAGIC, REPLAY_MAGIC_SIZE);
+    replay->active_used = REPLAY_MAGIC_SIZE;
+    replay->last_icount = machine->emu->icount;
+    pthread_create(&replay->thread, NULL, log_loop, (void *)replay);
+
+    pthread_mutex_lock(&exit_lock);
+    if (exit_replays == NULL)
+        atexit(write_at_exit);
+    replay->exit_next = exit_replays;
+    exit_replays = replay;
+    pthread_mutex_unlock(&exit_lock);
+    return replay;
+}
+
+/* Reads the LEB128 number at *p, 0 if the log ends in it. */
+static int read_number(const uint8_t **p, const uint8_t *end, uint64_t *value)
+{
+    int shift = 0;
+    *value = 0;
+    while (*p < end && shift < 64)
+    {
+        uint8_t byte = *(*p)++;
+        *value |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+            return 1;
+        shift += 7;
+    }
+    return 0;
+}
+
+/* Skips to the next event of type REPLAY_KBD (input) or another (checkpoint). */
+static uint32_t next_event(Replay *replay, uint32_t index, int input)
+{
+    while (index < replay->event_count && (replay->events[index].type == REPLAY_KBD) != input)
+        index++;
+    return index;
+}
+
+static void bad_log(const char *path)
+{
+    printf("Not a replay log: %s\n", path);
+    panic();
+}
+
+Replay *open_replay(Machine *machine, const char *path)
+{
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        printf("Could not open replay log: %s\n", path);
+        panic();
+    }
+
+    Replay *replay = new_replay(machine, fd, 0);
+    replay->data = malloc(st.st_size > 0 ? st.st_size : 1);
+    if (read(fd, replay->data, st.st_size) != st.st_size || st.st_size < REPLAY_MAGIC_SIZE ||
+        memcmp(replay->data, REPLAY_MAGIC, REPLAY_MAGIC_SIZE) != 0)
+        bad_log(path);
+
+    const uint8_t *p = replay->data + REPLAY_MAGIC_SIZE;
+    const uint8_t *end = replay->data + st.st_size;
+    uint64_t icount = machine->emu->icount;
+    uint32_t capacity = 0;
+    while (p < end)
+    {
+        uint8_t type = *p++;
+        uint64_t delta;
+        if (type < REPLAY_KBD || type > REPLAY_DISK || !read_number(&p, end, &delta))
+            bad_log(path);
+        if (replay->event_count == capacity)
+        {
+            capacity = capacity != 0 ? capacity * 2 : 1024;
+            replay->events = realloc(replay->events, capacity * sizeof(ReplayEvent));
+        }
+        ReplayEvent *event = &replay->events[replay->event_count++];
+        icount += delta;
+        event->icount = icount;
+        event->type = type;
+        event->length = 0;
+        if (type == REPLAY_KBD)
+        {
+            if (p >= end || *p > end - p - 1)
+                bad_log(path);
+            event->length = *p++;
+            event->offset = p - replay->data;
+            p += event->length;
+        }
+    }
+    replay->next_input = next_event(replay, 0, 1);
+    return replay;
+}
+
+void close_replay(Replay *replay)
+{
+    if (replay->recording)
+    {
+        pthread_mutex_lock(&replay->lock);
+        replay->quit = 1;
+        pthread_cond_signal(&replay->work);
+        pthread_mutex_unlock(&replay->lock);
+        pthread_join(replay->thread, NULL);
+
+        pthread_mutex_lock(&exit_lock);
+        Replay **link = &exit_replays;
+        while (*link != replay)
+            link = &(*link)->exit_next;
+        *link = replay->exit_next;
+        pthread_mutex_unlock(&exit_lock);
+
+        fdatasync(replay->fd);
+        free(replay->active);
+        free(replay->flushing);
+        pthread_mutex_destroy(&replay->lock);
+        pthread_cond_destroy(&replay->work);
+        pthread_cond_destroy(&replay->done);
+        pthread_cond_destroy(&replay->taken);
+    }
+    close(replay->fd);
+    free(replay->data);
+    free(replay->events);
+    free(replay);
+}
+
+/* CPU thread only. Waits for the log thread if both buffers are full. */
+static void append_record(Replay *replay, Emulator *emu, int type, const uint8_t *bytes, int length)
+{
+    uint8_t record[1 + 10 + 1 + 256];
+    uint64_t delta = emu->icount - replay->last_icount;
+    uint32_t size = 0;
+    replay->last_icount = emu->icount;
+
+    record[size++] = type;
+    do
+    {
+        uint8_t byte = delta & 0x7F;
+        delta >>= 7;
+        record[size++] = byte | (delta != 0 ? 0x80 : 0);
+    } while (delta != 0);
+    if (type == REPLAY_KBD)
+    {
+        record[size++] = length;
+        memcpy(record + size, bytes, length);
+        size += length;
+    }
+
+    pthread_mutex_lock(&replay->lock);
+    while (replay->active_used + size > REPLAY_BUFFER_SIZE)
+    {
+        pthread_cond_signal(&replay->work);
+        pthread_cond_wait(&replay->done, &replay->lock);
+    }
+    memcpy(replay->active + replay->active_used, record, size);
+    replay->active_used += size;
+    /* The log thread waits for the first record, then for half a buffer. */
+    if (replay->active_used == size || replay->active_used >= REPLAY_BUFFER_SIZE / 2)
+        pthread_cond_signal(&replay->work);
+    pthread_mutex_unlock(&replay->lock);
+}
+
+/* The kbd thread is cancelled by destroy_kbd while it waits. */
+static void unlock_replay(void *arg)
+{
+    pthread_mutex_unlock(&((Replay *)arg)->lock);
+}
+
+void post_input(Replay *replay, const uint8_t *bytes, int length)
+{
+    pthread_mutex_lock(&replay->lock);
+    pthread_cleanup_push(unlock_replay, replay);
+    if (length > 0)
+        memcpy(replay->posted, bytes, length);
+    replay->posted_length = length;
+    raise_attention(replay->machine->emu, ATTENTION_INPUT);
+    while (replay->posted_length >= 0)
+        pthread_cond_wait(&replay->taken, &replay->lock);
+    pthread_cleanup_pop(1);
+}
+
+void take_input(Replay *replay, Emulator *emu)
+{
+    uint8_t bytes[256];
+    pthread_mutex_lock(&replay->lock);
+    int length = replay->posted_length;
+    if (length > 0)
+        memcpy(bytes, replay->posted, length);
+    pthread_mutex_unlock(&replay->lock);
+    if (length < 0)
+        return;
+
+    append_record(replay, emu, REPLAY_KBD, bytes, length);
+    kbd_deliver(replay->machine->kbd, bytes, length);
+
+    pthread_mutex_lock(&replay->lock);
+    replay->posted_length = -1;
+    pthread_cond_signal(&replay->taken);
+    pthread_mutex_unlock(&replay->lock);
+}
+
+uint64_t replay_deadline(Replay *replay)
+{
+    if (replay->recording || replay->next_input >= replay->event_count)
+        return UINT64_MAX;
+    return replay->events[replay->next_input].icount;
+}
+
+void replay_inputs(Replay *replay, Emulator *emu)
+{
+    while (replay_deadline(replay) <= emu->icount)
+    {
+        ReplayEvent *event = &replay->events[replay->next_input];
+        kbd_deliver(replay->machine->kbd, replay->data + event->offset, event->length);
+        replay->next_input = next_event(replay, replay->next_input + 1, 1);
+    }
+}
+
+void replay_checkpoint(Replay *replay, Emulator *emu, int type)
+{
+    if (replay->recording)
+    {
+        append_record(replay, emu, type, NULL, 0);
+        return;
+    }
+    if (replay->diverged || replay->ended)
+        return;
+
+    replay->next_checkpoint = next_event(replay, replay->next_checkpoint, 0);
+    if (replay->next_checkpoint >= replay->event_count)
+    {
+        printf("Replay log ended at icount %llu.\n", (unsigned long long)emu->icount);
+        replay->ended = 1;
+        return;
+    }
+    ReplayEvent *event = &replay->events[replay->next_checkpoint++];
+    if (event->type != type || event->icount != emu->icount)
+    {
+        printf("Replay diverged at icount %llu: %s, the log has %s at icount %llu.\n",
+               (unsigned long long)emu->icount, event_names[type],
+               event_names[event->type], (unsigned long long)event->icount);
+        replay->diverged = 1;
+    }
+}
@@ -0,0 +1,106 @@
+#ifndef REPLAY_H_
+#define REPLAY_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "emulator.h"
+
+/*
+ * Record/replay of a run (-record, -replay)
+ * With -icount the LAPIC timer and the disk complete at instruction
+ * counts which only depend on the guest, so what is left to make a run
+ * reproducible is the host input: the keys. While recording, the kbd
+ * thread hands its bytes to the CPU thread (ATTENTION_INPUT), which
+ * stores them at the next instruction boundary and logs them with
+ * emu->icount. Replaying stores the logged bytes at the same counts
+ * and ignores the console input.
+ * Timer expirations and disk completions are logged as checkpoints:
+ * a replay which reaches a different one reports where it diverged.
+ *
+ * Log: "DAX86REC", then one record per event:
+ *   type (1 byte), icount since the previous record (LEB128),
+ *   for REPLAY_KBD the byte count (1 byte, 0: interrupt raised again)
+ *   and the bytes.
+ * The CPU thread fills a buffer, the log thread writes it out once half
+ * full or after REPLAY_DELAY_MS.
+ */
+#define REPLAY_KBD 1
+#define REPLAY_TIMER 2
+#define REPLAY_DISK 3
+
+#define REPLAY_BUFFER_SIZE 65536
+#define REPLAY_DELAY_MS 100
+
+typedef struct
+{
+    uint64_t icount;
+    uint8_t type;
+    uint8_t length;
+    /* Of the bytes in Replay.data */
+    uint32_t offset;
+} ReplayEvent;
+
+typedef struct Replay
+{
+    Machine *machine;
+    int fd;
+    int recording;
+
+    /* Recording; lock guards the buffers, posted and quit */
+    pthread_mutex_t lock;
+    /* work: to the log thread, done: a buffer was written, taken: posted was stored */
+    pthread_cond_t work;
+    pthread_cond_t done;
+    pthread_cond_t taken;
+    uint8_t *active;
+    uint32_t active_used;
+    uint8_t *flushing;
+    uint32_t flushing_used;
+    /* File offsets the buffers are written at */
+    uint64_t active_offset;
+    uint64_t flushing_offset;
+    /* icount of the last record, CPU thread only */
+    uint64_t last_icount;
+    /* Bytes from the kbd thread until the CPU thread stores them, -1: none */
+    uint8_t posted[256];
+    int posted_length;
+    int quit;
+    pthread_t thread;
+    struct Replay *exit_next;
+
+    /* Replaying */
+    uint8_t *data;
+    ReplayEvent *events;
+    uint32_t event_count;
+    /* Next REPLAY_KBD event and next checkpoint */
+    uint32_t next_input;
+    uint32_t next_checkpoint;
+    int diverged;
+    int ended;
+} Replay;
+
+/* Starts a log at path for machine (one vCPU). Ends the process if it can not be created. */
+Replay *open_record(Machine *machine, const char *path);
+/* Loads the log at path. Ends the process if it is not one. */
+Replay *open_replay(Machine *machine, const char *path);
+/* Writes everything out (recording) and frees replay. */
+void close_replay(Replay *replay);
+
+/*
+ * Recording, on the kbd thread: hands length bytes (0: raise the
+ * interrupt again) to the CPU thread, returns once they are stored.
+ */
+void post_input(Replay *replay, const uint8_t *bytes, int length);
+/* Recording, at ATTENTION_INPUT: stores and logs the posted bytes. */
+void take_input(Replay *replay, Emulator *emu);
+
+/* Replaying: icount of the next input, UINT64_MAX if none is left */
+uint64_t replay_deadline(Replay *replay);
+/* Replaying: stores the inputs logged up to emu->icount. */
+void replay_inputs(Replay *replay, Emulator *emu);
+
+/* Logs the checkpoint (REPLAY_TIMER, REPLAY_DISK), or checks it against the log. */
+void replay_checkpoint(Replay *replay, Emulator *emu, int type);
+
+#endif
@@ -0,0 +1,299 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sched.h"
+#include "machine.h"
+#include "cpu.h"
+#include "util.h"
+
+/*
+ * Guards Machine.scheduled.scheduler against unschedule_machine, so a
+ * device thread waking the machine then does not use a freed scheduler.
+ */
+static pthread_mutex_t wake_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void push(RunQueue *queue, Scheduled *scheduled)
+{
+    scheduled->next = NULL;
+    if (queue->tail != NULL)
+        queue->tail->next = scheduled;
+    else
+        queue->head = scheduled;
+    queue->tail = scheduled;
+}
+
+static Scheduled *pop(RunQueue *queue)
+{
+    Scheduled *scheduled = queue->head;
+    if (scheduled != NULL)
+    {
+        queue->head = scheduled->next;
+        if (queue->head == NULL)
+            queue->tail = NULL;
+    }
+    return scheduled;
+}
+
+/* With lock held */
+static void enqueue(Scheduler *scheduler, Scheduled *scheduled)
+{
+    scheduled->state = SCHED_QUEUED;
+    push(&scheduler->queues[scheduled->worker], scheduled);
+    pthread_cond_signal(&scheduler->work);
+}
+
+static void refill(Scheduled *scheduled, uint64_t now)
+{
+    int64_t burst = SCHED_BURST_NS * scheduled->quota / 100;
+    scheduled->budget_ns += (int64_t)(now - scheduled->refilled) * scheduled->quota / 100;
+    if (scheduled->budget_ns > burst)
+        scheduled->budget_ns = burst;
+    scheduled->refilled = now;
+}
+
+/* Queues the throttled machines with budget again, returns when the earliest of the others has. */
+static uint64_t release_throttled(Scheduler *scheduler, uint64_t now)
+{
+    Scheduled **link = &scheduler->throttled;
+    uint64_t earliest = UINT64_MAX;
+    while (*link != NULL)
+    {
+        Scheduled *scheduled = *link;
+        if (scheduled->resume <= now)
+        {
+            *link = scheduled->next;
+            refill(scheduled, now);
+            enqueue(scheduler, scheduled);
+            continue;
+        }
+        if (scheduled->resume < earliest)
+            earliest = scheduled->resume;
+        link = &scheduled->next;
+    }
+    return earliest;
+}
+
+/* Own queue first, then the others' from the next worker on; NULL on quit. */
+static Scheduled *next_machine(Scheduler *scheduler, int worker)
+{
+    pthread_mutex_lock(&scheduler->lock);
+    while (!scheduler->quit)
+    {
+        uint64_t resume = release_throttled(scheduler, monotonic_ns());
+        int i;
+        for (i = 0; i < scheduler->worker_count; i++)
+        {
+            Scheduled *scheduled = pop(&scheduler->queues[(worker + i) % scheduler->worker_count]);
+            if (scheduled != NULL)
+            {
+                scheduled->state = SCHED_RUNNING;
+                scheduled->worker = worker;
+                pthread_mutex_unlock(&scheduler->lock);
+                return scheduled;
+            }
+        }
+        if (resume == UINT64_MAX)
+        {
+            pthread_cond_wait(&scheduler->work, &scheduler->lock);
+        }
+        else
+        {
+            struct timespec until;
+            until.tv_sec = resume / 1000000000;
+            until.tv_nsec = resume % 1000000000;
+            pthread_cond_timedwait(&scheduler->work, &scheduler->lock, &until);
+        }
+    }
+    pthread_mutex_unlock(&scheduler->lock);
+    return NULL;
+}
+
+/* Host CPU time of the calling worker, which does not count while it is preempted */
+static uint64_t thread_cpu_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* Where the machine goes after a slice which used ns of CPU time and ended for reason */
+static void end_slice(Scheduler *scheduler, Scheduled *scheduled, int reason, uint64_t ns)
+{
+    Emulator *emu = scheduled->machine->emu;
+    uint64_t now = monotonic_ns();
+    pthread_mutex_lock(&scheduler->lock);
+    scheduled->cpu_ns += ns;
+    if (scheduled->quota != 0)
+    {
+        refill(scheduled, now);
+        scheduled->budget_ns -= ns;
+    }
+    switch (reason)
+    {
+    case RUN_LIMIT:
+        if (scheduled->quota != 0 && scheduled->budget_ns < 0)
+        {
+            /* Until the refill pays back what the slice overran */
+            scheduled->resume = now + (uint64_t)(-scheduled->budget_ns) * 100 / scheduled->quota;
+            scheduled->state = SCHED_THROTTLED;
+            scheduled->next = scheduler->throttled;
+            scheduler->throttled = scheduled;
+            /* An idle worker waits until then */
+            pthread_cond_signal(&scheduler->work);
+        }
+        else
+        {
+            enqueue(scheduler, scheduled);
+        }
+        break;
+    case RUN_HALT:
+        scheduled->state = SCHED_PARKED;
+        /* Raised before it was parked: wake_scheduled saw it running. */
+        if (__atomic_load_n(&emu->attention, __ATOMIC_SEQ_CST) & ATTENTION_WAKE)
+            enqueue(scheduler, scheduled);
+        break;
+    default:
+        scheduled->state = SCHED_DONE;
+        scheduled->exit_reason = reason;
+        pthread_cond_broadcast(&scheduler->done);
+        break;
+    }
+    pthread_mutex_unlock(&scheduler->lock);
+}
+
+typedef struct
+{
+    Scheduler *scheduler;
+    int worker;
+} WorkerArg;
+
+static void *worker_loop(void *ptr)
+{
+    WorkerArg *arg = (WorkerArg *)ptr;
+    Scheduler *scheduler = arg->scheduler;
+    int worker = arg->worker;
+    Scheduled *scheduled;
+    free(arg);
+
+    while ((scheduled = next_machine(scheduler, worker)) != NULL)
+    {
+        uint64_t start = thread_cpu_ns();
+        int reason;
+        emu_run(scheduled->machine->emu, SCHED_SLICE_INSNS, &reason);
+        end_slice(scheduler, scheduled, reason, thread_cpu_ns() - start);
+    }
+    return NULL;
+}
+
+Scheduler *create_scheduler(int workers)
+{
+    Scheduler *scheduler = calloc(1, sizeof(Scheduler));
+    pthread_condattr_t attr;
+    int i;
+    if (workers <= 0)
+        workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers <= 0)
+        workers = 1;
+
+    pthread_mutex_init(&scheduler->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&scheduler->work, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_cond_init(&scheduler->done, NULL);
+    scheduler->worker_count = workers;
+    scheduler->queues = calloc(workers, sizeof(RunQueue));
+    scheduler->threads = calloc(workers, sizeof(pthread_t));
+    for (i = 0; i < workers; i++)
+    {
+        WorkerArg *arg = malloc(sizeof(WorkerArg));
+        arg->scheduler = scheduler;
+        arg->worker = i;
+        pthread_create(&scheduler->threads[i], NULL, worker_loop, (void *)arg);
+    }
+    return scheduler;
+}
+
+void destroy_scheduler(Scheduler *scheduler)
+{
+    int i;
+    pthread_mutex_lock(&scheduler->lock);
+    scheduler->quit = 1;
+    pthread_cond_broadcast(&scheduler->work);
+    pthread_mutex_unlock(&scheduler->lock);
+    for (i = 0; i < scheduler->worker_count; i++)
+        pthread_join(scheduler->threads[i], NULL);
+
+    pthread_mutex_destroy(&scheduler->lock);
+    pthread_cond_destroy(&scheduler->work);
+    pthread_cond_destroy(&scheduler->done);
+    free(scheduler->queues);
+    free(scheduler->threads);
+    free(scheduler);
+}
+
+int schedule_machine(Scheduler *scheduler, Machine *machine, int quota)
+{
+    Scheduled *scheduled = &machine->scheduled;
+    if (machine->cpu_count != 1 || scheduled->scheduler != NULL)
+        return -1;
+
+    pthread_mutex_lock(&wake_lock);
+    pthread_mutex_lock(&scheduler->lock);
+    scheduled->scheduler = scheduler;
+    scheduled->machine = machine;
+    scheduled->quota = quota;
+    scheduled->budget_ns = SCHED_BURST_NS * quota / 100;
+    scheduled->refilled = monotonic_ns();
+    scheduled->cpu_ns = 0;
+    /* Spread over the workers, stealing evens out the rest */
+    scheduled->worker = scheduler->next_worker++ % scheduler->worker_count;
+    enqueue(scheduler, scheduled);
+    pthread_mutex_unlock(&scheduler->lock);
+    pthread_mutex_unlock(&wake_lock);
+    return 0;
+}
+
+int unschedule_machine(Scheduler *scheduler, Machine *machine)
+{
+    Scheduled *scheduled = &machine->scheduled;
+    pthread_mutex_lock(&scheduler->lock);
+    while (scheduled->state != SCHED_DONE)
+        pthread_cond_wait(&scheduler->done, &scheduler->lock);
+    pthread_mutex_unlock(&scheduler->lock);
+
+    /* A done machine is not queued again, so wake_scheduled only has to be kept off the scheduler. */
+    pthread_mutex_lock(&wake_lock);
+    scheduled->scheduler = NULL;
+    pthread_mutex_unlock(&wake_lock);
+    return scheduled->exit_reason;
+}
+
+uint64_t scheduled_cpu_ns(Machine *machine)
+{
+    Scheduler *scheduler = machine->scheduled.scheduler;
+    uint64_t ns;
+    if (scheduler == NULL)
+        return machine->scheduled.cpu_ns;
+    pthread_mutex_lock(&scheduler->lock);
+    ns = machine->scheduled.cpu_ns;
+    pthread_mutex_unlock(&scheduler->lock);
+    return ns;
+}
+
+void wake_scheduled(Machine *machine)
+{
+    Scheduled *scheduled = &machine->scheduled;
+    pthread_mutex_lock(&wake_lock);
+    Scheduler *scheduler = scheduled->scheduler;
+    if (scheduler != NULL)
+    {
+        pthread_mutex_lock(&scheduler->lock);
+        if (scheduled->state == SCHED_PARKED)
+            enqueue(scheduler, scheduled);
+        pthread_mutex_unlock(&scheduler->lock);
+    }
+    pthread_mutex_unlock(&wake_lock);
+}
@@ -0,0 +1,104 @@
+#ifndef SCHED_H_
+#define SCHED_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "emulator.h"
+
+/* Instructions per time slice, a few ms */
+#define SCHED_SLICE_INSNS 1000000
+/* A machine with a quota can run ahead by its share of this much host time */
+#define SCHED_BURST_NS 100000000ll
+
+enum ScheduledState
+{
+    /* On its worker's queue */
+    SCHED_QUEUED,
+    SCHED_RUNNING,
+    /* Halted, off the queues until raise_attention wakes it */
+    SCHED_PARKED,
+    /* Used up its quota, off the queues until Scheduled.resume */
+    SCHED_THROTTLED,
+    /* Stopped or ended, until unschedule_machine */
+    SCHED_DONE
+};
+
+/* How a Scheduler runs a machine (Machine.scheduled) */
+typedef struct Scheduled
+{
+    /* NULL while no scheduler runs the machine */
+    struct Scheduler *scheduler;
+    Machine *machine;
+    int state;
+    /* Worker whose queue it goes back to */
+    int worker;
+    /*
+     * Percent of one host CPU, 0: no limit. The budget (host ns it may
+     * run for) is refilled at quota percent of the host time passing
+     * and goes below 0 by the slice which used it up.
+     */
+    int quota;
+    int64_t budget_ns;
+    uint64_t refilled;
+    uint64_t resume;
+    /* Host CPU time of its slices */
+    uint64_t cpu_ns;
+    /* RunExit once SCHED_DONE */
+    int exit_reason;
+    /* Next on its queue, or of the throttled machines */
+    struct Scheduled *next;
+} Scheduled;
+
+typedef struct
+{
+    Scheduled *head;
+    Scheduled *tail;
+} RunQueue;
+
+/*
+ * Scheduler
+ * Runs machines of one vCPU in slices on a pool of worker threads.
+ * Each worker runs the machines of its own queue round-robin and
+ * steals from the others' queues once its own is empty, so a machine
+ * keeps to one worker while the load is even.
+ * A halted machine is parked instead of sleeping on its worker: emu_run
+ * returns RUN_HALT, and raise_attention (an interrupt, the disk,
+ * dax86_stop) queues it again on its worker.
+ * Slices are milliseconds, so one lock for the queues and the states
+ * is not contended.
+ */
+typedef struct Scheduler
+{
+    pthread_mutex_t lock;
+    /* work: to idle workers, done: a machine stopped */
+    pthread_cond_t work;
+    pthread_cond_t done;
+    int worker_count;
+    pthread_t *threads;
+    RunQueue *queues;
+    Scheduled *throttled;
+    /* Worker the next machine scheduled starts on */
+    int next_worker;
+    int quit;
+} Scheduler;
+
+/* workers: host threads, 0 for one per host CPU */
+Scheduler *create_scheduler(int workers);
+/* Once every machine was unscheduled: stops the workers and frees scheduler. */
+void destroy_scheduler(Scheduler *scheduler);
+
+/* Runs machine on the workers from now on; -1 if it has more than one vCPU or a scheduler. */
+int schedule_machine(Scheduler *scheduler, Machine *machine, int quota);
+/*
+ * Waits until machine stopped (ATTENTION_STOP) or ended and takes it off
+ * the scheduler; it can be run again. Returns the RunExit.
+ */
+int unschedule_machine(Scheduler *scheduler, Machine *machine);
+/* Host CPU time (ns) machine ran for on the workers */
+uint64_t scheduled_cpu_ns(Machine *machine);
+
+/* From raise_attention on the halted CPU of a scheduled machine */
+void wake_scheduled(Machine *machine);
+
+#endif
@@ -0,0 +1,408 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "script.h"
+#include "kbd.h"
+#include "machine.h"
+#include "console.h"
+#include "util.h"
+
+static const struct
+{
+    const char *name;
+    enum ScriptCommand command;
+    /* Takes a text, else a number */
+    int text;
+} commands[] = {
+    {"expect", SCRIPT_EXPECT, 1},
+    {"send", SCRIPT_SEND, 1},
+    {"fail", SCRIPT_FAIL, 1},
+    {"timeout", SCRIPT_TIMEOUT, 0},
+    {"sleep", SCRIPT_SLEEP, 0},
+    {"exit", SCRIPT_EXIT, 0},
+};
+
+/* Decodes the escapes of text into step. Returns 0 if it is empty or too long. */
+static int parse_text(ScriptStep *step, const char *text)
+{
+    step->length = 0;
+    while (*text != '\0')
+    {
+        uint8_t c = *text++;
+        if (c == '\\' && *text != '\0')
+        {
+            switch (*text++)
+            {
+            case 'n':
+                c = '\n';
+                break;
+            case 'r':
+                c = '\r';
+                break;
+            case 't':
+                c = '\t';
+                break;
+            case 'e':
+                c = 0x1B;
+                break;
+            default:
+                c = text[-1];
+                break;
+            }
+        }
+        if (step->length == SCRIPT_MAX_TEXT)
+            return 0;
+        step->text[step->length++] = c;
+    }
+    return step->length > 0;
+}
+
+/* Returns 0 if line is not a command. */
+static int parse_step(ScriptStep *step, char *line)
+{
+    char *argument = strchr(line, ' ');
+    char *end;
+    uint32_t i;
+    if (argument == NULL)
+        return 0;
+    *argument++ = '\0';
+    for (i = 0; i < sizeof(commands) / sizeof(commands[0]); i++)
+    {
+        if (strcmp(line, commands[i].name) != 0)
+            continue;
+        step->command = commands[i].command;
+        if (commands[i].text)
+            return parse_text(step, argument);
+        step->value = strtoul(argument, &end, 0);
+        return end != argument && *end == '\0';
+    }
+    return 0;
+}
+
+static void read_script(Script *script, const char *path)
+{
+    FILE *file = fopen(path, "r");
+    char *line = NULL;
+    size_t capacity = 0;
+    uint32_t allocated = 16;
+    uint32_t number = 0;
+    ssize_t length;
+    if (file == NULL)
+    {
+        printf("Could not open script: %s\n", path);
+        panic();
+    }
+    script->steps = malloc(allocated * sizeof(ScriptStep));
+    while ((length = getline(&line, &capacity, file)) >= 0)
+    {
+        number++;
+        while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+            line[--length] = '\0';
+        if (length == 0 || line[0] == '#')
+            continue;
+        if (script->step_count == allocated)
+        {
+            allocated *= 2;
+            script->steps = realloc(script->steps, allocated * sizeof(ScriptStep));
+        }
+        ScriptStep *step = &script->steps[script->step_count];
+        memset(step, 0, sizeof(*step));
+        step->line = number;
+        if (!parse_step(step, line))
+        {
+            printf("Script %s line %u: not a command.\n", path, number);
+            panic();
+        }
+        if (step->command == SCRIPT_FAIL && ++script->fail_count > SCRIPT_MAX_FAILS)
+        {
+            printf("Script %s line %u: more than %d fail texts.\n", path, number, SCRIPT_MAX_FAILS);
+            panic();
+        }
+        script->step_count++;
+    }
+    script->fail_count = 0;
+    free(line);
+    fclose(file);
+}
+
+Script *init_script(Machine *machine, const char *path)
+{
+    Script *script = calloc(1, sizeof(Script));
+    int fds[2];
+    pthread_condattr_t attr;
+    read_script(script, path);
+    if (pipe(fds) != 0)
+    {
+        printf("Could not create script input.\n");
+        panic();
+    }
+    script->emu = machine->emu;
+    script->kbd = machine->kbd;
+    script->input_fd = fds[1];
+    set_kbd_input(machine->kbd, fds[0], NULL);
+    pthread_mutex_init(&script->lock, NULL);
+    /* Deadlines are monotonic_ns. */
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&script->matched_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    machine->script = script;
+    return script;
+}
+
+/* Whether the output ends with step. lock has to be held. */
+static int ends_with(Script *script, const ScriptStep *step)
+{
+    return script->window_used >= step->length &&
+           memcmp(script->window + script->window_used - step->length, step->text, step->length) == 0;
+}
+
+void script_output(Script *script, uint8_t c)
+{
+    int i;
+    pthread_mutex_lock(&script->lock);
+    if (script->window_used == SCRIPT_WINDOW)
+    {
+        memmove(script->window, script->window + SCRIPT_WINDOW / 2, SCRIPT_WINDOW / 2);
+        script->window_used = SCRIPT_WINDOW / 2;
+    }
+    script->window[script->window_used++] = c;
+    for (i = 0; i < script->fail_count && script->failed == NULL; i++)
+    {
+        if (ends_with(script, script->fails[i]))
+        {
+            script->failed = script->fails[i];
+            pthread_cond_broadcast(&script->matched_cond);
+        }
+    }
+    if (script->expecting != NULL && !script->matched && ends_with(script, script->expecting))
+    {
+        script->matched = 1;
+        script->window_used = 0;
+        pthread_cond_broadcast(&script->matched_cond);
+    }
+    pthread_mutex_unlock(&script->lock);
+}
+
+/* Conditions of a wait, lock has to be held. */
+static int expect_matched(Script *script)
+{
+    return script->matched;
+}
+
+static int input_read(Script *script)
+{
+    return kbd_input_read(script->kbd, script->sent);
+}
+
+/*
+ * Waits until ready (NULL: only the timeout), the script failed or it
+ * is stopped. poll: ready is not signaled, it is looked at every ms.
+ */
+static enum ScriptResult wait_for(Script *script, int (*ready)(Script *), uint32_t timeout_ms, int poll)
+{
+    uint64_t start = monotonic_ns();
+    uint64_t deadline = timeout_ms > 0 ? start + (uint64_t)timeout_ms * 1000000 : UINT64_MAX;
+    enum ScriptResult result;
+    pthread_mutex_lock(&script->lock);
+    while (1)
+    {
+        if (script->quit)
+        {
+            result = SCRIPT_STOPPED;
+            break;
+        }
+        if (script->failed != NULL)
+        {
+            result = SCRIPT_FAILED;
+            break;
+        }
+        if (ready != NULL && ready(script))
+        {
+            result = SCRIPT_DONE;
+            break;
+        }
+        uint64_t now = monotonic_ns();
+        if (now >= deadline)
+        {
+            result = SCRIPT_TIMED_OUT;
+            break;
+        }
+        uint64_t until = poll && deadline - now > 1000000 ? now + 1000000 : deadline;
+        if (until == UINT64_MAX)
+        {
+            pthread_cond_wait(&script->matched_cond, &script->lock);
+            continue;
+        }
+        struct timespec ts = {until / 1000000000, until % 1000000000};
+        pthread_cond_timedwait(&script->matched_cond, &script->lock, &ts);
+    }
+    pthread_mutex_unlock(&script->lock);
+    uint64_t waited = monotonic_ns() - start;
+    script->wait_ns += waited;
+    if (waited > script->longest_wait_ns)
+    {
+        script->longest_wait_ns = waited;
+        script->longest_wait_line = script->at_line;
+    }
+    return result;
+}
+
+/* Looks for step in the output since the last match, then waits for it. */
+static enum ScriptResult expect(Script *script, const ScriptStep *step, uint32_t timeout_ms)
+{
+    uint32_t i;
+    pthread_mutex_lock(&script->lock);
+    script->matched = 0;
+    for (i = 0; i + step->length <= script->window_used; i++)
+    {
+        if (memcmp(script->window + i, step->text, step->length) == 0)
+        {
+            i += step->length;
+            memmove(script->window, script->window + i, script->window_used - i);
+            script->window_used -= i;
+            script->matched = 1;
+            break;
+        }
+    }
+    script->expecting = step;
+    pthread_mutex_unlock(&script->lock);
+
+    enum ScriptResult result = wait_for(script, expect_matched, timeout_ms, 0);
+    pthread_mutex_lock(&script->lock);
+    script->expecting = NULL;
+    pthread_mutex_unlock(&script->lock);
+    script->expects++;
+    return result;
+}
+
+/* Sends step once the guest read every key before, so it reads input again. */
+static enum ScriptResult send_text(Script *script, const ScriptStep *step, uint32_t timeout_ms)
+{
+    enum ScriptResult result = wait_for(script, input_read, timeout_ms, 1);
+    uint32_t done = 0;
+    if (result != SCRIPT_DONE)
+        return result;
+    while (done < step->length)
+    {
+        ssize_t n = write(script->input_fd, step->text + done, step->length - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return SCRIPT_STOPPED;
+        done += n;
+    }
+    script->sent += step->length;
+    script->sends++;
+    return SCRIPT_DONE;
+}
+
+static void *script_loop(void *arg)
+{
+    Script *script = arg;
+    uint32_t timeout_ms = SCRIPT_DEFAULT_TIMEOUT_MS;
+    uint32_t i;
+    enum ScriptResult result = SCRIPT_DONE;
+    script->status = 0;
+    for (i = 0; i < script->step_count && result == SCRIPT_DONE; i++)
+    {
+        const ScriptStep *step = &script->steps[i];
+        script->at_line = step->line;
+        switch (step->command)
+        {
+        case SCRIPT_EXPECT:
+            result = expect(script, step, timeout_ms);
+            break;
+        case SCRIPT_SEND:
+            result = send_text(script, step, timeout_ms);
+            break;
+        case SCRIPT_FAIL:
+            pthread_mutex_lock(&script->lock);
+            script->fails[script->fail_count++] = step;
+            pthread_mutex_unlock(&script->lock);
+            break;
+        case SCRIPT_TIMEOUT:
+            timeout_ms = step->value;
+            break;
+        case SCRIPT_SLEEP:
+            if (step->value > 0 && (result = wait_for(script, NULL, step->value, 0)) == SCRIPT_TIMED_OUT)
+                result = SCRIPT_DONE;
+            break;
+        case SCRIPT_EXIT:
+            script->status = step->value;
+            i = script->step_count;
+            break;
+        }
+    }
+    if (result == SCRIPT_TIMED_OUT || result == SCRIPT_FAILED)
+        script->status = 1;
+    else if (result == SCRIPT_STOPPED)
+        script->status = 2;
+    script->result = result;
+    script->end_ns = monotonic_ns();
+    /* Ends the run, the machine is not stopped again when it stopped first. */
+    if (result != SCRIPT_STOPPED)
+        raise_attention(script->emu, ATTENTION_STOP);
+    return NULL;
+}
+
+void start_script(Script *script)
+{
+    script->start_ns = monotonic_ns();
+    if (pthread_create(&script->thread, NULL, script_loop, script) != 0)
+    {
+        printf("Could not start script thread.\n");
+        panic();
+    }
+    script->started = 1;
+}
+
+static void stop_script(Script *script)
+{
+    if (!script->started)
+        return;
+    pthread_mutex_lock(&script->lock);
+    script->quit = 1;
+    pthread_cond_broadcast(&script->matched_cond);
+    pthread_mutex_unlock(&script->lock);
+    pthread_join(script->thread, NULL);
+    script->started = 0;
+}
+
+int finish_script(Script *script)
+{
+    int started = script->started;
+    stop_script(script);
+    if (!started)
+        return script->status;
+    /* The guest output comes before the results. */
+    flush_output_channels();
+    if (script->result == SCRIPT_TIMED_OUT)
+        printf("Script line %u: timed out.\n", script->at_line);
+    else if (script->result == SCRIPT_FAILED)
+        printf("Script line %u: the fail text of line %u was output.\n", script->at_line, script->failed->line);
+    else if (script->result == SCRIPT_STOPPED)
+        printf("Script line %u: the machine stopped.\n", script->at_line);
+    printf("Script: status %d in %.3f s, %u expects, %u sends, waited %.3f s (longest %.3f s at line %u), %lu instructions\n",
+           script->status, (script->end_ns - script->start_ns) / 1e9, script->expects, script->sends,
+           script->wait_ns / 1e9, script->longest_wait_ns / 1e9, script->longest_wait_line,
+           (unsigned long)script->emu->icount);
+    return script->status;
+}
+
+void destroy_script(Script *script)
+{
+    stop_script(script);
+    close(script->input_fd);
+    pthread_mutex_destroy(&script->lock);
+    pthread_cond_destroy(&script->matched_cond);
+    free(script->steps);
+    free(script);
+}
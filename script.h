@@ -0,0 +1,125 @@
+#ifndef SCRIPT_H_
+#define SCRIPT_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "emulator.h"
+
+/*
+ * Scripted session (-script file)
+ * Drives the guest console without a terminal: the keys sent go to the
+ * keyboard through a pipe, the bytes the guest writes to the serial port
+ * are matched as they are written (on the CPU thread).
+ * One command per line, # starts a comment line. Text is the rest of the
+ * line after the space, with the escapes \n \r \t \e \\.
+ * | expect text  | waits until text is in the output since the last match |
+ * | send text    | waits until the guest read the keys sent before (it    |
+ * |              | reads input again), then sends text                    |
+ * | fail text    | ends the script with status 1 whenever text is output  |
+ * |              | from here on (at most SCRIPT_MAX_FAILS)                |
+ * | timeout ms   | limit of the waits after it, 0: none                   |
+ * |              | (SCRIPT_DEFAULT_TIMEOUT_MS)                            |
+ * | sleep ms     | waits ms                                               |
+ * | exit status  | ends the script with status                            |
+ * When the script ends, the machine is stopped and the emulator exits
+ * with its status: 0 at the end of the file, 1 if a wait timed out or a
+ * fail text was output, 2 if the machine stopped first. A line with the
+ * timings is printed.
+ */
+#define SCRIPT_MAX_TEXT 256
+#define SCRIPT_MAX_FAILS 8
+/* Output kept for the next expect, the older half is dropped when full */
+#define SCRIPT_WINDOW 4096
+#define SCRIPT_DEFAULT_TIMEOUT_MS 10000
+
+enum ScriptCommand
+{
+    SCRIPT_EXPECT,
+    SCRIPT_SEND,
+    SCRIPT_FAIL,
+    SCRIPT_TIMEOUT,
+    SCRIPT_SLEEP,
+    SCRIPT_EXIT,
+};
+
+/* How a wait, and the script, ended */
+enum ScriptResult
+{
+    SCRIPT_DONE,
+    SCRIPT_TIMED_OUT,
+    SCRIPT_FAILED,
+    SCRIPT_STOPPED,
+};
+
+typedef struct
+{
+    enum ScriptCommand command;
+    /* Script line, for the messages */
+    uint32_t line;
+    /* expect, send, fail */
+    uint8_t text[SCRIPT_MAX_TEXT];
+    uint32_t length;
+    /* timeout, sleep, exit */
+    uint32_t value;
+} ScriptStep;
+
+typedef struct Script
+{
+    Emulator *emu;
+    struct KBD *kbd;
+    ScriptStep *steps;
+    uint32_t step_count;
+    /* Write end of the keyboard's pipe */
+    int input_fd;
+    /* Bytes sent so far */
+    uint64_t sent;
+
+    /* lock guards the matching state, matched is signaled when it changes. */
+    pthread_mutex_t lock;
+    pthread_cond_t matched_cond;
+    /* Output since the last match */
+    uint8_t window[SCRIPT_WINDOW];
+    uint32_t window_used;
+    /* Step being expected, NULL if none */
+    const ScriptStep *expecting;
+    int matched;
+    /* Fail steps so far */
+    const ScriptStep *fails[SCRIPT_MAX_FAILS];
+    int fail_count;
+    /* Fail step which was output, NULL if none */
+    const ScriptStep *failed;
+    int quit;
+
+    /* Exit status, how the script ended and at which line */
+    int status;
+    enum ScriptResult result;
+    uint32_t at_line;
+    /* Timings, monotonic_ns */
+    uint64_t start_ns;
+    uint64_t end_ns;
+    uint64_t wait_ns;
+    uint64_t longest_wait_ns;
+    uint32_t longest_wait_line;
+    uint32_t expects;
+    uint32_t sends;
+    int started;
+    pthread_t thread;
+} Script;
+
+/*
+ * Reads the file at path, creates machine->script and connects the
+ * keyboard to it (instead of stdin). Panics if the file can not be read
+ * or a line is not a command.
+ */
+Script *init_script(Machine *machine, const char *path);
+/* Starts the script thread, with the kbd thread. */
+void start_script(Script *script);
+/* On the CPU thread: byte c was written to the serial port. */
+void script_output(Script *script, uint8_t c);
+/* Once the BSP's emu_run returned: stops the thread, prints the timings and returns the exit status. */
+int finish_script(Script *script);
+/* Stops the thread and frees script. */
+void destroy_script(Script *script);
+
+#endif
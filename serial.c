@@ -0,0 +1,28 @@
+#include <stdint.h>
+
+#include "serial.h"
+#include "io.h"
+#include "machine.h"
+#include "script.h"
+
+/* Port handlers, device: the OutputChannel */
+static uint32_t read_serial_port(Emulator *emu, void *device, uint16_t address)
+{
+    if (address == SERIALLINESTA)
+        return SERIAL_LSR_TX_EMPTY;
+    return 0;
+}
+
+static void write_serial_port(Emulator *emu, void *device, uint16_t address, uint32_t value)
+{
+    channel_putc(device, value);
+    if (emu->machine->script != NULL)
+        script_output(emu->machine->script, value);
+}
+
+void init_serial(Machine *machine, OutputChannel *output)
+{
+    register_io_ports(machine->io, SERIALDATA, 1, 1, read_serial_port, write_serial_port, output);
+    register_io_ports(machine->io, SERIALDATA, 1, 4, read_serial_port, write_serial_port, output);
+    register_io_ports(machine->io, SERIALLINESTA, 1, 1, read_serial_port, NULL, output);
+}
@@ -0,0 +1,20 @@
+#ifndef SERIAL_H_
+#define SERIAL_H_
+
+#include "emulator.h"
+#include "console.h"
+
+/*
+ * Serial (COM1)
+ * 0x3f8: in|out: Data port (reads 0, no input)
+ * 0x3fd: in: Line status port (transmitter empty)
+ */
+#define SERIALDATA 0x3f8
+#define SERIALLINESTA 0x3fd
+
+#define SERIAL_LSR_TX_EMPTY 0x20
+
+/* Registers the ports on machine, bytes written to the data port go to output. */
+void init_serial(Machine *machine, OutputChannel *output);
+
+#endif
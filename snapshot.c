@@ -0,0 +1,272 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "snapshot.h"
+#include "emulator_functions.h"
+#include "cga.h"
+#include "disk.h"
+#include "ioapic.h"
+#include "kbd.h"
+#include "lapic.h"
+#include "machine.h"
+#include "paging.h"
+#include "pci.h"
+#include "pvblk.h"
+#include "pvnet.h"
+#include "util.h"
+
+#define PAGE_SIZE 0x1000
+
+void snapshot_data(Snapshot *snapshot, void *data, size_t size)
+{
+    size_t done = snapshot->restoring ? fread(data, 1, size, snapshot->file) : fwrite(data, 1, size, snapshot->file);
+    if (done != size)
+    {
+        printf("Could not %s snapshot.\n", snapshot->restoring ? "read" : "write");
+        panic();
+    }
+}
+
+/* Registers and the state of the CPU, caches are refilled after restore. */
+static void snapshot_cpu(Snapshot *snapshot, Emulator *emu)
+{
+    uint32_t halted = emu->attention & ATTENTION_HALT;
+    SNAPSHOT_FIELD(snapshot, emu->eflags);
+    SNAPSHOT_FIELD(snapshot, emu->lazy_flags);
+    SNAPSHOT_FIELD(snapshot, emu->registers);
+    SNAPSHOT_FIELD(snapshot, emu->segment_registers);
+    SNAPSHOT_FIELD(snapshot, emu->segment_caches);
+    SNAPSHOT_FIELD(snapshot, emu->control_registers);
+    SNAPSHOT_FIELD(snapshot, emu->eip);
+    SNAPSHOT_FIELD(snapshot, emu->gdtr);
+    SNAPSHOT_FIELD(snapshot, emu->idtr);
+    SNAPSHOT_FIELD(snapshot, emu->tr);
+    SNAPSHOT_FIELD(snapshot, emu->is_pe);
+    SNAPSHOT_FIELD(snapshot, emu->is_pg);
+    SNAPSHOT_FIELD(snapshot, emu->int_enabled);
+    SNAPSHOT_FIELD(snapshot, emu->icount);
+    SNAPSHOT_FIELD(snapshot, halted);
+    if (!snapshot->restoring)
+        return;
+    update_translation(emu);
+    tlb_flush(emu);
+    flush_fetch_window(emu);
+    /* Guest RAM was replaced without bumping page generations. */
+    flush_interrupt_caches(emu);
+    if (halted)
+        raise_attention(emu, ATTENTION_HALT);
+    /* IRR may hold requests from before the snapshot. */
+    raise_attention(emu, ATTENTION_INTERRUPT);
+}
+
+static int is_zero_page(const uint8_t *page)
+{
+    const uint64_t *words = (const uint64_t *)page;
+    int i;
+    for (i = 0; i < PAGE_SIZE / 8; i++)
+    {
+        if (words[i] != 0)
+            return 0;
+    }
+    return 1;
+}
+
+static uint64_t hash_page(const uint8_t *page)
+{
+    const uint64_t *words = (const uint64_t *)page;
+    uint64_t hash = 0xcbf29ce484222325ull;
+    int i;
+    for (i = 0; i < PAGE_SIZE / 8; i++)
+        hash = (hash ^ words[i]) * 0x100000001b3ull;
+    return hash;
+}
+
+/*
+ * Finds the index of each page's content, adding new contents to unique
+ * (page numbers of their first occurrence). Open addressing on the hash.
+ */
+static uint32_t dedup_pages(Emulator *emu, uint32_t *map, uint32_t *unique)
+{
+    uint32_t pages = emu->memory_size / PAGE_SIZE;
+    uint32_t table_size = 1;
+    uint32_t count = 0;
+    uint32_t page;
+    while (table_size < pages * 2)
+        table_size <<= 1;
+    /* Slot: index in unique + 1, 0 if empty */
+    uint32_t *table = calloc(table_size, sizeof(uint32_t));
+
+    for (page = 0; page < pages; page++)
+    {
+        uint8_t *content = emu->memory + (uint64_t)page * PAGE_SIZE;
+        if (is_zero_page(content))
+        {
+            map[page] = SNAPSHOT_ZERO_PAGE;
+            continue;
+        }
+        uint32_t slot = hash_page(content) & (table_size - 1);
+        while (table[slot] != 0 && memcmp(emu->memory + (uint64_t)unique[table[slot] - 1] * PAGE_SIZE, content, PAGE_SIZE) != 0)
+            slot = (slot + 1) & (table_size - 1);
+        if (table[slot] == 0)
+        {
+            unique[count++] = page;
+            table[slot] = count;
+        }
+        map[page] = table[slot] - 1;
+    }
+    free(table);
+    return count;
+}
+
+static void pad_to_page(Snapshot *snapshot)
+{
+    static uint8_t zeros[PAGE_SIZE];
+    long offset = ftell(snapshot->file);
+    if (offset % PAGE_SIZE != 0)
+        snapshot_data(snapshot, zeros, PAGE_SIZE - offset % PAGE_SIZE);
+}
+
+void snapshot_devices(Snapshot *snapshot, Emulator *emu)
+{
+    snapshot_cpu(snapshot, emu);
+    snapshot_lapic(snapshot, emu->lapic);
+    snapshot_ioapic(snapshot, emu->machine->ioapic);
+    snapshot_kbd(snapshot, emu->machine->kbd);
+    snapshot_disk(snapshot, emu->disk);
+    snapshot_pci(snapshot, emu->machine->pci);
+    snapshot_pvblk(snapshot, emu->machine->pvblk);
+    snapshot_pvnet(snapshot, emu->machine->pvnet);
+    snapshot_cga(snapshot, emu->machine->cga);
+}
+
+void save_snapshot(Emulator *emu, const char *path)
+{
+    uint32_t pages = emu->memory_size / PAGE_SIZE;
+    uint32_t *map = malloc(pages * sizeof(uint32_t));
+    uint32_t *unique = malloc(pages * sizeof(uint32_t));
+    uint32_t i;
+    Snapshot snapshot = {fopen(path, "wb"), 0, SNAPSHOT_FULL};
+    if (snapshot.file == NULL)
+    {
+        printf("Could not create snapshot: %s\n", path);
+        panic();
+    }
+
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.memory_size = emu->memory_size;
+    header.unique_pages = dedup_pages(emu, map, unique);
+    header.state_offset = sizeof(header);
+    SNAPSHOT_FIELD(&snapshot, header);
+
+    snapshot_devices(&snapshot, emu);
+    pad_to_page(&snapshot);
+    header.map_offset = ftell(snapshot.file);
+    snapshot_data(&snapshot, map, pages * sizeof(uint32_t));
+    pad_to_page(&snapshot);
+    header.pages_offset = ftell(snapshot.file);
+    for (i = 0; i < header.unique_pages; i++)
+        snapshot_data(&snapshot, emu->memory + (uint64_t)unique[i] * PAGE_SIZE, PAGE_SIZE);
+
+    fseek(snapshot.file, 0, SEEK_SET);
+    SNAPSHOT_FIELD(&snapshot, header);
+    if (fclose(snapshot.file) != 0)
+    {
+        printf("Could not write snapshot: %s\n", path);
+        panic();
+    }
+    free(map);
+    free(unique);
+}
+
+/*
+ * RAM of the snapshot: runs of pages whose contents are stored in order
+ * are mapped from the file at once, copies of a content seen before
+ * are copied (mapping each would take one host VMA per page).
+ */
+static void restore_memory(Emulator *emu, int fd, SnapshotHeader *header)
+{
+    uint32_t pages = emu->memory_size / PAGE_SIZE;
+    uint64_t map_size = (uint64_t)pages * sizeof(uint32_t);
+    uint64_t pages_size = (uint64_t)header->unique_pages * PAGE_SIZE;
+    uint32_t *map = malloc(map_size);
+    uint32_t next = 0;
+    uint32_t page = 0;
+    if (pread(fd, map, map_size, header->map_offset) != (ssize_t)map_size)
+    {
+        printf("Could not read snapshot memory.\n");
+        panic();
+    }
+    uint8_t *contents = pages_size > 0 ? mmap(NULL, pages_size, PROT_READ, MAP_PRIVATE, fd, header->pages_offset) : NULL;
+    if (contents == MAP_FAILED)
+    {
+        printf("Could not map snapshot memory.\n");
+        panic();
+    }
+
+    /* Zero pages are left as they are after this. */
+    madvise(emu->memory, emu->memory_size, MADV_DONTNEED);
+    while (page < pages)
+    {
+        if (map[page] == SNAPSHOT_ZERO_PAGE)
+        {
+            page++;
+            continue;
+        }
+        if (map[page] != next)
+        {
+            memcpy(emu->memory + (uint64_t)page * PAGE_SIZE, contents + (uint64_t)map[page] * PAGE_SIZE, PAGE_SIZE);
+            page++;
+            continue;
+        }
+        uint32_t run = 1;
+        while (page + run < pages && map[page + run] == next + run)
+            run++;
+        void *p = mmap(emu->memory + (uint64_t)page * PAGE_SIZE, (uint64_t)run * PAGE_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_FIXED, fd, header->pages_offset + (uint64_t)next * PAGE_SIZE);
+        if (p == MAP_FAILED)
+        {
+            printf("Could not map snapshot memory.\n");
+            panic();
+        }
+        page += run;
+        next += run;
+    }
+    if (contents != NULL)
+        munmap(contents, pages_size);
+    free(map);
+}
+
+void restore_snapshot(Emulator *emu, const char *path)
+{
+    Snapshot snapshot = {fopen(path, "rb"), 1, SNAPSHOT_FULL};
+    if (snapshot.file == NULL)
+    {
+        printf("Could not open snapshot: %s\n", path);
+        panic();
+    }
+    SnapshotHeader header;
+    SNAPSHOT_FIELD(&snapshot, header);
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 || header.version != SNAPSHOT_VERSION)
+    {
+        printf("Not a snapshot of this version: %s\n", path);
+        panic();
+    }
+    if (header.memory_size != emu->memory_size)
+    {
+        printf("Snapshot needs -m %uK.\n", header.memory_size >> 10);
+        panic();
+    }
+
+    restore_memory(emu, fileno(snapshot.file), &header);
+    fseek(snapshot.file, header.state_offset, SEEK_SET);
+    snapshot_devices(&snapshot, emu);
+    fclose(snapshot.file);
+}
@@ -0,0 +1,71 @@
+#ifndef SNAPSHOT_H_
+#define SNAPSHOT_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "emulator.h"
+
+/*
+ * <Snapshot file>
+ * | 0x0    | SnapshotHeader                                          |
+ * | state  | CPU and device state, in the order of save_snapshot     |
+ * | map    | uint32 per RAM page: index of its content in pages,     |
+ * |        | SNAPSHOT_ZERO_PAGE if it is all zero (page aligned)     |
+ * | pages  | distinct page contents, 4KB each (page aligned)         |
+ * Pages with the same content are stored once, so the guest's zeroed or
+ * junk-filled free memory takes no space. On restore the pages are
+ * mapped from the file (copy-on-write) instead of read.
+ * The disk image has to be the one the snapshot was taken with; sectors
+ * written to an -overlay are part of the snapshot.
+ */
+#define SNAPSHOT_MAGIC "DAX86SNP"
+#define SNAPSHOT_VERSION 3
+#define SNAPSHOT_ZERO_PAGE 0xFFFFFFFF
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t memory_size;
+    uint32_t unique_pages;
+    uint32_t reserved;
+    uint64_t state_offset;
+    uint64_t map_offset;
+    uint64_t pages_offset;
+} SnapshotHeader;
+
+/* What a Snapshot being written is for */
+enum SnapshotKind
+{
+    SNAPSHOT_FULL,
+    /* First checkpoint of a -checkpoint file: as SNAPSHOT_FULL */
+    SNAPSHOT_CHECKPOINT_BASE,
+    /* Later checkpoints: only the overlay sectors written since the last one */
+    SNAPSHOT_CHECKPOINT_DELTA
+};
+
+/*
+ * Devices list their state once in a function taking a Snapshot,
+ * which either writes or reads (restoring) each field.
+ */
+typedef struct Snapshot
+{
+    FILE *file;
+    int restoring;
+    /* enum SnapshotKind, when writing */
+    int kind;
+} Snapshot;
+
+void snapshot_data(Snapshot *snapshot, void *data, size_t size);
+#define SNAPSHOT_FIELD(snapshot, field) snapshot_data(snapshot, &(field), sizeof(field))
+
+/* CPU and device state (the state section), on the CPU thread with the disk idle. */
+void snapshot_devices(Snapshot *snapshot, Emulator *emu);
+
+/* On the CPU thread between instructions, with the disk idle. */
+void save_snapshot(Emulator *emu, const char *path);
+/* After the devices were created, instead of loading the boot sector. */
+void restore_snapshot(Emulator *emu, const char *path);
+
+#endif
@@ -0,0 +1,114 @@
+#include <stdint.h>
+#include <sched.h>
+
+#include "spin.h"
+#include "block_cache.h"
+#include "machine.h"
+#include "stats.h"
+#include "util.h"
+
+static void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+/* 1 once the same poll repeated SPIN_THRESHOLD times in a tight loop */
+static int repeated(Emulator *emu, int kind, uintptr_t key, uint32_t value)
+{
+    SpinDetector *spin = &emu->spin;
+    uint32_t eip = current_op_eip(emu);
+    uint64_t now = monotonic_ns();
+    if (spin->repeats > 0 && spin->kind == kind && spin->key == key && spin->value == value && spin->eip == eip &&
+        now - spin->last_ns < SPIN_GAP_NS)
+    {
+        spin->repeats++;
+    }
+    else
+    {
+        spin->kind = kind;
+        spin->key = key;
+        spin->value = value;
+        spin->eip = eip;
+        spin->repeats = 1;
+        spin->sleep_ns = SPIN_SLEEP_MIN_NS;
+    }
+    spin->last_ns = now;
+    return spin->repeats >= SPIN_THRESHOLD;
+}
+
+/* A scheduled machine leaves its worker to the others instead of waiting on it. */
+static int yield_slice(Emulator *emu)
+{
+    if (emu->machine->scheduled.scheduler == NULL)
+        return 0;
+    STAT_INC(stats.spin_yields);
+    raise_attention(emu, ATTENTION_YIELD);
+    return 1;
+}
+
+static void wait_for_wake(Emulator *emu)
+{
+    SpinDetector *spin = &emu->spin;
+    STAT_INC(stats.spin_waits);
+    wait_attention_for(emu, ATTENTION_WAKE, spin->sleep_ns);
+    if (spin->sleep_ns < SPIN_SLEEP_MAX_NS)
+        spin->sleep_ns *= 2;
+    /* The wait is not a gap in the loop. */
+    spin->last_ns = monotonic_ns();
+}
+
+static uint32_t load_word(void *word, int size)
+{
+    if (size == 1)
+        return __atomic_load_n((uint8_t *)word, __ATOMIC_RELAXED);
+    return __atomic_load_n((uint32_t *)word, __ATOMIC_RELAXED);
+}
+
+void spin_port(Emulator *emu, uint16_t port, uint32_t value)
+{
+    if (!config.spin_wait || config.icount || !repeated(emu, SPIN_PORT, port, value))
+        return;
+    if (!yield_slice(emu))
+        wait_for_wake(emu);
+}
+
+void spin_lock_word(Emulator *emu, void *word, int size, uint32_t value)
+{
+    if (!config.spin_wait || !repeated(emu, SPIN_LOCK, (uintptr_t)word, value) || yield_slice(emu))
+        return;
+    /* Only an interrupt handler can release it. */
+    if (emu->machine->cpu_count == 1)
+    {
+        if (!config.icount)
+            wait_for_wake(emu);
+        return;
+    }
+    STAT_INC(stats.spin_waits);
+    uint64_t until = monotonic_ns() + SPIN_LOCK_NS;
+    while (load_word(word, size) == value && __atomic_load_n(&emu->attention, __ATOMIC_RELAXED) == 0 &&
+           monotonic_ns() < until)
+        cpu_relax();
+    if (load_word(word, size) == value)
+        sched_yield();
+    emu->spin.last_ns = monotonic_ns();
+}
+
+void spin_pause(Emulator *emu)
+{
+    cpu_relax();
+    if (!config.spin_wait || !repeated(emu, SPIN_PAUSE, 0, 0) || yield_slice(emu))
+        return;
+    /* Waits for another vCPU, or for an interrupt. */
+    if (emu->machine->cpu_count > 1)
+    {
+        STAT_INC(stats.spin_waits);
+        sched_yield();
+        emu->spin.last_ns = monotonic_ns();
+    }
+    else if (!config.icount)
+    {
+        wait_for_wake(emu);
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef SPIN_H_
+#define SPIN_H_
+
+#include <stdint.h>
+
+#include "emulator.h"
+
+/*
+ * Spin-loop detection
+ * A vCPU busy-waiting gets the same value from the same op over and
+ * over: a device status port (in), a contended lock word (a locked
+ * xchg leaving it as it was), or PAUSE. After SPIN_THRESHOLD such
+ * polls, each within SPIN_GAP_NS of the last without a port write in
+ * between, the host thread stops burning CPU on it:
+ * - a scheduled machine ends its slice for the others (ATTENTION_YIELD);
+ * - a lock word of an SMP guest is watched on the host, with PAUSE,
+ *   until it changes or SPIN_LOCK_NS pass, then the thread yields;
+ * - anything else waits for an interrupt (ATTENTION_WAKE), from
+ *   SPIN_SLEEP_MIN_NS doubling up to SPIN_SLEEP_MAX_NS while the poll
+ *   keeps repeating.
+ * The guest runs the same instructions; what changes is that the host
+ * thread sleeps or yields instead of spinning, and guest wall-clock time
+ * can move on during that wait. With -icount it does not: time only
+ * moves with instructions, so only lock words of other vCPUs are waited
+ * for.
+ * -no-spin-wait turns it off.
+ */
+#define SPIN_THRESHOLD 32
+#define SPIN_GAP_NS 20000
+#define SPIN_LOCK_NS 50000
+#define SPIN_SLEEP_MIN_NS 10000
+#define SPIN_SLEEP_MAX_NS 1000000
+
+enum SpinKind
+{
+    SPIN_PORT = 1,
+    SPIN_LOCK,
+    SPIN_PAUSE
+};
+
+/* An in from port returned value. */
+void spin_port(Emulator *emu, uint16_t port, uint32_t value);
+/* A locked xchg found the word (size 1 or 4 bytes) at value and left it so. */
+void spin_lock_word(Emulator *emu, void *word, int size, uint32_t value);
+/* PAUSE (F3 90) */
+void spin_pause(Emulator *emu);
+
+/* A port write: the loop is doing work. */
+static inline void spin_reset(Emulator *emu)
+{
+    emu->spin.repeats = 0;
+}
+
+#endif
@@ -0,0 +1,62 @@
+#include <stdint.h>
+#include <stdio.h>
+
+#include "stats.h"
+#include "emulator_functions.h"
+
+Stats stats;
+
+void count_op(Emulator *emu, uint8_t op)
+{
+    if (op == 0x0F)
+        STAT_INC(stats.two_byte_ops[get_code8(emu, 1)]);
+    else
+        STAT_INC(stats.ops[op]);
+}
+
+static void print_table(const char *title, const char *format, uint64_t *counters, int size)
+{
+    int i;
+    printf("%s:\n", title);
+    for (i = 0; i < size; i++)
+    {
+        if (counters[i] == 0)
+            continue;
+        printf(format, i);
+        printf(" %llu\n", (unsigned long long)counters[i]);
+    }
+}
+
+void print_stats(void)
+{
+    uint64_t retired = 0;
+    int i;
+    for (i = 0; i < 256; i++)
+        retired += stats.ops[i] + stats.two_byte_ops[i];
+
+    printf("<Stats>\n");
+    printf("Instructions: %llu\n", (unsigned long long)retired);
+    print_table("Ops", "  %02X", stats.ops, 256);
+    print_table("Two-byte ops", "  0F %02X", stats.two_byte_ops, 256);
+    print_table("Interrupts", "  vector %3d", stats.interrupts, 256);
+    printf("Page walks: %llu\n", (unsigned long long)stats.page_walks);
+    printf("GDT reads: %llu\n", (unsigned long long)stats.gdt_reads);
+    printf("Blocks entered: %llu looked up, %llu chained, %llu returned to\n",
+           (unsigned long long)stats.block_lookups, (unsigned long long)stats.block_chains,
+           (unsigned long long)stats.block_returns);
+    printf("Spin loops: %llu waited in, %llu slices yielded\n", (unsigned long long)stats.spin_waits,
+           (unsigned long long)stats.spin_yields);
+    print_table("Port I/O", "  %04X", stats.ports, 0x10000);
+    printf("Disk sectors read: %llu\n", (unsigned long long)__atomic_load_n(&stats.disk_sectors_read, __ATOMIC_RELAXED));
+    printf("Disk sectors written: %llu\n", (unsigned long long)__atomic_load_n(&stats.disk_sectors_written, __ATOMIC_RELAXED));
+    printf("Network frames: %llu sent, %llu received, in %llu interrupts\n", (unsigned long long)stats.net_frames_sent,
+           (unsigned long long)__atomic_load_n(&stats.net_frames_received, __ATOMIC_RELAXED),
+           (unsigned long long)__atomic_load_n(&stats.net_interrupts, __ATOMIC_RELAXED));
+    printf("Timer ticks: %llu\n", (unsigned long long)__atomic_load_n(&stats.timer_ticks, __ATOMIC_RELAXED));
+    uint64_t ipis = __atomic_load_n(&stats.ipis, __ATOMIC_RELAXED);
+    printf("IPIs: %llu", (unsigned long long)ipis);
+    if (ipis != 0)
+        printf(" (latency avg %.1f us, max %.1f us)", __atomic_load_n(&stats.ipi_latency_ns, __ATOMIC_RELAXED) / 1000.0 / ipis,
+               __atomic_load_n(&stats.ipi_latency_max_ns, __ATOMIC_RELAXED) / 1000.0);
+    printf("\n");
+}
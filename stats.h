@@ -0,0 +1,53 @@
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <stdint.h>
+
+#include "emulator.h"
+
+/*
+ * Statistics counters (-stats)
+ * Printed on exit and on SIGUSR1. Counters bumped from device threads
+ * use relaxed atomics; the others are only written by the CPU thread.
+ * Per-op counters are only updated with -stats.
+ * Counters are per process, summed over the machines it runs.
+ */
+typedef struct
+{
+    uint64_t ops[256];
+    uint64_t two_byte_ops[256];
+    uint64_t interrupts[256];
+    uint64_t page_walks;
+    uint64_t gdt_reads;
+    /* Blocks entered by a hash lookup, through a chain, and by ret from the return stack */
+    uint64_t block_lookups;
+    uint64_t block_chains;
+    uint64_t block_returns;
+    /* Spin loops the host waited in, and slices they gave back to the scheduler (spin.h) */
+    uint64_t spin_waits;
+    uint64_t spin_yields;
+    uint64_t ports[0x10000];
+    uint64_t disk_sectors_read;
+    uint64_t disk_sectors_written;
+    /* pvnet frames, and the interrupts raised for them */
+    uint64_t net_frames_sent;
+    uint64_t net_frames_received;
+    uint64_t net_interrupts;
+    uint64_t timer_ticks;
+    /* Fixed IPIs accepted, and from send to accept in host ns */
+    uint64_t ipis;
+    uint64_t ipi_latency_ns;
+    uint64_t ipi_latency_max_ns;
+} Stats;
+
+extern Stats stats;
+
+#define STAT_INC(counter) ((counter)++)
+#define STAT_INC_ATOMIC(counter) __atomic_fetch_add(&(counter), 1, __ATOMIC_RELAXED)
+#define STAT_ADD(counter, n) ((counter) += (n))
+
+/* Counts the op at EIP with -stats. */
+void count_op(Emulator *emu, uint8_t op);
+void print_stats(void);
+
+#endif
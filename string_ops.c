@@ -0,0 +1,288 @@
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "string_ops.h"
+#include "emulator_functions.h"
+#include "io.h"
+#include "util.h"
+
+int is_string_op(uint8_t op)
+{
+    return op == 0x6D || op == 0x6F || (op >= 0xA4 && op <= 0xA7) || (op >= 0xAA && op <= 0xAF);
+}
+
+/*
+ * Finds how many elements from seg:offset can be accessed in bulk,
+ * moving in the direction of DF: they have to be in the same page,
+ * which has to be RAM (or ROM for reads), and inside the segment.
+ * Stores the host address of the first element to host.
+ */
+static uint32_t string_run(Emulator *emu, int seg_index, uint32_t offset, int size, uint8_t write, uint8_t **host)
+{
+    uint32_t p_address = get_physical_address(emu, seg_index, offset, write);
+    uint8_t type = emu->page_types[p_address >> 12];
+    if (type != PAGE_RAM && (write || type != PAGE_ROM))
+        return 0;
+    uint32_t page_offset = p_address & 0xFFF;
+    if (page_offset + size > 0x1000)
+        return 0;
+
+    uint64_t run;
+    if (is_direction_down(emu))
+    {
+        if (offset > emu->segment_caches[seg_index].limit)
+            return 0;
+        run = page_offset / size + 1;
+        /* Offset does not wrap below 0. */
+        if (run > offset / size + 1)
+            run = offset / size + 1;
+    }
+    else
+    {
+        uint32_t limit = emu->segment_caches[seg_index].limit;
+        run = (0x1000 - page_offset) / size;
+        if (offset > limit)
+            return 0;
+        if (run > ((uint64_t)limit - offset + 1) / size)
+            run = ((uint64_t)limit - offset + 1) / size;
+    }
+    if (write)
+    {
+        uint32_t bytes = run * size;
+        if (is_direction_down(emu))
+            page_written(emu, p_address + size - bytes, bytes);
+        else
+            page_written(emu, p_address, bytes);
+    }
+    *host = emu->memory + p_address;
+    return run;
+}
+
+static uint32_t min32(uint32_t a, uint32_t b)
+{
+    return a < b ? a : b;
+}
+
+static uint32_t load_element(const uint8_t *p, int size)
+{
+    uint32_t value = 0;
+    int i;
+    for (i = 0; i < size; i++)
+        value |= (uint32_t)p[i] << (i * 8);
+    return value;
+}
+
+static void store_element(uint8_t *p, uint32_t value, int size)
+{
+    int i;
+    for (i = 0; i < size; i++)
+        p[i] = value >> (i * 8);
+}
+
+static void advance(Emulator *emu, int reg_index, uint32_t bytes)
+{
+    uint32_t value = get_register32(emu, reg_index);
+    if (is_direction_down(emu))
+        set_register32(emu, reg_index, value - bytes);
+    else
+        set_register32(emu, reg_index, value + bytes);
+}
+
+/*
+ * Copying has to look the same as doing it element by element.
+ * If an element would be read after the destination overwrote it,
+ * the run is cut before that element.
+ */
+static uint32_t repeat_movs(Emulator *emu, uint32_t count, int size, int down)
+{
+    uint8_t *src, *dst;
+    uint32_t n = string_run(emu, emu->prefixes.segment, get_register32(emu, ESI), size, 0, &src);
+    if (n == 0)
+        return 0;
+    n = min32(n, string_run(emu, ES, get_register32(emu, EDI), size, 1, &dst));
+    n = min32(n, count);
+    if (n == 0)
+        return 0;
+
+    if (!down && dst > src && (uint32_t)(dst - src) < n * size)
+        n = (dst - src) / size;
+    if (down && src > dst && (uint32_t)(src - dst) < n * size)
+        n = (src - dst) / size;
+    if (n == 0)
+        return 0;
+
+    uint32_t bytes = n * size;
+    if (down)
+        memmove(dst - bytes + size, src - bytes + size, bytes);
+    else
+        memmove(dst, src, bytes);
+    advance(emu, ESI, bytes);
+    advance(emu, EDI, bytes);
+    return n;
+}
+
+static uint32_t repeat_stos(Emulator *emu, uint32_t count, int size, int down)
+{
+    uint8_t *dst;
+    uint32_t n = min32(count, string_run(emu, ES, get_register32(emu, EDI), size, 1, &dst));
+    if (n == 0)
+        return 0;
+
+    uint32_t bytes = n * size;
+    uint8_t *low = down ? dst - bytes + size : dst;
+    uint32_t eax_val = get_register32(emu, EAX);
+    if (size == 1)
+    {
+        memset(low, eax_val & 0xFF, bytes);
+    }
+    else
+    {
+        uint32_t i;
+        for (i = 0; i < n; i++)
+            store_element(low + i * size, eax_val, size);
+    }
+    advance(emu, EDI, bytes);
+    return n;
+}
+
+/* Only the last element loaded stays in AL/AX/EAX. */
+static uint32_t repeat_lods(Emulator *emu, uint32_t count, int size, int down)
+{
+    uint8_t *src;
+    uint32_t n = min32(count, string_run(emu, emu->prefixes.segment, get_register32(emu, ESI), size, 0, &src));
+    if (n == 0)
+        return 0;
+
+    uint32_t bytes = n * size;
+    uint8_t *last = down ? src - bytes + size : src + bytes - size;
+    if (size == 1)
+        set_register8(emu, AL, *last);
+    else if (size == 2)
+        set_register16(emu, EAX, load_element(last, size));
+    else
+        set_register32(emu, EAX, load_element(last, size));
+    advance(emu, ESI, bytes);
+    return n;
+}
+
+/*
+ * Skips elements which would not end the repetition,
+ * up to the one before the last of the run.
+ */
+static uint32_t repeat_scas(Emulator *emu, uint32_t count, int size, int down, int repne)
+{
+    uint8_t *dst;
+    uint32_t n = min32(count, string_run(emu, ES, get_register32(emu, EDI), size, 0, &dst));
+    if (n <= 1)
+        return 0;
+
+    uint32_t mask = size == 1 ? 0xFF : size == 2 ? 0xFFFF : 0xFFFFFFFF;
+    uint32_t value = get_register32(emu, EAX) & mask;
+    uint32_t i;
+    if (size == 1 && !down && repne)
+    {
+        uint8_t *found = memchr(dst, value, n - 1);
+        i = found != NULL ? found - dst : n - 1;
+    }
+    else
+    {
+        for (i = 0; i < n - 1; i++)
+        {
+            uint8_t *p = down ? dst - i * size : dst + i * size;
+            int equal = load_element(p, size) == value;
+            if (equal == repne)
+                break;
+        }
+    }
+    advance(emu, EDI, i * size);
+    return i;
+}
+
+static uint32_t repeat_cmps(Emulator *emu, uint32_t count, int size, int down, int repne)
+{
+    uint8_t *src, *dst;
+    uint32_t n = string_run(emu, emu->prefixes.segment, get_register32(emu, ESI), size, 0, &src);
+    if (n == 0)
+        return 0;
+    n = min32(n, string_run(emu, ES, get_register32(emu, EDI), size, 0, &dst));
+    n = min32(n, count);
+    if (n <= 1)
+        return 0;
+
+    uint32_t i;
+    for (i = 0; i < n - 1; i++)
+    {
+        uint32_t offset = down ? -(i * size) : i * size;
+        int equal = memcmp(src + offset, dst + offset, size) == 0;
+        if (equal == repne)
+            break;
+    }
+    advance(emu, ESI, i * size);
+    advance(emu, EDI, i * size);
+    return i;
+}
+
+/* Port data goes straight between the device and guest memory. */
+static uint32_t repeat_ins(Emulator *emu, uint32_t count, int down)
+{
+    uint8_t *dst;
+    /* Dwords arrive in ascending order, which a run going down would reverse. */
+    if (down)
+        return 0;
+    uint32_t n = min32(count, string_run(emu, ES, get_register32(emu, EDI), 4, 1, &dst));
+    if (n == 0)
+        return 0;
+    n = io_in_bulk32(emu, get_register16(emu, EDX), dst, n);
+    advance(emu, EDI, n * 4);
+    return n;
+}
+
+static uint32_t repeat_outs(Emulator *emu, uint32_t count, int down)
+{
+    uint8_t *src;
+    if (down)
+        return 0;
+    uint32_t n = min32(count, string_run(emu, emu->prefixes.segment, get_register32(emu, ESI), 4, 0, &src));
+    if (n == 0)
+        return 0;
+    n = io_out_bulk32(emu, get_register16(emu, EDX), src, n);
+    advance(emu, ESI, n * 4);
+    return n;
+}
+
+uint32_t repeat_string_op(Emulator *emu, uint8_t op, uint32_t count, int repne)
+{
+    /* Verbose mode prints every element. */
+    if (config.verbose)
+        return 0;
+
+    /* Words with 66 in protected mode */
+    int size = (op & 1) ? (emu->is_pe && emu->prefixes.operand_size ? 2 : 4) : 1;
+    int down = is_direction_down(emu);
+    switch (op)
+    {
+    case 0x6D:
+        return size == 4 ? repeat_ins(emu, count, down) : 0;
+    case 0x6F:
+        return size == 4 ? repeat_outs(emu, count, down) : 0;
+    case 0xA4:
+    case 0xA5:
+        return repeat_movs(emu, count, size, down);
+    case 0xA6:
+    case 0xA7:
+        return repeat_cmps(emu, count, size, down, repne);
+    case 0xAA:
+    case 0xAB:
+        return repeat_stos(emu, count, size, down);
+    case 0xAC:
+    case 0xAD:
+        return repeat_lods(emu, count, size, down);
+    case 0xAE:
+    case 0xAF:
+        return repeat_scas(emu, count, size, down, repne);
+    default:
+        return 0;
+    }
+}
@@ -0,0 +1,22 @@
+#ifndef STRING_OPS_H_
+#define STRING_OPS_H_
+
+#include <stdint.h>
+
+#include "emulator.h"
+
+/* Is op one of INSD, OUTSD (6D, 6F), MOVS, CMPS, STOS, LODS, SCAS (A4 - A7, AA - AF)? */
+int is_string_op(uint8_t op);
+
+/*
+ * Runs up to count elements of the string op at once.
+ * Only elements within one RAM page and the segment limits are done,
+ * so the caller keeps executing the op element by element otherwise.
+ * For CMPS/SCAS the element ending the repetition (and the last element
+ * of a run) is always left to the caller, which updates the flags.
+ * repne: 1 for REPNE (F2), 0 for REP/REPE (F3)
+ * Returns the number of elements done (0: none).
+ */
+uint32_t repeat_string_op(Emulator *emu, uint8_t op, uint32_t count, int repne);
+
+#endif
@@ -124,7 +124,11 @@ function test_all() {
   "disk"\
   "movzx"\
   "lapic"\
-  "ioapic"
+  "ioapic"\
+  "lock_adc"\
+  "pf_not_present"\
+  "pf_user_super"\
+  "pf_push_rep"
   do
     run_test $i
   done
@@ -0,0 +1,52 @@
+typedef unsigned int uint;
+typedef unsigned short ushort;
+
+// ALU reg/reg: ITERATIONS x (16 ALU ops + dec/jnz)
+
+#define ITERATIONS 250000
+
+#define BENCH_PORT 0xC200
+#define BENCH_BEGIN 1
+#define BENCH_END 2
+
+static inline void
+outl(ushort port, uint data)
+{
+    asm volatile("out %0,%1"
+                 :
+                 : "a"(data), "d"(port));
+}
+
+int main(void)
+{
+    outl(BENCH_PORT, BENCH_BEGIN);
+    asm volatile("mov %0, %%ecx\n"
+                 "mov $1, %%eax\n"
+                 "mov $3, %%ebx\n"
+                 "mov $5, %%edx\n"
+                 "mov $7, %%esi\n"
+                 "1:\n"
+                 "add %%ebx, %%eax\n"
+                 "sub %%edx, %%esi\n"
+                 "xor %%eax, %%edx\n"
+                 "and %%esi, %%ebx\n"
+                 "or %%edx, %%eax\n"
+                 "adc %%ebx, %%esi\n"
+                 "sbb %%eax, %%edx\n"
+                 "cmp %%esi, %%ebx\n"
+                 "test %%eax, %%edx\n"
+                 "inc %%eax\n"
+                 "neg %%ebx\n"
+                 "not %%esi\n"
+                 "shl $3, %%edx\n"
+                 "shr $1, %%eax\n"
+                 "mov %%eax, %%edi\n"
+                 "lea 4(%%edi, %%ebx, 2), %%ebx\n"
+                 "dec %%ecx\n"
+                 "jnz 1b\n"
+                 :
+                 : "i"(ITERATIONS)
+                 : "eax", "ebx", "ecx", "edx", "esi", "edi", "cc");
+    outl(BENCH_PORT, BENCH_END);
+    return 0;
+}
@@ -0,0 +1,6 @@
+BITS 32
+extern main
+global start
+start:
+    call main
+    jmp 0
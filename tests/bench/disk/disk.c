@@ -0,0 +1,100 @@
+typedef unsigned int uint;
+typedef unsigned short ushort;
+typedef unsigned char uchar;
+
+// Disk sector read throughput over PIO (polled, no interrupts):
+// phase 1 reads the image one sector per command as xv6's bootmain
+// does, phase 2 reads it MULTI sectors per command.
+
+#define SECTSIZE 512
+#define DISK_SECTORS 4096
+#define MULTI 256
+
+#define BENCH_PORT 0xC200
+#define BENCH_BEGIN 1
+#define BENCH_END 2
+
+static uint buf[MULTI * SECTSIZE / 4];
+
+static inline void
+outb(ushort port, uchar data)
+{
+    asm volatile("out %0,%1"
+                 :
+                 : "a"(data), "d"(port));
+}
+
+static inline void
+outl(ushort port, uint data)
+{
+    asm volatile("out %0,%1"
+                 :
+                 : "a"(data), "d"(port));
+}
+
+static inline uchar
+inb(ushort port)
+{
+    uchar data;
+
+    asm volatile("in %1,%0"
+                 : "=a"(data)
+                 : "d"(port));
+    return data;
+}
+
+static inline void
+insl(int port, void *addr, int cnt)
+{
+    asm volatile("cld; rep insl"
+                 : "=D"(addr), "=c"(cnt)
+                 : "d"(port), "0"(addr), "1"(cnt)
+                 : "memory", "cc");
+}
+
+static void
+waitdisk(void)
+{
+    // Wait for disk ready.
+    while ((inb(0x1F7) & 0xC0) != 0x40)
+        ;
+}
+
+// Read count (1 to 256) sectors from sector into dst.
+static void
+readsects(void *dst, uint sector, int count)
+{
+    int i;
+
+    // Issue command.
+    waitdisk();
+    outb(0x1F2, count & 0xFF); // 0 is 256
+    outb(0x1F3, sector);
+    outb(0x1F4, sector >> 8);
+    outb(0x1F5, sector >> 16);
+    outb(0x1F6, (sector >> 24) | 0xE0);
+    outb(0x1F7, 0x20); // cmd 0x20 - read sectors
+
+    // Read data.
+    for (i = 0; i < count; i++)
+    {
+        waitdisk();
+        insl(0x1F0, (uchar *)dst + i * SECTSIZE, SECTSIZE / 4);
+    }
+}
+
+int main(void)
+{
+    uint sector;
+
+    outl(BENCH_PORT, BENCH_BEGIN);
+    for (sector = 0; sector < DISK_SECTORS; sector++)
+        readsects(buf, sector, 1);
+    outl(BENCH_PORT, BENCH_END);
+
+    outl(BENCH_PORT, BENCH_BEGIN);
+    for (sector = 0; sector < DISK_SECTORS; sector += MULTI)
+        readsects(buf, sector, MULTI);
+    outl(BENCH_PORT, BENCH_END);
+    return 0;
+}
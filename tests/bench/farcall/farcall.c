@@ -0,0 +1,41 @@
+typedef unsigned int uint;
+typedef unsigned short ushort;
+
+// Far calls: ITERATIONS x (lcall through CS 8 + lret, near call + ret,
+// dec/jnz).
+
+#define ITERATIONS 200000
+
+#define BENCH_PORT 0xC200
+#define BENCH_BEGIN 1
+#define BENCH_END 2
+
+static inline void
+outl(ushort port, uint data)
+{
+    asm volatile("out %0,%1"
+                 :
+                 : "a"(data), "d"(port));
+}
+
+int main(void)
+{
+    outl(BENCH_PORT, BENCH_BEGIN);
+    asm volatile("mov %0, %%ecx\n"
+                 "1:\n"
+                 "lcall $8, $2f\n"
+                 "call 3f\n"
+                 "dec %%ecx\n"
+                 "jnz 1b\n"
+                 "jmp 4f\n"
+                 "2:\n"
+                 "lret\n"
+                 "3:\n"
+                 "ret\n"
+                 "4:\n"
+                 :
+                 : "i"(ITERATIONS)
+                 : "ecx", "cc", "memory");
+    outl(BENCH_PORT, BENCH_END);
+    return 0;
+}
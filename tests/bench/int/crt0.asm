@@ -0,0 +1,11 @@
+BITS 32
+extern main
+global start
+global int_entry
+start:
+    call main
+    jmp 0
+
+; Trap gate of the software interrupt, returns at once
+int_entry:
+    iretd
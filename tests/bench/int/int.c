@@ -0,0 +1,74 @@
+typedef unsigned int uint;
+typedef unsigned short ushort;
+typedef unsigned char uchar;
+
+// Software interrupts: ITERATIONS x (int through a trap gate whose
+// handler only returns with iret, dec/jnz).
+
+#define ITERATIONS 200000
+#define T_SYSCALL 64
+
+#define BENCH_PORT 0xC200
+#define BENCH_BEGIN 1
+#define BENCH_END 2
+
+struct gatedesc
+{
+    ushort off_15_0;
+    ushort cs;
+    uchar args;
+    uchar type; // Present, DPL 0, 32-bit trap gate
+    ushort off_31_16;
+};
+
+static struct gatedesc idt[256];
+
+extern void int_entry(void);
+
+static inline void
+outl(ushort port, uint data)
+{
+    asm volatile("out %0,%1"
+                 :
+                 : "a"(data), "d"(port));
+}
+
+static void
+setgate(int vector, void (*entry)(void))
+{
+    idt[vector].off_15_0 = (uint)entry & 0xFFFF;
+    idt[vector].cs = 8;
+    idt[vector].args = 0;
+    idt[vector].type = 0x8F;
+    idt[vector].off_31_16 = (uint)entry >> 16;
+}
+
+static void
+lidt(void)
+{
+    volatile ushort pd[3];
+    pd[0] = sizeof(idt) - 1;
+    pd[1] = (uint)idt;
+    pd[2] = (uint)idt >> 16;
+    asm volatile("lidt (%0)"
+                 :
+                 : "r"(pd));
+}
+
+int main(void)
+{
+    setgate(T_SYSCALL, int_entry);
+    lidt();
+
+    outl(BENCH_PORT, BENCH_BEGIN);
+    asm volatile("mov %0, %%ecx\n"
+                 "1:\n"
+                 "int %1\n"
+                 "dec %%ecx\n"
+                 "jnz 1b\n"
+                 :
+                 : "i"(ITERATIONS), "i"(T_SYSCALL)
+                 : "ecx", "cc", "memory");
+    outl(BENCH_PORT, BENCH_END);
+    return 0;
+}
@@ -0,0 +1,15 @@
+BITS 32
+extern main
+extern key
+global start
+global kbd_entry
+start:
+    call main
+    jmp 0
+
+; Interrupt gate of IRQ 1
+kbd_entry:
+    pushad
+    call key
+    popad
+    iretd
@@ -0,0 +1,131 @@
+typedef unsigned int uint;
+typedef unsigned short ushort;
+typedef unsigned char uchar;
+
+// Keyboard byte -> guest read: IRQ 1 routed through the IOAPIC, the
+// handler drains the controller until KEYS bytes were read.
+
+#define SVR (0x00F0 / 4)   // Spurious Interrupt Vector
+#define ENABLE 0x00000100  // Unit Enable
+#define TPR (0x0080 / 4)   // Task Priority
+#define EOI (0x00B0 / 4)   // EOI
+#define LINT0 (0x0350 / 4) // Local Vector Table 1 (LINT0)
+#define LINT1 (0x0360 / 4) // Local Vector Table 2 (LINT1)
+#define MASKED 0x00010000  // Interrupt masked
+
+#define REG_TABLE 0x10 // Redirection table base
+
+#define KBSTATP 0x64 // kbd controller status port(I)
+#define KBS_DIB 0x01 // kbd data in buffer
+#define KBDATAP 0x60 // kbd data port(I)
+
+#define T_IRQ0 32
+#define IRQ_KBD 1
+#define KEYS 100
+
+#define LAPIC_DEFAULT_BASE 0xFEE00000
+#define IOAPIC_DEFAULT_BASE 0xFEC00000
+
+#define BENCH_PORT 0xC200
+#define BENCH_BEGIN 1
+#define BENCH_END 2
+
+struct gatedesc
+{
+    ushort off_15_0;
+    ushort cs;
+    uchar args;
+    uchar type; // Present, DPL 0, 32-bit interrupt gate
+    ushort off_31_16;
+};
+
+static struct gatedesc idt[256];
+static volatile uint keys;
+
+extern void kbd_entry(void);
+
+static inline uchar
+inb(ushort port)
+{
+    uchar data;
+
+    asm volatile("in %1,%0"
+                 : "=a"(data)
+                 : "d"(port));
+    return data;
+}
+
+static inline void
+outl(ushort port, uint data)
+{
+    asm volatile("out %0,%1"
+                 :
+                 : "a"(data), "d"(port));
+}
+
+static void
+lapicw(int index, int value)
+{
+    volatile uint *lapic = (uint *)LAPIC_DEFAULT_BASE;
+    lapic[index] = value;
+    lapic[index];
+}
+
+static void
+ioapicwrite(int reg, uint data)
+{
+    volatile uint *ioapic = (uint *)IOAPIC_DEFAULT_BASE;
+    ioapic[0] = reg;  // select
+    ioapic[4] = data; // window
+}
+
+static void
+setgate(int vector, void (*entry)(void))
+{
+    idt[vector].off_15_0 = (uint)entry & 0xFFFF;
+    idt[vector].cs = 8;
+    idt[vector].args = 0;
+    idt[vector].type = 0x8E;
+    idt[vector].off_31_16 = (uint)entry >> 16;
+}
+
+static void
+lidt(void)
+{
+    volatile ushort pd[3];
+    pd[0] = sizeof(idt) - 1;
+    pd[1] = (uint)idt;
+    pd[2] = (uint)idt >> 16;
+    asm volatile("lidt (%0)"
+                 :
+                 : "r"(pd));
+}
+
+void key(void)
+{
+    while (inb(KBSTATP) & KBS_DIB)
+    {
+        inb(KBDATAP);
+        keys++;
+    }
+    lapicw(EOI, 0);
+}
+
+int main(void)
+{
+    setgate(T_IRQ0 + IRQ_KBD, kbd_entry);
+    lidt();
+    lapicw(SVR, ENABLE | (T_IRQ0 + 31));
+    lapicw(LINT0, MASKED);
+    lapicw(LINT1, MASKED);
+    lapicw(TPR, 0);
+    // Edge-triggered, active high, to CPU 0
+    ioapicwrite(REG_TABLE + 2 * IRQ_KBD, T_IRQ0 + IRQ_KBD);
+    ioapicwrite(REG_TABLE + 2 * IRQ_KBD + 1, 0);
+
+    outl(BENCH_PORT, BENCH_BEGIN);
+    while (keys < KEYS)
+        asm volatile("sti; hlt; cli");
+    outl(BENCH_PORT, BENCH_END);
+    return 0;
+}
@@ -0,0 +1,48 @@
+typedef unsigned int uint;
+typedef unsigned short ushort;
+
+// Memory operands: ITERATIONS x (8 loads/stores/read-modify-writes
+// through ModR/M and SIB addressing + dec/jnz), paging off.
+
+#define ITERATIONS 250000
+#define WORDS 1024
+
+#define BENCH_PORT 0xC200
+#define BENCH_BEGIN 1
+#define BENCH_END 2
+
+static uint buf[WORDS];
+
+static inline void
+outl(ushort port, uint data)
+{
+    asm volatile("out %0,%1"
+                 :
+                 : "a"(data), "d"(port));
+}
+
+int main(void)
+{
+    outl(BENCH_PORT, BENCH_BEGIN);
+    asm volatile("mov %0, %%ecx\n"
+                 "mov %1, %%esi\n"
+                 "xor %%ebx, %%ebx\n"
+                 "1:\n"
+                 "mov (%%esi), %%eax\n"
+                 "mov %%eax, 4(%%esi)\n"
+                 "add 8(%%esi, %%ebx, 4), %%eax\n"
+                 "mov %%eax, 12(%%esi, %%ebx, 4)\n"
+                 "addl $1, 16(%%esi)\n"
+                 "xor %%eax, 20(%%esi, %%ebx, 4)\n"
+                 "cmp 24(%%esi), %%eax\n"
+                 "mov 28(%%esi, %%ebx, 4), %%edx\n"
+                 "inc %%ebx\n"
+                 "and $1015, %%ebx\n"
+                 "dec %%ecx\n"
+                 "jnz 1b\n"
+                 :
+                 : "i"(ITERATIONS), "i"(buf)
+                 : "eax", "ebx", "ecx", "edx", "esi", "cc", "memory");
+    outl(BENCH_PORT, BENCH_END);
+    return 0;
+}
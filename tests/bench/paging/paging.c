@@ -0,0 +1,96 @@
+typedef unsigned int uint;
+typedef unsigned short ushort;
+
+// Memory traffic with paging on (4KB pages, identity mapped):
+// phase 1 stays on HOT_PAGES pages, phase 2 strides over PAGES pages
+// with CR3 reloaded (TLB flushed) before each pass.
+
+#define PASSES 1000
+#define HOT_PAGES 16
+#define PAGES 1024
+#define PGSIZE 4096
+#define BUFFER 0x800000 // PAGES pages from 8MB, mapped below MAPPED
+#define MAPPED (16 * 1024 * 1024)
+
+#define PTE_P 0x001 // Present
+#define PTE_W 0x002 // Writeable
+#define CR0_PG 0x80000000
+
+#define BENCH_PORT 0xC200
+#define BENCH_BEGIN 1
+#define BENCH_END 2
+
+static uint pgdir[1024] __attribute__((aligned(PGSIZE)));
+static uint pgtab[MAPPED / PGSIZE] __attribute__((aligned(PGSIZE)));
+
+static inline void
+outl(ushort port, uint data)
+{
+    asm volatile("out %0,%1"
+                 :
+                 : "a"(data), "d"(port));
+}
+
+static inline void
+lcr3(uint val)
+{
+    asm volatile("movl %0,%%cr3"
+                 :
+                 : "r"(val));
+}
+
+static void
+enable_paging(void)
+{
+    uint i, cr0;
+
+    for (i = 0; i < MAPPED / PGSIZE; i++)
+        pgtab[i] = i * PGSIZE | PTE_P | PTE_W;
+    for (i = 0; i < MAPPED / PGSIZE / 1024; i++)
+        pgdir[i] = (uint)&pgtab[i * 1024] | PTE_P | PTE_W;
+    lcr3((uint)pgdir);
+    asm volatile("movl %%cr0,%0"
+                 : "=r"(cr0));
+    asm volatile("movl %0,%%cr0"
+                 :
+                 : "r"(cr0 | CR0_PG));
+}
+
+// One pass: load, add and store a word on each of pages pages.
+static void
+touch(int pages)
+{
+    asm volatile("mov %0, %%ecx\n"
+                 "mov %1, %%esi\n"
+                 "1:\n"
+                 "mov (%%esi), %%eax\n"
+                 "add $1, %%eax\n"
+                 "mov %%eax, 4(%%esi)\n"
+                 "add %2, %%esi\n"
+                 "dec %%ecx\n"
+                 "jnz 1b\n"
+                 :
+                 : "r"(pages), "i"(BUFFER), "i"(PGSIZE)
+                 : "eax", "ecx", "esi", "cc", "memory");
+}
+
+int main(void)
+{
+    int i;
+
+    enable_paging();
+
+    outl(BENCH_PORT, BENCH_BEGIN);
+    for (i = 0; i < PASSES * (PAGES / HOT_PAGES); i++)
+        touch(HOT_PAGES);
+    outl(BENCH_PORT, BENCH_END);
+
+    outl(BENCH_PORT, BENCH_BEGIN);
+    for (i = 0; i < PASSES; i++)
+    {
+        lcr3((uint)pgdir);
+        touch(PAGES);
+    }
+    outl(BENCH_PORT, BENCH_END);
+    return 0;
+}
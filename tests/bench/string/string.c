@@ -0,0 +1,81 @@
+typedef unsigned int uint;
+typedef unsigned short ushort;
+
+// String ops: ITERATIONS x (rep stosl, rep movsl, rep movsb of BYTES
+// bytes, a lodsb/stosb loop of LOOP_BYTES).
+
+#define ITERATIONS 2000
+#define BYTES 4096
+#define LOOP_BYTES 64
+
+#define BENCH_PORT 0xC200
+#define BENCH_BEGIN 1
+#define BENCH_END 2
+
+static uint src[BYTES / 4];
+static uint dst[BYTES / 4];
+
+static inline void
+outl(ushort port, uint data)
+{
+    asm volatile("out %0,%1"
+                 :
+                 : "a"(data), "d"(port));
+}
+
+static inline void
+stosl(void *addr, uint data, int cnt)
+{
+    asm volatile("cld; rep stosl"
+                 : "=D"(addr), "=c"(cnt)
+                 : "0"(addr), "1"(cnt), "a"(data)
+                 : "memory", "cc");
+}
+
+static inline void
+movsl(void *dst, void *src, int cnt)
+{
+    asm volatile("cld; rep movsl"
+                 : "=D"(dst), "=S"(src), "=c"(cnt)
+                 : "0"(dst), "1"(src), "2"(cnt)
+                 : "memory", "cc");
+}
+
+static inline void
+movsb(void *dst, void *src, int cnt)
+{
+    asm volatile("cld; rep movsb"
+                 : "=D"(dst), "=S"(src), "=c"(cnt)
+                 : "0"(dst), "1"(src), "2"(cnt)
+                 : "memory", "cc");
+}
+
+// Byte at a time, not rep
+static inline void
+lodsb_stosb(void *dst, void *src, int cnt)
+{
+    asm volatile("cld\n"
+                 "1:\n"
+                 "lodsb\n"
+                 "stosb\n"
+                 "loop 1b\n"
+                 : "=D"(dst), "=S"(src), "=c"(cnt)
+                 : "0"(dst), "1"(src), "2"(cnt)
+                 : "eax", "memory", "cc");
+}
+
+int main(void)
+{
+    int i;
+
+    outl(BENCH_PORT, BENCH_BEGIN);
+    for (i = 0; i < ITERATIONS; i++)
+    {
+        stosl(src, i, BYTES / 4);
+        movsl(dst, src, BYTES / 4);
+        movsb(src, dst, BYTES);
+        lodsb_stosb(dst, src, LOOP_BYTES);
+    }
+    outl(BENCH_PORT, BENCH_END);
+    return 0;
+}
@@ -0,0 +1,15 @@
+BITS 32
+extern main
+extern tick
+global start
+global timer_entry
+start:
+    call main
+    jmp 0
+
+; Interrupt gate of the timer vector
+timer_entry:
+    pushad
+    call tick
+    popad
+    iretd
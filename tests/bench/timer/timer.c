@@ -0,0 +1,106 @@
+typedef unsigned int uint;
+typedef unsigned short ushort;
+typedef unsigned char uchar;
+
+// Timer interrupt -> handler entry: TICKS periodic interrupts of
+// TICR counts (1 ms at the emulated 1 GHz bus), waited for with hlt.
+
+#define SVR (0x00F0 / 4)   // Spurious Interrupt Vector
+#define ENABLE 0x00000100  // Unit Enable
+#define TPR (0x0080 / 4)   // Task Priority
+#define EOI (0x00B0 / 4)   // EOI
+#define TIMER (0x0320 / 4) // Local Vector Table 0 (TIMER)
+#define LINT0 (0x0350 / 4) // Local Vector Table 1 (LINT0)
+#define LINT1 (0x0360 / 4) // Local Vector Table 2 (LINT1)
+#define TICR (0x0380 / 4)  // Timer Initial Count
+#define MASKED 0x00010000  // Interrupt masked
+#define PERIODIC 0x00020000
+
+#define T_IRQ0 32
+#define IRQ_TIMER 0
+#define TICKS 1000
+#define PERIOD 1000000
+
+#define LAPIC_DEFAULT_BASE 0xFEE00000
+
+#define BENCH_PORT 0xC200
+#define BENCH_BEGIN 1
+#define BENCH_END 2
+
+struct gatedesc
+{
+    ushort off_15_0;
+    ushort cs;
+    uchar args;
+    uchar type; // Present, DPL 0, 32-bit interrupt gate
+    ushort off_31_16;
+};
+
+static struct gatedesc idt[256];
+static volatile uint ticks;
+
+extern void timer_entry(void);
+
+static inline void
+outl(ushort port, uint data)
+{
+    asm volatile("out %0,%1"
+                 :
+                 : "a"(data), "d"(port));
+}
+
+static void
+lapicw(int index, int value)
+{
+    volatile uint *lapic = (uint *)LAPIC_DEFAULT_BASE;
+    lapic[index] = value;
+    lapic[index];
+}
+
+static void
+setgate(int vector, void (*entry)(void))
+{
+    idt[vector].off_15_0 = (uint)entry & 0xFFFF;
+    idt[vector].cs = 8;
+    idt[vector].args = 0;
+    idt[vector].type = 0x8E;
+    idt[vector].off_31_16 = (uint)entry >> 16;
+}
+
+static void
+lidt(void)
+{
+    volatile ushort pd[3];
+    pd[0] = sizeof(idt) - 1;
+    pd[1] = (uint)idt;
+    pd[2] = (uint)idt >> 16;
+    asm volatile("lidt (%0)"
+                 :
+                 : "r"(pd));
+}
+
+void tick(void)
+{
+    ticks++;
+    lapicw(EOI, 0);
+}
+
+int main(void)
+{
+    setgate(T_IRQ0 + IRQ_TIMER, timer_entry);
+    lidt();
+    lapicw(SVR, ENABLE | (T_IRQ0 + 31));
+    lapicw(LINT0, MASKED);
+    lapicw(LINT1, MASKED);
+    lapicw(TPR, 0);
+
+    outl(BENCH_PORT, BENCH_BEGIN);
+    lapicw(TIMER, PERIODIC | (T_IRQ0 + IRQ_TIMER));
+    lapicw(TICR, PERIOD);
+    while (ticks < TICKS)
+        asm volatile("sti; hlt; cli");
+    lapicw(TIMER, MASKED);
+    lapicw(TICR, 0);
+    outl(BENCH_PORT, BENCH_END);
+    return 0;
+}
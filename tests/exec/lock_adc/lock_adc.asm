@@ -0,0 +1,33 @@
+BITS 32
+    org 0x7c00
+
+    ; lock adc rm32, r32: src + CF wraps to 0 ;
+
+    mov dword [0x7e00], 0x10
+    mov eax, 0xFFFFFFFF
+    stc
+    lock adc dword [0x7e00], eax ; 0x10 + 0xFFFFFFFF + 1 = 0x1 0000 0010
+    pushfd
+    pop ebx ; CF
+    mov ecx, dword [0x7e00] ; 0x10
+
+    ; lock adc rm8, r8 ;
+
+    mov byte [0x7e04], 0x80
+    mov dl, 0xFF
+    stc
+    lock adc byte [0x7e04], dl ; 0x80 + 0xFF + 1 = 0x180
+    pushfd
+    pop esi ; CF, SF (no OF: -128 + -1 + 1)
+    movzx edi, byte [0x7e04] ; 0x80
+
+    ; lock sbb rm32, r32 ;
+
+    mov dword [0x7e08], 0x10
+    stc
+    lock sbb dword [0x7e08], eax ; 0x10 - 0xFFFFFFFF - 1 borrows
+    pushfd
+    pop ebp ; CF
+    mov edx, dword [0x7e08] ; 0x10
+
+    jmp 0
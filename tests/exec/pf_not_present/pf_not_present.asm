@@ -0,0 +1,118 @@
+BITS 16
+    org 0x7c00
+
+    ; #PF on pages not present: pf_handler
+    ; records the error code, CR2 and the EIP pushed at 0x9010 + 16 * n,
+    ; maps the page and restarts the instruction.
+
+    lgdt [GDT_DESC]
+    mov eax, cr0
+    or eax, 1
+    mov cr0, eax
+    jmp 8:pe_enter
+
+BITS 32
+pe_enter:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov ss, ax
+    mov esp, 0x7000
+
+    ; Page table at 0x11000: identity, pages 0x200000 and 0x201000 not present
+    xor ecx, ecx
+fill_pte:
+    mov eax, ecx
+    shl eax, 12
+    or eax, 7
+    mov [0x11000 + ecx * 4], eax
+    inc ecx
+    cmp ecx, 1024
+    jne fill_pte
+    mov dword [0x11000 + 0x200 * 4], 0
+    mov dword [0x11000 + 0x201 * 4], 0
+    mov dword [0x10000], 0x11007
+
+    ; IDT at 0x8000, vector 14
+    mov eax, pf_handler
+    mov [0x8000 + 14 * 8], ax
+    mov word [0x8000 + 14 * 8 + 2], 8
+    mov word [0x8000 + 14 * 8 + 4], 0x8E00
+    shr eax, 16
+    mov [0x8000 + 14 * 8 + 6], ax
+    lidt [IDT_DESC]
+
+    ; Paging with CR0.WP
+    mov eax, 0x10000
+    mov cr3, eax
+    mov eax, cr0
+    or eax, 0x80010000
+    mov cr0, eax
+
+fault_write:
+    mov word [fs:0x200010], 0x1234 ; prefixes FS, 66: error code 2 (W), EIP at the first one
+    mov eax, [0x201000] ; error code 0 (read)
+
+    mov eax, [0x9010] ; 2
+    mov ebx, [0x9014] ; 0x200010
+    mov ecx, [0x9018]
+    sub ecx, fault_write ; 0
+    mov edx, [0x9020] ; 0
+    mov esi, [0x9024] ; 0x201000
+    mov edi, [0x9000] ; 2 faults
+    movzx ebp, word [0x200010] ; 0x1234: written once restarted
+    jmp 0
+
+pf_handler:
+    push eax
+    push edx
+    mov edx, [0x9000]
+    shl edx, 4
+    mov eax, [esp + 8]
+    mov [0x9010 + edx], eax ; error code
+    mov eax, cr2
+    mov [0x9014 + edx], eax ; CR2
+    mov eax, [esp + 12]
+    mov [0x9018 + edx], eax ; EIP
+    mov [0x901C + edx], ecx ; ECX
+    inc dword [0x9000]
+    ; Maps the page of CR2, user writable
+    mov eax, cr2
+    and eax, 0xFFFFF000
+    or eax, 7
+    mov edx, eax
+    shr edx, 12
+    mov [0x11000 + edx * 4], eax
+    invlpg [eax]
+    pop edx
+    pop eax
+    add esp, 4 ; error code
+    iret
+
+GDT:
+    ; null segment descriptor
+    dd 0
+    dd 0
+    ; code segment descriptor
+    dw 0xFFFF       ; limit low
+    dw 0            ; base low
+    db 0            ; base middle
+    db 10011010b    ; access
+    db 11001111b    ; limit + flags
+    db 0            ; base high
+    ; data segment descriptor
+    dw 0xFFFF       ; limit low
+    dw 0            ; base low
+    db 0            ; base middle
+    db 10010010b    ; access
+    db 11001111b    ; limit + flags
+    db 0            ; base high
+
+GDT_DESC:
+    dw (GDT_DESC - GDT - 1)
+    dd GDT
+
+IDT_DESC:
+    dw 256 * 8 - 1
+    dd 0x8000
@@ -0,0 +1,173 @@
+BITS 16
+    org 0x7c00
+
+    ; #PF in the middle of a ring 3 push and rep movsb, which cross into
+    ; pages not present (0x202000, 0x206000). pf_handler records the error
+    ; code, CR2, the EIP pushed and ECX at 0x9010 + 16 * n, maps the page
+    ; and restarts the instruction: ESP is the one before the push, ECX
+    ; and EDI count the bytes copied before the fault.
+
+    lgdt [GDT_DESC]
+    mov eax, cr0
+    or eax, 1
+    mov cr0, eax
+    jmp 8:pe_enter
+
+BITS 32
+pe_enter:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov ss, ax
+    mov esp, 0x7000
+
+    ; Page table at 0x11000: identity, pages 0x202000 and 0x206000 not present
+    xor ecx, ecx
+fill_pte:
+    mov eax, ecx
+    shl eax, 12
+    or eax, 7
+    mov [0x11000 + ecx * 4], eax
+    inc ecx
+    cmp ecx, 1024
+    jne fill_pte
+    mov dword [0x11000 + 0x202 * 4], 0
+    mov dword [0x11000 + 0x206 * 4], 0
+    mov dword [0x10000], 0x11007
+
+    ; IDT at 0x8000, vector 14
+    mov eax, pf_handler
+    mov [0x8000 + 14 * 8], ax
+    mov word [0x8000 + 14 * 8 + 2], 8
+    mov word [0x8000 + 14 * 8 + 4], 0x8E00
+    shr eax, 16
+    mov [0x8000 + 14 * 8 + 6], ax
+    lidt [IDT_DESC]
+
+    ; TSS: the handler runs on SS0:ESP0 = 0x10:0x7000
+    mov dword [0x9800 + 4], 0x7000
+    mov dword [0x9800 + 8], 0x10
+    mov ax, 0x28
+    ltr ax
+
+    ; Paging with CR0.WP
+    mov eax, 0x10000
+    mov cr3, eax
+    mov eax, cr0
+    or eax, 0x80010000
+    mov cr0, eax
+
+    ; To ring 3: SS, ESP, EFLAGS, CS, EIP
+    push 0x23
+    push 0x7800
+    push 2
+    push 0x1B
+    push user_start
+    iret
+
+user_start:
+    mov ax, 0x23
+    mov ds, ax
+    mov es, ax
+    mov esp, 0x203002
+    mov eax, 0xAABBCCDD
+    push eax ; 0x202FFE - 0x203001: error code 6 (W, U), CR2 0x202FFE
+
+    mov esi, 0x7c00
+    mov edi, 0x205FF0
+    mov ecx, 32
+    cld
+fault_rep:
+    rep movsb ; CR2 0x206000 with 16 bytes left
+
+    mov esi, 0x7c00
+    mov edi, 0x205FF0
+    mov ecx, 32
+    repe cmpsb
+    mov esi, [0x902C] ; 16
+    je copied
+    mov esi, 0xBAD
+copied:
+    mov eax, [0x9010] ; 6
+    mov ebx, [0x9014] ; 0x202FFE
+    mov ecx, [0x9020] ; 6
+    mov edx, [0x9024] ; 0x206000
+    mov edi, [0x9028]
+    sub edi, fault_rep ; 0: EIP at the rep prefix
+    mov ebp, [0x202FFE] ; 0xAABBCCDD
+    jmp 0 ; ESP: 0x202FFE, pushed once
+
+pf_handler:
+    push eax
+    push edx
+    mov edx, [0x9000]
+    shl edx, 4
+    mov eax, [esp + 8]
+    mov [0x9010 + edx], eax ; error code
+    mov eax, cr2
+    mov [0x9014 + edx], eax ; CR2
+    mov eax, [esp + 12]
+    mov [0x9018 + edx], eax ; EIP
+    mov [0x901C + edx], ecx ; ECX
+    inc dword [0x9000]
+    ; Maps the page of CR2, user writable
+    mov eax, cr2
+    and eax, 0xFFFFF000
+    or eax, 7
+    mov edx, eax
+    shr edx, 12
+    mov [0x11000 + edx * 4], eax
+    invlpg [eax]
+    pop edx
+    pop eax
+    add esp, 4 ; error code
+    iret
+
+GDT:
+    ; null segment descriptor
+    dd 0
+    dd 0
+    ; code segment descriptor
+    dw 0xFFFF       ; limit low
+    dw 0            ; base low
+    db 0            ; base middle
+    db 10011010b    ; access
+    db 11001111b    ; limit + flags
+    db 0            ; base high
+    ; data segment descriptor
+    dw 0xFFFF       ; limit low
+    dw 0            ; base low
+    db 0            ; base middle
+    db 10010010b    ; access
+    db 11001111b    ; limit + flags
+    db 0            ; base high
+    ; user code segment descriptor (0x1B)
+    dw 0xFFFF       ; limit low
+    dw 0            ; base low
+    db 0            ; base middle
+    db 11111010b    ; access
+    db 11001111b    ; limit + flags
+    db 0            ; base high
+    ; user data segment descriptor (0x23)
+    dw 0xFFFF       ; limit low
+    dw 0            ; base low
+    db 0            ; base middle
+    db 11110010b    ; access
+    db 11001111b    ; limit + flags
+    db 0            ; base high
+    ; TSS descriptor (0x28) of the TSS at 0x9800
+    dw 0x67         ; limit low
+    dw 0x9800       ; base low
+    db 0            ; base middle
+    db 10001001b    ; access
+    db 0            ; limit + flags
+    db 0            ; base high
+
+GDT_DESC:
+    dw (GDT_DESC - GDT - 1)
+    dd GDT
+
+IDT_DESC:
+    dw 256 * 8 - 1
+    dd 0x8000
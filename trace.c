@@ -0,0 +1,46 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "trace.h"
+
+void init_trace(Emulator *emu, uint32_t size)
+{
+#ifdef DAX86_TRACE
+    uint32_t entries = 1;
+    while (entries < size && entries < 0x80000000)
+        entries <<= 1;
+    TraceRing *ring = malloc(sizeof(TraceRing));
+    ring->entries = calloc(entries, sizeof(TraceEntry));
+    if (ring->entries == NULL)
+    {
+        printf("Could not allocate trace of %u entries.\n", entries);
+        free(ring);
+        return;
+    }
+    ring->mask = entries - 1;
+    ring->index = 0;
+    ring->full = 0;
+    emu->trace = ring;
+#else
+    printf("Trace is not built in (make TRACE=1).\n");
+#endif
+}
+
+static void print_entry(TraceEntry *entry)
+{
+    printf("CS: %04x EIP: %08x Op: %02x SS: %04x ESP: %08x\n", entry->cs, entry->eip, entry->op, entry->ss, entry->esp);
+}
+
+void trace_dump(Emulator *emu)
+{
+    TraceRing *ring = emu->trace;
+    if (ring == NULL)
+        return;
+    uint32_t count = ring->full ? ring->mask + 1 : ring->index;
+    uint32_t start = ring->full ? ring->index : 0;
+    uint32_t i;
+    printf("Last %u instructions:\n", count);
+    for (i = 0; i < count; i++)
+        print_entry(&ring->entries[(start + i) & ring->mask]);
+}
@@ -0,0 +1,56 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdint.h>
+
+#include "emulator.h"
+
+/*
+ * Execution trace
+ * Ring of the last executed instructions, dumped on panic.
+ * Enabled with -trace [entries]; compiled out with make TRACE=0.
+ */
+typedef struct
+{
+    uint32_t eip;
+    uint32_t esp;
+    uint16_t cs;
+    uint16_t ss;
+    uint8_t op;
+} TraceEntry;
+
+struct TraceRing
+{
+    TraceEntry *entries;
+    /* entries - 1, entries is a power of 2 */
+    uint32_t mask;
+    uint32_t index;
+    /* Becomes 1 once index wrapped. */
+    uint8_t full;
+};
+
+/* Allocates emu->trace with at least size entries. */
+void init_trace(Emulator *emu, uint32_t size);
+void trace_dump(Emulator *emu);
+
+#ifdef DAX86_TRACE
+static inline void trace_append(Emulator *emu, uint8_t op)
+{
+    TraceRing *ring = emu->trace;
+    if (ring == NULL)
+        return;
+    TraceEntry *entry = &ring->entries[ring->index];
+    entry->eip = emu->eip;
+    entry->esp = emu->registers[ESP];
+    entry->cs = emu->segment_registers[CS];
+    entry->ss = emu->segment_registers[SS];
+    entry->op = op;
+    ring->index = (ring->index + 1) & ring->mask;
+    if (ring->index == 0)
+        ring->full = 1;
+}
+#else
+#define trace_append(emu, op) ((void)0)
+#endif
+
+#endif
@@ -5,47 +5,32 @@
 #include "emulator.h"
 #include "lapic.h"
 #include "ioapic.h"
+#include "machine.h"
+#include "trace.h"
+#include "block_cache.h"
+#include "profile.h"
+#include "bench.h"
+#include "stats.h"
+#include "console.h"
 
 #include <termios.h>
-
-#define DEBUG_SIZE 256
+#include <time.h>
 
 Config config;
-int debug_i = 0;
-int debug_cs[DEBUG_SIZE];
-int debug_eips[DEBUG_SIZE];
-int debug_ops[DEBUG_SIZE];
-int debug_ss[DEBUG_SIZE];
-int debug_esp[DEBUG_SIZE];
 
 void init_config(int verbose, int test)
 {
     config.verbose = verbose;
     config.test = test;
-}
-
-void debug_append(uint16_t cs, uint32_t eip, uint8_t op, uint16_t ss, uint32_t esp_val)
-{
-    debug_cs[debug_i] = cs;
-    debug_eips[debug_i] = eip;
-    debug_ops[debug_i] = op;
-    debug_ss[debug_i] = ss;
-    debug_esp[debug_i] = esp_val;
-    debug_i = (debug_i + 1) % DEBUG_SIZE;
-}
-
-void debug_print()
-{
-    printf("Last %d instructions:\n", DEBUG_SIZE);
-    int i;
-    for (i = debug_i; i < 256; i++)
-    {
-        printf("CS: %04x EIP: %08x Op: %02x SS: %04x ESP: %08x\n", debug_cs[i], debug_eips[i], debug_ops[i], debug_ss[i], debug_esp[i]);
-    }
-    for (i = 0; i < debug_i; i++)
-    {
-        printf("CS: %04x EIP: %08x Op: %02x SS: %04x ESP: %08x\n", debug_cs[i], debug_eips[i], debug_ops[i], debug_ss[i], debug_esp[i]);
-    }
+    config.jit = 0;
+    config.fusion_stats = 0;
+    config.stats = 0;
+    config.icount = 0;
+    config.bench = BENCH_NONE;
+    config.huge_pages = HUGE_PAGES_NONE;
+    config.share_ram = 0;
+    config.spin_wait = 1;
+    config.snapshot_path = NULL;
 }
 
 void print_emu(Emulator *emu)
@@ -54,12 +39,18 @@ void print_emu(Emulator *emu)
     dump_eflags(emu);
     dump_memory(emu, 0x7b00, 1024);
     dump_lapic(emu->lapic);
-    dump_ioapic();
+    if (emu->machine != NULL)
+        dump_ioapic(emu->machine->ioapic);
 }
 
+/* Whether remove_canon_echo changed the terminal (stdin may be none) */
+static int canon_removed = 0;
+
 void add_canon_echo()
 {
     static struct termios oldt, newt;
+    if (!canon_removed)
+        return;
     tcgetattr(STDIN_FILENO, &oldt);
     newt = oldt;
     newt.c_lflag |= (ICANON | ECHO);
@@ -69,36 +60,62 @@ void add_canon_echo()
 void remove_canon_echo()
 {
     static struct termios oldt, newt;
-    tcgetattr(STDIN_FILENO, &oldt);
+    if (tcgetattr(STDIN_FILENO, &oldt) != 0)
+        return;
     newt = oldt;
     newt.c_lflag &= ~(ICANON | ECHO);
     tcsetattr(STDIN_FILENO, TCSANOW, &newt);
+    canon_removed = 1;
 }
 
 void panic()
 {
+    flush_output_channels();
     add_canon_echo();
     exit(1);
 }
 
 void panic_exit(Emulator *emu)
 {
+    flush_output_channels();
     add_canon_echo();
-    debug_print();
+    trace_dump(emu);
     print_emu(emu);
     exit(1);
 }
 
+static void print_exit_stats(void)
+{
+    if (config.stats)
+        print_stats();
+    if (config.fusion_stats || config.stats)
+        print_fusion_stats();
+    print_profile();
+    if (config.bench)
+        print_bench();
+}
+
 void sig_exit(Emulator *emu)
 {
+    flush_output_channels();
     add_canon_echo();
-    debug_print();
+    print_exit_stats();
+    trace_dump(emu);
     print_emu(emu);
     exit(0);
 }
 
-void normal_exit()
+void normal_exit(int status)
 {
+    flush_output_channels();
     add_canon_echo();
-    exit(0);
-}
\ No newline at end of file
+    print_exit_stats();
+    exit(status);
+}
+
+uint64_t monotonic_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
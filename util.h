@@ -5,17 +5,49 @@
 
 #include "emulator.h"
 
+enum HugePages
+{
+    HUGE_PAGES_NONE,
+    HUGE_PAGES_TRANSPARENT,
+    HUGE_PAGES_HUGETLB
+};
+
+enum BenchOutput
+{
+    BENCH_NONE,
+    BENCH_TEXT,
+    BENCH_JSON
+};
+
+/*
+ * Options from the command line, shared by all machines of the process:
+ * set before the first machine is created and only read after that.
+ */
 typedef struct
 {
     int verbose;
     int test;
+    int jit;
+    int fusion_stats;
+    int stats;
+    int icount;
+    /* -bench, -bench-json: latency samples and phases (bench.h) */
+    int bench;
+    /* -perf-map, -perf-jitdump: PerfOutput bits (perf_map.h) */
+    int perf;
+    /* HugePages */
+    int huge_pages;
+    /* -share-ram: RAM is MADV_MERGEABLE, -kernel maps the segments from the file */
+    int share_ram;
+    /* Host waits in guest spin loops (spin.h), cleared by -no-spin-wait */
+    int spin_wait;
+    /* -save-snapshot file, NULL if none */
+    const char *snapshot_path;
 } Config;
 
 extern Config config;
 
 void init_config(int verbose, int test);
-void debug_append(uint16_t cs, uint32_t eip, uint8_t op, uint16_t ss, uint32_t esp_val);
-void debug_print();
 void print_emu(Emulator *emu);
 
 void add_canon_echo();
@@ -24,6 +56,9 @@ void remove_canon_echo();
 void panic() __attribute__((noreturn));
 void panic_exit(Emulator *emu) __attribute__((noreturn));
 void sig_exit(Emulator *emu) __attribute__((noreturn));
-void normal_exit();
+void normal_exit(int status);
+
+/* Host CLOCK_MONOTONIC in ns */
+uint64_t monotonic_ns(void);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,153 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "watch.h"
+#include "block_cache.h"
+#include "gdb.h"
+
+/* Only changed before the vCPUs start or while GDB has them stopped */
+static Watch watches[WATCH_MAX];
+static int watch_count = 0;
+
+static const char *access_names[] = {[WATCH_WRITE] = "write", [WATCH_READ] = "read", [WATCH_ACCESS] = "locked op"};
+
+static int covers_page(Watch *watch, uint32_t page)
+{
+    return (watch->phys_addr >> 12) <= page && page <= ((watch->phys_addr + watch->length - 1) >> 12);
+}
+
+/* Pages of [phys_addr, phys_addr + length) are PAGE_WATCH while some watchpoint covers them. */
+static void update_pages(Emulator *emu, uint32_t phys_addr, uint32_t length)
+{
+    uint32_t page;
+    int i;
+    for (page = phys_addr >> 12; page <= (phys_addr + length - 1) >> 12; page++)
+    {
+        uint8_t type = PAGE_RAM;
+        for (i = 0; i < watch_count; i++)
+        {
+            if (covers_page(&watches[i], page))
+                type = PAGE_WATCH;
+        }
+        emu->page_types[page] = type;
+    }
+}
+
+int add_watch(Emulator *emu, uint32_t phys_addr, uint32_t length, int kind, int by_gdb, uint32_t linear_addr)
+{
+    uint32_t page;
+    if (length == 0 || phys_addr >= emu->memory_size || length > emu->memory_size - phys_addr || watch_count == WATCH_MAX)
+        return 0;
+    for (page = phys_addr >> 12; page <= (phys_addr + length - 1) >> 12; page++)
+    {
+        if (emu->page_types[page] != PAGE_RAM && emu->page_types[page] != PAGE_WATCH)
+            return 0;
+    }
+    Watch *watch = &watches[watch_count++];
+    watch->phys_addr = phys_addr;
+    watch->length = length;
+    watch->kind = kind;
+    watch->by_gdb = by_gdb;
+    watch->linear_addr = linear_addr;
+    update_pages(emu, phys_addr, length);
+    return 1;
+}
+
+int remove_watch(Emulator *emu, uint32_t phys_addr, uint32_t length, int kind, int by_gdb)
+{
+    int i;
+    for (i = 0; i < watch_count; i++)
+    {
+        Watch *watch = &watches[i];
+        if (watch->phys_addr == phys_addr && watch->length == length && watch->kind == kind && watch->by_gdb == by_gdb)
+        {
+            *watch = watches[--watch_count];
+            update_pages(emu, phys_addr, length);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void remove_gdb_watches(Emulator *emu)
+{
+    int i = 0;
+    while (i < watch_count)
+    {
+        Watch watch = watches[i];
+        if (watch.by_gdb)
+            remove_watch(emu, watch.phys_addr, watch.length, watch.kind, 1);
+        else
+            i++;
+    }
+}
+
+int parse_watch(Emulator *emu, const char *arg)
+{
+    char *end;
+    int kind = WATCH_WRITE;
+    uint32_t length = 4;
+    uint32_t phys_addr = strtoul(arg, &end, 0);
+    if (end != arg && *end == ',')
+        length = strtoul(end + 1, &end, 0);
+    if (end != arg && *end == ':')
+    {
+        kind = strcmp(end + 1, "w") == 0    ? WATCH_WRITE
+               : strcmp(end + 1, "r") == 0  ? WATCH_READ
+               : strcmp(end + 1, "rw") == 0 ? WATCH_ACCESS
+                                            : 0;
+        end += strlen(end);
+    }
+    if (end == arg || *end != '\0' || kind == 0)
+    {
+        printf("-watch addr[,length][:w|r|rw] expected, got %s.\n", arg);
+        return 0;
+    }
+    if (!add_watch(emu, phys_addr, length, kind, 0, 0))
+    {
+        printf("-watch %s: not RAM, or more than %d watchpoints.\n", arg, WATCH_MAX);
+        return 0;
+    }
+    return 1;
+}
+
+static void report(Emulator *emu, uint32_t p_address, int size, uint32_t value, int access)
+{
+    int digits = size * 2;
+    printf("Watch: CPU %d EIP %08X %s of %d bytes at 0x%08x: 0x%0*x", emu->cpu_id, current_op_eip(emu), access_names[access],
+           size, p_address, digits, value);
+    if (access == WATCH_WRITE)
+    {
+        uint32_t old = 0;
+        int i;
+        for (i = 0; i < size; i++)
+            old |= (uint32_t)emu->memory[p_address + i] << (i * 8);
+        printf(" (was 0x%0*x)", digits, old);
+    }
+    printf("\n");
+}
+
+void watch_access(Emulator *emu, uint32_t p_address, int size, uint32_t value, int access)
+{
+    int i;
+    for (i = 0; i < watch_count; i++)
+    {
+        Watch *watch = &watches[i];
+        if ((watch->kind & access) == 0 || p_address + size <= watch->phys_addr ||
+            p_address >= watch->phys_addr + watch->length)
+            continue;
+        if (watch->by_gdb)
+        {
+            uint32_t offset = p_address > watch->phys_addr ? p_address - watch->phys_addr : 0;
+            gdb_watch_hit(emu, watch->kind, watch->linear_addr + offset);
+        }
+        else
+        {
+            report(emu, p_address, size, value, access);
+        }
+        /* One report per access */
+        return;
+    }
+}
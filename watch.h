@@ -0,0 +1,55 @@
+#ifndef WATCH_H_
+#define WATCH_H_
+
+#include <stdint.h>
+
+#include "emulator.h"
+
+/*
+ * Data watchpoints (-watch, GDB Z2 - Z4)
+ * The RAM pages of a watched range are PAGE_WATCH instead of PAGE_RAM.
+ * The fast paths (stores, loads, string ops) only take RAM, so accesses
+ * to these pages go through the MMIO path, which compares them with the
+ * ranges; other pages run as fast as without watchpoints. A hit prints
+ * the vCPU, op EIP, address, width and value, or stops the vCPUs for GDB
+ * once the op is done. Device DMA, page walks and code fetches are not
+ * watched.
+ * -watch ranges are physical; GDB ranges are linear, translated with the
+ * paging of the selected vCPU when they are set (page by page).
+ */
+#define WATCH_MAX 32
+
+/* Accesses a watchpoint is hit by; locked read-modify-writes are both. */
+enum WatchKind
+{
+    WATCH_WRITE = 1,
+    WATCH_READ = 2,
+    WATCH_ACCESS = 3
+};
+
+typedef struct
+{
+    uint32_t phys_addr;
+    uint32_t length;
+    uint8_t kind;
+    /* Set by GDB, which gets the hits at linear_addr */
+    uint8_t by_gdb;
+    uint32_t linear_addr;
+} Watch;
+
+/* Watches RAM [phys_addr, phys_addr + length); returns 0 if it is not RAM or there are WATCH_MAX. */
+int add_watch(Emulator *emu, uint32_t phys_addr, uint32_t length, int kind, int by_gdb, uint32_t linear_addr);
+/* Removes the watchpoint added with the same range and kind; returns 0 if there is none. */
+int remove_watch(Emulator *emu, uint32_t phys_addr, uint32_t length, int kind, int by_gdb);
+/* When GDB is gone */
+void remove_gdb_watches(Emulator *emu);
+/* -watch addr[,length][:w|r|rw], 4 bytes written by default; returns 0 if it is malformed. */
+int parse_watch(Emulator *emu, const char *arg);
+
+/*
+ * Before an access (WatchKind) of size bytes to a PAGE_WATCH page:
+ * value is read, to be written, or before a locked op.
+ */
+void watch_access(Emulator *emu, uint32_t p_address, int size, uint32_t value, int access);
+
+#endif
@@ -0,0 +1,228 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "writeback.h"
+
+/* Buffers written out by the exit handler, of every machine */
+static WriteBack *exit_writebacks = NULL;
+static pthread_mutex_t exit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct
+{
+    uint64_t sector;
+    uint32_t index;
+} SectorOrder;
+
+static int compare_sectors(const void *a, const void *b)
+{
+    uint64_t sa = ((const SectorOrder *)a)->sector;
+    uint64_t sb = ((const SectorOrder *)b)->sector;
+    return sa < sb ? -1 : sa > sb;
+}
+
+/* Writes every sector of batch, coalescing adjacent sectors into one pwritev. */
+static void write_batch(WriteBack *wb, WriteBatch *batch)
+{
+    SectorOrder order[WRITEBACK_BATCH];
+    struct iovec iov[WRITEBACK_BATCH];
+    uint32_t i, j;
+
+    for (i = 0; i < batch->count; i++)
+    {
+        order[i].sector = batch->sectors[i];
+        order[i].index = i;
+    }
+    qsort(order, batch->count, sizeof(SectorOrder), compare_sectors);
+
+    for (i = 0; i < batch->count; i = j)
+    {
+        uint64_t first = order[i].sector;
+        /* A batch is below IOV_MAX, so a run fits in one pwritev. */
+        for (j = i; j < batch->count; j++)
+        {
+            if (order[j].sector != first + (j - i))
+                break;
+            iov[j - i].iov_base = batch->data[order[j].index];
+            iov[j - i].iov_len = 512;
+        }
+        if (pwritev(wb->fd, iov, j - i, first * 512) != (ssize_t)((j - i) * 512))
+            printf("Disk write at sector %llu failed.\n", (unsigned long long)first);
+    }
+}
+
+static void *writeback_loop(void *ptr)
+{
+    WriteBack *wb = (WriteBack *)ptr;
+    pthread_mutex_lock(&wb->lock);
+    while (1)
+    {
+        while (wb->active->count == 0 && !wb->quit)
+            pthread_cond_wait(&wb->work, &wb->lock);
+        if (wb->active->count == 0)
+            break;
+        if (wb->active->count < WRITEBACK_BATCH / 2 && !wb->flush_requested)
+        {
+            /* Gives more sectors the chance to join the batch. */
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_nsec += WRITEBACK_DELAY_MS * 1000000;
+            if (until.tv_nsec >= 1000000000)
+            {
+                until.tv_sec += 1;
+                until.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&wb->work, &wb->lock, &until);
+        }
+
+        WriteBatch *batch = wb->active;
+        wb->active = wb->flushing;
+        wb->flushing = batch;
+        pthread_mutex_unlock(&wb->lock);
+
+        write_batch(wb, batch);
+
+        pthread_mutex_lock(&wb->lock);
+        batch->count = 0;
+        pthread_cond_broadcast(&wb->done);
+    }
+    pthread_mutex_unlock(&wb->lock);
+    return NULL;
+}
+
+/*
+ * Runs at exit, possibly from a signal handler interrupting the CPU
+ * thread inside writeback_write, so the lock is not taken.
+ * Sectors of a batch in flight are just written twice.
+ */
+static void write_at_exit(void)
+{
+    WriteBack *wb;
+    for (wb = exit_writebacks; wb != NULL; wb = wb->exit_next)
+    {
+        write_batch(wb, wb->flushing);
+        write_batch(wb, wb->active);
+        fdatasync(wb->fd);
+    }
+}
+
+WriteBack *open_writeback(const char *path)
+{
+    int fd = open(path, O_RDWR);
+    if (fd < 0)
+        return NULL;
+
+    WriteBack *wb = malloc(sizeof(WriteBack));
+    wb->fd = fd;
+    pthread_mutex_init(&wb->lock, NULL);
+    pthread_cond_init(&wb->work, NULL);
+    pthread_cond_init(&wb->done, NULL);
+    wb->active = calloc(1, sizeof(WriteBatch));
+    wb->flushing = calloc(1, sizeof(WriteBatch));
+    wb->flush_requested = 0;
+    wb->quit = 0;
+    pthread_create(&wb->thread, NULL, writeback_loop, (void *)wb);
+
+    pthread_mutex_lock(&exit_lock);
+    if (exit_writebacks == NULL)
+        atexit(write_at_exit);
+    wb->exit_next = exit_writebacks;
+    exit_writebacks = wb;
+    pthread_mutex_unlock(&exit_lock);
+    return wb;
+}
+
+void writeback_write(WriteBack *wb, uint64_t sector, const uint8_t *data)
+{
+    uint32_t i;
+    pthread_mutex_lock(&wb->lock);
+    WriteBatch *batch = wb->active;
+    for (i = 0; i < batch->count; i++)
+    {
+        if (batch->sectors[i] == sector)
+            break;
+    }
+    /* The I/O thread is behind: waits for it to take the full batch. */
+    while (i == WRITEBACK_BATCH)
+    {
+        pthread_cond_signal(&wb->work);
+        pthread_cond_wait(&wb->done, &wb->lock);
+        batch = wb->active;
+        i = batch->count;
+    }
+    memcpy(batch->data[i], data, 512);
+    if (i == batch->count)
+    {
+        batch->sectors[i] = sector;
+        batch->count++;
+    }
+    /* The first sector starts the delay, half a batch cuts it short. */
+    if (batch->count == 1 || batch->count == WRITEBACK_BATCH / 2)
+        pthread_cond_signal(&wb->work);
+    pthread_mutex_unlock(&wb->lock);
+}
+
+/* The newest copy is in active, older ones in flushing. */
+int writeback_read(WriteBack *wb, uint64_t sector, uint8_t *data)
+{
+    WriteBatch *batches[2];
+    int found = 0;
+    int b;
+    uint32_t i;
+    pthread_mutex_lock(&wb->lock);
+    batches[0] = wb->active;
+    batches[1] = wb->flushing;
+    for (b = 0; b < 2 && !found; b++)
+    {
+        for (i = 0; i < batches[b]->count; i++)
+        {
+            if (batches[b]->sectors[i] == sector)
+            {
+                memcpy(data, batches[b]->data[i], 512);
+                found = 1;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&wb->lock);
+    return found;
+}
+
+void writeback_flush(WriteBack *wb)
+{
+    pthread_mutex_lock(&wb->lock);
+    wb->flush_requested = 1;
+    pthread_cond_signal(&wb->work);
+    while (wb->active->count != 0 || wb->flushing->count != 0)
+        pthread_cond_wait(&wb->done, &wb->lock);
+    wb->flush_requested = 0;
+    pthread_mutex_unlock(&wb->lock);
+    fdatasync(wb->fd);
+}
+
+void close_writeback(WriteBack *wb)
+{
+    writeback_flush(wb);
+    pthread_mutex_lock(&wb->lock);
+    wb->quit = 1;
+    pthread_cond_signal(&wb->work);
+    pthread_mutex_unlock(&wb->lock);
+    pthread_join(wb->thread, NULL);
+
+    pthread_mutex_lock(&exit_lock);
+    WriteBack **link = &exit_writebacks;
+    while (*link != wb)
+        link = &(*link)->exit_next;
+    *link = wb->exit_next;
+    pthread_mutex_unlock(&exit_lock);
+
+    close(wb->fd);
+    free(wb->active);
+    free(wb->flushing);
+    free(wb);
+}
@@ -0,0 +1,59 @@
+#ifndef WRITEBACK_H_
+#define WRITEBACK_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+/* Sectors buffered before the I/O thread is woken up */
+#define WRITEBACK_BATCH 256
+
+typedef struct
+{
+    uint32_t count;
+    uint64_t sectors[WRITEBACK_BATCH];
+    uint8_t data[WRITEBACK_BATCH][512];
+} WriteBatch;
+
+/*
+ * Write-back buffer of a disk image
+ * Sectors written by the CPU are kept in the active batch, which is
+ * handed to the I/O thread once half full, on flush, or after
+ * WRITEBACK_DELAY_MS. The thread writes the batch with one pwritev per
+ * run of adjacent sectors while the CPU keeps filling the other batch.
+ * lock guards the batches and flush_requested.
+ */
+typedef struct WriteBack
+{
+    int fd;
+    pthread_mutex_t lock;
+    /* work: to the I/O thread, done: a batch was written (to waiters) */
+    pthread_cond_t work;
+    pthread_cond_t done;
+    WriteBatch *active;
+    WriteBatch *flushing;
+    int flush_requested;
+    /* Set by close_writeback once everything is written */
+    int quit;
+    pthread_t thread;
+    /* Next of the buffers written out at exit */
+    struct WriteBack *exit_next;
+} WriteBack;
+
+#define WRITEBACK_DELAY_MS 10
+
+/* Opens the image at path for writing, NULL if it can not be written. */
+WriteBack *open_writeback(const char *path);
+
+/* Buffers 512 bytes of data for the sector. */
+void writeback_write(WriteBack *wb, uint64_t sector, const uint8_t *data);
+
+/* Copies the sector to data if it is still buffered, returns 0 otherwise. */
+int writeback_read(WriteBack *wb, uint64_t sector, uint8_t *data);
+
+/* Returns once everything written before is on the disk (FLUSH CACHE). */
+void writeback_flush(WriteBack *wb);
+
+/* Writes everything out, stops the I/O thread and frees wb. */
+void close_writeback(WriteBack *wb);
+
+#endif